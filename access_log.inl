@@ -0,0 +1,465 @@
+/* access_log.inl
+ *
+ * Asynchronous access log.
+ *
+ * This file is part of the CivetWeb project.
+ *
+ * Writing the access log used to cost every request an fopen, an append
+ * with fflush and an fclose of access_log_file on the worker thread. Now a
+ * worker formats the line as before and copies it into a ring of its own.
+ * A writer thread drains the rings of all workers every ALOG_DRAIN_MS,
+ * writes the lines in large batches and fsyncs the file every
+ * "access_log_fsync_ms". A worker never waits for the disk or for a lock:
+ * when its ring is full, the line is dropped and counted, and the writer
+ * reports the number of dropped lines in the error log.
+ *
+ * The file is rotated when it reaches "access_log_rotate_size" bytes or
+ * is "access_log_rotate_ms" old: it is renamed to <name>.YYYYmmdd-HHMMSS
+ * and a new one is started.
+ *
+ * Lines from one worker keep their order, lines of different workers may
+ * be written slightly out of order. Only the log of the default domain is
+ * written this way; the log of further domains (mg_start_domain), and the
+ * log of compilers without the GCC __atomic builtins, is written by the
+ * workers as before.
+ */
+
+
+#if defined(ASYNC_ACCESS_LOG)
+
+/* Size of the ring of one worker, a power of 2 */
+#define ALOG_RING_SIZE (64 * 1024)
+
+/* The writer drains the rings this often */
+#define ALOG_DRAIN_MS (100)
+
+/* Lines are collected up to this size for one write */
+#define ALOG_BATCH_SIZE (256 * 1024)
+
+
+/* Single producer (the worker), single consumer (the writer) ring. head
+ * and tail count bytes ever written and taken, so head - tail is the fill
+ * level. The producer only publishes complete lines. */
+struct mg_alog_ring {
+	char *data; /* NULL until the worker has started */
+	uint64_t head;
+	char pad[64]; /* head and tail on separate cache lines */
+	uint64_t tail;
+	int64_t dropped; /* Lines dropped since the writer looked last */
+};
+
+
+struct mg_access_log {
+	struct mg_context *ctx;
+	struct mg_alog_ring *rings; /* One per worker thread */
+	unsigned int num_rings;
+	pthread_t thread_id;
+	int running; /* The writer thread has been started */
+	int stop;    /* Set to make the writer exit */
+
+	/* Only used by the writer */
+	FILE *fp;
+	char *batch;
+	size_t batch_len;
+	int64_t file_size;
+	time_t file_time;    /* When the file was started */
+	uint64_t last_sync;  /* Last fsync (ns) */
+	int unsynced;        /* Written since the last fsync */
+	int write_failed;    /* Reported to the error log already */
+	int64_t fsync_ms;
+	int64_t rotate_size; /* 0: no size limit */
+	int64_t rotate_ms;   /* 0: no time limit */
+	struct mg_connection fc; /* For mg_fopen and mg_cry */
+
+	/* Statistics (atomic) */
+	int64_t lines;
+	int64_t bytes;
+	int64_t dropped;
+	int64_t rotations;
+};
+
+
+/* Called by a worker for each line. Returns 0 if the ring was full. */
+static int
+access_log_push(struct mg_alog_ring *ring, const char *line)
+{
+	size_t len = strlen(line);
+	uint64_t head = ring->head; /* Only this thread writes head */
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t pos, first;
+
+	if ((len + 1) > ALOG_RING_SIZE - (size_t)(head - tail)) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	pos = (size_t)(head & (ALOG_RING_SIZE - 1));
+	first = ALOG_RING_SIZE - pos;
+	if (first > len) {
+		memcpy(ring->data + pos, line, len);
+		ring->data[pos + len] = '\n';
+	} else {
+		memcpy(ring->data + pos, line, first);
+		memcpy(ring->data, line + first, len - first);
+		ring->data[len - first] = '\n';
+	}
+	__atomic_store_n(&ring->head, head + len + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+/* Open the log file. Returns 0 on error. */
+static int
+access_log_open(struct mg_access_log *alog)
+{
+	struct mg_file fi;
+	const char *path = alog->ctx->dd.config[ACCESS_LOG_FILE];
+
+	if (!mg_fopen(&alog->fc, path, MG_FOPEN_MODE_APPEND, &fi)) {
+		alog->fp = NULL;
+		return 0;
+	}
+	alog->fp = fi.access.fp;
+	alog->file_size = (int64_t)fi.stat.size;
+	/* A log kept from an earlier run is as old as its last write at least,
+	 * so a restart does not postpone its rotation */
+	alog->file_time = ((fi.stat.size > 0) && (fi.stat.last_modified > 0))
+	                      ? fi.stat.last_modified
+	                      : time(NULL);
+	return 1;
+}
+
+
+static void
+access_log_sync(struct mg_access_log *alog)
+{
+	if ((alog->fp == NULL) || !alog->unsynced) {
+		return;
+	}
+#if defined(_WIN32)
+	(void)_commit(_fileno(alog->fp));
+#else
+	(void)fsync(fileno(alog->fp));
+#endif
+	alog->unsynced = 0;
+	alog->last_sync = mg_get_current_time_ns();
+}
+
+
+/* Rename the log file to <name>.YYYYmmdd-HHMMSS and start a new one */
+static void
+access_log_rotate(struct mg_access_log *alog)
+{
+	const char *path = alog->ctx->dd.config[ACCESS_LOG_FILE];
+	char rotated[UTF8_PATH_MAX + 20], stamp[20];
+	time_t now = time(NULL);
+	struct tm *tm;
+#if defined(REENTRANT_TIME)
+	struct tm _tm;
+	tm = localtime_r(&now, &_tm);
+#else
+	tm = localtime(&now);
+#endif
+
+	if ((tm == NULL)
+	    || (strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", tm) == 0)) {
+		return;
+	}
+	mg_snprintf(NULL, NULL, rotated, sizeof(rotated), "%s.%s", path, stamp);
+
+	(void)fflush(alog->fp);
+	access_log_sync(alog);
+	(void)fclose(alog->fp);
+	alog->fp = NULL;
+	if (rename(path, rotated) != 0) {
+		mg_cry_ctx_internal(alog->ctx,
+		                    "Cannot rotate access log %s: %s",
+		                    path,
+		                    strerror(ERRNO));
+	} else {
+		__atomic_add_fetch(&alog->rotations, 1, __ATOMIC_RELAXED);
+	}
+	(void)access_log_open(alog);
+}
+
+
+/* Write the collected lines */
+static void
+access_log_flush_batch(struct mg_access_log *alog)
+{
+	if (alog->batch_len == 0) {
+		return;
+	}
+	if (alog->fp == NULL) {
+		/* Opening failed before, e.g. the directory was missing */
+		(void)access_log_open(alog);
+	}
+
+	if ((alog->fp == NULL)
+	    || (fwrite(alog->batch, 1, alog->batch_len, alog->fp)
+	        != alog->batch_len)) {
+		if (!alog->write_failed) {
+			mg_cry_ctx_internal(alog->ctx,
+			                    "Error writing log file %s",
+			                    alog->ctx->dd.config[ACCESS_LOG_FILE]);
+			alog->write_failed = 1;
+		}
+	} else {
+		alog->write_failed = 0;
+		alog->unsynced = 1;
+		alog->file_size += (int64_t)alog->batch_len;
+		__atomic_add_fetch(&alog->bytes,
+		                   (int64_t)alog->batch_len,
+		                   __ATOMIC_RELAXED);
+	}
+	alog->batch_len = 0;
+}
+
+
+/* Move the lines of all rings to the file */
+static void
+access_log_drain(struct mg_access_log *alog)
+{
+	int64_t dropped = 0, lines = 0;
+	unsigned int i;
+
+	/* Rotate between drains only, so no line is split over two files */
+	if ((alog->fp != NULL)
+	    && (((alog->rotate_size > 0) && (alog->file_size >= alog->rotate_size))
+	        || ((alog->rotate_ms > 0)
+	            && ((int64_t)difftime(time(NULL), alog->file_time) * 1000
+	                >= alog->rotate_ms)))) {
+		access_log_rotate(alog);
+	}
+
+	for (i = 0; i < alog->num_rings; i++) {
+		struct mg_alog_ring *ring = &alog->rings[i];
+		uint64_t head, tail;
+
+		if (__atomic_load_n(&ring->data, __ATOMIC_ACQUIRE) == NULL) {
+			continue;
+		}
+		dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail; /* Only this thread writes tail */
+
+		while (tail != head) {
+			size_t pos = (size_t)(tail & (ALOG_RING_SIZE - 1));
+			size_t len = (size_t)(head - tail);
+			size_t k;
+
+			if (len > ALOG_RING_SIZE - pos) {
+				len = ALOG_RING_SIZE - pos; /* up to the end of the ring */
+			}
+			if (len > ALOG_BATCH_SIZE - alog->batch_len) {
+				len = ALOG_BATCH_SIZE - alog->batch_len;
+			}
+			memcpy(alog->batch + alog->batch_len, ring->data + pos, len);
+			for (k = 0; k < len; k++) {
+				lines += (ring->data[pos + k] == '\n');
+			}
+			alog->batch_len += len;
+			tail += len;
+			/* Give the space back before the disk write */
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+			if (alog->batch_len == ALOG_BATCH_SIZE) {
+				access_log_flush_batch(alog);
+			}
+		}
+	}
+	access_log_flush_batch(alog);
+	if (alog->fp != NULL) {
+		(void)fflush(alog->fp);
+	}
+
+	__atomic_add_fetch(&alog->lines, lines, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		__atomic_add_fetch(&alog->dropped, dropped, __ATOMIC_RELAXED);
+		mg_cry_ctx_internal(alog->ctx,
+		                    "Access log full: %" INT64_FMT " lines dropped",
+		                    dropped);
+	}
+	if ((alog->fsync_ms > 0)
+	    && (mg_get_current_time_ns() - alog->last_sync
+	        >= (uint64_t)alog->fsync_ms * 1000000u)) {
+		access_log_sync(alog);
+	}
+}
+
+
+static void *
+access_log_thread(void *thread_func_param)
+{
+	struct mg_access_log *alog = (struct mg_access_log *)thread_func_param;
+	struct mg_context *ctx = alog->ctx;
+	struct mg_workerTLS tls;
+
+	mg_set_thread_name("log");
+
+	memset(&tls, 0, sizeof(tls));
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+	pthread_setspecific(sTlsKey, &tls);
+
+	if (ctx->callbacks.init_thread) {
+		/* The writer is an internal thread (type 2) */
+		tls.user_ptr = ctx->callbacks.init_thread(ctx, 2);
+	}
+
+	while (!__atomic_load_n(&alog->stop, __ATOMIC_ACQUIRE)) {
+		mg_sleep(ALOG_DRAIN_MS);
+		access_log_drain(alog);
+	}
+	/* The workers have exited: write their last lines */
+	access_log_drain(alog);
+	access_log_sync(alog);
+
+	if (ctx->callbacks.exit_thread) {
+		ctx->callbacks.exit_thread(ctx, 2, tls.user_ptr);
+	}
+	pthread_setspecific(sTlsKey, NULL);
+	return NULL;
+}
+
+
+/* Start the writer if the default domain has an access log. Without it
+ * (or if it cannot be started), the workers write the log themselves. */
+static void
+access_log_init(struct mg_context *ctx)
+{
+	struct mg_access_log *alog;
+
+	if ((ctx->dd.config[ACCESS_LOG_FILE] == NULL)
+	    || (ctx->dd.config[ACCESS_LOG_FILE][0] == 0)) {
+		return;
+	}
+	alog = (struct mg_access_log *)mg_calloc_ctx(1, sizeof(*alog), ctx);
+	if (alog == NULL) {
+		return;
+	}
+	alog->ctx = ctx;
+	fake_connection(&alog->fc, ctx);
+	alog->num_rings = ctx->cfg_max_worker_threads;
+	alog->rings = (struct mg_alog_ring *)mg_calloc_ctx(
+	    alog->num_rings, sizeof(struct mg_alog_ring), ctx);
+	alog->batch = (char *)mg_malloc_ctx(ALOG_BATCH_SIZE, ctx);
+	alog->fsync_ms = atoi(ctx->dd.config[ACCESS_LOG_FSYNC]);
+	alog->rotate_size =
+	    strtoll(ctx->dd.config[ACCESS_LOG_ROTATE_SIZE], NULL, 10);
+	alog->rotate_ms =
+	    strtoll(ctx->dd.config[ACCESS_LOG_ROTATE_TIME], NULL, 10);
+	alog->last_sync = mg_get_current_time_ns();
+
+	if ((alog->rings == NULL) || (alog->batch == NULL)) {
+		mg_cry_ctx_internal(ctx,
+		                    "%s",
+		                    "Out of memory: Cannot allocate access log");
+	} else if (!access_log_open(alog)) {
+		mg_cry_ctx_internal(ctx,
+		                    "Cannot open access log %s: %s",
+		                    ctx->dd.config[ACCESS_LOG_FILE],
+		                    strerror(ERRNO));
+	} else if (mg_start_thread_with_id(
+	               access_log_thread, alog, &alog->thread_id)
+	           != 0) {
+		mg_cry_ctx_internal(ctx, "%s", "Cannot start access log thread");
+	} else {
+		alog->running = 1;
+		ctx->access_log = alog;
+		return;
+	}
+
+	if (alog->fp != NULL) {
+		(void)fclose(alog->fp);
+	}
+	mg_free(alog->rings);
+	mg_free(alog->batch);
+	mg_free(alog);
+}
+
+
+/* Called by a worker thread when it starts. Returns its ring, or NULL if
+ * it is to write the log itself. */
+static struct mg_alog_ring *
+access_log_attach(struct mg_context *ctx, int thread_index)
+{
+	struct mg_alog_ring *ring;
+	char *data;
+
+	if ((ctx->access_log == NULL) || (thread_index < 0)
+	    || ((unsigned)thread_index >= ctx->access_log->num_rings)) {
+		return NULL;
+	}
+	ring = &ctx->access_log->rings[thread_index];
+	data = ring->data;
+	if (data == NULL) {
+		data = (char *)mg_malloc_ctx(ALOG_RING_SIZE, ctx);
+		if (data == NULL) {
+			return NULL;
+		}
+		__atomic_store_n(&ring->data, data, __ATOMIC_RELEASE);
+	}
+	return ring;
+}
+
+
+/* Stop the writer after all workers have exited. It writes what is left
+ * in the rings before it exits. */
+static void
+access_log_stop(struct mg_context *ctx)
+{
+	struct mg_access_log *alog = ctx->access_log;
+
+	if ((alog != NULL) && alog->running) {
+		__atomic_store_n(&alog->stop, 1, __ATOMIC_RELEASE);
+		mg_join_thread(alog->thread_id);
+		alog->running = 0;
+	}
+}
+
+
+static void
+access_log_free(struct mg_context *ctx)
+{
+	struct mg_access_log *alog = ctx->access_log;
+	unsigned int i;
+
+	if (alog == NULL) {
+		return;
+	}
+	access_log_stop(ctx);
+	if (alog->fp != NULL) {
+		(void)fclose(alog->fp);
+	}
+	for (i = 0; i < alog->num_rings; i++) {
+		mg_free(alog->rings[i].data);
+	}
+	mg_free(alog->rings);
+	mg_free(alog->batch);
+	mg_free(alog);
+	ctx->access_log = NULL;
+}
+#endif /* ASYNC_ACCESS_LOG */
+
+
+CIVETWEB_API int
+mg_get_access_log_stats(const struct mg_context *ctx,
+                        struct mg_access_log_stat *stat)
+{
+#if defined(ASYNC_ACCESS_LOG)
+	const struct mg_access_log *alog;
+
+	if ((ctx == NULL) || (stat == NULL) || (ctx->access_log == NULL)) {
+		return -1;
+	}
+	alog = ctx->access_log;
+	memset(stat, 0, sizeof(*stat));
+	stat->lines = __atomic_load_n(&alog->lines, __ATOMIC_RELAXED);
+	stat->bytes = __atomic_load_n(&alog->bytes, __ATOMIC_RELAXED);
+	stat->dropped = __atomic_load_n(&alog->dropped, __ATOMIC_RELAXED);
+	stat->rotations = __atomic_load_n(&alog->rotations, __ATOMIC_RELAXED);
+	return 0;
+#else
+	(void)ctx;
+	(void)stat;
+	return -1;
+#endif
+}
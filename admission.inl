@@ -0,0 +1,374 @@
+/* admission.inl
+ *
+ * Admission control: load shedding and per-client request rate limits.
+ *
+ * This file is part of the CivetWeb project.
+ *
+ * Without it, a server that cannot keep up lets connections wait in the
+ * socket queue (and behind it, in the kernel accept queue) until the client
+ * gives up. Clients see a hanging page instead of an error they could act
+ * on, and the requests that are finally served are stale. With
+ * "max_queue_wait_ms" set:
+ *   - a connection accepted while the socket queue is full is answered
+ *     "503 Service Unavailable" right away by the accepting thread,
+ *   - a connection that waited longer than max_queue_wait_ms for a worker
+ *     gets a 503 for its first request instead of being processed.
+ * Both responses carry a Retry-After derived from the observed queue wait.
+ *
+ * "request_rate" limits the requests per second of a client address with
+ * a token bucket. The option has the syntax of "throttle" (and shares its
+ * parser): "*=20,10.0.0.0/8=0,/api/login=1" allows 20 requests per second
+ * to every client, no limit from 10.0.0.0/8, and one login per second. The
+ * last matching rule applies, and every rule has buckets of its own, so
+ * the logins above do not count against the 20. A bucket holds one second
+ * worth of requests (at least one). Requests over the limit are answered
+ * "429 Too Many Requests" with a Retry-After.
+ */
+
+
+/* The token buckets of the clients seen recently. A client and rule maps
+ * to a set of RATE_WAYS buckets; when none is free, the bucket used least
+ * recently is taken over. Sets are protected by one of RATE_LOCKS
+ * mutexes. */
+#define RATE_SETS (1024)
+#define RATE_WAYS (4)
+#define RATE_LOCKS (64)
+
+/* Weight of a new sample in the smoothed queue wait: 1 / 2^QUEUE_WAIT_SHIFT
+ */
+#define QUEUE_WAIT_SHIFT (3)
+
+static const char shed_body[] = "Server is overloaded, try again later.\n";
+
+
+struct mg_rate_bucket {
+	uint64_t key;  /* Client address and rule, see rate_key. 0: unused */
+	uint64_t last; /* Time of the last refill (ns) */
+	double tokens;
+};
+
+
+struct mg_rate_limiter {
+	pthread_mutex_t locks[RATE_LOCKS];
+	struct mg_rate_bucket buckets[RATE_SETS * RATE_WAYS];
+};
+
+
+#if defined(LOCKFREE_QUEUE)
+static int sq_filled(const struct mg_context *ctx);
+#endif
+
+
+/* Allocate what the admission control options need. Returns 0 if out of
+ * memory. */
+static int
+admission_init(struct mg_context *ctx)
+{
+	const char *rate = ctx->dd.config[REQUEST_RATE];
+	int i;
+
+	ctx->max_queue_wait_ms = atoi(ctx->dd.config[MAX_QUEUE_WAIT]);
+	if ((rate == NULL) || (*rate == 0)) {
+		return 1;
+	}
+	ctx->rate_limiter = (struct mg_rate_limiter *)mg_calloc_ctx(
+	    1, sizeof(struct mg_rate_limiter), ctx);
+	if (ctx->rate_limiter == NULL) {
+		return 0;
+	}
+	for (i = 0; i < RATE_LOCKS; i++) {
+		pthread_mutex_init(&ctx->rate_limiter->locks[i], &pthread_mutex_attr);
+	}
+	return 1;
+}
+
+
+static void
+admission_free(struct mg_context *ctx)
+{
+	int i;
+
+	if (ctx->rate_limiter == NULL) {
+		return;
+	}
+	for (i = 0; i < RATE_LOCKS; i++) {
+		pthread_mutex_destroy(&ctx->rate_limiter->locks[i]);
+	}
+	mg_free(ctx->rate_limiter);
+	ctx->rate_limiter = NULL;
+}
+
+
+/* Number of accepted sockets waiting for a worker, and the room for them
+ * in the socket queue. The per-worker sockets of ALTERNATIVE_QUEUE are not
+ * a queue: 0 and 0. */
+static int
+admission_queue_depth(struct mg_context *ctx, int *size)
+{
+#if defined(ALTERNATIVE_QUEUE)
+	(void)ctx;
+	*size = 0;
+	return 0;
+#elif defined(LOCKFREE_QUEUE)
+	*size = ctx->sq_size;
+	return sq_filled(ctx);
+#else
+	int depth;
+	(void)pthread_mutex_lock(&ctx->thread_mutex);
+	depth = ctx->sq_head - ctx->sq_tail;
+	(void)pthread_mutex_unlock(&ctx->thread_mutex);
+	*size = ctx->sq_size;
+	return depth;
+#endif
+}
+
+
+/* Atomic load of a counter */
+static ptrdiff_t
+admission_load(const volatile ptrdiff_t *addr)
+{
+	return mg_atomic_compare_and_swap((volatile ptrdiff_t *)addr, 0, 0);
+}
+
+
+/* Seconds a client should wait before it tries again after a 503 */
+static int
+admission_retry_after(const struct mg_context *ctx)
+{
+	return 1 + (int)(admission_load(&ctx->queue_wait_us) / 1000000);
+}
+
+
+/* The Access-Control-Allow-Origin line for a rejection, so that browser
+ * clients can read it (option "access_control_allow_origin"), or "" */
+static void
+admission_cors_header(const struct mg_context *ctx, char *buf, size_t size)
+{
+	const char *origin = ctx->dd.config[ACCESS_CONTROL_ALLOW_ORIGIN];
+
+	buf[0] = 0;
+	if ((origin != NULL) && (*origin != 0)) {
+		mg_snprintf(NULL,
+		            NULL,
+		            buf,
+		            size,
+		            "Access-Control-Allow-Origin: %s\r\n",
+		            origin);
+	}
+}
+
+
+/* Called by the accepting thread for a new connection. Returns 1 if the
+ * socket queue is full and the connection has been answered with 503 and
+ * closed. */
+static int
+admission_shed_on_accept(struct mg_context *ctx, struct socket *so)
+{
+	char buf[512];
+	char cors[160];
+	int size;
+
+	if ((ctx->max_queue_wait_ms <= 0)
+	    || (admission_queue_depth(ctx, &size) < size) || (size == 0)) {
+		return 0;
+	}
+
+	if (!so->is_ssl) {
+		/* Read what the client has already sent (the socket is non
+		 * blocking), since closing a socket with unread data resets the
+		 * connection, and the client might lose the response. Data that
+		 * arrives later still causes a reset. */
+		(void)recv(so->sock, buf, sizeof(buf), 0);
+		admission_cors_header(ctx, cors, sizeof(cors));
+		mg_snprintf(NULL,
+		            NULL,
+		            buf,
+		            sizeof(buf),
+		            "HTTP/1.1 503 Service Unavailable\r\n"
+		            "%s"
+		            "Retry-After: %d\r\n"
+		            "Content-Type: text/plain; charset=utf-8\r\n"
+		            "Content-Length: %d\r\n"
+		            "Connection: close\r\n\r\n%s",
+		            cors,
+		            admission_retry_after(ctx),
+		            (int)sizeof(shed_body) - 1,
+		            shed_body);
+		(void)send(so->sock, buf, (int)strlen(buf), MSG_NOSIGNAL);
+		(void)shutdown(so->sock, SHUTDOWN_WR);
+	}
+	/* No TLS handshake on the accepting thread: the client only sees the
+	 * connection closed */
+	closesocket(so->sock);
+	mg_atomic_inc(&ctx->shed_queue_full);
+	return 1;
+}
+
+
+/* Called by a worker that took a socket from the queue. Records how long
+ * it waited, and returns 1 if that was longer than max_queue_wait_ms. */
+static int
+admission_check_queue_wait(struct mg_context *ctx, const struct socket *so)
+{
+	uint64_t now = mg_get_monotonic_time_ns();
+	ptrdiff_t wait_us, avg;
+
+	wait_us = (now > so->accept_time)
+	              ? (ptrdiff_t)((now - so->accept_time) / 1000)
+	              : 0;
+
+	/* Exponential moving average. A lost update when two workers race
+	 * only costs one sample. */
+	avg = admission_load(&ctx->queue_wait_us);
+	(void)mg_atomic_compare_and_swap(
+	    &ctx->queue_wait_us, avg, avg + ((wait_us - avg) >> QUEUE_WAIT_SHIFT));
+
+	return (ctx->max_queue_wait_ms > 0)
+	       && (wait_us > (ptrdiff_t)ctx->max_queue_wait_ms * 1000);
+}
+
+
+/* Bucket key for a client address and a rule of "request_rate" */
+static uint64_t
+rate_key(const union usa *rsa, int rule)
+{
+	const unsigned char *addr;
+	size_t len, i;
+	uint64_t h = 14695981039346656037u; /* FNV-1a */
+
+#if defined(USE_IPV6)
+	if (rsa->sa.sa_family == AF_INET6) {
+		/* A host usually owns a whole /64 and may pick any address in it */
+		addr = (const unsigned char *)&rsa->sin6.sin6_addr;
+		len = 8;
+	} else
+#endif
+	{
+		addr = (const unsigned char *)&rsa->sin.sin_addr;
+		len = sizeof(rsa->sin.sin_addr);
+	}
+	for (i = 0; i < len; i++) {
+		h = (h ^ addr[i]) * 1099511628211u;
+	}
+	h = (h ^ (uint64_t)(unsigned)rule) * 1099511628211u;
+	return (h != 0) ? h : 1;
+}
+
+
+/* Take a token from the bucket of the client for this request. Returns 0
+ * if the request may be processed, otherwise the seconds until the client
+ * has a token again. */
+static int
+admission_rate_limit(struct mg_connection *conn)
+{
+	struct mg_rate_limiter *rl = conn->phys_ctx->rate_limiter;
+	struct mg_rate_bucket *set, *b;
+	uint64_t key, now;
+	double rate, burst;
+	int rule = 0, i, wait = 0;
+
+	if (rl == NULL) {
+		return 0;
+	}
+	rate = match_throttle_spec(conn->dom_ctx->config[REQUEST_RATE],
+	                           &conn->client.rsa,
+	                           conn->request_info.local_uri,
+	                           &rule);
+	if (rate <= 0) {
+		return 0;
+	}
+	burst = (rate < 1) ? 1 : rate;
+	key = rate_key(&conn->client.rsa, rule);
+	set = &rl->buckets[(key % RATE_SETS) * RATE_WAYS];
+	now = mg_get_current_time_ns();
+
+	(void)pthread_mutex_lock(&rl->locks[(key % RATE_SETS) % RATE_LOCKS]);
+	b = set;
+	for (i = 0; i < RATE_WAYS; i++) {
+		if (set[i].key == key) {
+			b = &set[i];
+			break;
+		}
+		if (set[i].last < b->last) {
+			b = &set[i];
+		}
+	}
+	if (b->key != key) {
+		/* New client, or one that has been gone long enough to lose its
+		 * bucket: it starts with a full one */
+		b->key = key;
+		b->tokens = burst;
+	} else if (now > b->last) {
+		b->tokens += (double)(now - b->last) * 1e-9 * rate;
+		if (b->tokens > burst) {
+			b->tokens = burst;
+		}
+	}
+	b->last = now;
+	if (b->tokens >= 1) {
+		b->tokens -= 1;
+	} else {
+		wait = (int)((1 - b->tokens) / rate) + 1;
+	}
+	(void)pthread_mutex_unlock(&rl->locks[(key % RATE_SETS) % RATE_LOCKS]);
+
+	if (wait > 0) {
+		mg_atomic_inc(&conn->phys_ctx->rate_limited);
+	}
+	return wait;
+}
+
+
+/* Answer a request that is not admitted with status 503 or 429 */
+static void
+admission_reject(struct mg_connection *conn, int status, int retry_after)
+{
+	char headers[256];
+	char cors[160];
+	size_t len;
+
+	admission_cors_header(conn->phys_ctx, cors, sizeof(cors));
+	mg_snprintf(conn,
+	            NULL,
+	            headers,
+	            sizeof(headers),
+	            "%s"
+	            "Retry-After: %d\r\n"
+	            "Content-Type: text/plain; charset=utf-8\r\n",
+	            cors,
+	            retry_after);
+	len = strlen(headers);
+	if (status == 503) {
+		/* Free the worker for a connection that is not shed */
+		conn->must_close = 1;
+		mg_atomic_inc(&conn->phys_ctx->shed_queue_wait);
+		(void)mg_send_response(conn,
+		                       status,
+		                       headers,
+		                       len,
+		                       shed_body,
+		                       sizeof(shed_body) - 1);
+	} else {
+		static const char body[] = "Too many requests, slow down.\n";
+		(void)mg_send_response(
+		    conn, status, headers, len, body, sizeof(body) - 1);
+	}
+}
+
+
+CIVETWEB_API int
+mg_get_admission_stats(const struct mg_context *ctx,
+                       struct mg_admission_stat *stat)
+{
+	if ((ctx == NULL) || (stat == NULL)) {
+		return -1;
+	}
+	memset(stat, 0, sizeof(*stat));
+	stat->shed_queue_full = (long long)admission_load(&ctx->shed_queue_full);
+	stat->shed_queue_wait = (long long)admission_load(&ctx->shed_queue_wait);
+	stat->rate_limited = (long long)admission_load(&ctx->rate_limited);
+	stat->queue_wait_ms = (int)(admission_load(&ctx->queue_wait_us) / 1000);
+	stat->queue_depth =
+	    admission_queue_depth((struct mg_context *)ctx, &stat->queue_size);
+	return 0;
+}
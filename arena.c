@@ -0,0 +1,204 @@
+#include "arena.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+// An arena that needed more than this for one request goes back to a single
+// block of at most this size, so one large upload does not pin memory in
+// every worker that ever served one.
+#define ARENA_KEEP_MAX (1024 * 1024)
+
+struct arena_block {
+    arena_block *next;
+    size_t size; // usable bytes behind the header
+    size_t used;
+};
+
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+#define BLOCK_HEADER ALIGN_UP(sizeof(arena_block), ARENA_ALIGN)
+#define BLOCK_DATA(b) ((char *)(b) + BLOCK_HEADER)
+
+static atomic_size_t stat_high_water;
+static atomic_size_t stat_reserved;
+static atomic_ullong stat_resets;
+static atomic_ullong stat_block_allocs;
+
+static arena_block *block_new(size_t size) {
+    arena_block *b = malloc(BLOCK_HEADER + size);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    atomic_fetch_add(&stat_reserved, size);
+    return b;
+}
+
+static void block_free(arena_block *b) {
+    atomic_fetch_sub(&stat_reserved, b->size);
+    free(b);
+}
+
+int arena_init(arena *a, size_t size) {
+    memset(a, 0, sizeof(*a));
+    a->blocks = block_new(ALIGN_UP(size ? size : ARENA_BLOCK_SIZE, ARENA_ALIGN));
+    return a->blocks ? 0 : -1;
+}
+
+void arena_destroy(arena *a) {
+    while (a->blocks) {
+        arena_block *next = a->blocks->next;
+        block_free(a->blocks);
+        a->blocks = next;
+    }
+    a->last = NULL;
+    a->used = 0;
+}
+
+void arena_reset(arena *a) {
+    size_t peak = atomic_load(&stat_high_water);
+    while (a->used > peak && !atomic_compare_exchange_weak(&stat_high_water, &peak, a->used)) {
+    }
+    if (a->used > a->high_water) {
+        a->high_water = a->used;
+    }
+    atomic_fetch_add(&stat_resets, 1);
+
+    if (a->blocks && a->blocks->next) {
+        // The request did not fit: replace the chain by one block large
+        // enough for it. If that fails, keep the newest (largest) block.
+        size_t want = ALIGN_UP(a->used, ARENA_BLOCK_SIZE);
+        arena_block *keep = block_new(want < ARENA_KEEP_MAX ? want : ARENA_KEEP_MAX);
+        arena_block *b = a->blocks;
+        if (keep) {
+            atomic_fetch_add(&stat_block_allocs, 1);
+        } else {
+            keep = b;
+            b = b->next;
+            keep->next = NULL;
+        }
+        while (b) {
+            arena_block *next = b->next;
+            block_free(b);
+            b = next;
+        }
+        a->blocks = keep;
+    }
+    if (a->blocks) {
+        a->blocks->used = 0;
+    }
+    a->last = NULL;
+    a->used = 0;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    size_t n = ALIGN_UP(size ? size : 1, ARENA_ALIGN);
+    arena_block *b = a->blocks;
+    char *p;
+
+    if (!b || b->size - b->used < n) {
+        size_t block_size = b ? b->size : ARENA_BLOCK_SIZE;
+        arena_block *nb = block_new(n > block_size ? n : block_size);
+        if (!nb) return NULL;
+        atomic_fetch_add(&stat_block_allocs, 1);
+        nb->next = b;
+        a->blocks = b = nb;
+    }
+    p = BLOCK_DATA(b) + b->used;
+    b->used += n;
+    a->used += n;
+    a->last = p;
+    return p;
+}
+
+void *arena_calloc(arena *a, size_t size) {
+    void *p = arena_alloc(a, size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+void *arena_realloc(arena *a, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return arena_alloc(a, new_size);
+    if (ptr == a->last) {
+        arena_block *b = a->blocks;
+        size_t offset = (size_t)((char *)ptr - BLOCK_DATA(b));
+        size_t n = ALIGN_UP(new_size ? new_size : 1, ARENA_ALIGN);
+        if (n <= b->size - offset) {
+            a->used = a->used - (b->used - offset) + n;
+            b->used = offset + n;
+            return ptr;
+        }
+    }
+    void *p = arena_alloc(a, new_size);
+    if (p) memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    return p;
+}
+
+void arena_buf_init(arena_buf *b, arena *a, size_t size) {
+    b->a = a;
+    b->len = 0;
+    b->cap = size ? size : 1;
+    b->data = arena_alloc(a, b->cap);
+    if (b->data) b->data[0] = '\0';
+}
+
+// Make room for 'extra' more bytes plus the terminator.
+static int buf_reserve(arena_buf *b, size_t extra) {
+    if (!b->data) return -1;
+    if (b->len + extra + 1 <= b->cap) return 0;
+    size_t cap = b->cap * 2;
+    while (b->len + extra + 1 > cap) cap *= 2;
+    char *p = arena_realloc(b->a, b->data, b->cap, cap);
+    if (!p) {
+        b->data = NULL;
+        return -1;
+    }
+    b->data = p;
+    b->cap = cap;
+    return 0;
+}
+
+int arena_buf_append(arena_buf *b, const char *s, size_t len) {
+    if (buf_reserve(b, len) != 0) return -1;
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+int arena_buf_puts(arena_buf *b, const char *s) {
+    return arena_buf_append(b, s, strlen(s));
+}
+
+int arena_buf_printf(arena_buf *b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (!b->data) return -1;
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        b->data = NULL;
+        return -1;
+    }
+    if ((size_t)n >= b->cap - b->len) {
+        // Did not fit: grow and format again
+        if (buf_reserve(b, (size_t)n) != 0) return -1;
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += (size_t)n;
+    return 0;
+}
+
+void arena_get_stats(arena_stats *stats) {
+    stats->high_water = atomic_load(&stat_high_water);
+    stats->reserved = atomic_load(&stat_reserved);
+    stats->resets = atomic_load(&stat_resets);
+    stats->block_allocs = atomic_load(&stat_block_allocs);
+}
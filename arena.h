@@ -0,0 +1,74 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for per-request memory.
+//
+// Each worker thread owns one arena. Allocations are carved out of a block
+// and never freed one by one; arena_reset releases everything at once after
+// the response has been sent. The first block is kept across resets and is
+// grown to the high-water mark when a request did not fit, so a worker
+// settles on one block and steady-state requests do not call malloc.
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block arena_block;
+
+typedef struct {
+    arena_block *blocks; // block in use first, older ones behind it
+    char *last;          // most recent allocation, can grow in place
+    size_t used;         // bytes handed out since the last reset
+    size_t high_water;   // largest 'used' of this arena
+} arena;
+
+// Set up an arena with a first block of at least 'size' bytes.
+// Returns 0 on success, -1 if the block cannot be allocated.
+int arena_init(arena *a, size_t size);
+
+// Free all blocks.
+void arena_destroy(arena *a);
+
+// Release all allocations and update the statistics.
+void arena_reset(arena *a);
+
+// Allocate 'size' bytes, aligned for any type. Returns NULL when out of memory.
+void *arena_alloc(arena *a, size_t size);
+
+// Like arena_alloc, with the memory zeroed.
+void *arena_calloc(arena *a, size_t size);
+
+// Resize an allocation from old_size to new_size bytes. The most recent
+// allocation grows in place when the block has room, anything else is copied.
+void *arena_realloc(arena *a, void *ptr, size_t old_size, size_t new_size);
+
+// Growable NUL terminated string in an arena, for building responses.
+// Errors are sticky: after a failed append 'data' is NULL.
+typedef struct {
+    arena *a;
+    char *data;
+    size_t len;
+    size_t cap;
+} arena_buf;
+
+// Start an empty string with room for 'size' bytes.
+void arena_buf_init(arena_buf *b, arena *a, size_t size);
+int arena_buf_append(arena_buf *b, const char *s, size_t len);
+int arena_buf_puts(arena_buf *b, const char *s);
+int arena_buf_printf(arena_buf *b, const char *fmt, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+// Process-wide statistics over all arenas.
+typedef struct {
+    size_t high_water;                // most memory used by one request
+    size_t reserved;                  // bytes held in blocks by all arenas
+    unsigned long long resets;        // requests served
+    unsigned long long block_allocs;  // blocks allocated after arena_init
+} arena_stats;
+
+void arena_get_stats(arena_stats *stats);
+
+#endif // ARENA_H
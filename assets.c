@@ -0,0 +1,334 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // strdup, opendir
+#endif
+
+#include "assets.h"
+#include "civetweb.h" // mg_get_builtin_mime_type
+#include "sync.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#define ASSETS_BUCKETS 64
+
+// Keep the gzip variant only if it saves at least this many percent
+#define GZIP_MIN_SAVING 10
+
+// The watcher checks for shutdown this often
+#define WATCH_POLL_MS 500
+
+// Fingerprinted names (app.3f2a9c1b.js) change with their content, so
+// browsers may keep them. Everything else is revalidated with the ETag.
+#define CACHE_IMMUTABLE "Cache-Control: public, max-age=31536000, immutable\r\n"
+#define CACHE_REVALIDATE "Cache-Control: no-cache\r\n"
+
+typedef struct entry entry;
+struct entry {
+    asset a; // first: assets_release casts back
+    entry *next;
+    char *name;
+    atomic_int refs; // one for the table, one per assets_acquire
+    char etag[24];
+    char gzip_etag[28];
+};
+
+static sync_mutex lock;
+static entry *table[ASSETS_BUCKETS];
+static char *root;
+
+#ifdef __linux__
+static int inotify_fd = -1;
+static sync_thread watcher;
+static atomic_int stopping;
+#endif
+
+static unsigned long long fnv1a(const void *data, size_t len) {
+    const unsigned char *p = data;
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static entry **bucket(const char *name) {
+    return &table[fnv1a(name, strlen(name)) % ASSETS_BUCKETS];
+}
+
+static void entry_free(entry *e) {
+    free((void *)e->a.data);
+    free((void *)e->a.gzip);
+    free((void *)e->a.headers);
+    free((void *)e->a.gzip_headers);
+    free(e->name);
+    free(e);
+}
+
+static int is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// A run of at least 8 hex digits after a '.' or '-' and before a '.'
+static int is_fingerprinted(const char *name) {
+    for (const char *p = name; *p; p++) {
+        if (*p != '.' && *p != '-') continue;
+        const char *q = p + 1;
+        while (is_hex(*q)) q++;
+        if (q - p > 8 && *q == '.') return 1;
+    }
+    return 0;
+}
+
+#ifdef USE_ZLIB
+// gzip 'data' at the best level. Returns NULL if it does not pay off.
+static char *gzip_compress(const char *data, size_t size, size_t *out_size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t bound = deflateBound(&zs, (uLong)size);
+    char *out = malloc(bound);
+    if (out) {
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = (uInt)size;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)bound;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END
+            || zs.total_out * 100 > size * (100 - GZIP_MIN_SAVING)) {
+            free(out);
+            out = NULL;
+        } else {
+            *out_size = zs.total_out;
+        }
+    }
+    deflateEnd(&zs);
+    return out;
+}
+#endif
+
+static char *make_headers(const char *mime_type, const char *etag, const char *cache,
+                          int vary, int gzip, size_t *len) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "Content-Type: %s\r\nETag: %s\r\n%s%s%s",
+                     mime_type, etag, cache,
+                     vary ? "Vary: Accept-Encoding\r\n" : "",
+                     gzip ? "Content-Encoding: gzip\r\n" : "");
+    if (n < 0 || (size_t)n >= sizeof(buf)) return NULL;
+    *len = (size_t)n;
+    return strdup(buf);
+}
+
+// Read dir/name into a new entry. Returns NULL if it is not a regular
+// file, too large or cannot be read.
+static entry *load_file(const char *name) {
+    char path[1024];
+    struct stat st;
+    FILE *f;
+
+    if (name[0] == '.') return NULL; // hidden, editor swap files
+    if (snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path)) return NULL;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > ASSETS_MAX_FILE_SIZE) {
+        return NULL;
+    }
+
+    entry *e = calloc(1, sizeof(*e));
+    char *data = malloc(st.st_size > 0 ? (size_t)st.st_size : 1);
+    if (!e || !data || !(f = fopen(path, "rb"))) {
+        free(e);
+        free(data);
+        return NULL;
+    }
+    size_t size = fread(data, 1, (size_t)st.st_size, f);
+    fclose(f);
+
+    e->name = strdup(name);
+    e->a.data = data;
+    e->a.size = size;
+    unsigned long long hash = fnv1a(data, size);
+    snprintf(e->etag, sizeof(e->etag), "\"%016llx\"", hash);
+    snprintf(e->gzip_etag, sizeof(e->gzip_etag), "\"%016llx-gz\"", hash);
+    e->a.etag = e->etag;
+    e->a.gzip_etag = e->gzip_etag;
+#ifdef USE_ZLIB
+    e->a.gzip = gzip_compress(data, size, &e->a.gzip_size);
+#endif
+
+    const char *mime_type = mg_get_builtin_mime_type(name);
+    const char *cache = is_fingerprinted(name) ? CACHE_IMMUTABLE : CACHE_REVALIDATE;
+    int vary = e->a.gzip != NULL;
+    e->a.headers = make_headers(mime_type, e->etag, cache, vary, 0, &e->a.headers_len);
+    if (vary) {
+        e->a.gzip_headers = make_headers(mime_type, e->gzip_etag, cache, 1, 1, &e->a.gzip_headers_len);
+    }
+    if (!e->name || !e->a.headers || (vary && !e->a.gzip_headers)) {
+        entry_free(e);
+        return NULL;
+    }
+    atomic_init(&e->refs, 1);
+    return e;
+}
+
+// Put e (NULL to remove) in place of the entry called name
+static void table_set(const char *name, entry *e) {
+    entry *old = NULL;
+    sync_mutex_lock(&lock);
+    for (entry **p = bucket(name); *p; p = &(*p)->next) {
+        if (strcmp((*p)->name, name) == 0) {
+            old = *p;
+            *p = old->next;
+            break;
+        }
+    }
+    if (e) {
+        entry **b = bucket(name);
+        e->next = *b;
+        *b = e;
+    }
+    sync_mutex_unlock(&lock);
+    if (old) assets_release(&old->a);
+}
+
+static void reload(const char *name) {
+    table_set(name, load_file(name));
+}
+
+// Load all files of the directory. Returns the number cached, -1 on error.
+static int load_dir(void) {
+    int count = 0;
+#ifdef _WIN32
+    char pattern[1024];
+    WIN32_FIND_DATAA fd;
+    snprintf(pattern, sizeof(pattern), "%s\\*", root);
+    HANDLE h = FindFirstFileA(pattern, &fd);
+    if (h == INVALID_HANDLE_VALUE) return -1;
+    do {
+        entry *e = load_file(fd.cFileName);
+        if (e) {
+            table_set(e->name, e);
+            count++;
+        }
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+#else
+    DIR *d = opendir(root);
+    struct dirent *de;
+    if (!d) return -1;
+    while ((de = readdir(d)) != NULL) {
+        entry *e = load_file(de->d_name);
+        if (e) {
+            table_set(e->name, e);
+            count++;
+        }
+    }
+    closedir(d);
+#endif
+    return count;
+}
+
+#ifdef __linux__
+static void watch(void *arg) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    (void)arg;
+
+    while (!atomic_load(&stopping)) {
+        struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, WATCH_POLL_MS) <= 0) continue;
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        for (char *p = buf; n > 0 && p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                load_dir(); // events were lost
+            } else if (ev->len > 0) {
+                reload(ev->name); // removes it if it is gone
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+#endif
+
+int assets_init(const char *dir) {
+    if (sync_mutex_init(&lock) != 0) return -1;
+    root = strdup(dir);
+    if (!root) return -1;
+    int count = load_dir();
+    if (count < 0) return -1;
+
+#ifdef __linux__
+    // Editors and deploy scripts either rewrite a file or rename a new one
+    // over it
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd >= 0
+        && (inotify_add_watch(inotify_fd, root, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0
+            || sync_thread_start(&watcher, watch, NULL) != 0)) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (inotify_fd < 0) {
+        fprintf(stderr, "Cannot watch %s, changed frontend files need a restart\n", root);
+    }
+#endif
+    return count;
+}
+
+void assets_shutdown(void) {
+#ifdef __linux__
+    if (inotify_fd >= 0) {
+        atomic_store(&stopping, 1);
+        sync_thread_join(watcher);
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+#endif
+    for (int i = 0; i < ASSETS_BUCKETS; i++) {
+        while (table[i]) {
+            entry *e = table[i];
+            table[i] = e->next;
+            entry_free(e);
+        }
+    }
+    free(root);
+    root = NULL;
+}
+
+const asset *assets_acquire(const char *uri) {
+    const char *name;
+    entry *e;
+
+    if (!root || !uri || uri[0] != '/') return NULL;
+    name = uri[1] ? uri + 1 : "index.html";
+    if (strchr(name, '/')) return NULL; // subdirectories are not cached
+
+    sync_mutex_lock(&lock);
+    for (e = *bucket(name); e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            atomic_fetch_add(&e->refs, 1);
+            break;
+        }
+    }
+    sync_mutex_unlock(&lock);
+    return e ? &e->a : NULL;
+}
+
+void assets_release(const asset *a) {
+    entry *e = (entry *)a;
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        entry_free(e);
+    }
+}
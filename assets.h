@@ -0,0 +1,47 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+
+// In-memory cache of the frontend files.
+//
+// assets_init loads the regular files of one directory (not of its
+// subdirectories), each with a gzip variant if that is clearly smaller, and
+// prepares the response headers for both. On Linux a watcher thread reloads
+// a file when it is written, renamed or deleted (inotify); elsewhere the
+// files are loaded once. Requests for cached files are answered from memory
+// without stat, open or read.
+
+// Larger files are not cached and left to civetweb
+#define ASSETS_MAX_FILE_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    const char *data; // file content
+    size_t size;
+    const char *gzip; // gzip variant, NULL if not worth it
+    size_t gzip_size;
+    const char *etag;      // strong ETag of data, quoted
+    const char *gzip_etag; // strong ETag of gzip
+    // Header blocks for mg_send_response_as_is: Content-Type, ETag,
+    // Cache-Control, and Vary if there is a gzip variant. gzip_headers
+    // also have Content-Encoding.
+    const char *headers;
+    size_t headers_len;
+    const char *gzip_headers;
+    size_t gzip_headers_len;
+} asset;
+
+// Load the files of dir and start watching it. Returns the number of files
+// cached, or -1 if dir cannot be read.
+int assets_init(const char *dir);
+
+// Stop the watcher and free the cache. No asset may be in use.
+void assets_shutdown(void);
+
+// Find the cached file for a request path, "/" is "/index.html". Returns
+// NULL if there is none. The asset stays valid until assets_release, even
+// if the file is reloaded meanwhile.
+const asset *assets_acquire(const char *uri);
+void assets_release(const asset *a);
+
+#endif // ASSETS_H
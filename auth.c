@@ -1,11 +1,28 @@
+#ifdef _WIN32
+#define _CRT_RAND_S // rand_s
+#endif
 #include "auth.h"
 #include "db.h"
+#include "sync.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+#endif
 #define MD5_STATIC static
 #include "md5.inl"
+#define SHA_API static
+#include "sha1.inl"
+
+static int init_sessions(void);
 
 void hash_password(const char *password, char *hashed) {
     md5_state_t state;
@@ -72,7 +89,9 @@ static int create_default_teacher() {
 int auth_init(void) {
     int rc = create_default_admin();
     if (rc != SQLITE_OK) return rc;
-    return create_default_teacher();
+    rc = create_default_teacher();
+    if (rc != SQLITE_OK) return rc;
+    return init_sessions();
 }
 
 int auth_handle_login(const char *username, const char *password) {
@@ -100,35 +119,581 @@ int auth_get_user_id(const char *username) {
     return db_get_user_id_by_username(username);
 }
 
-// Simple token storage (in memory, not persistent)
-#define MAX_TOKENS 100
-static char tokens[MAX_TOKENS][65];
-static int user_ids[MAX_TOKENS];
-static int token_count = 0;
+int auth_get_user_role(const char *username) {
+    char role[16];
+    if (db_get_user_role(username, role, sizeof(role)) != 0) {
+        return 0;
+    }
+    if (strcmp(role, "admin") == 0) {
+        return AUTH_ROLE_ADMIN;
+    }
+    return strcmp(role, "teacher") == 0 ? AUTH_ROLE_TEACHER : 0;
+}
+
+// Sessions: a hash table in AUTH_SHARDS shards, each with its own lock and
+// buckets. A token's hash picks the shard and the bucket, so a lookup takes
+// one lock and walks a chain of about one entry. A shard doubles its buckets
+// when it has more sessions than buckets.
+#define AUTH_SHARD_BITS 6
+#define AUTH_SHARDS (1 << AUTH_SHARD_BITS)
+#define SHARD_INITIAL_BUCKETS 64
+#define SHARD_MAX_SESSIONS (AUTH_MAX_SESSIONS / AUTH_SHARDS)
+
+typedef struct session session;
+struct session {
+    session *next;
+    unsigned long long hash;
+    long long expires; // sync_now_ms() time
+    int user_id;
+    int role;
+    char token[AUTH_TOKEN_MAX + 1];
+};
+
+typedef struct {
+    _Alignas(64) sync_mutex lock; // a cache line of its own per shard
+    session **buckets;
+    size_t mask; // buckets - 1
+    size_t count;
+    unsigned long long expired;
+    unsigned long long rejected;
+} shard;
+
+static shard shards[AUTH_SHARDS];
+static int sessions_ready = 0;
+
+static unsigned long long token_hash(const char *token) {
+    unsigned long long h = 1469598103934665603ULL; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)token; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static shard *shard_of(unsigned long long hash) {
+    return &shards[hash >> (64 - AUTH_SHARD_BITS)]; // the low bits pick the bucket
+}
+
+static int init_sessions(void) {
+    if (sessions_ready) {
+        return 0;
+    }
+    for (int i = 0; i < AUTH_SHARDS; i++) {
+        shard *sh = &shards[i];
+        sh->buckets = calloc(SHARD_INITIAL_BUCKETS, sizeof(session *));
+        if (!sh->buckets || sync_mutex_init(&sh->lock) != 0) {
+            free(sh->buckets);
+            sh->buckets = NULL;
+            while (i-- > 0) {
+                sync_mutex_destroy(&shards[i].lock);
+                free(shards[i].buckets);
+                shards[i].buckets = NULL;
+            }
+            return -1;
+        }
+        sh->mask = SHARD_INITIAL_BUCKETS - 1;
+        sh->count = 0;
+    }
+    sessions_ready = 1;
+    return 0;
+}
+
+// Double the buckets of a shard, called with its lock held. If there is no
+// memory the chains just get longer.
+static void grow_shard(shard *sh) {
+    size_t n = (sh->mask + 1) * 2;
+    session **buckets = calloc(n, sizeof(session *));
+    if (!buckets) {
+        return;
+    }
+    for (size_t b = 0; b <= sh->mask; b++) {
+        session *s = sh->buckets[b];
+        while (s) {
+            session *next = s->next;
+            session **head = &buckets[s->hash & (n - 1)];
+            s->next = *head;
+            *head = s;
+            s = next;
+        }
+    }
+    free(sh->buckets);
+    sh->buckets = buckets;
+    sh->mask = n - 1;
+}
+
+// Free the expired sessions of a shard, called with its lock held
+static int sweep_shard(shard *sh, long long now) {
+    int freed = 0;
+    for (size_t b = 0; b <= sh->mask; b++) {
+        session **link = &sh->buckets[b];
+        while (*link) {
+            session *s = *link;
+            if (s->expires <= now) {
+                *link = s->next;
+                free(s);
+                freed++;
+            } else {
+                link = &s->next;
+            }
+        }
+    }
+    sh->count -= (size_t)freed;
+    sh->expired += (unsigned long long)freed;
+    return freed;
+}
+
+// Fill buf with len bytes from the operating system's CSPRNG. Returns 0,
+// or -1 if none could be read.
+static int random_bytes(unsigned char *buf, size_t len) {
+#ifdef _WIN32
+    for (size_t i = 0; i < len; i += sizeof(unsigned int)) {
+        unsigned int r;
+        if (rand_s(&r) != 0) {
+            return -1;
+        }
+        size_t n = len - i < sizeof(r) ? len - i : sizeof(r);
+        memcpy(buf + i, &r, n);
+    }
+    return 0;
+#else
+    size_t done = 0;
+#ifdef __linux__
+    while (done < len) {
+        ssize_t n = getrandom(buf + done, len - done, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // ENOSYS on old kernels: try the device
+        }
+        done += (size_t)n;
+    }
+    if (done == len) {
+        return 0;
+    }
+#endif
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+    return 0;
+#endif
+}
 
-void auth_generate_token(char *token, size_t len) {
-    // Generate a simple random token
+// A random token of len - 1 characters. Returns 0, or -1 without a source
+// of randomness.
+static int generate_token(char *token, size_t len) {
     const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-    for (size_t i = 0; i < len - 1; ++i) {
-        token[i] = charset[rand() % (sizeof(charset) - 1)];
+    const size_t n = sizeof(charset) - 1;
+    unsigned char bytes[AUTH_TOKEN_MAX];
+    size_t i = 0;
+    while (i < len - 1) {
+        size_t want = len - 1 - i < sizeof(bytes) ? len - 1 - i : sizeof(bytes);
+        if (random_bytes(bytes, want) != 0) {
+            return -1;
+        }
+        for (size_t j = 0; j < want; j++) {
+            // Drop bytes past the last multiple of n so that every
+            // character is equally likely
+            if (bytes[j] < 256 / n * n) {
+                token[i++] = charset[bytes[j] % n];
+            }
+        }
     }
     token[len - 1] = '\0';
+    return 0;
 }
 
-int auth_validate_token(const char *token) {
-    for (int i = 0; i < token_count; ++i) {
-        if (strcmp(tokens[i], token) == 0) {
-            return user_ids[i];
+// User id of a live session, -1 if there is none. Extends the session, or
+// ends it if end is set.
+static int find_session(const char *token, int end, int *role) {
+    if (!sessions_ready || strlen(token) > AUTH_TOKEN_MAX) {
+        return -1;
+    }
+    unsigned long long hash = token_hash(token);
+    shard *sh = shard_of(hash);
+    long long now = sync_now_ms();
+    int user_id = -1;
+
+    sync_mutex_lock(&sh->lock);
+    for (session **link = &sh->buckets[hash & sh->mask]; *link; link = &(*link)->next) {
+        session *s = *link;
+        if (s->hash != hash || strcmp(s->token, token) != 0) {
+            continue;
+        }
+        if (s->expires > now) {
+            user_id = s->user_id;
+            if (role) {
+                *role = s->role;
+            }
+        }
+        if (s->expires <= now || end) {
+            // Expired and not swept yet, or logged out
+            *link = s->next;
+            sh->count--;
+            sh->expired += s->expires <= now;
+            free(s);
+        } else {
+            s->expires = now + AUTH_SESSION_IDLE_MS; // sliding expiry
+        }
+        break;
+    }
+    sync_mutex_unlock(&sh->lock);
+    return user_id;
+}
+
+// Returns 0, 1 if the token is already in use, or -1 if the table is full.
+static int store_session(const char *token, int user_id, int role) {
+    if (!sessions_ready || strlen(token) > AUTH_TOKEN_MAX) {
+        return -1;
+    }
+    unsigned long long hash = token_hash(token);
+    shard *sh = shard_of(hash);
+    long long now = sync_now_ms();
+    session *s = malloc(sizeof(*s));
+    if (!s) {
+        return -1;
+    }
+    s->hash = hash;
+    s->expires = now + AUTH_SESSION_IDLE_MS;
+    s->user_id = user_id;
+    s->role = role;
+    strcpy(s->token, token);
+
+    sync_mutex_lock(&sh->lock);
+    for (session *t = sh->buckets[hash & sh->mask]; t; t = t->next) {
+        if (t->hash == hash && strcmp(t->token, token) == 0) {
+            sync_mutex_unlock(&sh->lock);
+            free(s);
+            return 1;
+        }
+    }
+    if (sh->count >= SHARD_MAX_SESSIONS && sweep_shard(sh, now) == 0) {
+        sh->rejected++;
+        sync_mutex_unlock(&sh->lock);
+        free(s);
+        return -1;
+    }
+    if (sh->count > sh->mask) {
+        grow_shard(sh);
+    }
+    session **head = &sh->buckets[hash & sh->mask];
+    s->next = *head;
+    *head = s;
+    sh->count++;
+    sync_mutex_unlock(&sh->lock);
+    return 0;
+}
+
+// Signed tokens: "s1.<user id>.<role>.<expiry>.<signature>", with the expiry
+// in Unix seconds and the signature the HMAC-SHA1 of everything before it,
+// in base64url. They are checked without any table, so every server with
+// the same secret accepts them and they outlive restarts. Logged out tokens
+// go to a small revocation set until they expire; it is local to the
+// process.
+#define SIGNED_PREFIX "s1."
+#define SIGNATURE_LEN 27 // base64url of SHA1_DIGEST_SIZE bytes
+#define HMAC_BLOCK 64
+#define REVOKED_SLOTS (2 * AUTH_REVOKED_MAX) // open addressing, half full at most
+
+typedef struct {
+    char signature[SIGNATURE_LEN];
+    long long expires; // 0: free slot
+} revoked_token;
+
+static int signing = 0;
+static SHA_CTX hmac_inner, hmac_outer; // after the padded key
+static sync_mutex revoked_lock;
+static revoked_token revoked[REVOKED_SLOTS], revoked_tmp[REVOKED_SLOTS];
+static int num_revoked = 0;
+static atomic_int any_revoked;
+
+int auth_set_token_secret(const char *secret, size_t len) {
+    unsigned char key[HMAC_BLOCK] = { 0 }, pad[HMAC_BLOCK];
+    SHA_CTX ctx;
+
+    if (len < AUTH_SECRET_MIN || signing || sync_mutex_init(&revoked_lock) != 0) {
+        return -1;
+    }
+    if (len > HMAC_BLOCK) {
+        SHA1_Init(&ctx);
+        SHA1_Update(&ctx, (const uint8_t *)secret, (uint32_t)len);
+        SHA1_Final(key, &ctx);
+    } else {
+        memcpy(key, secret, len);
+    }
+    for (int i = 0; i < HMAC_BLOCK; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    SHA1_Init(&hmac_inner);
+    SHA1_Update(&hmac_inner, pad, HMAC_BLOCK);
+    for (int i = 0; i < HMAC_BLOCK; i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    SHA1_Init(&hmac_outer);
+    SHA1_Update(&hmac_outer, pad, HMAC_BLOCK);
+    memset(key, 0, sizeof(key));
+    signing = 1;
+    return 0;
+}
+
+// Base64url signature of data[0..len)
+static void sign(const char *data, size_t len, char *signature) {
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned char digest[SHA1_DIGEST_SIZE + 1];
+    SHA_CTX ctx = hmac_inner;
+
+    SHA1_Update(&ctx, (const uint8_t *)data, (uint32_t)len);
+    SHA1_Final(digest, &ctx);
+    ctx = hmac_outer;
+    SHA1_Update(&ctx, digest, SHA1_DIGEST_SIZE);
+    SHA1_Final(digest, &ctx);
+    digest[SHA1_DIGEST_SIZE] = 0;
+    for (int i = 0, o = 0; o < SIGNATURE_LEN; i += 3) {
+        unsigned v = (unsigned)digest[i] << 16 | (unsigned)digest[i + 1] << 8
+                     | (i + 2 < SHA1_DIGEST_SIZE ? digest[i + 2] : 0);
+        for (int k = 18; k >= 0 && o < SIGNATURE_LEN; k -= 6) {
+            signature[o++] = b64[(v >> k) & 63];
+        }
+    }
+}
+
+static unsigned long long parse_digits(const char **p, int *ok) {
+    unsigned long long v = 0;
+    const char *start = *p;
+    while (**p >= '0' && **p <= '9' && *p - start < 19) {
+        v = v * 10 + (unsigned long long)(**p - '0');
+        (*p)++;
+    }
+    *ok = *p > start;
+    return v;
+}
+
+// Parse and check a signed token. Returns the user id, or -1.
+static int check_signed(const char *token, int *role, long long *expires, const char **signature) {
+    const char *p = token + sizeof(SIGNED_PREFIX) - 1;
+    char expected[SIGNATURE_LEN];
+    int ok_id, ok_expiry;
+
+    unsigned long long user_id = parse_digits(&p, &ok_id);
+    if (!ok_id || user_id > 0x7fffffff || *p++ != '.'
+        || (*p != AUTH_ROLE_ADMIN && *p != AUTH_ROLE_TEACHER) || p[1] != '.') {
+        return -1;
+    }
+    int r = *p;
+    p += 2;
+    unsigned long long expiry = parse_digits(&p, &ok_expiry);
+    if (!ok_expiry || *p++ != '.' || strlen(p) != SIGNATURE_LEN) {
+        return -1;
+    }
+    // Compare all bytes, so the time does not tell how many matched
+    sign(token, (size_t)(p - token), expected);
+    unsigned char diff = 0;
+    for (int i = 0; i < SIGNATURE_LEN; i++) {
+        diff |= (unsigned char)(expected[i] ^ p[i]);
+    }
+    if (diff != 0 || (long long)expiry <= (long long)time(NULL)) {
+        return -1;
+    }
+    if (role) {
+        *role = r;
+    }
+    *expires = (long long)expiry;
+    *signature = p;
+    return (int)user_id;
+}
+
+static size_t revoked_slot(const char *signature) {
+    size_t h = 0;
+    memcpy(&h, signature, sizeof(h)); // random already
+    return h % REVOKED_SLOTS;
+}
+
+// Called with revoked_lock held
+static int is_revoked(const char *signature) {
+    for (size_t i = revoked_slot(signature); revoked[i].expires; i = (i + 1) % REVOKED_SLOTS) {
+        if (memcmp(revoked[i].signature, signature, SIGNATURE_LEN) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Drop the revocations of expired tokens, called with revoked_lock held
+static void purge_revoked(long long now) {
+    memcpy(revoked_tmp, revoked, sizeof(revoked));
+    memset(revoked, 0, sizeof(revoked));
+    num_revoked = 0;
+    for (size_t j = 0; j < REVOKED_SLOTS; j++) {
+        if (revoked_tmp[j].expires > now) {
+            size_t i = revoked_slot(revoked_tmp[j].signature);
+            while (revoked[i].expires) {
+                i = (i + 1) % REVOKED_SLOTS;
+            }
+            revoked[i] = revoked_tmp[j];
+            num_revoked++;
+        }
+    }
+    atomic_store(&any_revoked, num_revoked > 0);
+}
+
+static int revoke(const char *signature, long long expires) {
+    int rc = 0;
+    sync_mutex_lock(&revoked_lock);
+    if (num_revoked >= AUTH_REVOKED_MAX) {
+        purge_revoked((long long)time(NULL));
+    }
+    if (is_revoked(signature)) {
+        rc = 0;
+    } else if (num_revoked >= AUTH_REVOKED_MAX) {
+        rc = AUTH_REVOKED_FULL;
+    } else {
+        size_t i = revoked_slot(signature);
+        while (revoked[i].expires) {
+            i = (i + 1) % REVOKED_SLOTS;
         }
+        memcpy(revoked[i].signature, signature, SIGNATURE_LEN);
+        revoked[i].expires = expires;
+        num_revoked++;
+        atomic_store(&any_revoked, 1);
     }
-    return -1;
+    sync_mutex_unlock(&revoked_lock);
+    return rc;
 }
 
-// Helper to store token
-void auth_store_token(const char *token, int user_id) {
-    if (token_count < MAX_TOKENS) {
-        strcpy(tokens[token_count], token);
-        user_ids[token_count] = user_id;
-        token_count++;
+int auth_issue_token(char *token, size_t size, int user_id, int role) {
+    if (!signing) {
+        if (size < AUTH_TOKEN_MAX + 1) {
+            return -1;
+        }
+        int rc;
+        do {
+            if (generate_token(token, AUTH_TOKEN_MAX + 1) != 0) {
+                return -1;
+            }
+            rc = store_session(token, user_id, role);
+        } while (rc == 1); // already taken: draw another
+        return rc;
+    }
+    long long expires = (long long)time(NULL) + AUTH_SIGNED_TOKEN_TTL_S;
+    int len = snprintf(token, size, SIGNED_PREFIX "%d.%c.%lld.", user_id, role, expires);
+    if (len < 0 || (size_t)len + SIGNATURE_LEN >= size) {
+        return -1;
+    }
+    sign(token, (size_t)len, token + len);
+    token[len + SIGNATURE_LEN] = '\0';
+    return 0;
+}
+
+int auth_check_token(const char *token, int *role) {
+    if (strncmp(token, SIGNED_PREFIX, sizeof(SIGNED_PREFIX) - 1) != 0) {
+        return find_session(token, 0, role);
+    }
+    long long expires;
+    const char *signature;
+    int user_id = signing ? check_signed(token, role, &expires, &signature) : -1;
+    if (user_id >= 0 && atomic_load_explicit(&any_revoked, memory_order_relaxed)) {
+        sync_mutex_lock(&revoked_lock);
+        if (is_revoked(signature)) {
+            user_id = -1;
+        }
+        sync_mutex_unlock(&revoked_lock);
+    }
+    return user_id;
+}
+
+int auth_validate_token(const char *token) {
+    return auth_check_token(token, NULL);
+}
+
+int auth_revoke_token(const char *token) {
+    if (strncmp(token, SIGNED_PREFIX, sizeof(SIGNED_PREFIX) - 1) != 0) {
+        return find_session(token, 1, NULL) >= 0 ? 0 : -1;
+    }
+    long long expires;
+    const char *signature;
+    if (!signing || check_signed(token, NULL, &expires, &signature) < 0) {
+        return -1;
+    }
+    return revoke(signature, expires);
+}
+
+int auth_sweep_sessions(void) {
+    int freed = 0;
+    if (signing) {
+        sync_mutex_lock(&revoked_lock);
+        purge_revoked((long long)time(NULL));
+        sync_mutex_unlock(&revoked_lock);
+    }
+    if (!sessions_ready) {
+        return 0;
+    }
+    // One shard at a time: a worker waits for at most one shard's sweep
+    for (int i = 0; i < AUTH_SHARDS; i++) {
+        shard *sh = &shards[i];
+        sync_mutex_lock(&sh->lock);
+        freed += sweep_shard(sh, sync_now_ms());
+        sync_mutex_unlock(&sh->lock);
+    }
+    return freed;
+}
+
+void auth_get_session_stats(auth_session_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (signing) {
+        sync_mutex_lock(&revoked_lock);
+        stats->revoked = (unsigned long long)num_revoked;
+        sync_mutex_unlock(&revoked_lock);
+    }
+    if (!sessions_ready) {
+        return;
+    }
+    for (int i = 0; i < AUTH_SHARDS; i++) {
+        shard *sh = &shards[i];
+        sync_mutex_lock(&sh->lock);
+        stats->sessions += (unsigned long long)sh->count;
+        stats->expired += sh->expired;
+        stats->rejected += sh->rejected;
+        sync_mutex_unlock(&sh->lock);
+    }
+}
+
+void auth_shutdown(void) {
+    if (signing) {
+        signing = 0;
+        sync_mutex_destroy(&revoked_lock);
+        memset(&hmac_inner, 0, sizeof(hmac_inner));
+        memset(&hmac_outer, 0, sizeof(hmac_outer));
+        memset(revoked, 0, sizeof(revoked));
+        num_revoked = 0;
+        atomic_store(&any_revoked, 0);
+    }
+    if (!sessions_ready) {
+        return;
+    }
+    sessions_ready = 0;
+    for (int i = 0; i < AUTH_SHARDS; i++) {
+        shard *sh = &shards[i];
+        for (size_t b = 0; b <= sh->mask; b++) {
+            while (sh->buckets[b]) {
+                session *s = sh->buckets[b];
+                sh->buckets[b] = s->next;
+                free(s);
+            }
+        }
+        free(sh->buckets);
+        sh->buckets = NULL;
+        sync_mutex_destroy(&sh->lock);
     }
 }
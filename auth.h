@@ -14,9 +14,80 @@ int auth_handle_login(const char *username, const char *password);
 // Get user ID by username
 int auth_get_user_id(const char *username);
 
-// Token management
-void auth_generate_token(char *token, size_t len);
+// Token role of a user from the users table, AUTH_ROLE_ADMIN or
+// AUTH_ROLE_TEACHER, or 0 for no such user or any other role
+int auth_get_user_role(const char *username);
+
+// Tokens. By default a token is a random string naming a session: the
+// sessions are kept in a hash table split into shards with a lock each, so
+// lookups are O(1) and workers rarely wait for each other. A session ends
+// AUTH_SESSION_IDLE_MS after it was last used. Expired sessions are freed by
+// auth_sweep_sessions, which main.c runs on the civetweb timer thread every
+// AUTH_SWEEP_INTERVAL_S, or when a lookup comes across them.
+//
+// With a secret (auth_set_token_secret), tokens are signed instead: they
+// carry the user id, role and expiry (AUTH_SIGNED_TOKEN_TTL_S after the
+// login) with an HMAC-SHA1 signature, and are checked without any shared
+// state. Servers with the same secret accept each other's tokens, also after
+// a restart. Revoked ones are kept in a set of up to AUTH_REVOKED_MAX until
+// they expire. Session tokens are still accepted.
+#ifndef AUTH_SESSION_IDLE_MS
+#define AUTH_SESSION_IDLE_MS (2 * 60 * 60 * 1000LL)
+#endif
+#ifndef AUTH_MAX_SESSIONS
+#define AUTH_MAX_SESSIONS (4 * 1024 * 1024)
+#endif
+#ifndef AUTH_SWEEP_INTERVAL_S
+#define AUTH_SWEEP_INTERVAL_S 10
+#endif
+#ifndef AUTH_SIGNED_TOKEN_TTL_S
+#define AUTH_SIGNED_TOKEN_TTL_S (8 * 60 * 60)
+#endif
+#ifndef AUTH_REVOKED_MAX
+#define AUTH_REVOKED_MAX 4096
+#endif
+#define AUTH_SECRET_MIN 16
+#define AUTH_TOKEN_MAX 64
+
+// Roles in tokens
+#define AUTH_ROLE_ADMIN   'a'
+#define AUTH_ROLE_TEACHER 't'
+
+typedef struct {
+    unsigned long long sessions; // live now
+    unsigned long long expired;  // freed by sweeps and lookups
+    unsigned long long rejected; // not stored, the table was full
+    unsigned long long revoked;  // signed tokens in the revocation set
+} auth_session_stats;
+
+// Sign tokens with this secret of at least AUTH_SECRET_MIN bytes from now
+// on. Call before the server starts. Returns 0, or -1 if it is too short.
+int auth_set_token_secret(const char *secret, size_t len);
+
+// A token for a login, in token[size], size at least AUTH_TOKEN_MAX + 1.
+// Returns 0, or -1 if the session table is full (AUTH_MAX_SESSIONS sessions
+// that have not expired), out of memory, or the system has no random
+// source. Session tokens come from the system CSPRNG.
+int auth_issue_token(char *token, size_t size, int user_id, int role);
+
+// User id of a valid token, or -1. role, if not NULL, gets its role. Using
+// a session token extends the session.
+int auth_check_token(const char *token, int *role);
 int auth_validate_token(const char *token);
-void auth_store_token(const char *token, int user_id);
+
+// Log out: end the session, or revoke the signed token. Returns 0, -1 if
+// the token is not valid, or AUTH_REVOKED_FULL if the revocation set is full
+// and the token stays valid.
+#define AUTH_REVOKED_FULL (-2)
+int auth_revoke_token(const char *token);
+
+// Free the expired sessions and revocations. Returns how many sessions
+// there were.
+int auth_sweep_sessions(void);
+
+void auth_get_session_stats(auth_session_stats *stats);
+
+// Free all sessions and forget the secret
+void auth_shutdown(void);
 
 #endif // AUTH_H
@@ -0,0 +1,155 @@
+// In-memory connections for bench_handlers.c.
+//
+// civetweb.c is included, as in bench_queue.c, to build a struct
+// mg_connection without a client. send and sendmsg are renamed before the
+// include: what a handler writes to the connection is appended to a buffer
+// instead of going to the kernel, and the rest of civetweb's response code
+// runs as in the server.
+
+#define send bench_send
+#define sendmsg bench_sendmsg
+#include "civetweb.c"
+#undef send
+#undef sendmsg
+
+// The real ones, declared under the new names by the system headers
+ssize_t send(int sock, const void *buf, size_t len, int flags);
+ssize_t sendmsg(int sock, const struct msghdr *msg, int flags);
+
+// The socket of the in-memory connection. Anything else is a real socket.
+#define BENCH_SOCKET ((SOCKET)0x7ffffff0)
+
+static char *output;
+static size_t output_len, output_cap;
+
+static int capture(const void *buf, size_t len)
+{
+    if (output_len + len > output_cap) {
+        size_t cap = output_cap ? output_cap : 4096;
+        while (cap < output_len + len) {
+            cap *= 2;
+        }
+        char *p = mg_realloc(output, cap);
+        if (!p) {
+            return -1;
+        }
+        output = p;
+        output_cap = cap;
+    }
+    memcpy(output + output_len, buf, len);
+    output_len += len;
+    return (int)len;
+}
+
+ssize_t bench_send(int sock, const void *buf, size_t len, int flags)
+{
+    if (sock != BENCH_SOCKET) {
+        return send(sock, buf, len, flags);
+    }
+    return capture(buf, len);
+}
+
+ssize_t bench_sendmsg(int sock, const struct msghdr *msg, int flags)
+{
+    int n = 0;
+    if (sock != BENCH_SOCKET) {
+        return sendmsg(sock, msg, flags);
+    }
+    for (size_t i = 0; i < (size_t)msg->msg_iovlen; i++) {
+        if (capture(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len) < 0) {
+            return -1;
+        }
+        n += (int)msg->msg_iov[i].iov_len;
+    }
+    return n;
+}
+
+// A connection of ctx, as a worker thread sets it up. thread_pointer is
+// what the init_thread callback would have returned for the worker.
+struct mg_connection *bench_conn_new(struct mg_context *ctx, void *thread_pointer)
+{
+    struct mg_connection *conn = mg_calloc(1, sizeof(*conn));
+    if (!conn) {
+        return NULL;
+    }
+    conn->buf = mg_malloc(ctx->max_request_size);
+    if (!conn->buf) {
+        mg_free(conn);
+        return NULL;
+    }
+    conn->buf_size = (int)ctx->max_request_size;
+    conn->phys_ctx = ctx;
+    conn->dom_ctx = &ctx->dd;
+    conn->tls_user_ptr = thread_pointer;
+    conn->request_info.user_data = ctx->user_data;
+    conn->client.sock = BENCH_SOCKET;
+    conn->client.rsa.sin.sin_family = AF_INET;
+    conn->client.rsa.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    conn->client.lsa = conn->client.rsa;
+    mg_strlcpy(conn->request_info.remote_addr, "127.0.0.1", sizeof(conn->request_info.remote_addr));
+    mg_strlcpy(conn->request_info.server_addr, "127.0.0.1", sizeof(conn->request_info.server_addr));
+    pthread_mutex_init(&conn->mutex, &pthread_mutex_attr);
+    conn->conn_birth_time = time(NULL);
+    return conn;
+}
+
+void bench_conn_free(struct mg_connection *conn)
+{
+    pthread_mutex_destroy(&conn->mutex);
+    mg_free(conn->buf);
+    mg_free(conn);
+}
+
+// Load a complete HTTP/1.1 request (headers and body) into conn, parsed as
+// get_request and process_new_connection would after reading it. The URI
+// is taken as it is, not decoded or cleaned. Returns 0, or -1 if the
+// request does not fit or does not parse.
+int bench_conn_request(struct mg_connection *conn, const char *request, size_t len)
+{
+    const char *cl;
+    char *query;
+
+    reset_per_request_attributes(conn);
+    output_len = 0;
+    if (len >= (size_t)conn->buf_size) {
+        return -1;
+    }
+    memcpy(conn->buf, request, len);
+    conn->data_len = (int)len;
+    conn->request_len = get_http_header_len(conn->buf, conn->data_len);
+    if (conn->request_len <= 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &conn->req_time);
+    conn->req_read_time = conn->req_time;
+    conn->connection_type = CONNECTION_TYPE_REQUEST;
+    if (parse_http_request(conn->buf, conn->buf_size, &conn->request_info) <= 0) {
+        return -1;
+    }
+
+    cl = get_header(conn->request_info.http_headers, conn->request_info.num_headers, "Content-Length");
+    conn->content_len = cl ? strtoll(cl, NULL, 10) : 0;
+    conn->request_info.content_length = conn->content_len;
+#if defined(USE_ZLIB)
+    cl = get_header(conn->request_info.http_headers, conn->request_info.num_headers, "Accept-Encoding");
+    conn->accept_gzip = cl && header_accepts_gzip(cl);
+#endif
+    conn->protocol_type = PROTOCOL_TYPE_HTTP1;
+
+    query = strchr(conn->request_info.request_uri, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+    conn->request_info.query_string = query;
+    conn->request_info.local_uri_raw = conn->request_info.request_uri;
+    conn->request_info.local_uri = conn->request_info.request_uri;
+    return 0;
+}
+
+// After the handler: what it wrote since bench_conn_request
+const char *bench_conn_output(struct mg_connection *conn, size_t *len)
+{
+    free_buffered_response_header_list(conn);
+    *len = output_len;
+    return output;
+}
@@ -0,0 +1,531 @@
+// Microbenchmark for the db.c queries at realistic data sizes.
+//
+// Generates a database per scale with a deterministic synthetic data set,
+// then times each db.c function in isolation on it: ns per call, rows
+// returned per second, and the allocations per call (SQLite's, counted
+// through a wrapped allocator, plus new arena blocks).
+//
+// A scale is a number of teachers. For each of them the generator creates
+// a login and 1 to 8 subjects (2.5 on average, 5% of all subjects have no
+// teacher), spread over 24 programs with Zipf popularity. Materials, on
+// average MATERIALS_PER_TEACHER per teacher, go to subjects in proportion
+// to a Pareto weight, so a few subjects have hundreds and most a handful.
+// Categories are weighted as uploaded in practice (mostly lecture notes),
+// and file_data is 96 to 1536 bytes of base64. The same seed gives the
+// same database, which is kept as bench_db_<teachers>.db and reused by the
+// next run.
+//
+// Build and run with "make bench-db". Optional arguments:
+//   bench_db [teachers,...] [materials per teacher] [seconds per function]
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "db.h"
+#include "events.h"
+
+#define DEFAULT_SCALES "100,1000,10000"
+#define MATERIALS_PER_TEACHER 100
+#define DEFAULT_SECONDS 0.3
+#define MAX_CALLS 1000000
+#define SEED 0x5eed2024u
+#define FILE_DATA_MAX 1536
+// Bumped whenever the generator changes, so old databases are not reused
+#define DATASET_VERSION 1
+
+static const char *const programs[] = {
+    "BS Information Technology", "BS Computer Science", "BS Education",
+    "BS Nursing", "BS Accountancy", "BS Business Administration",
+    "BS Civil Engineering", "BS Criminology", "BS Psychology",
+    "BS Hospitality Management", "BS Electrical Engineering", "BS Biology",
+    "BS Mathematics", "BS Mechanical Engineering", "BS Tourism Management",
+    "BA Communication", "BS Architecture", "BS Social Work",
+    "BA Political Science", "BS Agriculture", "BS Marine Engineering",
+    "BS Pharmacy", "BS Physics", "BA English Language",
+};
+#define NUM_PROGRAMS (int)(sizeof(programs) / sizeof(programs[0]))
+
+static const char *const courses[] = {
+    "Programming", "Data Structures", "Calculus", "Statistics",
+    "Purposive Communication", "Ethics", "Physics", "Chemistry",
+    "Accounting", "Anatomy", "Research Methods", "Networking",
+    "Databases", "Economics", "Filipino", "Art Appreciation",
+};
+#define NUM_COURSES (int)(sizeof(courses) / sizeof(courses[0]))
+
+static const char *const grade_levels[] = { "1st Year", "2nd Year", "3rd Year", "4th Year" };
+static const char *const semesters[] = { "1st Semester", "2nd Semester", "Summer" };
+
+static const struct {
+    const char *name;
+    const char *file;
+    unsigned weight;
+} categories[] = {
+    { "Lecture Notes", "notes", 35 }, { "Assignments", "assignment", 20 },
+    { "Quizzes", "quiz", 15 },        { "Exams", "exam", 10 },
+    { "Laboratory", "lab", 10 },      { "Syllabus", "syllabus", 5 },
+    { "References", "reading", 5 },
+};
+#define NUM_CATEGORIES (int)(sizeof(categories) / sizeof(categories[0]))
+
+static const char *const extensions[] = { "pdf", "pdf", "pdf", "docx", "pptx", "xlsx" };
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Uniform in [0, 1)
+static double uniform(void)
+{
+    return (double)(next_random() >> 11) / 9007199254740992.0;
+}
+
+// 0 .. n-1 with probability proportional to 1 / (i + 1)
+static int zipf(int n)
+{
+    double h = 0, u;
+    for (int i = 0; i < n; i++) {
+        h += 1.0 / (i + 1);
+    }
+    u = uniform() * h;
+    for (int i = 0; i < n; i++) {
+        u -= 1.0 / (i + 1);
+        if (u < 0) {
+            return i;
+        }
+    }
+    return n - 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// SQLite's allocator, wrapped to count allocations
+static sqlite3_mem_methods default_mem;
+static unsigned long long alloc_count, alloc_bytes;
+
+static void *counting_malloc(int n)
+{
+    alloc_count++;
+    alloc_bytes += (unsigned)n;
+    return default_mem.xMalloc(n);
+}
+
+static void *counting_realloc(void *p, int n)
+{
+    alloc_count++;
+    alloc_bytes += (unsigned)n;
+    return default_mem.xRealloc(p, n);
+}
+
+static int exec(const char *sql)
+{
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+static sqlite3_stmt *prepare(const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, sqlite3_errmsg(db));
+        exit(1);
+    }
+    return stmt;
+}
+
+static void step(sqlite3_stmt *stmt)
+{
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    sqlite3_reset(stmt);
+}
+
+// Fill the tables db_init created (and seeded with a few rows) with the
+// data set of a scale
+static int generate(int teachers, int materials_per_teacher)
+{
+    static char base64[FILE_DATA_MAX * 2];
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char a[128], b[128], c[128];
+    int num_subjects = 0, num_materials = teachers * materials_per_teacher;
+    int first_teacher = 0;
+    int *subject_ids;
+    double *cumulative;
+
+    rng_state = SEED;
+    for (size_t i = 0; i < sizeof(base64); i++) {
+        base64[i] = alphabet[next_random() % 64];
+    }
+    if (exec("BEGIN;") != 0) {
+        return -1;
+    }
+
+    sqlite3_stmt *stmt = prepare("INSERT OR IGNORE INTO programs (name) VALUES (?);");
+    for (int i = 0; i < NUM_PROGRAMS; i++) {
+        sqlite3_bind_text(stmt, 1, programs[i], -1, SQLITE_STATIC);
+        step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    stmt = prepare("INSERT INTO users (name, username, password, role, access_code) VALUES (?, ?, ?, 'teacher', ?);");
+    for (int i = 0; i < teachers; i++) {
+        snprintf(a, sizeof(a), "Teacher %d", i);
+        snprintf(b, sizeof(b), "teacher%05d", i);
+        snprintf(c, sizeof(c), "pass%05d", i);
+        sqlite3_bind_text(stmt, 1, a, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, b, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, c, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, c + 4, -1, SQLITE_TRANSIENT);
+        step(stmt);
+        if (i == 0) {
+            first_teacher = (int)sqlite3_last_insert_rowid(db);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    // 1 to 8 subjects per teacher, fewer more likely
+    int max_subjects = teachers * 8;
+    subject_ids = malloc((size_t)max_subjects * sizeof(int));
+    cumulative = malloc((size_t)max_subjects * sizeof(double));
+    if (!subject_ids || !cumulative) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    stmt = prepare("INSERT INTO subjects (program, grade_level, semester, subject, teacher_id) VALUES (?, ?, ?, ?, ?);");
+    double total_weight = 0;
+    for (int i = 0; i < teachers; i++) {
+        int n = 1 + (int)(uniform() * uniform() * 8);
+        for (int j = 0; j < n; j++) {
+            snprintf(a, sizeof(a), "%s %d", courses[next_random() % NUM_COURSES], 1 + (int)(next_random() % 4));
+            sqlite3_bind_text(stmt, 1, programs[zipf(NUM_PROGRAMS)], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, grade_levels[next_random() % 4], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, semesters[zipf(3)], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 4, a, -1, SQLITE_TRANSIENT);
+            // Every 20th subject is unassigned
+            if (num_subjects % 20 != 19) {
+                sqlite3_bind_int(stmt, 5, first_teacher + i);
+            } else {
+                sqlite3_bind_null(stmt, 5);
+            }
+            step(stmt);
+            subject_ids[num_subjects] = (int)sqlite3_last_insert_rowid(db);
+            total_weight += 1.0 / (0.02 + uniform()); // Pareto, alpha 1
+            cumulative[num_subjects] = total_weight;
+            num_subjects++;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    stmt = prepare("INSERT INTO materials (subject_id, category, original_filename, file_data, uploaded_at) "
+                   "VALUES (?, ?, ?, ?, datetime(1704067200 + ?, 'unixepoch'));");
+    for (int i = 0; i < num_materials; i++) {
+        double w = uniform() * total_weight;
+        int lo = 0, hi = num_subjects - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cumulative[mid] < w) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        unsigned r = (unsigned)(next_random() % 100);
+        int k = 0;
+        while (r >= categories[k].weight) {
+            r -= categories[k].weight;
+            k++;
+        }
+        snprintf(a, sizeof(a), "%s_%d.%s", categories[k].file, 1 + (int)(next_random() % 40),
+                 extensions[next_random() % 6]);
+        int len = 96 << (next_random() % 5);
+        sqlite3_bind_int(stmt, 1, subject_ids[lo]);
+        sqlite3_bind_text(stmt, 2, categories[k].name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, a, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, base64 + next_random() % FILE_DATA_MAX, len, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, (int)(next_random() % (365 * 86400)));
+        step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    free(subject_ids);
+    free(cumulative);
+
+    snprintf(a, sizeof(a), "PRAGMA user_version = %d;", DATASET_VERSION);
+    if (exec(a) != 0 || exec("COMMIT;") != 0 || exec("ANALYZE;") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// What a timed function works on, drawn before the clock starts
+typedef struct {
+    int teacher_id;
+    int material_id;
+    char username[32];
+    char password[32];
+} bench_args;
+
+typedef struct {
+    const char *name;
+    // Returns the number of rows the call produced, or -1 on error
+    int (*run)(arena_buf *out, const bench_args *args);
+} bench_fn;
+
+static int teacher_base, num_teachers, material_base, num_materials;
+
+static int count(const char *s, const char *needle)
+{
+    int n = 0;
+    while (s && (s = strstr(s, needle))) {
+        n++;
+        s++;
+    }
+    return n;
+}
+
+static int run_materials_by_teacher(arena_buf *out, const bench_args *args)
+{
+    return db_get_materials_by_teacher_json(out, args->teacher_id) == SQLITE_OK ? count(out->data, "{\"id\":") : -1;
+}
+
+static int run_subjects_by_teacher(arena_buf *out, const bench_args *args)
+{
+    return db_get_subjects_by_teacher_json(out, args->teacher_id) == SQLITE_OK ? count(out->data, "{\"id\":") : -1;
+}
+
+static int run_dashboard_data(arena_buf *out, const bench_args *args)
+{
+    // Rows counted, not returned: the materials of the teacher
+    return db_get_dashboard_data_json(out, args->teacher_id) == SQLITE_OK ? atoi(out->data + 9) : -1;
+}
+
+static int run_all_subjects(arena_buf *out, const bench_args *args)
+{
+    (void)args;
+    return db_get_all_subjects_json(out) == SQLITE_OK ? count(out->data, "{\"id\":") : -1;
+}
+
+static int run_all_teachers(arena_buf *out, const bench_args *args)
+{
+    (void)args;
+    return db_get_all_teachers_json(out) == SQLITE_OK ? count(out->data, "{\"id\":") : -1;
+}
+
+static int run_tracking_data(arena_buf *out, const bench_args *args)
+{
+    (void)args;
+    return db_get_tracking_data_json(out) == SQLITE_OK ? 1 : -1;
+}
+
+static int run_read_material(arena_buf *out, const bench_args *args)
+{
+    static char category[256], file_name[256], file_data[4096];
+    int subject_id;
+    (void)out;
+    return db_read_material(args->material_id, &subject_id, category, file_name, file_data) == SQLITE_OK ? 1 : -1;
+}
+
+static int run_check_credentials(arena_buf *out, const bench_args *args)
+{
+    (void)out;
+    return db_check_user_credentials(args->username, args->password) ? 1 : -1;
+}
+
+static int run_login_attempts(arena_buf *out, const bench_args *args)
+{
+    (void)out;
+    return db_get_login_attempts(args->username) >= 0 ? 1 : -1;
+}
+
+static int run_user_id(arena_buf *out, const bench_args *args)
+{
+    (void)out;
+    return db_get_user_id_by_username(args->username) > 0 ? 1 : -1;
+}
+
+static int run_reset_login_attempts(arena_buf *out, const bench_args *args)
+{
+    (void)out;
+    return db_reset_login_attempts(args->username) == SQLITE_OK ? 1 : -1;
+}
+
+static const bench_fn functions[] = {
+    { "materials_by_teacher_json", run_materials_by_teacher },
+    { "subjects_by_teacher_json", run_subjects_by_teacher },
+    { "dashboard_data_json", run_dashboard_data },
+    { "all_subjects_json", run_all_subjects },
+    { "all_teachers_json", run_all_teachers },
+    { "tracking_data_json", run_tracking_data },
+    { "read_material", run_read_material },
+    { "check_user_credentials", run_check_credentials },
+    { "get_login_attempts", run_login_attempts },
+    { "get_user_id_by_username", run_user_id },
+    { "reset_login_attempts", run_reset_login_attempts },
+};
+#define NUM_FUNCTIONS (int)(sizeof(functions) / sizeof(functions[0]))
+
+static void draw_args(bench_args *args)
+{
+    int t = (int)(next_random() % (unsigned)num_teachers);
+    args->teacher_id = teacher_base + t;
+    args->material_id = material_base + (int)(next_random() % (unsigned)num_materials);
+    snprintf(args->username, sizeof(args->username), "teacher%05d", t);
+    snprintf(args->password, sizeof(args->password), "pass%05d", t);
+}
+
+static void bench(const bench_fn *fn, arena *a, double seconds)
+{
+    uint64_t elapsed = 0, limit = (uint64_t)(seconds * 1e9);
+    unsigned long long rows = 0, allocs = 0, bytes = 0;
+    long calls = 0;
+    arena_stats before, after;
+    bench_args args;
+
+    // Warm the page cache and the statement paths
+    for (int i = 0; i < 3; i++) {
+        arena_buf out;
+        draw_args(&args);
+        arena_buf_init(&out, a, 4096);
+        fn->run(&out, &args);
+        arena_reset(a);
+    }
+
+    arena_get_stats(&before);
+    while (elapsed < limit && calls < MAX_CALLS) {
+        arena_buf out;
+        draw_args(&args);
+        unsigned long long count0 = alloc_count, bytes0 = alloc_bytes;
+        uint64_t t0 = now_ns();
+        arena_buf_init(&out, a, 4096);
+        int n = fn->run(&out, &args);
+        uint64_t t1 = now_ns();
+        allocs += alloc_count - count0;
+        bytes += alloc_bytes - bytes0;
+        arena_reset(a);
+        if (n < 0) {
+            fprintf(stderr, "%s failed\n", fn->name);
+            return;
+        }
+        elapsed += t1 - t0;
+        rows += (unsigned)n;
+        calls++;
+    }
+    arena_get_stats(&after);
+    allocs += after.block_allocs - before.block_allocs;
+
+    printf("  %-26s %8ld %12.0f %10.1f %12.0f %9.1f %10.0f\n", fn->name, calls,
+           (double)elapsed / (double)calls, (double)rows / (double)calls,
+           (double)rows * 1e9 / (double)elapsed, (double)allocs / (double)calls,
+           (double)bytes / (double)calls);
+}
+
+static int int_query(const char *sql)
+{
+    sqlite3_stmt *stmt = prepare(sql);
+    int v = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    return v;
+}
+
+static int run_scale(int teachers, int materials_per_teacher, double seconds)
+{
+    char path[64];
+    arena a;
+    uint64_t t0 = now_ns();
+
+    snprintf(path, sizeof(path), "bench_db_%d.db", teachers);
+    // Not through db_init, which would add its sample rows again
+    int reuse = access(path, F_OK) == 0 && sqlite3_open(path, &db) == SQLITE_OK;
+    if (reuse && (int_query("PRAGMA user_version;") != DATASET_VERSION
+                  || int_query("SELECT COUNT(*) FROM materials;") != teachers * materials_per_teacher + 2)) {
+        reuse = 0;
+    }
+    if (!reuse) {
+        db_close();
+        remove(path);
+        if (db_init(path) != SQLITE_OK || generate(teachers, materials_per_teacher) != 0) {
+            db_close();
+            return -1;
+        }
+    }
+    // The generated teachers and materials follow the rows db_init seeds
+    teacher_base = int_query("SELECT MIN(id) FROM users WHERE username = 'teacher00000';");
+    num_teachers = teachers;
+    material_base = int_query("SELECT MIN(id) FROM materials;") + 2;
+    num_materials = teachers * materials_per_teacher;
+
+    printf("%d teachers, %d subjects, %d materials (%s in %.1f s)\n", teachers,
+           int_query("SELECT COUNT(*) FROM subjects;"), int_query("SELECT COUNT(*) FROM materials;"),
+           reuse ? "opened" : "generated", (double)(now_ns() - t0) / 1e9);
+    printf("  %-26s %8s %12s %10s %12s %9s %10s\n", "function", "calls", "ns/call", "rows/call",
+           "rows/s", "allocs", "alloc B");
+
+    if (arena_init(&a, ARENA_BLOCK_SIZE) != 0) {
+        db_close();
+        return -1;
+    }
+    rng_state = SEED ^ (uint64_t)teachers;
+    for (int i = 0; i < NUM_FUNCTIONS; i++) {
+        bench(&functions[i], &a, seconds);
+    }
+    arena_destroy(&a);
+    db_close();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char scales[256];
+    int materials_per_teacher = argc > 2 ? atoi(argv[2]) : MATERIALS_PER_TEACHER;
+    double seconds = argc > 3 ? atof(argv[3]) : DEFAULT_SECONDS;
+    sqlite3_mem_methods counting;
+
+    snprintf(scales, sizeof(scales), "%s", argc > 1 ? argv[1] : DEFAULT_SCALES);
+    if (materials_per_teacher < 1 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [teachers,...] [materials per teacher] [seconds per function]\n", argv[0]);
+        return 2;
+    }
+
+    // Before SQLite is initialized by the first sqlite3_open
+    sqlite3_config(SQLITE_CONFIG_GETMALLOC, &default_mem);
+    counting = default_mem;
+    counting.xMalloc = counting_malloc;
+    counting.xRealloc = counting_realloc;
+    sqlite3_config(SQLITE_CONFIG_MALLOC, &counting);
+    // db.c reports changes to the dashboards; nobody is subscribed here
+    if (events_init(0) != 0) {
+        return 1;
+    }
+
+    for (char *s = strtok(scales, ","); s; s = strtok(NULL, ",")) {
+        int teachers = atoi(s);
+        if (teachers < 1 || run_scale(teachers, materials_per_teacher, seconds) != 0) {
+            fprintf(stderr, "Cannot benchmark %s teachers\n", s);
+            return 1;
+        }
+    }
+    return 0;
+}
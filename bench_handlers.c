@@ -0,0 +1,304 @@
+// In-process benchmark of the request handlers in main.c.
+//
+// Every route is a raw HTTP request, loaded into a connection that has no
+// socket (bench_conn.c): civetweb parses it as after reading it from a
+// client, then the handler is called directly, and what it sends goes to a
+// memory buffer. Only the handler call is timed, so the numbers are the CPU
+// cost of the JSON parsing, token checks, SQL and serialization, and of
+// civetweb's response code, without the kernel and the network. The
+// database is in memory, with the rows db_init and auth_init create, and
+// the DB executor pool is off, so queries run on the calling thread.
+//
+// The harness is also a regression check. Before timing, each route is
+// run once and its response (without the Date header) is appended to a
+// responses file. If the file exists, the responses must be byte for byte
+// the same as the ones in it, otherwise the harness fails and writes the
+// new ones next to it (.new). Record the file with one build and run the
+// other against it.
+//
+// Build and run with "make bench-handlers". Optional arguments:
+//   bench_handlers [iterations per route] [seconds per route] [responses file]
+
+#define _POSIX_C_SOURCE 200809L
+#define main eknows_main
+#include "main.c"
+#undef main
+
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_ITERATIONS 1000000
+#define DEFAULT_SECONDS 3
+#define DEFAULT_RESPONSES "bench_handlers.responses"
+// Routes that add rows are undone this often (not timed)
+#define CLEANUP_EVERY 1000
+
+// bench_conn.c
+struct mg_connection *bench_conn_new(struct mg_context *ctx, void *thread_pointer);
+void bench_conn_free(struct mg_connection *conn);
+int bench_conn_request(struct mg_connection *conn, const char *request, size_t len);
+const char *bench_conn_output(struct mg_connection *conn, size_t *len);
+
+typedef struct {
+    const char *name;
+    mg_request_handler handler;
+    const char *method;
+    const char *uri;
+    int auth;            // send the token of the login
+    const char *body;
+    const char *cleanup; // SQL undoing what the route changed
+} bench_route;
+
+static const bench_route routes[] = {
+    { "health", handle_health, "GET", "/health", 0, NULL, NULL },
+    { "teacher_login", handle_api_teacher_login, "POST", "/api/teacher/login", 0,
+      "{\"username\":\"bennamae\",\"password\":\"teacher123\"}", NULL },
+    { "dashboard_data", handle_api_teacher_dashboard_data, "POST", "/api/teacher/dashboard-data", 1,
+      "{\"teacher_id\":1}", NULL },
+    { "teacher_subjects", handle_api_teacher_get_subjects, "GET", "/api/teacher/get-subjects?teacher_id=1", 1,
+      NULL, NULL },
+    { "bad_token", handle_api_teacher_get_subjects, "GET", "/api/teacher/get-subjects?teacher_id=1", -1,
+      NULL, NULL },
+    { "get_materials", handle_get_materials, "GET", "/get-materials?teacher_id=1", 0, NULL, NULL },
+    { "admin_subjects", handle_api_admin_get_subjects, "GET", "/api/admin/get-subjects", 0, NULL, NULL },
+    { "admin_teachers", handle_api_admin_get_teachers, "GET", "/api/admin/get-teachers", 0, NULL, NULL },
+    { "download", handle_download_material, "GET", "/download?id=1", 0, NULL, NULL },
+    { "upload", handle_upload_material, "POST", "/upload-material", 0,
+      "{\"subject_id\":1,\"category\":\"Lecture Notes\",\"file_name\":\"week1.pdf\","
+      "\"file_base64\":\"JVBERi0xLjQKJcfsj6IKNSAwIG9iago8PC9MZW5ndGggNiAwIFI+PgpzdHJlYW0K\"}",
+      "DELETE FROM materials WHERE id > 2;" },
+};
+#define NUM_ROUTES (int)(sizeof(routes) / sizeof(routes[0]))
+
+static char token[80];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Cycles where there is a time stamp counter, ns elsewhere
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static int build_request(const bench_route *r, char *buf, size_t size)
+{
+    size_t body_len = r->body ? strlen(r->body) : 0;
+    int len = snprintf(buf, size,
+                       "%s %s HTTP/1.1\r\nHost: localhost\r\n"
+                       "%s%s%s"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: %zu\r\n\r\n%s",
+                       r->method, r->uri,
+                       r->auth ? "Authorization: Bearer " : "",
+                       r->auth > 0 ? token : r->auth < 0 ? "not-a-token" : "",
+                       r->auth ? "\r\n" : "", body_len, r->body ? r->body : "");
+    return len > 0 && (size_t)len < size ? len : -1;
+}
+
+// One request of a route; the response is in the connection's output
+static int run_route(struct mg_connection *conn, arena *a, const bench_route *r,
+                     const char *request, int len, uint64_t *elapsed)
+{
+    if (bench_conn_request(conn, request, (size_t)len) != 0) {
+        return -1;
+    }
+    uint64_t t0 = ticks();
+    int status = r->handler(conn, NULL);
+    uint64_t t1 = ticks();
+    end_request(conn, status);
+    arena_reset(a);
+    if (elapsed) {
+        *elapsed = t1 - t0;
+    }
+    return status;
+}
+
+// Append a response to the recorded ones, without the Date header and with
+// login tokens masked, since they are random
+static void record_response(arena_buf *rec, const char *name, const char *out, size_t len)
+{
+    const char *date = NULL, *end = out + len;
+    size_t start = rec->len;
+    for (const char *p = out; p + 6 < end && !(p[0] == '\r' && p[2] == '\r'); p++) {
+        if (strncmp(p, "\r\nDate:", 7) == 0) {
+            date = p + 2;
+            break;
+        }
+    }
+    arena_buf_printf(rec, "== %s\n", name);
+    if (date) {
+        const char *eol = strstr(date, "\r\n");
+        arena_buf_append(rec, out, (size_t)(date - out));
+        out = eol + 2;
+    }
+    arena_buf_append(rec, out, (size_t)(end - out));
+    arena_buf_puts(rec, "\n");
+    char *t = rec->data ? strstr(rec->data + start, "\"token\":\"") : NULL;
+    for (t = t ? t + 9 : NULL; t && isalnum((unsigned char)*t); t++) {
+        *t = '*';
+    }
+}
+
+static int check_responses(const char *path, const arena_buf *rec)
+{
+    FILE *f = fopen(path, "rb");
+    char name[512];
+
+    if (!f) {
+        f = fopen(path, "wb");
+        if (!f || fwrite(rec->data, 1, rec->len, f) != rec->len) {
+            fprintf(stderr, "Cannot write %s\n", path);
+            return -1;
+        }
+        fclose(f);
+        printf("Responses recorded in %s\n", path);
+        return 0;
+    }
+
+    char *old = malloc(rec->len + 1);
+    size_t n = old ? fread(old, 1, rec->len + 1, f) : 0;
+    fclose(f);
+    int same = old && n == rec->len && memcmp(old, rec->data, n) == 0;
+    free(old);
+    if (same) {
+        printf("Responses match %s\n", path);
+        return 0;
+    }
+    snprintf(name, sizeof(name), "%s.new", path);
+    f = fopen(name, "wb");
+    if (f) {
+        fwrite(rec->data, 1, rec->len, f);
+        fclose(f);
+    }
+    fprintf(stderr, "Responses differ from %s, see %s\n", path, name);
+    return -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    double seconds = argc > 2 ? atof(argv[2]) : DEFAULT_SECONDS;
+    const char *responses = argc > 3 ? argv[3] : DEFAULT_RESPONSES;
+    char request[BUFFER_SIZE];
+    arena_buf rec;
+    arena rec_arena;
+
+    if (iterations < 1 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [iterations per route] [seconds per route] [responses file]\n", argv[0]);
+        return 2;
+    }
+    if (db_init(":memory:") != 0 || events_init(0) != 0 || auth_init() != 0) {
+        fprintf(stderr, "Cannot set up the database\n");
+        return 1;
+    }
+    // The sample rows are stamped with the time db_init ran
+    sqlite3_exec(db, "UPDATE materials SET uploaded_at = '2024-06-01 08:00:00';", NULL, NULL, NULL);
+
+    // A context for the handlers that ask for it. Its port is never used.
+    const char *options[] = {
+        "listening_ports", "127.0.0.1:0",
+        "num_threads", "1",
+        "enable_keep_alive", "yes",
+#if defined(USE_ZLIB)
+        "compression_min_size", COMPRESSION_MIN_SIZE,
+#endif
+        NULL
+    };
+    struct mg_callbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    ctx = mg_start(&callbacks, NULL, options);
+    arena *a = init_worker_thread(ctx, 1);
+    struct mg_connection *conn = ctx && a ? bench_conn_new(ctx, a) : NULL;
+    uint64_t *samples = malloc((size_t)iterations * sizeof(uint64_t));
+    if (!conn || !samples || arena_init(&rec_arena, ARENA_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Cannot set up the connection\n");
+        return 1;
+    }
+
+    // Record the responses, in route order
+    arena_buf_init(&rec, &rec_arena, ARENA_BLOCK_SIZE);
+    for (int i = 0; i < NUM_ROUTES; i++) {
+        const bench_route *r = &routes[i];
+        size_t out_len;
+        int len = build_request(r, request, sizeof(request));
+        if (len < 0 || run_route(conn, a, r, request, len, NULL) < 0) {
+            fprintf(stderr, "%s: cannot run the request\n", r->name);
+            return 1;
+        }
+        const char *out = bench_conn_output(conn, &out_len);
+        record_response(&rec, r->name, out, out_len);
+        if (r == &routes[1]) {
+            const char *t = strstr(out, "\"token\":\"");
+            if (!t || sscanf(t + 9, "%64[A-Za-z0-9]", token) != 1) {
+                fprintf(stderr, "No token in the login response\n");
+                return 1;
+            }
+        }
+        if (r->cleanup) {
+            sqlite3_exec(db, r->cleanup, NULL, NULL, NULL);
+        }
+    }
+    if (!rec.data || check_responses(responses, &rec) != 0) {
+        return 1;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    printf("%-18s %10s %12s %12s %10s %10s\n", "route", "requests", unit, "p50", "ns", "bytes");
+    for (int i = 0; i < NUM_ROUTES; i++) {
+        const bench_route *r = &routes[i];
+        int len = build_request(r, request, sizeof(request));
+        uint64_t sum = 0, start = now_ns(), limit = (uint64_t)(seconds * 1e9);
+        size_t out_len = 0;
+        long n;
+        for (n = 0; n < iterations && (n % 64 != 0 || now_ns() - start < limit); n++) {
+            if (run_route(conn, a, r, request, len, &samples[n]) < 0) {
+                fprintf(stderr, "%s: cannot run the request\n", r->name);
+                return 1;
+            }
+            sum += samples[n];
+            bench_conn_output(conn, &out_len);
+            if (r->cleanup && n % CLEANUP_EVERY == CLEANUP_EVERY - 1) {
+                sqlite3_exec(db, r->cleanup, NULL, NULL, NULL);
+            }
+        }
+        uint64_t wall = now_ns() - start;
+        if (r->cleanup) {
+            sqlite3_exec(db, r->cleanup, NULL, NULL, NULL);
+        }
+        qsort(samples, (size_t)n, sizeof(uint64_t), cmp_u64);
+        // ns per request includes the untimed parsing of the request
+        printf("%-18s %10ld %12.0f %12llu %10.0f %10zu\n", r->name, n, (double)sum / (double)n,
+               (unsigned long long)samples[n / 2], (double)wall / (double)n, out_len);
+    }
+
+    bench_conn_free(conn);
+    exit_worker_thread(ctx, 1, a);
+    arena_destroy(&rec_arena);
+    free(samples);
+    mg_stop(ctx);
+    db_close();
+    return 0;
+}
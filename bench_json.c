@@ -0,0 +1,137 @@
+// Microbenchmark for request body parsing.
+//
+// Compares json_bind (json.c) with the strstr/strchr extraction the handlers
+// in main.c used before, on a subject request body: once compact, and once
+// with whitespace and extra members, which the old code rescanned for every
+// field.
+//
+// Build and run with "make bench-json". Optional argument: iterations.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define ROUNDS 5
+
+typedef struct {
+    char program[100];
+    char grade_level[50];
+    char semester[50];
+    char subject[100];
+    int teacher_id;
+} subject_request;
+
+static const json_field subject_fields[] = {
+    JSON_FIELD_STRING(subject_request, program),
+    JSON_FIELD_STRING(subject_request, grade_level),
+    JSON_FIELD_STRING(subject_request, semester),
+    JSON_FIELD_STRING(subject_request, subject),
+    JSON_FIELD_INT(subject_request, teacher_id),
+};
+
+static const char compact_body[] =
+    "{\"program\":\"BSIT\",\"grade_level\":\"2nd Year\",\"semester\":\"1st\","
+    "\"subject\":\"Data Structures\",\"teacher_id\":42}";
+
+static const char padded_body[] =
+    "{\n"
+    "  \"token\": \"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\",\n"
+    "  \"notes\": \"Moved from the old curriculum, see the program description\",\n"
+    "  \"tags\": [\"core\", \"lab\", \"2024\"],\n"
+    "  \"program\":\"BSIT\",\n"
+    "  \"grade_level\":\"2nd Year\",\n"
+    "  \"semester\":\"1st\",\n"
+    "  \"subject\":\"Data Structures\",\n"
+    "  \"teacher_id\":42\n"
+    "}";
+
+// Copy a "key":"value" string the way the handlers did
+static void old_string_field(const char *json, const char *key, char *out, size_t size) {
+    const char *start = strstr(json, key);
+    if (start) {
+        start += strlen(key);
+        const char *end = strchr(start, '"');
+        if (end) {
+            size_t len = (size_t)(end - start);
+            if (len < size) {
+                strncpy(out, start, len);
+                out[len] = '\0';
+            }
+        }
+    }
+}
+
+// The strstr based parse_subject_json from main.c
+static int old_parse_subject(const char *json, subject_request *req) {
+    old_string_field(json, "\"program\":\"", req->program, sizeof(req->program));
+    old_string_field(json, "\"grade_level\":\"", req->grade_level, sizeof(req->grade_level));
+    old_string_field(json, "\"semester\":\"", req->semester, sizeof(req->semester));
+    old_string_field(json, "\"subject\":\"", req->subject, sizeof(req->subject));
+    const char *tid_key = "\"teacher_id\":";
+    const char *tid_start = strstr(json, tid_key);
+    if (tid_start) {
+        req->teacher_id = atoi(tid_start + strlen(tid_key));
+    }
+    return req->program[0] && req->grade_level[0] && req->semester[0] && req->subject[0]
+           && req->teacher_id != 0;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *name, const char *body, long iterations) {
+    size_t len = strlen(body);
+    unsigned long sink = 0;
+    subject_request req;
+    double start, old_sec, new_sec;
+
+    // Both must read the same values
+    subject_request a = {0}, b = {0};
+    old_parse_subject(body, &a);
+    if (json_bind(body, len, subject_fields, JSON_FIELD_COUNT(subject_fields), &b) != 5
+        || memcmp(&a, &b, sizeof(a)) != 0) {
+        fprintf(stderr, "%s: results differ\n", name);
+        exit(1);
+    }
+
+    // Best of a few rounds, to filter out scheduling noise
+    old_sec = new_sec = 1e9;
+    for (int round = 0; round < ROUNDS; round++) {
+        start = now_sec();
+        for (long i = 0; i < iterations; i++) {
+            memset(&req, 0, sizeof(req));
+            sink += (unsigned long)old_parse_subject(body, &req) + (unsigned long)req.teacher_id;
+        }
+        if (now_sec() - start < old_sec) old_sec = now_sec() - start;
+
+        start = now_sec();
+        for (long i = 0; i < iterations; i++) {
+            memset(&req, 0, sizeof(req));
+            sink += (unsigned long)json_bind(body, len, subject_fields,
+                                             JSON_FIELD_COUNT(subject_fields), &req)
+                    + (unsigned long)req.teacher_id;
+        }
+        if (now_sec() - start < new_sec) new_sec = now_sec() - start;
+    }
+
+    printf("%s body, %zu bytes (checksum %lu)\n", name, len, sink);
+    printf("  strstr:    %8.1f ns/parse\n", old_sec * 1e9 / (double)iterations);
+    printf("  json_bind: %8.1f ns/parse\n", new_sec * 1e9 / (double)iterations);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = (argc > 1) ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+    run("compact", compact_body, iterations);
+    run("padded", padded_body, iterations);
+    return 0;
+}
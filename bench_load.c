@@ -0,0 +1,560 @@
+// HTTP load generator for the API.
+//
+// Drives the real endpoints of a running server with a weighted mix of
+// requests over keep-alive connections, one thread per connection:
+//   login      POST /api/teacher/login
+//   materials  GET  /get-materials?teacher_id=T
+//   subjects   GET  /api/admin/get-subjects
+//   upload     POST /upload-material (a 1 KB file)
+//   download   GET  /download?id=N (ids of the teacher's materials)
+//
+// With a rate (-r) the load is open loop: request i is due at start + i /
+// rate, whether or not earlier requests have been answered. Its latency is
+// counted from that due time, not from when a connection was free to send
+// it, so a stalled server shows up in the percentiles instead of slowing
+// the load down (coordinated omission). The service time, from sending to
+// the end of the response, is reported as well. Without a rate every
+// connection sends its next request as soon as it has the response.
+//
+// "make bench-load" runs it against a server on a copy of eknows.db. The
+// summary goes to stderr, the results as one JSON object to stdout (or -o)
+// for comparing builds. Options:
+//   -H host -p port -c connections -r requests/s (0: closed loop)
+//   -d seconds -w warmup seconds -m mix (name=weight,...) -u user:password
+//   -t teacher_id -s subject_id -l label -o file
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION 10
+#define DEFAULT_WARMUP 2
+#define DEFAULT_MIX "login=1,materials=4,subjects=4,upload=1,download=2"
+#define RESPONSE_MAX (1024 * 1024)
+#define IO_TIMEOUT_S 10
+#define MAX_DOWNLOAD_IDS 256
+#define UPLOAD_SIZE 1024
+
+enum { LOGIN, MATERIALS, SUBJECTS, UPLOAD, DOWNLOAD, NUM_KINDS };
+
+static const char *const kind_name[NUM_KINDS] = {
+    "login", "materials", "subjects", "upload", "download"
+};
+
+// Latencies of one kind of request, in us. Only the owning thread appends.
+typedef struct {
+    uint64_t *latency; // from the due time
+    uint64_t *service; // from sending
+    size_t count, cap;
+    uint64_t errors;   // no response, or status >= 400
+    uint64_t rejected; // 429 and 503: shed by the server
+} samples;
+
+typedef struct {
+    pthread_t thread;
+    int fd;
+    unsigned rng;
+    char *buf;
+    uint64_t last_done;
+    samples s[NUM_KINDS];
+} worker;
+
+static struct {
+    const char *host;
+    const char *port;
+    int connections;
+    double rate;
+    double duration, warmup;
+    unsigned weight[NUM_KINDS];
+    unsigned total_weight;
+    const char *user, *password;
+    int teacher_id, subject_id;
+    const char *label;
+    const char *output;
+} opt;
+
+static struct addrinfo *server;
+static uint64_t start_ns, measure_ns, end_ns;
+static uint64_t next_index; // open loop: next request to send
+static int download_ids[MAX_DOWNLOAD_IDS];
+static int num_download_ids;
+static char upload_body[UPLOAD_SIZE + 256];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(t / 1000000000u);
+    ts.tv_nsec = (long)(t % 1000000000u);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int connect_server(void)
+{
+    struct timeval tv = { IO_TIMEOUT_S, 0 };
+    int one = 1;
+    int fd = socket(server->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, server->ai_addr, server->ai_addrlen) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// One request on w's connection, reconnecting once if the server closed
+// it. Returns the status, or -1. The body is in w->buf, NUL terminated.
+static int http_request(worker *w, const char *method, const char *uri,
+                        const char *body)
+{
+    char head[512];
+    size_t body_len = body ? strlen(body) : 0;
+    int head_len = snprintf(head, sizeof(head),
+                            "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                            "Content-Type: application/json\r\n"
+                            "Content-Length: %zu\r\n\r\n",
+                            method, uri, opt.host, body_len);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (w->fd < 0 && (w->fd = connect_server()) < 0) {
+            return -1;
+        }
+        size_t len = 0;
+        char *end = NULL;
+        if (send_all(w->fd, head, (size_t)head_len) == 0
+            && send_all(w->fd, body ? body : "", body_len) == 0) {
+            // Headers, then Content-Length bytes of body
+            while (!(end = memmem(w->buf, len, "\r\n\r\n", 4))) {
+                ssize_t n = len < RESPONSE_MAX ? recv(w->fd, w->buf + len, RESPONSE_MAX - len, 0) : -1;
+                if (n <= 0) {
+                    break;
+                }
+                len += (size_t)n;
+            }
+        }
+        if (!end) {
+            close(w->fd);
+            w->fd = -1;
+            if (len == 0) {
+                continue; // keep-alive connection closed meanwhile
+            }
+            return -1;
+        }
+
+        *end = '\0';
+        int status = atoi(w->buf + 9);
+        const char *cl = strcasestr(w->buf, "\r\nContent-Length:");
+        int must_close = strcasestr(w->buf, "\r\nConnection: close") != NULL;
+        size_t header_len = (size_t)(end + 4 - w->buf);
+        size_t want = cl ? (size_t)strtoull(cl + 17, NULL, 10) : 0;
+        if (!cl || header_len + want >= RESPONSE_MAX) {
+            close(w->fd);
+            w->fd = -1;
+            return -1;
+        }
+        while (len < header_len + want) {
+            ssize_t n = recv(w->fd, w->buf + len, header_len + want - len, 0);
+            if (n <= 0) {
+                close(w->fd);
+                w->fd = -1;
+                return -1;
+            }
+            len += (size_t)n;
+        }
+        memmove(w->buf, w->buf + header_len, want);
+        w->buf[want] = '\0';
+        if (must_close) {
+            close(w->fd);
+            w->fd = -1;
+        }
+        return status;
+    }
+    return -1;
+}
+
+static void record(samples *s, uint64_t latency_us, uint64_t service_us)
+{
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint64_t *l = realloc(s->latency, cap * sizeof(uint64_t));
+        uint64_t *v = l ? realloc(s->service, cap * sizeof(uint64_t)) : NULL;
+        if (!l || !v) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        s->latency = l;
+        s->service = v;
+        s->cap = cap;
+    }
+    s->latency[s->count] = latency_us;
+    s->service[s->count] = service_us;
+    s->count++;
+}
+
+static int pick_kind(worker *w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 17;
+    w->rng ^= w->rng << 5;
+    unsigned r = w->rng % opt.total_weight;
+    for (int k = 0; k < NUM_KINDS; k++) {
+        if (r < opt.weight[k]) {
+            return k;
+        }
+        r -= opt.weight[k];
+    }
+    return NUM_KINDS - 1;
+}
+
+static int run_request(worker *w, int kind)
+{
+    char uri[128], body[256];
+
+    switch (kind) {
+    case LOGIN:
+        snprintf(body, sizeof(body), "{\"username\":\"%s\",\"password\":\"%s\"}",
+                 opt.user, opt.password);
+        return http_request(w, "POST", "/api/teacher/login", body);
+    case MATERIALS:
+        snprintf(uri, sizeof(uri), "/get-materials?teacher_id=%d", opt.teacher_id);
+        return http_request(w, "GET", uri, NULL);
+    case SUBJECTS:
+        return http_request(w, "GET", "/api/admin/get-subjects", NULL);
+    case UPLOAD:
+        return http_request(w, "POST", "/upload-material", upload_body);
+    default:
+        snprintf(uri, sizeof(uri), "/download?id=%d",
+                 download_ids[w->rng % (unsigned)num_download_ids]);
+        return http_request(w, "GET", uri, NULL);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker *w = arg;
+
+    for (;;) {
+        uint64_t due, sent, done;
+        if (opt.rate > 0) {
+            uint64_t i = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+            due = start_ns + (uint64_t)((double)i * 1e9 / opt.rate);
+            if (due >= end_ns) {
+                break;
+            }
+            sleep_until(due);
+        } else if ((due = now_ns()) >= end_ns) {
+            break;
+        }
+
+        int kind = pick_kind(w);
+        sent = now_ns();
+        int status = run_request(w, kind);
+        done = now_ns();
+        if (due < measure_ns) {
+            continue; // warmup
+        }
+        samples *s = &w->s[kind];
+        w->last_done = done;
+        record(s, (done - due) / 1000, (done - sent) / 1000);
+        if (status < 0 || status >= 400) {
+            s->errors++;
+        }
+        if (status == 429 || status == 503) {
+            s->rejected++;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (double)n);
+    return sorted[i < n ? i : n - 1];
+}
+
+// Merge the samples of one kind (or all, kind < 0) over all workers
+static samples merge(worker *workers, int kind)
+{
+    samples m = { 0 };
+    for (int i = 0; i < opt.connections; i++) {
+        for (int k = 0; k < NUM_KINDS; k++) {
+            samples *s = &workers[i].s[k];
+            if (kind >= 0 && k != kind) {
+                continue;
+            }
+            for (size_t j = 0; j < s->count; j++) {
+                record(&m, s->latency[j], s->service[j]);
+            }
+            m.errors += s->errors;
+            m.rejected += s->rejected;
+        }
+    }
+    qsort(m.latency, m.count, sizeof(uint64_t), cmp_u64);
+    qsort(m.service, m.count, sizeof(uint64_t), cmp_u64);
+    return m;
+}
+
+static void print_stats(FILE *out, const char *name, const samples *m, double seconds)
+{
+    fprintf(out,
+            "\"%s\":{\"requests\":%zu,\"errors\":%llu,\"rejected\":%llu,"
+            "\"throughput\":%.1f,"
+            "\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+            "\"service_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}",
+            name, m->count, (unsigned long long)m->errors,
+            (unsigned long long)m->rejected, (double)m->count / seconds,
+            (unsigned long long)percentile(m->latency, m->count, 0.5),
+            (unsigned long long)percentile(m->latency, m->count, 0.99),
+            (unsigned long long)percentile(m->latency, m->count, 0.999),
+            (unsigned long long)percentile(m->latency, m->count, 1.0),
+            (unsigned long long)percentile(m->service, m->count, 0.5),
+            (unsigned long long)percentile(m->service, m->count, 0.99),
+            (unsigned long long)percentile(m->service, m->count, 0.999),
+            (unsigned long long)percentile(m->service, m->count, 1.0));
+}
+
+static void print_summary(const char *name, const samples *m, double seconds)
+{
+    fprintf(stderr, "  %-10s %8zu req %9.1f/s  err %-6llu p50 %7.2f  p99 %8.2f  p999 %8.2f ms\n",
+            name, m->count, (double)m->count / seconds, (unsigned long long)m->errors,
+            (double)percentile(m->latency, m->count, 0.5) / 1000.0,
+            (double)percentile(m->latency, m->count, 0.99) / 1000.0,
+            (double)percentile(m->latency, m->count, 0.999) / 1000.0);
+}
+
+static int parse_mix(const char *mix)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", mix);
+    memset(opt.weight, 0, sizeof(opt.weight));
+    opt.total_weight = 0;
+    for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        int k;
+        if (eq) {
+            *eq = '\0';
+        }
+        for (k = 0; k < NUM_KINDS && strcmp(item, kind_name[k]) != 0; k++) {
+        }
+        if (k == NUM_KINDS) {
+            fprintf(stderr, "Unknown request kind in mix: %s\n", item);
+            return -1;
+        }
+        opt.weight[k] = eq ? (unsigned)atoi(eq + 1) : 1;
+        opt.total_weight += opt.weight[k];
+    }
+    return opt.total_weight > 0 ? 0 : -1;
+}
+
+// Upload a material if downloads are in the mix, and collect the ids of
+// the teacher's materials for them
+static int setup(worker *w)
+{
+    int status;
+
+    for (int i = 0; i < UPLOAD_SIZE; i++) {
+        upload_body[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i % 64];
+    }
+    upload_body[UPLOAD_SIZE] = '\0';
+    char file[UPLOAD_SIZE + 1];
+    memcpy(file, upload_body, sizeof(file));
+    snprintf(upload_body, sizeof(upload_body),
+             "{\"subject_id\":%d,\"category\":\"bench\",\"file_name\":\"bench.txt\","
+             "\"file_base64\":\"%s\"}", opt.subject_id, file);
+
+    if ((status = http_request(w, "GET", "/health", NULL)) != 200) {
+        fprintf(stderr, "Server at %s:%s is not up (%d)\n", opt.host, opt.port, status);
+        return -1;
+    }
+    if (opt.weight[DOWNLOAD] == 0) {
+        return 0;
+    }
+    if (http_request(w, "POST", "/upload-material", upload_body) != 200) {
+        fprintf(stderr, "Cannot upload a material for subject %d\n", opt.subject_id);
+        return -1;
+    }
+    char uri[64];
+    snprintf(uri, sizeof(uri), "/get-materials?teacher_id=%d", opt.teacher_id);
+    if (http_request(w, "GET", uri, NULL) == 200) {
+        for (const char *p = w->buf; (p = strstr(p, "{\"id\":")) && num_download_ids < MAX_DOWNLOAD_IDS; p++) {
+            download_ids[num_download_ids++] = atoi(p + 6);
+        }
+    }
+    if (num_download_ids == 0) {
+        fprintf(stderr, "No materials of teacher %d to download\n", opt.teacher_id);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = { 0 };
+    char user[128] = "teacher1:teacher1";
+    const char *mix = DEFAULT_MIX;
+    FILE *out = stdout;
+    int c;
+
+    opt.host = "127.0.0.1";
+    opt.port = "8080";
+    opt.connections = DEFAULT_CONNECTIONS;
+    opt.duration = DEFAULT_DURATION;
+    opt.warmup = DEFAULT_WARMUP;
+    opt.teacher_id = 1;
+    opt.subject_id = 1;
+    opt.label = "";
+    while ((c = getopt(argc, argv, "H:p:c:r:d:w:m:u:t:s:l:o:")) != -1) {
+        switch (c) {
+        case 'H': opt.host = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'w': opt.warmup = atof(optarg); break;
+        case 'm': mix = optarg; break;
+        case 'u': snprintf(user, sizeof(user), "%s", optarg); break;
+        case 't': opt.teacher_id = atoi(optarg); break;
+        case 's': opt.subject_id = atoi(optarg); break;
+        case 'l': opt.label = optarg; break;
+        case 'o': opt.output = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-r rate] [-d seconds] "
+                            "[-w seconds] [-m mix] [-u user:password] [-t teacher_id] "
+                            "[-s subject_id] [-l label] [-o file]\n", argv[0]);
+            return 2;
+        }
+    }
+    char *colon = strchr(user, ':');
+    if (!colon || opt.connections < 1 || opt.duration <= 0 || opt.warmup < 0 || parse_mix(mix) != 0) {
+        fprintf(stderr, "Invalid options\n");
+        return 2;
+    }
+    *colon = '\0';
+    opt.user = user;
+    opt.password = colon + 1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opt.host, opt.port, &hints, &server) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", opt.host);
+        return 1;
+    }
+
+    worker *workers = calloc((size_t)opt.connections, sizeof(worker));
+    if (!workers) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        workers[i].fd = -1;
+        workers[i].rng = 2463534242u + (unsigned)i * 7919u;
+        workers[i].buf = malloc(RESPONSE_MAX + 1);
+        if (!workers[i].buf) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    if (setup(&workers[0]) != 0) {
+        return 1;
+    }
+
+    start_ns = now_ns() + 10000000; // let the threads start
+    measure_ns = start_ns + (uint64_t)(opt.warmup * 1e9);
+    end_ns = measure_ns + (uint64_t)(opt.duration * 1e9);
+    for (int i = 0; i < opt.connections; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (opt.output && !(out = fopen(opt.output, "w"))) {
+        fprintf(stderr, "Cannot write %s\n", opt.output);
+        return 1;
+    }
+    // An overloaded server finishes after the end of the schedule: the
+    // throughput is what it completed, over the time it took
+    uint64_t last_done = end_ns;
+    for (int i = 0; i < opt.connections; i++) {
+        if (workers[i].last_done > last_done) {
+            last_done = workers[i].last_done;
+        }
+    }
+    double seconds = (double)(last_done - measure_ns) / 1e9;
+    samples all = merge(workers, -1);
+    fprintf(stderr, "%s%s%d connections, %s, %.0f s after %.0f s warmup\n",
+            opt.label, opt.label[0] ? ": " : "", opt.connections,
+            opt.rate > 0 ? "open loop" : "closed loop", opt.duration, opt.warmup);
+    if (opt.rate > 0) {
+        fprintf(stderr, "  target %.0f req/s, latency from the scheduled send time\n", opt.rate);
+    }
+    fprintf(out, "{\"label\":\"%s\",\"connections\":%d,\"rate\":%.1f,\"duration_s\":%.1f,"
+                 "\"mix\":\"%s\",",
+            opt.label, opt.connections, opt.rate, opt.duration, mix);
+    print_stats(out, "total", &all, seconds);
+    print_summary("total", &all, seconds);
+    fprintf(out, ",\"endpoints\":{");
+    for (int k = 0, first = 1; k < NUM_KINDS; k++) {
+        if (opt.weight[k] == 0) {
+            continue;
+        }
+        samples m = merge(workers, k);
+        fprintf(out, "%s", first ? "" : ",");
+        print_stats(out, kind_name[k], &m, seconds);
+        print_summary(kind_name[k], &m, seconds);
+        free(m.latency);
+        free(m.service);
+        first = 0;
+    }
+    fprintf(out, "}}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return all.errors > 0 ? 3 : 0;
+}
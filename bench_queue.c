@@ -0,0 +1,172 @@
+// Accept-to-dispatch latency of the civetweb socket queue.
+//
+// One thread plays the master and hands "sockets" to worker threads through
+// produce_socket/consume_socket, in bursts as after a wave of connects. The
+// latency is the time from produce_socket until a worker has the socket.
+// With several producers, they share each burst like acceptor threads
+// (acceptor_threads option), and block together while the queue is full.
+// civetweb.c is included so the static queue functions can be called
+// directly; no server is started and no real sockets are used.
+//
+// The queue is chosen at compile time, so "make bench-queue" builds this
+// twice: with the lock-free ring (the default on Linux) and with
+// -DNO_LOCKFREE_QUEUE. Optional arguments:
+//   bench_queue [workers] [connections] [burst] [producers]
+
+#include "civetweb.c"
+
+#define DEFAULT_WORKERS 8
+#define DEFAULT_CONNECTIONS 200000
+#define DEFAULT_BURST 64
+#define MAX_PRODUCERS 64
+#define QUEUE_SIZE 20 // civetweb's default connection_queue
+
+#if defined(LOCKFREE_QUEUE)
+#define QUEUE_NAME "lock-free ring"
+#else
+#define QUEUE_NAME "mutex queue"
+#endif
+
+static struct mg_context *ctx;
+static uint64_t *produced_at;   // per connection, ns
+static uint64_t *latency;       // per connection, ns
+static int dispatched;
+static int connections, burst, producers;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+    struct socket so;
+    int first = 1;
+    (void)arg;
+
+    while (consume_socket(ctx, &so, 0, first)) {
+        first = 0;
+        latency[so.sock] = now_ns() - produced_at[so.sock];
+        __atomic_add_fetch(&dispatched, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Producer p sends every producers-th connection of each burst, then waits
+// until the whole burst is dispatched
+static void *producer(void *arg)
+{
+    int p = (int)(intptr_t)arg;
+    struct socket so;
+    int sent;
+
+    memset(&so, 0, sizeof(so));
+    for (sent = 0; sent < connections;) {
+        int end = (sent + burst < connections) ? sent + burst : connections;
+        for (int i = sent + p; i < end; i += producers) {
+            so.sock = (SOCKET)i;
+            produced_at[i] = now_ns();
+            produce_socket(ctx, &so);
+        }
+        sent = end;
+        while (__atomic_load_n(&dispatched, __ATOMIC_ACQUIRE) < sent) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    int workers = (argc > 1) ? atoi(argv[1]) : DEFAULT_WORKERS;
+    pthread_t *threads, producer_threads[MAX_PRODUCERS];
+    double start, elapsed;
+    int i;
+
+    connections = (argc > 2) ? atoi(argv[2]) : DEFAULT_CONNECTIONS;
+    burst = (argc > 3) ? atoi(argv[3]) : DEFAULT_BURST;
+    producers = (argc > 4) ? atoi(argv[4]) : 1;
+
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (connections < 1) {
+        connections = 1;
+    }
+    if (burst < 1) {
+        burst = 1;
+    }
+    if (producers < 1 || producers > MAX_PRODUCERS) {
+        producers = (producers < 1) ? 1 : MAX_PRODUCERS;
+    }
+
+    ctx = mg_calloc(1, sizeof(*ctx));
+    produced_at = mg_calloc((size_t)connections, sizeof(uint64_t));
+    latency = mg_calloc((size_t)connections, sizeof(uint64_t));
+    threads = mg_calloc((size_t)workers, sizeof(pthread_t));
+    if (!ctx || !produced_at || !latency || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Just enough of a context for the queue. cfg_max_worker_threads stays
+    // 0, so produce_socket never starts real workers.
+    pthread_mutex_init(&ctx->thread_mutex, NULL);
+#if defined(LOCKFREE_QUEUE)
+    if (!sq_alloc(ctx, QUEUE_SIZE)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+#else
+    pthread_cond_init(&ctx->sq_empty, NULL);
+    pthread_cond_init(&ctx->sq_full, NULL);
+    ctx->squeue = mg_calloc(QUEUE_SIZE, sizeof(struct socket));
+    ctx->sq_size = QUEUE_SIZE;
+#endif
+
+    // Like the master thread, count each worker idle before it starts
+    ctx->idle_worker_thread_count = (unsigned)workers;
+    for (i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, worker, NULL);
+    }
+
+    start = (double)now_ns();
+    for (i = 1; i < producers; i++) {
+        pthread_create(&producer_threads[i], NULL, producer, (void *)(intptr_t)i);
+    }
+    producer((void *)0);
+    for (i = 1; i < producers; i++) {
+        pthread_join(producer_threads[i], NULL);
+    }
+    elapsed = ((double)now_ns() - start) * 1e-9;
+
+    STOP_FLAG_ASSIGN(&ctx->stop_flag, 1);
+#if defined(LOCKFREE_QUEUE)
+    sq_wake_all(ctx);
+#else
+    pthread_mutex_lock(&ctx->thread_mutex);
+    pthread_cond_broadcast(&ctx->sq_full);
+    pthread_mutex_unlock(&ctx->thread_mutex);
+#endif
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    qsort(latency, (size_t)connections, sizeof(uint64_t), cmp_u64);
+    printf("%s: %d workers, %d producers, %d connections in bursts of %d\n",
+           QUEUE_NAME, workers, producers, connections, burst);
+    printf("  throughput: %10.0f connections/s\n", (double)connections / elapsed);
+    printf("  latency:    p50 %6.1f us  p99 %6.1f us  max %8.1f us\n",
+           (double)latency[connections / 2] / 1000.0,
+           (double)latency[(size_t)((double)connections * 0.99)] / 1000.0,
+           (double)latency[connections - 1] / 1000.0);
+    return 0;
+}
@@ -0,0 +1,170 @@
+// Microbenchmark for request handler dispatch.
+//
+// Compares the compiled route tables (route.inl) with the linear search
+// get_request_handler used before: up to three passes over the handler list
+// (exact, prefix, pattern). civetweb.c is included so the static lookup
+// functions can be called directly; no server is started. That also means
+// the civetweb allocation and formatting helpers have to be used here.
+//
+// Build and run with "make bench-route". Optional arguments:
+//   bench_route [routes] [iterations]
+
+#include "civetweb.c"
+
+#define DEFAULT_ROUTES 80
+#define DEFAULT_ITERATIONS 2000000
+
+// The routes registered by main.c, padded with generated ones.
+static const char *app_routes[] = {
+    "/health", "/login", "/api/admin/login", "/api/teacher/login",
+    "/api/teacher/dashboard-data", "/api/teacher/get-subjects",
+    "/api/teacher/add-subject", "/api/teacher/delete-subject",
+    "/api/admin/get-subjects", "/api/teacher/assign-subject",
+    "/api/admin/get-programs", "/api/admin/get-teachers",
+    "/api/admin/get-tracking-data", "/api/admin/add-program",
+    "/api/admin/delete-program", "/api/admin/add-teacher",
+    "/api/admin/delete-teacher", "/get-materials", "/upload-material",
+    "/delete-material", "/download", "/get-subjects", "/create-subject",
+    "/update-subject", "/delete-subject", "/assign-subject",
+    // A few patterns, to exercise the match_prefix path
+    "/static/**.css$", "/files/*/meta",
+};
+
+// Request URIs: exact hits, prefix hits, case variants and misses.
+static const char *requests[] = {
+    "/health", "/api/admin/get-subjects", "/api/teacher/dashboard-data",
+    "/download", "/assign-subject", "/api/admin/delete-teacher",
+    "/download/123", "/api/admin/login/extra", "/Health",
+    "/API/admin/get-programs", "/static/css/site.css", "/files/42/meta",
+    "/index.html", "/favicon.ico", "/api/unknown", "/api/admin/route-77",
+    "/api/gen/route-40/x", "/downloads",
+};
+
+#define NUM_APP_ROUTES (sizeof(app_routes) / sizeof(app_routes[0]))
+#define NUM_REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+// The lookup used by get_request_handler before route.inl.
+static struct mg_handler_info *linear_lookup(struct mg_handler_info *list,
+                                             int handler_type,
+                                             const char *uri,
+                                             size_t urilen)
+{
+    struct mg_handler_info *rh;
+    int step, matched;
+
+    for (step = 0; step < 3; step++) {
+        for (rh = list; rh != NULL; rh = rh->next) {
+            if (rh->handler_type != handler_type) {
+                continue;
+            }
+            if (step == 0) {
+                matched = (rh->uri_len == urilen) && (strcmp(rh->uri, uri) == 0);
+            } else if (step == 1) {
+                matched = (rh->uri_len < urilen) && (uri[rh->uri_len] == '/')
+                          && (memcmp(rh->uri, uri, rh->uri_len) == 0);
+            } else {
+                matched = match_prefix(rh->uri, rh->uri_len, uri) > 0;
+            }
+            if (matched) {
+                return rh;
+            }
+        }
+    }
+    return NULL;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static struct mg_handler_info *add_route(struct mg_handler_info **tail,
+                                         const char *uri)
+{
+    struct mg_handler_info *rh = mg_calloc(1, sizeof(*rh));
+    if (rh == NULL || (rh->uri = mg_strdup(uri)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    rh->uri_len = strlen(uri);
+    rh->handler_type = REQUEST_HANDLER;
+    *tail = rh;
+    return rh;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_routes = (argc > 1) ? atoi(argv[1]) : DEFAULT_ROUTES;
+    long iterations = (argc > 2) ? atol(argv[2]) : DEFAULT_ITERATIONS;
+    struct mg_handler_info *list = NULL, **tail = &list;
+    struct mg_routes *routes;
+    size_t lens[NUM_REQUESTS];
+    size_t i;
+    long n;
+    int r;
+    double start, linear_sec, compiled_sec;
+    uintptr_t sink = 0;
+    char uri[64];
+
+    if (num_routes < (int)NUM_APP_ROUTES) {
+        num_routes = (int)NUM_APP_ROUTES;
+    }
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    for (i = 0; i < NUM_APP_ROUTES; i++) {
+        tail = &add_route(tail, app_routes[i])->next;
+    }
+    for (r = (int)NUM_APP_ROUTES; r < num_routes; r++) {
+        mg_snprintf(NULL, NULL, uri, sizeof(uri), "/api/%s/route-%d",
+                    (r % 2) ? "admin" : "gen", r);
+        tail = &add_route(tail, uri)->next;
+    }
+
+    routes = routes_compile(list, NULL);
+    if (routes == NULL) {
+        fprintf(stderr, "Cannot compile routes\n");
+        return 1;
+    }
+
+    // Both implementations must agree on every request
+    for (i = 0; i < NUM_REQUESTS; i++) {
+        lens[i] = strlen(requests[i]);
+        if (linear_lookup(list, REQUEST_HANDLER, requests[i], lens[i])
+            != routes_lookup(routes, REQUEST_HANDLER, requests[i], lens[i])) {
+            fprintf(stderr, "Mismatch for %s\n", requests[i]);
+            return 1;
+        }
+    }
+
+    start = now_sec();
+    for (n = 0; n < iterations; n++) {
+        i = (size_t)n % NUM_REQUESTS;
+        sink += (uintptr_t)linear_lookup(list, REQUEST_HANDLER, requests[i], lens[i]);
+    }
+    linear_sec = now_sec() - start;
+
+    start = now_sec();
+    for (n = 0; n < iterations; n++) {
+        i = (size_t)n % NUM_REQUESTS;
+        sink += (uintptr_t)routes_lookup(routes, REQUEST_HANDLER, requests[i], lens[i]);
+    }
+    compiled_sec = now_sec() - start;
+
+    printf("%d routes, %ld lookups (checksum %lx)\n",
+           num_routes, iterations, (unsigned long)sink);
+    printf("  linear:   %8.1f ns/lookup\n", linear_sec * 1e9 / (double)iterations);
+    printf("  compiled: %8.1f ns/lookup\n", compiled_sec * 1e9 / (double)iterations);
+
+    routes_free(routes);
+    while (list != NULL) {
+        struct mg_handler_info *next = list->next;
+        mg_free(list->uri);
+        mg_free(list);
+        list = next;
+    }
+    return 0;
+}
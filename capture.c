@@ -0,0 +1,380 @@
+#include "capture.h"
+#include "sync.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Each of the two buffers; the writer writes one while workers fill the other
+#define CAPTURE_BUFFER_SIZE (8 * 1024 * 1024)
+#define CAPTURE_FLUSH_MS 100
+
+// Room for the numbers and the method and flags bytes of a record
+#define RECORD_HEAD_MAX 64
+
+const char *const capture_methods[CAPTURE_NUM_METHODS] = {
+    "GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS", "PATCH"
+};
+
+// Body fields replaced by CAPTURE_MASK, and those replaced by as many 'A's
+static const char *const masked_fields[] = { "password", "access_code", "token", NULL };
+static const char *const blanked_fields[] = { "file_base64", NULL };
+
+enum { KEEP, MASK, BLANK };
+
+typedef struct {
+    int active;
+    long long start_us;
+    unsigned char method;
+    unsigned flags;
+    char uri[CAPTURE_MAX_URI];
+    size_t uri_len;
+    char *body; // sanitized
+    size_t body_len, body_cap;
+} record;
+
+static _Thread_local record current;
+
+static sync_mutex lock;
+static sync_cond wake;
+static sync_thread writer;
+static atomic_int running;
+static int stopping = 0;
+static FILE *file = NULL;
+static long long start_us;
+static char *pending, *spare; // the buffers
+static size_t pending_len = 0;
+static unsigned long long pending_records = 0;
+static capture_stats stats;
+
+static size_t put_varint(unsigned char *p, unsigned long long v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static int field_kind(const char *name, size_t len) {
+    for (int i = 0; masked_fields[i]; i++) {
+        if (strlen(masked_fields[i]) == len && memcmp(masked_fields[i], name, len) == 0) {
+            return MASK;
+        }
+    }
+    for (int i = 0; blanked_fields[i]; i++) {
+        if (strlen(blanked_fields[i]) == len && memcmp(blanked_fields[i], name, len) == 0) {
+            return BLANK;
+        }
+    }
+    return KEEP;
+}
+
+static size_t put_value(char *out, int kind, size_t len) {
+    if (kind == MASK) {
+        memcpy(out, CAPTURE_MASK, sizeof(CAPTURE_MASK) - 1);
+        return sizeof(CAPTURE_MASK) - 1;
+    }
+    memset(out, 'A', len);
+    return len;
+}
+
+static int is_password(const char *name, size_t len) {
+    return len == 8 && memcmp(name, "password", 8) == 0;
+}
+
+// Index of the quote closing the JSON string that starts at in[i], or len
+static size_t string_end(const char *in, size_t len, size_t i) {
+    for (i++; i < len; i++) {
+        if (in[i] == '\\') {
+            i++;
+        } else if (in[i] == '"') {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Copy a JSON body, replacing the string values of the fields above. Only
+// "name": "value" pairs are looked at, the rest is copied as it is, so any
+// text passes. out needs room for 2 * len + sizeof(CAPTURE_MASK) bytes.
+static size_t sanitize_json(const char *in, size_t len, char *out, unsigned *flags) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        if (in[i] != '"') {
+            out[o++] = in[i++];
+            continue;
+        }
+        size_t end = string_end(in, len, i);
+        size_t n = (end < len ? end + 1 : len) - i;
+        const char *name = in + i + 1;
+        size_t name_len = n >= 2 ? n - 2 : 0;
+        memcpy(out + o, in + i, n);
+        o += n;
+        i += n;
+
+        size_t j = i;
+        while (j < len && (in[j] == ' ' || in[j] == '\t' || in[j] == '\r' || in[j] == '\n')) {
+            j++;
+        }
+        int kind = j < len && in[j] == ':' ? field_kind(name, name_len) : KEEP;
+        if (kind == KEEP) {
+            continue;
+        }
+        for (j++; j < len && (in[j] == ' ' || in[j] == '\t' || in[j] == '\r' || in[j] == '\n'); j++) {
+        }
+        if (j >= len || in[j] != '"') {
+            continue; // not a string, copied as it is
+        }
+        memcpy(out + o, in + i, j - i + 1);
+        o += j - i + 1;
+        end = string_end(in, len, j);
+        o += put_value(out + o, kind, (end < len ? end : len) - j - 1);
+        if (end < len) {
+            out[o++] = '"';
+        }
+        i = end < len ? end + 1 : len;
+        if (kind == MASK && is_password(name, name_len)) {
+            *flags |= CAPTURE_CREDENTIALS;
+        }
+    }
+    return o;
+}
+
+// Copy a form body (name=value&...), replacing the values of the fields above
+static size_t sanitize_form(const char *in, size_t len, char *out, unsigned *flags) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        const char *amp = memchr(in + i, '&', len - i);
+        size_t pair_end = amp ? (size_t)(amp - in) : len;
+        const char *eq = memchr(in + i, '=', pair_end - i);
+        size_t name_len = eq ? (size_t)(eq - (in + i)) : 0;
+        int kind = eq ? field_kind(in + i, name_len) : KEEP;
+        if (kind == KEEP) {
+            memcpy(out + o, in + i, pair_end - i);
+            o += pair_end - i;
+        } else {
+            memcpy(out + o, in + i, name_len + 1);
+            o += name_len + 1;
+            o += put_value(out + o, kind, pair_end - i - name_len - 1);
+            if (kind == MASK && is_password(in + i, name_len)) {
+                *flags |= CAPTURE_CREDENTIALS;
+            }
+        }
+        i = pair_end;
+        if (i < len) {
+            out[o++] = in[i++];
+        }
+    }
+    return o;
+}
+
+// Write out the full buffer, called with the lock held. The lock is released
+// while writing.
+static void flush_locked(void) {
+    if (pending_len == 0) {
+        return;
+    }
+    char *data = pending;
+    size_t len = pending_len;
+    unsigned long long records = pending_records;
+    pending = spare;
+    pending_len = 0;
+    pending_records = 0;
+
+    sync_mutex_unlock(&lock);
+    int ok = fwrite(data, 1, len, file) == len && fflush(file) == 0;
+    sync_mutex_lock(&lock);
+
+    spare = data;
+    if (ok) {
+        stats.records += records;
+        stats.bytes += len;
+    } else {
+        stats.dropped += records;
+    }
+}
+
+static void writer_main(void *arg) {
+    (void)arg;
+    sync_mutex_lock(&lock);
+    while (!stopping) {
+        sync_cond_wait(&wake, &lock, CAPTURE_FLUSH_MS);
+        flush_locked();
+    }
+    flush_locked();
+    sync_mutex_unlock(&lock);
+}
+
+int capture_start(const char *path) {
+    unsigned char head[CAPTURE_MAGIC_LEN + 8];
+    unsigned long long now = (unsigned long long)time(NULL);
+
+    memcpy(head, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    for (int i = 0; i < 8; i++) {
+        head[CAPTURE_MAGIC_LEN + i] = (unsigned char)(now >> (8 * i));
+    }
+    pending = malloc(CAPTURE_BUFFER_SIZE);
+    spare = malloc(CAPTURE_BUFFER_SIZE);
+    file = fopen(path, "wb");
+    if (!pending || !spare || !file || fwrite(head, 1, sizeof(head), file) != sizeof(head)
+        || sync_mutex_init(&lock) != 0) {
+        goto fail;
+    }
+    if (sync_cond_init(&wake) != 0) {
+        sync_mutex_destroy(&lock);
+        goto fail;
+    }
+    start_us = sync_now_us();
+    stopping = 0;
+    atomic_store(&running, 1);
+    if (sync_thread_start(&writer, writer_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        sync_cond_destroy(&wake);
+        sync_mutex_destroy(&lock);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+    free(pending);
+    free(spare);
+    pending = spare = NULL;
+    return -1;
+}
+
+void capture_stop(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    atomic_store(&running, 0);
+    sync_mutex_lock(&lock);
+    stopping = 1;
+    sync_cond_signal(&wake);
+    sync_mutex_unlock(&lock);
+    sync_thread_join(writer);
+
+    fclose(file);
+    file = NULL;
+    free(pending);
+    free(spare);
+    pending = spare = NULL;
+    sync_cond_destroy(&wake);
+    sync_mutex_destroy(&lock);
+}
+
+int capture_running(void) {
+    return atomic_load_explicit(&running, memory_order_relaxed);
+}
+
+void capture_begin(const char *method, const char *uri, const char *query, unsigned flags) {
+    record *r = &current;
+    int m;
+
+    r->active = 0;
+    if (!capture_running()) {
+        return;
+    }
+    for (m = 0; m < CAPTURE_NUM_METHODS && strcmp(method, capture_methods[m]) != 0; m++) {
+    }
+    if (m == CAPTURE_NUM_METHODS) {
+        return;
+    }
+    int len = snprintf(r->uri, sizeof(r->uri), "%s%s%s", uri, query ? "?" : "", query ? query : "");
+    r->uri_len = len < 0 ? 0 : (size_t)len < sizeof(r->uri) ? (size_t)len : sizeof(r->uri) - 1;
+    r->start_us = sync_now_us();
+    r->method = (unsigned char)m;
+    r->flags = flags & (CAPTURE_TOKEN | CAPTURE_FORM | CAPTURE_GZIP);
+    r->body_len = 0;
+    r->active = 1;
+}
+
+void capture_body(const char *body, size_t len) {
+    record *r = &current;
+    if (!r->active) {
+        return;
+    }
+    if (len > CAPTURE_MAX_BODY) {
+        len = CAPTURE_MAX_BODY;
+        r->flags |= CAPTURE_TRUNCATED;
+    }
+    size_t need = 2 * len + sizeof(CAPTURE_MASK);
+    if (need > r->body_cap) {
+        char *p = realloc(r->body, need);
+        if (!p) {
+            r->active = 0; // dropped
+            return;
+        }
+        r->body = p;
+        r->body_cap = need;
+    }
+    // By the body, not the Content-Type: clients send JSON as a form too
+    size_t i = 0;
+    while (i < len && (body[i] == ' ' || body[i] == '\t' || body[i] == '\r' || body[i] == '\n')) {
+        i++;
+    }
+    int json = i < len && (body[i] == '{' || body[i] == '[');
+    r->body_len = json ? sanitize_json(body, len, r->body, &r->flags)
+                       : sanitize_form(body, len, r->body, &r->flags);
+}
+
+void capture_end(int status) {
+    record *r = &current;
+    unsigned char head[RECORD_HEAD_MAX], body_head[16];
+    size_t n = 0;
+
+    if (!r->active) {
+        return;
+    }
+    r->active = 0;
+    long long now = sync_now_us();
+    n += put_varint(head + n, (unsigned long long)(r->start_us - start_us));
+    head[n++] = r->method;
+    head[n++] = (unsigned char)r->flags;
+    n += put_varint(head + n, (unsigned long long)(status > 0 ? status : 0));
+    n += put_varint(head + n, (unsigned long long)(now - r->start_us));
+    n += put_varint(head + n, r->uri_len);
+    size_t body_head_len = put_varint(body_head, r->body_len);
+    size_t total = n + r->uri_len + body_head_len + r->body_len;
+
+    sync_mutex_lock(&lock);
+    if (pending_len + total > CAPTURE_BUFFER_SIZE) {
+        stats.dropped++;
+    } else {
+        char *p = pending + pending_len;
+        memcpy(p, head, n);
+        memcpy(p + n, r->uri, r->uri_len);
+        p += n + r->uri_len;
+        memcpy(p, body_head, body_head_len);
+        memcpy(p + body_head_len, r->body, r->body_len);
+        pending_len += total;
+        pending_records++;
+        if (pending_len > CAPTURE_BUFFER_SIZE / 2) {
+            sync_cond_signal(&wake);
+        }
+    }
+    sync_mutex_unlock(&lock);
+}
+
+void capture_thread_exit(void) {
+    free(current.body);
+    current.body = NULL;
+    current.body_cap = 0;
+    current.active = 0;
+}
+
+void capture_get_stats(capture_stats *out) {
+    if (!atomic_load(&running)) {
+        *out = stats;
+        return;
+    }
+    sync_mutex_lock(&lock);
+    *out = stats;
+    sync_mutex_unlock(&lock);
+}
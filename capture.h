@@ -0,0 +1,77 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+
+// Traffic capture, for replaying real load against a test server (replay.c).
+//
+// Off until capture_start opens the log (main.c: EKNOWS_CAPTURE names the
+// file). A worker keeps the record of its current request in a thread-local:
+// capture_begin when the request arrives, capture_body when the handler has
+// read the body, capture_end once the response is sent. Finished records go
+// to a shared buffer that a background thread writes to the file every
+// CAPTURE_FLUSH_MS. If the writer falls behind, records are dropped and
+// counted; requests never wait for the disk.
+//
+// Records are sanitized on the worker. The Authorization header is only a
+// flag. In JSON and form bodies, passwords, access codes and tokens become
+// CAPTURE_MASK and uploaded file contents as many 'A's, so the sizes stay.
+// Everything else (names, ids, query strings) is kept as it was sent.
+//
+// The file starts with CAPTURE_MAGIC and the Unix time of the start (8 bytes,
+// little endian), followed by one record per request, in the order the
+// requests finished. Numbers in a record are unsigned LEB128 varints:
+//   offset_us   arrival of the request, from the start of the capture
+//   method      one byte, index in capture_methods
+//   flags       one byte, CAPTURE_* below
+//   status      response status
+//   service_us  time from arrival to the end of the response
+//   uri_len     followed by the URI (path and query string)
+//   body_len    followed by the body
+
+#define CAPTURE_MAGIC "EKCAP1\n"
+#define CAPTURE_MAGIC_LEN 7
+
+// Record flags
+#define CAPTURE_TOKEN       0x01 // sent a bearer token
+#define CAPTURE_FORM        0x02 // Content-Type was a form, JSON otherwise
+#define CAPTURE_GZIP        0x04 // accepts gzip
+#define CAPTURE_CREDENTIALS 0x08 // a password was masked
+#define CAPTURE_TRUNCATED   0x10 // body cut at CAPTURE_MAX_BODY
+
+#define CAPTURE_MASK "********"
+
+// Longer bodies and URIs are cut
+#define CAPTURE_MAX_BODY (256 * 1024)
+#define CAPTURE_MAX_URI 2048
+
+#define CAPTURE_NUM_METHODS 7
+extern const char *const capture_methods[CAPTURE_NUM_METHODS];
+
+typedef struct {
+    unsigned long long records; // written to the file
+    unsigned long long bytes;
+    unsigned long long dropped; // buffer full or write error
+} capture_stats;
+
+// Create the file at path and start the writer. Returns 0 on success.
+int capture_start(const char *path);
+
+// Write what is buffered and close the file. Call once no request runs.
+void capture_stop(void);
+
+int capture_running(void);
+
+// The request of the calling thread. Requests with other methods than
+// capture_methods are not captured. query may be NULL. flags: CAPTURE_TOKEN,
+// CAPTURE_FORM and CAPTURE_GZIP.
+void capture_begin(const char *method, const char *uri, const char *query, unsigned flags);
+void capture_body(const char *body, size_t len);
+void capture_end(int status);
+
+// Free the record buffers of the calling thread
+void capture_thread_exit(void);
+
+void capture_get_stats(capture_stats *out);
+
+#endif // CAPTURE_H
@@ -152,6 +152,45 @@ mg_static_assert(sizeof(void *) >= sizeof(int), "data type size check");
 #define NO_ALTERNATIVE_QUEUE
 #endif
 
+/* On Linux, the CONNECTION_QUEUE_SIZE queue is a lock-free ring: the master
+ * thread and the workers do not share a mutex to pass sockets, and idle
+ * workers sleep on a futex. Define NO_LOCKFREE_QUEUE to use the queue
+ * protected by thread_mutex instead. */
+#if defined(NO_ALTERNATIVE_QUEUE) && defined(__linux__)                        \
+    && !defined(NO_LOCKFREE_QUEUE) && !defined(LOCKFREE_QUEUE)
+#define LOCKFREE_QUEUE
+#endif
+#if defined(LOCKFREE_QUEUE) && defined(ALTERNATIVE_QUEUE)
+#error "LOCKFREE_QUEUE replaces the NO_ALTERNATIVE_QUEUE queue"
+#endif
+
+/* On Linux, the "acceptor_threads" option replaces the accept loop of the
+ * master thread by several acceptor threads. Each one has its own
+ * SO_REUSEPORT listening socket per port and an epoll loop, the kernel
+ * spreads new connections over them, and all of them feed the same socket
+ * queue. Define NO_MULTI_ACCEPTOR to remove the option. */
+#if defined(NO_ALTERNATIVE_QUEUE) && defined(__linux__)                        \
+    && !defined(NO_MULTI_ACCEPTOR) && !defined(MULTI_ACCEPTOR)
+#define MULTI_ACCEPTOR
+#endif
+
+/* The access log is written by a background thread (access_log.inl). It
+ * needs the GCC __atomic builtins; define NO_ASYNC_ACCESS_LOG to let the
+ * workers write it. */
+#if defined(__GNUC__) && !defined(NO_FILESYSTEMS)                              \
+    && !defined(MG_EXTERNAL_FUNCTION_log_access)                               \
+    && !defined(NO_ASYNC_ACCESS_LOG) && !defined(ASYNC_ACCESS_LOG)
+#define ASYNC_ACCESS_LOG
+#endif
+
+/* Per-route request counts and latency histograms (metrics.inl), kept per
+ * worker with the GCC __atomic builtins. Define NO_REQUEST_METRICS to
+ * remove them. */
+#if defined(__GNUC__) && !defined(NO_REQUEST_METRICS)                          \
+    && !defined(REQUEST_METRICS)
+#define REQUEST_METRICS
+#endif
+
 #if defined(NO_FILESYSTEMS) && !defined(NO_FILES)
 /* File system access:
  * NO_FILES = do not serve any files from the file system automatically.
@@ -887,8 +926,10 @@ typedef unsigned short int in_port_t;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #if !defined(__rtems__)
 #include <sys/utsname.h>
 #endif
@@ -1197,52 +1238,52 @@ mg_atomic_dec(volatile ptrdiff_t *addr)
 }
 
 
-#if defined(USE_SERVER_STATS) || defined(STOP_FLAG_NEEDS_LOCK)
+FUNCTION_MAY_BE_UNUSED
 static ptrdiff_t
-mg_atomic_add(volatile ptrdiff_t *addr, ptrdiff_t value)
+mg_atomic_compare_and_swap(volatile ptrdiff_t *addr,
+                           ptrdiff_t oldval,
+                           ptrdiff_t newval)
 {
 	ptrdiff_t ret;
 
 #if defined(_WIN64) && !defined(NO_ATOMICS)
-	ret = InterlockedAdd64(addr, value);
+	ret = InterlockedCompareExchange64(addr, newval, oldval);
 #elif defined(_WIN32) && !defined(NO_ATOMICS)
-	ret = InterlockedExchangeAdd(addr, value) + value;
+	ret = InterlockedCompareExchange(addr, newval, oldval);
 #elif defined(__GNUC__)                                                        \
     && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 0)))           \
     && !defined(NO_ATOMICS)
-	ret = __sync_add_and_fetch(addr, value);
+	ret = __sync_val_compare_and_swap(addr, oldval, newval);
 #else
 	mg_global_lock();
-	*addr += value;
-	ret = (*addr);
+	ret = *addr;
+	if ((ret != newval) && (ret == oldval)) {
+		*addr = newval;
+	}
 	mg_global_unlock();
 #endif
 	return ret;
 }
 
 
-FUNCTION_MAY_BE_UNUSED
+#if defined(USE_SERVER_STATS) || defined(STOP_FLAG_NEEDS_LOCK)
 static ptrdiff_t
-mg_atomic_compare_and_swap(volatile ptrdiff_t *addr,
-                           ptrdiff_t oldval,
-                           ptrdiff_t newval)
+mg_atomic_add(volatile ptrdiff_t *addr, ptrdiff_t value)
 {
 	ptrdiff_t ret;
 
 #if defined(_WIN64) && !defined(NO_ATOMICS)
-	ret = InterlockedCompareExchange64(addr, newval, oldval);
+	ret = InterlockedAdd64(addr, value);
 #elif defined(_WIN32) && !defined(NO_ATOMICS)
-	ret = InterlockedCompareExchange(addr, newval, oldval);
+	ret = InterlockedExchangeAdd(addr, value) + value;
 #elif defined(__GNUC__)                                                        \
     && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 0)))           \
     && !defined(NO_ATOMICS)
-	ret = __sync_val_compare_and_swap(addr, oldval, newval);
+	ret = __sync_add_and_fetch(addr, value);
 #else
 	mg_global_lock();
-	ret = *addr;
-	if ((ret != newval) && (ret == oldval)) {
-		*addr = newval;
-	}
+	*addr += value;
+	ret = (*addr);
 	mg_global_unlock();
 #endif
 	return ret;
@@ -1722,6 +1763,17 @@ mg_get_current_time_ns(void)
 }
 
 
+/* For durations: not changed when the wall clock is set */
+FUNCTION_MAY_BE_UNUSED
+static uint64_t
+mg_get_monotonic_time_ns(void)
+{
+	struct timespec tsnow;
+	clock_gettime(CLOCK_MONOTONIC, &tsnow);
+	return (((uint64_t)tsnow.tv_sec) * 1000000000) + (uint64_t)tsnow.tv_nsec;
+}
+
+
 #if defined(GCC_DIAGNOSTIC)
 /* Show no warning in case system functions are not used. */
 #pragma GCC diagnostic pop
@@ -1954,8 +2006,54 @@ struct socket {
 	unsigned char
 	    is_optional; /* Shouldn't cause us to exit if we can't bind to it */
 	unsigned char in_use; /* 0: invalid, 1: valid, 2: free */
+	uint64_t accept_time; /* When accepted (monotonic ns), see
+	                       * admission.inl */
+};
+
+
+#if defined(LOCKFREE_QUEUE)
+/* One slot of the lock-free socket queue. seq tells producers and consumers
+ * whose turn it is (see sq_push and sq_pop). */
+struct sq_cell {
+	uint64_t seq;
+	struct socket sock;
 };
 
+/* Keep the producer and the consumer position on separate cache lines */
+#define SQ_CACHE_LINE (64)
+#endif
+
+
+#if defined(MULTI_ACCEPTOR)
+/* An acceptor thread and its listening sockets. Acceptor 0 serves the
+ * sockets of set_ports_option, the others a SO_REUSEPORT copy of each
+ * TCP socket. With a single acceptor, the master thread is acceptor 0. */
+struct mg_acceptor {
+	struct mg_context *ctx;
+	pthread_t thread_id;
+	struct socket *sockets;
+	unsigned int num_sockets;
+	int own_sockets; /* sockets are not ctx->listening_sockets */
+	int epfd;        /* epoll instance of the acceptor thread */
+
+	int64_t accepted;        /* Connections accepted (atomic) */
+	int64_t accept_rate;     /* Connections per second (atomic) */
+	int64_t sample_accepted; /* accepted at the last rate sample */
+	uint64_t sample_time;    /* Time of the last rate sample (ns) */
+};
+
+/* Update accept_rate at most this often */
+#define ACCEPTOR_SAMPLE_MS (1000)
+
+/* Accept at most this many connections from one socket per wakeup, so one
+ * busy port does not hold up the others of the same acceptor */
+#define ACCEPTOR_BATCH (64)
+
+#if !defined(MAX_ACCEPTOR_THREADS)
+#define MAX_ACCEPTOR_THREADS (64)
+#endif
+#endif
+
 
 /* Enum const for all options must be in sync with
  * static struct mg_option config_options[]
@@ -1977,13 +2075,24 @@ enum {
 #if defined(__linux__)
 	ALLOW_SENDFILE_CALL,
 #endif
+#if defined(MULTI_ACCEPTOR)
+	ACCEPTOR_THREADS,
+#endif
 #if defined(_WIN32)
 	CASE_SENSITIVE_FILES,
 #endif
 	THROTTLE,
+	REQUEST_RATE,
+	MAX_QUEUE_WAIT,
+	ACCESS_LOG_FSYNC,
+	ACCESS_LOG_ROTATE_SIZE,
+	ACCESS_LOG_ROTATE_TIME,
+	TRACE_SAMPLE,
+	TRACE_SLOW,
 	ENABLE_KEEP_ALIVE,
 	REQUEST_TIMEOUT,
 	KEEP_ALIVE_TIMEOUT,
+	KEEP_ALIVE_MAX_REQUESTS,
 #if defined(USE_WEBSOCKET)
 	WEBSOCKET_TIMEOUT,
 	ENABLE_WEBSOCKET_PING_PONG,
@@ -1997,6 +2106,9 @@ enum {
 #if defined(USE_HTTP2)
 	ENABLE_HTTP2,
 #endif
+#if defined(USE_ZLIB)
+	COMPRESSION_MIN_SIZE,
+#endif
 
 	/* Once for each domain */
 	DOCUMENT_ROOT,
@@ -2126,13 +2238,24 @@ static const struct mg_option config_options[] = {
 #if defined(__linux__)
     {"allow_sendfile_call", MG_CONFIG_TYPE_BOOLEAN, "yes"},
 #endif
+#if defined(MULTI_ACCEPTOR)
+    {"acceptor_threads", MG_CONFIG_TYPE_NUMBER, "1"},
+#endif
 #if defined(_WIN32)
     {"case_sensitive", MG_CONFIG_TYPE_BOOLEAN, "no"},
 #endif
     {"throttle", MG_CONFIG_TYPE_STRING_LIST, NULL},
+    {"request_rate", MG_CONFIG_TYPE_STRING_LIST, NULL},
+    {"max_queue_wait_ms", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"access_log_fsync_ms", MG_CONFIG_TYPE_NUMBER, "1000"},
+    {"access_log_rotate_size", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"access_log_rotate_ms", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"trace_sample", MG_CONFIG_TYPE_NUMBER, "0"},
+    {"trace_slow_ms", MG_CONFIG_TYPE_NUMBER, "0"},
     {"enable_keep_alive", MG_CONFIG_TYPE_BOOLEAN, "no"},
     {"request_timeout_ms", MG_CONFIG_TYPE_NUMBER, "30000"},
     {"keep_alive_timeout_ms", MG_CONFIG_TYPE_NUMBER, "500"},
+    {"keep_alive_max_requests", MG_CONFIG_TYPE_NUMBER, "0"},
 #if defined(USE_WEBSOCKET)
     {"websocket_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
     {"enable_websocket_ping_pong", MG_CONFIG_TYPE_BOOLEAN, "no"},
@@ -2146,6 +2269,9 @@ static const struct mg_option config_options[] = {
 #if defined(USE_HTTP2)
     {"enable_http2", MG_CONFIG_TYPE_BOOLEAN, "no"},
 #endif
+#if defined(USE_ZLIB)
+    {"compression_min_size", MG_CONFIG_TYPE_NUMBER, "1024"},
+#endif
 
     /* Once for each domain */
     {"document_root", MG_CONFIG_TYPE_DIRECTORY, NULL},
@@ -2293,8 +2419,6 @@ struct mg_handler_info {
 
 	/* Handler for http/https or requests. */
 	mg_request_handler handler;
-	unsigned int refcount;
-	int removing;
 
 	/* Handler for ws/wss (websocket) requests. */
 	mg_websocket_connect_handler connect_handler;
@@ -2311,6 +2435,9 @@ struct mg_handler_info {
 	/* User supplied argument for the handler function. */
 	void *cbdata;
 
+	/* Route of a request handler in the metrics, see metrics.inl */
+	int metrics_route;
+
 	/* next handler in a linked list */
 	struct mg_handler_info *next;
 };
@@ -2324,10 +2451,14 @@ enum {
 };
 
 
+struct mg_routes; /* compiled handler lookup tables, see route.inl */
+
 struct mg_domain_context {
 	SSL_CTX *ssl_ctx;                 /* SSL context */
 	char *config[NUM_OPTIONS];        /* Civetweb configuration parameters */
 	struct mg_handler_info *handlers; /* linked list of uri handlers */
+	struct mg_routes *volatile routes; /* handlers compiled for lookup,
+	                                    * read without lock (route.inl) */
 	int64_t ssl_cert_last_mtime;
 
 	/* Server nonce */
@@ -2417,9 +2548,16 @@ struct mg_context {
 	struct mg_pollfd *listening_socket_fds;
 	unsigned int num_listening_sockets;
 
+#if defined(MULTI_ACCEPTOR)
+	struct mg_acceptor *acceptors; /* See acceptors_init */
+	unsigned int num_acceptors;
+#endif
+
 	struct mg_connection *worker_connections; /* The connection struct, pre-
 	                                           * allocated for each worker */
 
+	volatile ptrdiff_t route_epoch; /* Handler table version, see route.inl */
+
 #if defined(USE_SERVER_STATS)
 	volatile ptrdiff_t active_connections;
 	volatile ptrdiff_t max_active_connections;
@@ -2451,6 +2589,22 @@ struct mg_context {
 #if defined(ALTERNATIVE_QUEUE)
 	struct socket *client_socks;
 	void **client_wait_events;
+#elif defined(LOCKFREE_QUEUE)
+	struct sq_cell *sq_cells; /* Socket queue (sq) : ring of sq_size cells */
+	uint64_t sq_mask;         /* sq_size - 1, sq_size is a power of 2 */
+	char sq_pad0[SQ_CACHE_LINE];
+	uint64_t sq_head; /* Next cell to fill, advanced by producers */
+	char sq_pad1[SQ_CACHE_LINE];
+	uint64_t sq_tail; /* Next cell to take, advanced by consumers */
+	char sq_pad2[SQ_CACHE_LINE];
+	int sq_full;              /* Futex, bumped when a socket is produced */
+	int sq_empty;             /* Futex, bumped when a socket is consumed */
+	int sq_idle_waiting;      /* Workers sleeping on sq_full */
+	int sq_producers_waiting; /* Producers sleeping on sq_empty, sq is full */
+	int sq_size;              /* No of elements in socket queue */
+#if defined(USE_SERVER_STATS)
+	int sq_max_fill;
+#endif /* USE_SERVER_STATS */
 #else
 	struct socket *squeue; /* Socket queue (sq) : accepted sockets waiting for a
 	                       worker thread */
@@ -2465,6 +2619,22 @@ struct mg_context {
 #endif /* USE_SERVER_STATS */
 #endif /* ALTERNATIVE_QUEUE */
 
+	/* Admission control, see admission.inl */
+	int max_queue_wait_ms;
+	volatile ptrdiff_t queue_wait_us;   /* Smoothed wait for a worker */
+	volatile ptrdiff_t shed_queue_full; /* Connections shed on accept */
+	volatile ptrdiff_t shed_queue_wait; /* Requests shed after the wait */
+	volatile ptrdiff_t rate_limited;    /* Requests over request_rate */
+	struct mg_rate_limiter *rate_limiter;
+
+#if defined(ASYNC_ACCESS_LOG)
+	struct mg_access_log *access_log; /* See access_log.inl */
+#endif
+#if defined(REQUEST_METRICS)
+	struct mg_metrics *metrics; /* See metrics.inl */
+#endif
+	struct mg_tracer *tracer; /* See trace.inl, NULL if tracing is off */
+
 	/* Memory related */
 	unsigned int max_request_size; /* The max request size */
 
@@ -2484,6 +2654,15 @@ struct mg_context {
 	struct ttimers *timers;
 #endif
 
+#if defined(USE_ZLIB)
+	/* Compression level for dynamic content, adapted to the CPU load
+	 * by the master thread (see mod_zlib.inl) */
+	volatile int gzip_level;
+	uint64_t gzip_sample_wall; /* Wall clock of last load sample (ns) */
+	uint64_t gzip_sample_cpu;  /* Process CPU time of last sample (ns) */
+	int gzip_num_cpus;
+#endif
+
 	/* Lua specific: Background operations and shared websockets */
 #if defined(USE_LUA)
 	void *lua_background_state;   /* lua_State (here as void *) */
@@ -2547,10 +2726,38 @@ enum {
 #define HTTP2_DYN_TABLE_SIZE (256)
 #endif
 
+struct mg_http2_stream; /* see http2.inl */
+
 struct mg_http2_connection {
-	uint32_t stream_id;
-	uint32_t dyn_table_size;
+	uint32_t stream_id;     /* stream currently answered */
+	uint32_t max_stream_id; /* highest stream opened by the client */
+	uint32_t stream_seq;    /* arrival order of streams */
+
+	/* HPACK dynamic table (ring buffer) used to decode request headers */
+	uint32_t dyn_table_size; /* number of entries */
+	uint32_t dyn_table_first;
+	uint32_t dyn_table_octets;
+	uint32_t dyn_table_max_octets;
 	struct mg_header dyn_table[HTTP2_DYN_TABLE_SIZE];
+
+	/* Flow control and settings of the peer */
+	int64_t send_window;
+	int64_t initial_window_size;
+	uint32_t max_frame_size;
+
+	struct mg_http2_stream *streams; /* HTTP2_MAX_STREAMS entries */
+	struct mg_http2_stream *current; /* stream currently answered */
+	uint64_t body_read;              /* request body bytes read by mg_read */
+	uint8_t *frame_buf;
+
+	/* Header block split into HEADERS and CONTINUATION frames */
+	uint8_t *hdr_block;
+	uint32_t hdr_block_len;
+	uint32_t hdr_block_stream;
+	int hdr_block_end_stream;
+
+	int goaway_received;
+	int closed; /* connection error or closed by the peer */
 };
 #endif
 
@@ -2586,6 +2793,8 @@ struct mg_connection {
 #endif
 	struct timespec req_time; /* Time (since system start) when the request
 	                           * was received */
+	struct timespec req_read_time; /* Time (since system start) when the
+	                                * request headers had been read */
 	int64_t num_bytes_sent;   /* Total bytes sent to client */
 	int64_t content_len;      /* How many bytes of content can be read
 	                           * !is_chunked: Content-Length header value
@@ -2622,6 +2831,25 @@ struct mg_connection {
 	int websocket_deflate_flush;
 	z_stream websocket_deflate_state;
 	z_stream websocket_inflate_state;
+#endif
+	/* Scratch space of the worker thread for the status line and the
+	 * generated header lines of mg_send_response, see response.inl */
+	char response_scratch[256];
+	char response_date[64];    /* Cached Date header value */
+	time_t response_date_time; /* Time of response_date */
+
+	/* Lock-free handler lookup, see route.inl: epoch of the handler table
+	 * while looking up a handler (0 otherwise), and the request handler
+	 * in use until release_handler_ref. */
+	volatile ptrdiff_t route_epoch;
+	struct mg_handler_info *volatile route_handler;
+
+#if defined(USE_ZLIB)
+	/* Deflate state for dynamic responses (mg_response_send_body).
+	 * Initialized once per worker thread and reset between responses. */
+	int response_deflate_initialized;
+	int response_deflate_level;
+	z_stream response_deflate_state;
 #endif
 	int handled_requests; /* Number of requests handled by this connection
 	                       */
@@ -2631,6 +2859,16 @@ struct mg_connection {
 	int status_code;      /* HTTP reply status code, e.g. 200 */
 	int throttle;         /* Throttling, bytes/sec. <= 0 means no
 	                       * throttle */
+	int queue_shed;       /* 1 if the first request is to be answered with
+	                       * 503, see admission.inl */
+#if defined(ASYNC_ACCESS_LOG)
+	struct mg_alog_ring *access_log_ring; /* Of this worker, or NULL */
+#endif
+#if defined(REQUEST_METRICS)
+	struct mg_thread_metrics *metrics; /* Of this worker, or NULL */
+	int metrics_route;                 /* Route of the current request */
+#endif
+	struct mg_worker_trace *trace; /* Of this worker, or NULL */
 
 	time_t last_throttle_time; /* Last time throttled data was sent */
 	int last_throttle_bytes;   /* Bytes sent this second */
@@ -2687,6 +2925,13 @@ typedef struct tagTHREADNAME_INFO {
 #if defined(ALTERNATIVE_QUEUE)
 #include <sys/eventfd.h>
 #endif /* ALTERNATIVE_QUEUE */
+#if defined(LOCKFREE_QUEUE)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif /* LOCKFREE_QUEUE */
+#if defined(MULTI_ACCEPTOR)
+#include <sys/epoll.h>
+#endif /* MULTI_ACCEPTOR */
 
 
 #if defined(ALTERNATIVE_QUEUE)
@@ -3358,6 +3603,50 @@ mg_get_server_ports(const struct mg_context *ctx,
 }
 
 
+CIVETWEB_API int
+mg_get_acceptor_stats(const struct mg_context *ctx,
+                      struct mg_acceptor_stat *stats,
+                      int max_stats)
+{
+#if defined(MULTI_ACCEPTOR)
+	unsigned int i, j;
+
+	if ((ctx == NULL) || (ctx->acceptors == NULL)) {
+		return 0;
+	}
+
+	for (i = 0; (i < ctx->num_acceptors) && ((int)i < max_stats); i++) {
+		const struct mg_acceptor *acc = &ctx->acceptors[i];
+
+		memset(&stats[i], 0, sizeof(stats[i]));
+		stats[i].accepted = __atomic_load_n(&acc->accepted, __ATOMIC_RELAXED);
+		stats[i].accept_rate =
+		    __atomic_load_n(&acc->accept_rate, __ATOMIC_RELAXED);
+
+		for (j = 0; j < acc->num_sockets; j++) {
+			struct tcp_info ti;
+			socklen_t len = sizeof(ti);
+			/* For a listening socket, tcpi_unacked is the length of the
+			 * accept queue and tcpi_sacked its limit. */
+			if (getsockopt(
+			        acc->sockets[j].sock, IPPROTO_TCP, TCP_INFO, &ti, &len)
+			    == 0) {
+				stats[i].backlog += (int)ti.tcpi_unacked;
+				stats[i].backlog_max += (int)ti.tcpi_sacked;
+			}
+		}
+	}
+
+	return (int)ctx->num_acceptors;
+#else
+	(void)ctx;
+	(void)stats;
+	(void)max_stats;
+	return 0;
+#endif
+}
+
+
 #if defined(USE_X_DOM_SOCKET) && !defined(UNIX_DOMAIN_SOCKET_SERVER_NAME)
 #define UNIX_DOMAIN_SOCKET_SERVER_NAME "*"
 #endif
@@ -4050,6 +4339,9 @@ header_has_option(const char *header, const char *option)
 /* Pattern matching has been reimplemented in a new file */
 #include "match.inl"
 
+/* Compiled request handler lookup */
+#include "route.inl"
+
 
 /* HTTP 1.1 assumes keep alive if "Connection:" header is not set
  * This function must tolerate situations when connection info is not
@@ -4071,6 +4363,16 @@ should_keep_alive(const struct mg_connection *conn)
 		return 0;
 	}
 
+	if (conn->dom_ctx->config[KEEP_ALIVE_MAX_REQUESTS]) {
+		/* Close, if this is the last request allowed for this connection */
+		int max_requests =
+		    atoi(conn->dom_ctx->config[KEEP_ALIVE_MAX_REQUESTS]);
+		if ((max_requests > 0)
+		    && (conn->handled_requests + 1 >= max_requests)) {
+			return 0;
+		}
+	}
+
 	/* Check explicit wish of the client */
 	header = mg_get_header(conn, "Connection");
 	if (header) {
@@ -6308,6 +6610,23 @@ push_inner(struct mg_context *ctx,
 }
 
 
+/* Send timeout in seconds */
+static double
+get_push_timeout(const struct mg_context *ctx)
+{
+	double timeout = -1.0;
+
+	if (ctx->dd.config[REQUEST_TIMEOUT]) {
+		timeout = atoi(ctx->dd.config[REQUEST_TIMEOUT]) / 1000.0;
+	}
+	if (timeout <= 0.0) {
+		timeout = strtod(config_options[REQUEST_TIMEOUT].default_value, NULL)
+		          / 1000.0;
+	}
+	return timeout;
+}
+
+
 static int
 push_all(struct mg_context *ctx,
          FILE *fp,
@@ -6316,20 +6635,14 @@ push_all(struct mg_context *ctx,
          const char *buf,
          int len)
 {
-	double timeout = -1.0;
+	double timeout;
 	int n, nwritten = 0;
 
 	if (ctx == NULL) {
 		return -1;
 	}
 
-	if (ctx->dd.config[REQUEST_TIMEOUT]) {
-		timeout = atoi(ctx->dd.config[REQUEST_TIMEOUT]) / 1000.0;
-	}
-	if (timeout <= 0.0) {
-		timeout = strtod(config_options[REQUEST_TIMEOUT].default_value, NULL)
-		          / 1000.0;
-	}
+	timeout = get_push_timeout(ctx);
 
 	while ((len > 0) && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
 		n = push_inner(ctx, fp, sock, ssl, buf + nwritten, len, timeout);
@@ -6350,6 +6663,127 @@ push_all(struct mg_context *ctx,
 }
 
 
+#if !defined(MG_MAX_IOVEC)
+#define MG_MAX_IOVEC (16)
+#endif
+
+
+/* Write several buffers to a plain socket with one system call
+ * (sendmsg/WSASend) each time the socket accepts data. Partial writes and
+ * timeouts are handled like in push_inner/push_all.
+ * Return: number of bytes written, or -1 if nothing could be written */
+static int
+push_all_vec(struct mg_context *ctx,
+             SOCKET sock,
+             const struct mg_iovec *iov,
+             int iovcnt)
+{
+#if defined(_WIN32)
+	WSABUF vec[MG_MAX_IOVEC];
+#else
+	struct iovec vec[MG_MAX_IOVEC];
+	struct msghdr msg;
+#endif
+	uint64_t start = mg_get_current_time_ns();
+	uint64_t timeout_ns = (uint64_t)(get_push_timeout(ctx) * 1.0E9);
+	int first = 0, cnt = 0, nwritten = 0;
+	int i, n, err;
+
+	for (i = 0; (i < iovcnt) && (cnt < MG_MAX_IOVEC); i++) {
+		if (iov[i].len == 0) {
+			continue;
+		}
+#if defined(_WIN32)
+		vec[cnt].buf = (char *)iov[i].buf;
+		vec[cnt].len = (ULONG)iov[i].len;
+#else
+		vec[cnt].iov_base = (void *)iov[i].buf;
+		vec[cnt].iov_len = iov[i].len;
+#endif
+		cnt++;
+	}
+
+	while ((first < cnt) && STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+#if defined(_WIN32)
+		DWORD sent = 0;
+		n = (WSASend(sock,
+		             vec + first,
+		             (DWORD)(cnt - first),
+		             &sent,
+		             0,
+		             NULL,
+		             NULL)
+		     == 0)
+		        ? (int)sent
+		        : -1;
+#else
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec + first;
+		msg.msg_iovlen = (cnt - first);
+		n = (int)sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+		err = (n < 0) ? ERRNO : 0;
+
+		if (n > 0) {
+			nwritten += n;
+
+			/* Skip all buffers sent completely, adjust a partial one */
+			while ((first < cnt) && (n > 0)) {
+#if defined(_WIN32)
+				if ((ULONG)n >= vec[first].len) {
+					n -= (int)vec[first].len;
+					first++;
+				} else {
+					vec[first].buf += n;
+					vec[first].len -= (ULONG)n;
+					n = 0;
+				}
+#else
+				if ((size_t)n >= vec[first].iov_len) {
+					n -= (int)vec[first].iov_len;
+					first++;
+				} else {
+					vec[first].iov_base = (char *)vec[first].iov_base + n;
+					vec[first].iov_len -= (size_t)n;
+					n = 0;
+				}
+#endif
+			}
+			continue;
+		}
+		if ((n < 0) && !ERROR_TRY_AGAIN(err)) {
+			/* shutdown of the socket at client side */
+			DEBUG_TRACE("sendmsg() failed, error %d", err);
+			break;
+		}
+
+		/* Socket buffer is full: wait until it is writable again */
+		{
+			struct mg_pollfd pfd[2];
+			unsigned int num_sock = 1;
+
+			pfd[0].fd = sock;
+			pfd[0].events = POLLOUT;
+			if (ctx->context_type == CONTEXT_SERVER) {
+				pfd[num_sock].fd = ctx->thread_shutdown_notification_socket;
+				pfd[num_sock].events = POLLIN;
+				num_sock++;
+			}
+			if (mg_poll(pfd, num_sock, SOCKET_TIMEOUT_QUANTUM, &(ctx->stop_flag))
+			    > 0) {
+				continue;
+			}
+		}
+		if ((mg_get_current_time_ns() - start) > timeout_ns) {
+			/* Timeout */
+			break;
+		}
+	}
+
+	return (nwritten > 0) ? nwritten : -1;
+}
+
+
 /* Read from IO channel - opened file descriptor, socket, or SSL descriptor.
  * Return value:
  *  >=0 .. number of bytes successfully read
@@ -6790,6 +7224,11 @@ mg_read_inner(struct mg_connection *conn, void *buf, size_t len)
 /* Forward declarations */
 static void handle_request(struct mg_connection *);
 static void log_access(const struct mg_connection *);
+#if defined(REQUEST_METRICS)
+static void metrics_record(struct mg_connection *);
+#endif
+static void trace_begin(struct mg_connection *);
+static void trace_end(struct mg_connection *);
 
 
 /* Handle request, update statistics and call access log */
@@ -6800,9 +7239,18 @@ handle_request_stat_log(struct mg_connection *conn)
 	struct timespec tnow;
 	conn->conn_state = 4; /* processing */
 #endif
+#if defined(REQUEST_METRICS)
+	conn->metrics_route = 0; /* set by get_request_handler */
+#endif
+	trace_begin(conn);
 
 	handle_request(conn);
 
+	trace_end(conn);
+
+#if defined(REQUEST_METRICS)
+	metrics_record(conn);
+#endif
 
 #if defined(USE_SERVER_STATS)
 	conn->conn_state = 5; /* processed */
@@ -6826,10 +7274,11 @@ handle_request_stat_log(struct mg_connection *conn)
 
 
 #if defined(USE_HTTP2)
-#if defined(NO_SSL)
-#error "HTTP2 requires ALPN, ALPN requires SSL/TLS"
-#endif
+#if !defined(NO_SSL)
+/* HTTP/2 via TLS is negotiated using ALPN. Without TLS, only cleartext
+ * HTTP/2 (h2c) is available. */
 #define USE_ALPN
+#endif
 #include "http2.inl"
 /* Not supported with HTTP/2 */
 #define HTTP1_only                                                             \
@@ -6856,6 +7305,12 @@ mg_read(struct mg_connection *conn, void *buf, size_t len)
 		return 0;
 	}
 
+#if defined(USE_HTTP2)
+	if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
+		return http2_read_body(conn, buf, len);
+	}
+#endif
+
 	if (conn->is_chunked) {
 		size_t all_read = 0;
 
@@ -7027,7 +7482,8 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 	conn->request_state = 10;
 #if defined(USE_HTTP2)
 	if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
-		http2_data_frame_head(conn, len, 0);
+		/* DATA frames are subject to HTTP/2 flow control */
+		return http2_send_data(conn, (const char *)buf, len);
 	}
 #endif
 
@@ -7090,6 +7546,72 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 }
 
 
+int
+mg_writev(struct mg_connection *conn, const struct mg_iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i, n;
+
+	if (conn == NULL) {
+		return 0;
+	}
+	if ((iov == NULL) || (iovcnt < 0)) {
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].len;
+		if (len > INT_MAX) {
+			return -1;
+		}
+	}
+
+	if ((iovcnt > MG_MAX_IOVEC) || (conn->ssl != NULL) || (conn->throttle > 0)
+	    || (conn->protocol_type == PROTOCOL_TYPE_HTTP2)) {
+		/* No vectored I/O: copy short data into one buffer, so it is still
+		 * sent in one piece (one TLS record, one DATA frame), otherwise
+		 * send buffer by buffer. */
+		char buf[MG_BUF_LEN];
+		size_t pos = 0;
+		int total = 0;
+
+		if (len <= sizeof(buf)) {
+			for (i = 0; i < iovcnt; i++) {
+				if (iov[i].len > 0) {
+					memcpy(buf + pos, iov[i].buf, iov[i].len);
+					pos += iov[i].len;
+				}
+			}
+			return mg_write(conn, buf, len);
+		}
+		for (i = 0; i < iovcnt; i++) {
+			if (iov[i].len == 0) {
+				continue;
+			}
+			n = mg_write(conn, iov[i].buf, iov[i].len);
+			if (n < 0) {
+				return (total > 0) ? total : n;
+			}
+			total += n;
+			if ((size_t)n != iov[i].len) {
+				break;
+			}
+		}
+		return total;
+	}
+
+	/* Mark connection as "data sent" */
+	conn->request_state = 10;
+	if (len == 0) {
+		return 0;
+	}
+	n = push_all_vec(conn->phys_ctx, conn->client.sock, iov, iovcnt);
+	if (n > 0) {
+		conn->num_bytes_sent += n;
+	}
+	return n;
+}
+
+
 /* Send a chunk, if "Transfer-Encoding: chunked" is used */
 CIVETWEB_API int
 mg_send_chunk(struct mg_connection *conn,
@@ -7913,10 +8435,75 @@ substitute_index_file(struct mg_connection *conn,
 #endif
 
 
-static void
-interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
-              char *filename,             /* out: filename */
-              size_t filename_buf_len,    /* in: size of filename buffer */
+/* Check if an Accept-Encoding header value allows a gzip encoded response.
+ * Codings may carry a quality value: "gzip;q=0" explicitly refuses gzip,
+ * "*" accepts any coding not listed by name (RFC 9110, 12.5.3). */
+static int
+header_accepts_gzip(const char *accept_encoding)
+{
+	int gzip_q = -1;
+	int any_q = -1;
+	const char *p = accept_encoding;
+
+	while ((p != NULL) && (*p != '\0')) {
+		const char *token, *end;
+		size_t token_len;
+		int q = 1;
+
+		while ((*p == ' ') || (*p == '\t') || (*p == ',')) {
+			p++;
+		}
+		token = p;
+		while ((*p != '\0') && (*p != ',') && (*p != ';') && (*p != ' ')
+		       && (*p != '\t')) {
+			p++;
+		}
+		token_len = (size_t)(p - token);
+		end = strchr(p, ',');
+		if (end == NULL) {
+			end = p + strlen(p);
+		}
+
+		/* Parameters: only the quality value is of interest. Any non-zero
+		 * digit makes q > 0 ("0", "0.0", "0.000" are all zero). */
+		while (p < end) {
+			if (*p++ != ';') {
+				continue;
+			}
+			while ((*p == ' ') || (*p == '\t')) {
+				p++;
+			}
+			if (((*p == 'q') || (*p == 'Q')) && (p[1] == '=')) {
+				p += 2;
+				q = 0;
+				while ((p < end) && ((*p == '0') || (*p == '.'))) {
+					p++;
+				}
+				if ((p < end) && (*p >= '1') && (*p <= '9')) {
+					q = 1;
+				}
+			}
+		}
+
+		if (((token_len == 4) && !mg_strncasecmp(token, "gzip", 4))
+		    || ((token_len == 6) && !mg_strncasecmp(token, "x-gzip", 6))) {
+			gzip_q = q;
+		} else if ((token_len == 1) && (*token == '*')) {
+			any_q = q;
+		}
+	}
+
+	if (gzip_q >= 0) {
+		return gzip_q;
+	}
+	return (any_q > 0);
+}
+
+
+static void
+interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
+              char *filename,             /* out: filename */
+              size_t filename_buf_len,    /* in: size of filename buffer */
               struct mg_file_stat *filestat, /* out: file status structure */
               int *is_found,                 /* out: file found (directly) */
               int *is_script_resource,       /* out: handled by a script? */
@@ -7980,9 +8567,7 @@ interpret_uri(struct mg_connection *conn, /* in/out: request (must be valid) */
 	/* Step 4: Check if gzip encoded response is allowed */
 	conn->accept_gzip = 0;
 	if ((accept_encoding = mg_get_header(conn, "Accept-Encoding")) != NULL) {
-		if (strstr(accept_encoding, "gzip") != NULL) {
-			conn->accept_gzip = 1;
-		}
+		conn->accept_gzip = header_accepts_gzip(accept_encoding);
 	}
 
 #if !defined(NO_FILES)
@@ -10401,8 +10986,10 @@ send_file_data(struct mg_connection *conn,
 	if (len > 0 && filep->access.fp != NULL) {
 		/* file stored on disk */
 #if defined(__linux__)
-		/* sendfile is only available for Linux */
+		/* sendfile is only available for Linux.
+		 * HTTP/2 data must be sent in frames (mg_write). */
 		if ((conn->ssl == 0) && (conn->throttle == 0)
+		    && (conn->protocol_type != PROTOCOL_TYPE_HTTP2)
 		    && (!mg_strcasecmp(conn->dom_ctx->config[ALLOW_SENDFILE_CALL],
 		                       "yes"))) {
 			off_t sf_offs = (off_t)offset;
@@ -11587,6 +12174,27 @@ forward_body_data(struct mg_connection *conn, FILE *fp, SOCKET sock, SSL *ssl)
 #endif /* USE_TIMERS */
 
 
+CIVETWEB_API int
+mg_set_timer(struct mg_context *ctx,
+             double period,
+             int (*action)(void *arg),
+             void *arg)
+{
+#if defined(USE_TIMERS)
+	if (!ctx || !action || (period <= 0.0)) {
+		return -1;
+	}
+	return timer_add(ctx, period, period, 1, action, arg, NULL) ? -1 : 0;
+#else
+	(void)ctx;
+	(void)period;
+	(void)action;
+	(void)arg;
+	return -1;
+#endif
+}
+
+
 #if !defined(NO_CGI)
 /* This structure helps to create an environment for the spawned CGI
  * program.
@@ -14416,15 +15024,22 @@ parse_match_net(const struct vec *vec, const union usa *sa, int no_strict)
 }
 
 
-static int
-set_throttle(const char *spec, const union usa *rsa, const char *uri)
+/* Value of the last rule of a "throttle" style spec that matches the
+ * client address and URI, 0 if none does. If rule is not NULL, it is set
+ * to the index of that rule in the spec. */
+static double
+match_throttle_spec(const char *spec,
+                    const union usa *rsa,
+                    const char *uri,
+                    int *rule)
 {
-	int throttle = 0;
+	double throttle = 0;
 	struct vec vec, val;
 	char mult;
 	double v;
+	int i, matched;
 
-	while ((spec = next_option(spec, &vec, &val)) != NULL) {
+	for (i = 0; (spec = next_option(spec, &vec, &val)) != NULL; i++) {
 		mult = ',';
 		if ((val.ptr == NULL)
 		    || (sscanf(val.ptr, "%lf%c", &v, &mult)
@@ -14440,16 +15055,18 @@ set_throttle(const char *spec, const union usa *rsa, const char *uri)
 		         ? 1024
 		         : ((lowercase(&mult) == 'm') ? 1048576 : 1);
 		if (vec.len == 1 && vec.ptr[0] == '*') {
-			throttle = (int)v;
+			matched = 1;
 		} else {
-			int matched = parse_match_net(&vec, rsa, 0);
-			if (matched >= 0) {
-				/* a valid IP subnet */
-				if (matched) {
-					throttle = (int)v;
-				}
-			} else if (match_prefix(vec.ptr, vec.len, uri) > 0) {
-				throttle = (int)v;
+			matched = parse_match_net(&vec, rsa, 0);
+			if (matched < 0) {
+				/* not a valid IP subnet */
+				matched = (match_prefix(vec.ptr, vec.len, uri) > 0);
+			}
+		}
+		if (matched) {
+			throttle = v;
+			if (rule != NULL) {
+				*rule = i;
 			}
 		}
 	}
@@ -14458,6 +15075,25 @@ set_throttle(const char *spec, const union usa *rsa, const char *uri)
 }
 
 
+static int
+set_throttle(const char *spec, const union usa *rsa, const char *uri)
+{
+	return (int)match_throttle_spec(spec, rsa, uri, NULL);
+}
+
+
+/* Load shedding and request rate limits */
+#include "admission.inl"
+
+static size_t mg_str_append(char **dst, char *end, const char *src);
+
+/* Per-route request metrics, mg_get_metrics */
+#include "metrics.inl"
+
+/* Stage timing of sampled and slow requests, mg_get_traces */
+#include "trace.inl"
+
+
 /* The mg_upload function is superseded by mg_handle_form_request. */
 #include "handle_form.inl"
 
@@ -14636,7 +15272,8 @@ mg_set_handler_type(struct mg_context *phys_ctx,
                     mg_authorization_handler auth_handler,
                     void *cbdata)
 {
-	struct mg_handler_info *tmp_rh, **lastref;
+	struct mg_handler_info *tmp_rh, *old_rh, **lastref;
+	struct mg_domain_context *dom;
 	size_t urilen = strlen(uri);
 
 	if (handler_type == WEBSOCKET_HANDLER) {
@@ -14703,107 +15340,89 @@ mg_set_handler_type(struct mg_context *phys_ctx,
 	mg_lock_context(phys_ctx);
 
 	/* first try to find an existing handler */
-	do {
-		lastref = &(dom_ctx->handlers);
-		for (tmp_rh = dom_ctx->handlers; tmp_rh != NULL;
-		     tmp_rh = tmp_rh->next) {
-			if (tmp_rh->handler_type == handler_type
-			    && (urilen == tmp_rh->uri_len) && !strcmp(tmp_rh->uri, uri)) {
-				if (!is_delete_request) {
-					/* update existing handler */
-					if (handler_type == REQUEST_HANDLER) {
-						/* Wait for end of use before updating */
-						if (tmp_rh->refcount) {
-							mg_unlock_context(phys_ctx);
-							mg_sleep(1);
-							mg_lock_context(phys_ctx);
-							/* tmp_rh might have been freed, search again. */
-							break;
-						}
-						/* Ok, the handler is no more use -> Update it */
-						tmp_rh->handler = handler;
-					} else if (handler_type == WEBSOCKET_HANDLER) {
-						tmp_rh->subprotocols = subprotocols;
-						tmp_rh->connect_handler = connect_handler;
-						tmp_rh->ready_handler = ready_handler;
-						tmp_rh->data_handler = data_handler;
-						tmp_rh->close_handler = close_handler;
-					} else { /* AUTH_HANDLER */
-						tmp_rh->auth_handler = auth_handler;
-					}
-					tmp_rh->cbdata = cbdata;
-				} else {
-					/* remove existing handler */
-					if (handler_type == REQUEST_HANDLER) {
-						/* Wait for end of use before removing */
-						if (tmp_rh->refcount) {
-							tmp_rh->removing = 1;
-							mg_unlock_context(phys_ctx);
-							mg_sleep(1);
-							mg_lock_context(phys_ctx);
-							/* tmp_rh might have been freed, search again. */
-							break;
-						}
-						/* Ok, the handler is no more used */
-					}
-					*lastref = tmp_rh->next;
-					mg_free(tmp_rh->uri);
-					mg_free(tmp_rh);
-				}
-				mg_unlock_context(phys_ctx);
-				return;
-			}
-			lastref = &(tmp_rh->next);
+	lastref = &(dom_ctx->handlers);
+	for (old_rh = dom_ctx->handlers; old_rh != NULL; old_rh = old_rh->next) {
+		if (old_rh->handler_type == handler_type && (urilen == old_rh->uri_len)
+		    && !strcmp(old_rh->uri, uri)) {
+			break;
 		}
-	} while (tmp_rh != NULL);
+		lastref = &(old_rh->next);
+	}
 
 	if (is_delete_request) {
-		/* no handler to set, this was a remove request to a non-existing
-		 * handler */
-		mg_unlock_context(phys_ctx);
-		return;
-	}
+		if (old_rh == NULL) {
+			/* no handler to set, this was a remove request to a non-existing
+			 * handler */
+			mg_unlock_context(phys_ctx);
+			return;
+		}
+		tmp_rh = NULL;
 
-	tmp_rh =
-	    (struct mg_handler_info *)mg_calloc_ctx(1,
-	                                            sizeof(struct mg_handler_info),
-	                                            phys_ctx);
-	if (tmp_rh == NULL) {
-		mg_unlock_context(phys_ctx);
-		mg_cry_ctx_internal(phys_ctx,
-		                    "%s",
-		                    "Cannot create new request handler struct, OOM");
-		return;
-	}
-	tmp_rh->uri = mg_strdup_ctx(uri, phys_ctx);
-	if (!tmp_rh->uri) {
-		mg_unlock_context(phys_ctx);
-		mg_free(tmp_rh);
-		mg_cry_ctx_internal(phys_ctx,
-		                    "%s",
-		                    "Cannot create new request handler struct, OOM");
-		return;
+	} else {
+		/* Lookups run without lock, so handlers are never modified in place.
+		 * A new or updated handler is a new element of the list. */
+		tmp_rh = (struct mg_handler_info *)
+		    mg_calloc_ctx(1, sizeof(struct mg_handler_info), phys_ctx);
+		if (tmp_rh == NULL) {
+			mg_unlock_context(phys_ctx);
+			mg_cry_ctx_internal(phys_ctx,
+			                    "%s",
+			                    "Cannot create new request handler struct, OOM");
+			return;
+		}
+		tmp_rh->uri = mg_strdup_ctx(uri, phys_ctx);
+		if (!tmp_rh->uri) {
+			mg_unlock_context(phys_ctx);
+			mg_free(tmp_rh);
+			mg_cry_ctx_internal(phys_ctx,
+			                    "%s",
+			                    "Cannot create new request handler struct, OOM");
+			return;
+		}
+		tmp_rh->uri_len = urilen;
+		if (handler_type == REQUEST_HANDLER) {
+			tmp_rh->handler = handler;
+#if defined(REQUEST_METRICS)
+			tmp_rh->metrics_route = metrics_route_id(phys_ctx, uri);
+#endif
+		} else if (handler_type == WEBSOCKET_HANDLER) {
+			tmp_rh->subprotocols = subprotocols;
+			tmp_rh->connect_handler = connect_handler;
+			tmp_rh->ready_handler = ready_handler;
+			tmp_rh->data_handler = data_handler;
+			tmp_rh->close_handler = close_handler;
+		} else { /* AUTH_HANDLER */
+			tmp_rh->auth_handler = auth_handler;
+		}
+		tmp_rh->cbdata = cbdata;
+		tmp_rh->handler_type = handler_type;
+		tmp_rh->next = (old_rh != NULL) ? old_rh->next : NULL;
+	}
+
+	/* Replace, remove or append */
+	*lastref = (tmp_rh != NULL) ? tmp_rh : old_rh->next;
+	if (old_rh != NULL) {
+		/* Other domains may start their list with this element */
+		for (dom = &(phys_ctx->dd); dom != NULL; dom = dom->next) {
+			if (dom->handlers == old_rh) {
+				dom->handlers = *lastref;
+			}
+		}
 	}
-	tmp_rh->uri_len = urilen;
-	if (handler_type == REQUEST_HANDLER) {
-		tmp_rh->refcount = 0;
-		tmp_rh->removing = 0;
-		tmp_rh->handler = handler;
-	} else if (handler_type == WEBSOCKET_HANDLER) {
-		tmp_rh->subprotocols = subprotocols;
-		tmp_rh->connect_handler = connect_handler;
-		tmp_rh->ready_handler = ready_handler;
-		tmp_rh->data_handler = data_handler;
-		tmp_rh->close_handler = close_handler;
-	} else { /* AUTH_HANDLER */
-		tmp_rh->auth_handler = auth_handler;
-	}
-	tmp_rh->cbdata = cbdata;
-	tmp_rh->handler_type = handler_type;
-	tmp_rh->next = NULL;
-
-	*lastref = tmp_rh;
+
+	/* Publish the new handler tables. Returns after no lookup can find the
+	 * old handler any more. */
+	routes_update(phys_ctx);
 	mg_unlock_context(phys_ctx);
+
+	if (old_rh != NULL) {
+		if (handler_type == REQUEST_HANDLER) {
+			/* Wait for end of use before freeing */
+			routes_wait_unused(phys_ctx, old_rh);
+		}
+		mg_free(old_rh->uri);
+		mg_free(old_rh);
+	}
 }
 
 
@@ -14919,64 +15538,35 @@ get_request_handler(struct mg_connection *conn,
 		const char *uri = request_info->local_uri;
 		size_t urilen = strlen(uri);
 		struct mg_handler_info *tmp_rh;
-		int step, matched;
 
 		if (!conn || !conn->phys_ctx || !conn->dom_ctx) {
 			return 0;
 		}
 
-		mg_lock_context(conn->phys_ctx);
-
-		for (step = 0; step < 3; step++) {
-			for (tmp_rh = conn->dom_ctx->handlers; tmp_rh != NULL;
-			     tmp_rh = tmp_rh->next) {
-				if (tmp_rh->handler_type != handler_type) {
-					continue;
-				}
-				if (step == 0) {
-					/* first try for an exact match */
-					matched = (tmp_rh->uri_len == urilen)
-					          && (strcmp(tmp_rh->uri, uri) == 0);
-				} else if (step == 1) {
-					/* next try for a partial match, we will accept
-					uri/something */
-					matched =
-					    (tmp_rh->uri_len < urilen)
-					    && (uri[tmp_rh->uri_len] == '/')
-					    && (memcmp(tmp_rh->uri, uri, tmp_rh->uri_len) == 0);
-				} else {
-					/* finally try for pattern match */
-					matched =
-					    match_prefix(tmp_rh->uri, tmp_rh->uri_len, uri) > 0;
-				}
-				if (matched) {
-					if (handler_type == WEBSOCKET_HANDLER) {
-						*subprotocols = tmp_rh->subprotocols;
-						*connect_handler = tmp_rh->connect_handler;
-						*ready_handler = tmp_rh->ready_handler;
-						*data_handler = tmp_rh->data_handler;
-						*close_handler = tmp_rh->close_handler;
-					} else if (handler_type == REQUEST_HANDLER) {
-						if (tmp_rh->removing) {
-							/* Treat as none found */
-							step = 2;
-							break;
-						}
-						*handler = tmp_rh->handler;
-						/* Acquire handler and give it back */
-						tmp_rh->refcount++;
-						*handler_info = tmp_rh;
-					} else { /* AUTH_HANDLER */
-						*auth_handler = tmp_rh->auth_handler;
-					}
-					*cbdata = tmp_rh->cbdata;
-					mg_unlock_context(conn->phys_ctx);
-					return 1;
-				}
+		/* No lock required, see route.inl */
+		tmp_rh = routes_lookup(routes_enter(conn), handler_type, uri, urilen);
+		if (tmp_rh != NULL) {
+			if (handler_type == WEBSOCKET_HANDLER) {
+				*subprotocols = tmp_rh->subprotocols;
+				*connect_handler = tmp_rh->connect_handler;
+				*ready_handler = tmp_rh->ready_handler;
+				*data_handler = tmp_rh->data_handler;
+				*close_handler = tmp_rh->close_handler;
+			} else if (handler_type == REQUEST_HANDLER) {
+				*handler = tmp_rh->handler;
+				/* Acquire handler and give it back */
+				conn->route_handler = tmp_rh;
+				*handler_info = tmp_rh;
+#if defined(REQUEST_METRICS)
+				conn->metrics_route = tmp_rh->metrics_route;
+#endif
+			} else { /* AUTH_HANDLER */
+				*auth_handler = tmp_rh->auth_handler;
 			}
+			*cbdata = tmp_rh->cbdata;
 		}
-
-		mg_unlock_context(conn->phys_ctx);
+		routes_leave(conn);
+		return (tmp_rh != NULL);
 	}
 	return 0; /* none found */
 }
@@ -15026,17 +15616,14 @@ experimental_websocket_client_close_wrapper(const struct mg_connection *conn,
 #endif
 
 
-/* Decrement recount of handler. conn must not be NULL, handler_info may be NULL
- */
+/* Release the request handler found by get_request_handler. conn must not
+ * be NULL, handler_info may be NULL */
 static void
 release_handler_ref(struct mg_connection *conn,
                     struct mg_handler_info *handler_info)
 {
 	if (handler_info != NULL) {
-		/* Use context lock for ref counter */
-		mg_lock_context(conn->phys_ctx);
-		handler_info->refcount--;
-		mg_unlock_context(conn->phys_ctx);
+		routes_release_handler(conn);
 	}
 }
 
@@ -15145,6 +15732,23 @@ handle_request(struct mg_connection *conn)
 	                              &conn->client.rsa,
 	                              ri->local_uri);
 
+	/* 2a. reject the request if the server is overloaded or the client
+	 * sends too many requests (see admission.inl) */
+	if (conn->queue_shed) {
+		conn->queue_shed = 0;
+		conn->status_code = 503;
+		admission_reject(conn, 503, admission_retry_after(conn->phys_ctx));
+		return;
+	}
+	if ((i = admission_rate_limit(conn)) > 0) {
+		conn->status_code = 429;
+		admission_reject(conn, 429, i);
+		if (!conn->must_close) {
+			discard_unread_request_data(conn);
+		}
+		return;
+	}
+
 	/* 3. call a "handle everything" callback, if registered */
 	if (conn->phys_ctx->callbacks.begin_request != NULL) {
 		/* Note that since V1.7 the "begin_request" function is called
@@ -15407,8 +16011,9 @@ handle_request(struct mg_connection *conn)
 	/* request is authorized or does not need authorization */
 
 	/* 7. check if there are request handlers for this uri */
+	/* Handlers must send their response using mg_response_header_* and
+	 * mg_write for HTTP/2: raw HTTP/1.x headers cannot be translated. */
 	if (is_callback_resource) {
-		HTTP1_only;
 		if (!is_websocket_request) {
 			i = callback_handler(conn, callback_data);
 
@@ -15875,6 +16480,23 @@ close_all_listening_sockets(struct mg_context *ctx)
 }
 
 
+#if defined(MULTI_ACCEPTOR)
+/* Value of the "acceptor_threads" option */
+static int
+acceptor_threads_option(const struct mg_context *ctx)
+{
+	int n = atoi(ctx->dd.config[ACCEPTOR_THREADS]);
+	if (n < 1) {
+		return 1;
+	}
+	if (n > MAX_ACCEPTOR_THREADS) {
+		return MAX_ACCEPTOR_THREADS;
+	}
+	return n;
+}
+#endif
+
+
 /* Valid listening port specification is: [ip_address:]port[s]
  * Examples for IPv4: 80, 443s, 127.0.0.1:3128, 192.0.2.3:8080s
  * Examples for IPv6: [::]:80, [::1]:80,
@@ -16268,6 +16890,23 @@ set_ports_option(struct mg_context *phys_ctx)
 		}
 #endif
 
+#if defined(MULTI_ACCEPTOR)
+		/* The other acceptors bind copies of this socket (acceptors_init).
+		 * If this fails, they cannot, and acceptor 0 serves the port. */
+		if ((acceptor_threads_option(phys_ctx) > 1) && (ip_version != 99)
+		    && (setsockopt(so.sock,
+		                   SOL_SOCKET,
+		                   SO_REUSEPORT,
+		                   (SOCK_OPT_TYPE)&on,
+		                   sizeof(on))
+		        != 0)) {
+			mg_cry_ctx_internal(
+			    phys_ctx,
+			    "cannot set socket option SO_REUSEPORT (entry %i)",
+			    portsTotal);
+		}
+#endif
+
 #if defined(USE_X_DOM_SOCKET)
 		if (ip_version == 99) {
 			/* Unix domain socket */
@@ -16489,6 +17128,186 @@ set_ports_option(struct mg_context *phys_ctx)
 }
 
 
+#if defined(MULTI_ACCEPTOR)
+/* Open another listening socket for the TCP port of orig. Both sockets have
+ * SO_REUSEPORT set, so the kernel spreads new connections over them. */
+static int
+acceptor_copy_socket(struct mg_context *ctx,
+                     const struct socket *orig,
+                     struct socket *so)
+{
+	int on = 1;
+	socklen_t len;
+#if defined(USE_IPV6)
+	int v6only = 0;
+	socklen_t optlen = sizeof(v6only);
+#endif
+
+	*so = *orig;
+	if (so->lsa.sa.sa_family == AF_INET) {
+		len = sizeof(so->lsa.sin);
+	}
+#if defined(USE_IPV6)
+	else if (so->lsa.sa.sa_family == AF_INET6) {
+		len = sizeof(so->lsa.sin6);
+	}
+#endif
+	else {
+		/* Unix domain sockets stay with acceptor 0 */
+		so->sock = INVALID_SOCKET;
+		return 0;
+	}
+
+	so->sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, 6);
+	if (so->sock == INVALID_SOCKET) {
+		mg_cry_ctx_internal(ctx,
+		                    "cannot create acceptor socket: %d (%s)",
+		                    (int)ERRNO,
+		                    strerror(ERRNO));
+		return 0;
+	}
+
+#if defined(USE_IPV6)
+	if ((so->lsa.sa.sa_family == AF_INET6)
+	    && (getsockopt(
+	            orig->sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &optlen)
+	        == 0)) {
+		(void)setsockopt(
+		    so->sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+	}
+#endif
+
+	/* lsa holds the bound port, also if the port option was 0.
+	 * The backlog option was checked by set_ports_option. */
+	if ((setsockopt(so->sock,
+	                SOL_SOCKET,
+	                SO_REUSEADDR,
+	                (SOCK_OPT_TYPE)&on,
+	                sizeof(on))
+	     != 0)
+	    || (setsockopt(so->sock,
+	                   SOL_SOCKET,
+	                   SO_REUSEPORT,
+	                   (SOCK_OPT_TYPE)&on,
+	                   sizeof(on))
+	        != 0)
+	    || (bind(so->sock, &so->lsa.sa, len) != 0)
+	    || (listen(so->sock,
+	               (int)strtol(ctx->dd.config[LISTEN_BACKLOG_SIZE], NULL, 10))
+	        != 0)) {
+		mg_cry_ctx_internal(ctx,
+		                    "cannot set up acceptor socket for port %d: %d (%s)",
+		                    (int)ntohs(USA_IN_PORT_UNSAFE(&so->lsa)),
+		                    (int)ERRNO,
+		                    strerror(ERRNO));
+		closesocket(so->sock);
+		so->sock = INVALID_SOCKET;
+		return 0;
+	}
+
+	set_close_on_exec(so->sock, NULL, ctx);
+	set_non_blocking_mode(so->sock);
+	return 1;
+}
+
+
+/* Close the sockets an acceptor opened itself */
+static void
+acceptor_close_sockets(struct mg_acceptor *acc)
+{
+	unsigned int i;
+	if (acc->own_sockets) {
+		for (i = 0; i < acc->num_sockets; i++) {
+			closesocket(acc->sockets[i].sock);
+		}
+		mg_free(acc->sockets);
+		acc->own_sockets = 0;
+	}
+	acc->sockets = NULL;
+	acc->num_sockets = 0;
+}
+
+
+/* Set up the acceptors for the "acceptor_threads" option. Called after
+ * set_ports_option. Acceptor 0 takes the sockets from there, the others
+ * get copies of the TCP sockets. If copies cannot be opened, fewer
+ * acceptors are used. */
+static void
+acceptors_init(struct mg_context *ctx)
+{
+	int want = acceptor_threads_option(ctx);
+	struct mg_acceptor *acc;
+	unsigned int i;
+
+	ctx->acceptors = (struct mg_acceptor *)
+	    mg_calloc_ctx((size_t)want, sizeof(ctx->acceptors[0]), ctx);
+	if (ctx->acceptors == NULL) {
+		mg_cry_ctx_internal(ctx, "%s", "Out of memory");
+		return;
+	}
+
+	for (; (int)ctx->num_acceptors < want; ctx->num_acceptors++) {
+		acc = &ctx->acceptors[ctx->num_acceptors];
+		acc->ctx = ctx;
+		acc->epfd = -1;
+		acc->sample_time = mg_get_current_time_ns();
+		if (ctx->num_acceptors == 0) {
+			acc->sockets = ctx->listening_sockets;
+			acc->num_sockets = ctx->num_listening_sockets;
+			continue;
+		}
+
+		acc->sockets = (struct socket *)
+		    mg_calloc_ctx(ctx->num_listening_sockets,
+		                  sizeof(acc->sockets[0]),
+		                  ctx);
+		if (acc->sockets == NULL) {
+			break;
+		}
+		acc->own_sockets = 1;
+		for (i = 0; i < ctx->num_listening_sockets; i++) {
+			if (acceptor_copy_socket(ctx,
+			                         &ctx->listening_sockets[i],
+			                         &acc->sockets[acc->num_sockets])) {
+				acc->num_sockets++;
+			}
+		}
+		if (acc->num_sockets == 0) {
+			acceptor_close_sockets(acc);
+			break;
+		}
+	}
+
+	if ((int)ctx->num_acceptors < want) {
+		mg_cry_ctx_internal(ctx,
+		                    "Using %u of %d acceptor threads",
+		                    ctx->num_acceptors,
+		                    want);
+	}
+	if (ctx->num_acceptors > 1) {
+		/* Acceptor threads accept until EAGAIN */
+		for (i = 0; i < ctx->num_listening_sockets; i++) {
+			set_non_blocking_mode(ctx->listening_sockets[i].sock);
+		}
+	}
+}
+
+
+/* Release the acceptors, after their threads stopped */
+static void
+acceptors_free(struct mg_context *ctx)
+{
+	unsigned int i;
+	for (i = 0; i < ctx->num_acceptors; i++) {
+		acceptor_close_sockets(&ctx->acceptors[i]);
+	}
+	mg_free(ctx->acceptors);
+	ctx->acceptors = NULL;
+	ctx->num_acceptors = 0;
+}
+#endif
+
+
 static const char *
 header_val(const struct mg_connection *conn, const char *header)
 {
@@ -16502,6 +17321,10 @@ header_val(const struct mg_connection *conn, const char *header)
 }
 
 
+/* Access log writer thread */
+#include "access_log.inl"
+
+
 #if defined(MG_EXTERNAL_FUNCTION_log_access)
 #include "external_log_access.inl"
 #elif !defined(NO_FILESYSTEMS)
@@ -16521,6 +17344,7 @@ log_access(const struct mg_connection *conn)
 
 	const char *referer;
 	const char *user_agent;
+	struct mg_alog_ring *ring = NULL;
 
 	char log_buf[4096];
 
@@ -16574,7 +17398,14 @@ log_access(const struct mg_connection *conn)
 	}
 #endif
 
-	if (conn->dom_ctx->config[ACCESS_LOG_FILE] != NULL) {
+	fi.access.fp = NULL;
+#if defined(ASYNC_ACCESS_LOG)
+	if (conn->dom_ctx == &conn->phys_ctx->dd) {
+		/* Set if the writer thread writes the file */
+		ring = conn->access_log_ring;
+	}
+#endif
+	if ((conn->dom_ctx->config[ACCESS_LOG_FILE] != NULL) && (ring == NULL)) {
 		if (mg_fopen(conn,
 		             conn->dom_ctx->config[ACCESS_LOG_FILE],
 		             MG_FOPEN_MODE_APPEND,
@@ -16582,13 +17413,11 @@ log_access(const struct mg_connection *conn)
 		    == 0) {
 			fi.access.fp = NULL;
 		}
-	} else {
-		fi.access.fp = NULL;
 	}
 
 	/* Log is written to a file and/or a callback. If both are not set,
 	 * executing the rest of the function is pointless. */
-	if ((fi.access.fp == NULL)
+	if ((fi.access.fp == NULL) && (ring == NULL)
 	    && (conn->phys_ctx->callbacks.log_access == NULL)) {
 		return;
 	}
@@ -16644,6 +17473,12 @@ log_access(const struct mg_connection *conn)
 	}
 
 	/* Store in file */
+#if defined(ASYNC_ACCESS_LOG)
+	if (ring != NULL) {
+		(void)access_log_push(ring, log_buf);
+		return;
+	}
+#endif
 	if (fi.access.fp) {
 		int ok = 1;
 		flockfile(fi.access.fp);
@@ -19150,6 +19985,9 @@ get_message(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *err)
 		}
 		return 0;
 	}
+	/* req_time includes the wait for the next request of a keep-alive
+	 * connection */
+	clock_gettime(CLOCK_MONOTONIC, &(conn->req_read_time));
 	return 1;
 }
 
@@ -19166,6 +20004,14 @@ get_request(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *err)
 		return 0;
 	}
 
+#if defined(USE_HTTP2)
+	if (is_http2_prior_knowledge(conn)) {
+		/* Not a HTTP/1.x request, but the HTTP/2 connection preface */
+		conn->protocol_type = PROTOCOL_TYPE_HTTP2;
+		return 1;
+	}
+#endif
+
 	if (parse_http_request(conn->buf, conn->buf_size, &conn->request_info)
 	    <= 0) {
 		mg_snprintf(conn,
@@ -19196,7 +20042,7 @@ get_request(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *err)
 	                      conn->request_info.num_headers,
 	                      "Accept-Encoding"))
 	     != NULL)
-	    && strstr(cl, "gzip")) {
+	    && header_accepts_gzip(cl)) {
 		conn->accept_gzip = 1;
 	}
 #endif
@@ -19937,6 +20783,14 @@ process_new_connection(struct mg_connection *conn)
 				mg_send_http_error(conn, reqerr, "%s", ebuf);
 			}
 
+#if defined(USE_HTTP2)
+		} else if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
+			/* Cleartext HTTP/2 with prior knowledge: the connection
+			 * continues with HTTP/2 frames */
+			process_http2_prior_knowledge(conn);
+			break;
+#endif
+
 		} else if (strcmp(ri->http_version, "1.0")
 		           && strcmp(ri->http_version, "1.1")) {
 			/* HTTP/2 is not allowed here */
@@ -19995,12 +20849,17 @@ process_new_connection(struct mg_connection *conn)
 			conn->protocol_type = should_switch_to_protocol(conn);
 
 			if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
-				/* This will occur, if a HTTP/1.1 request should be upgraded
-				 * to HTTP/2 - but not if HTTP/2 is negotiated using ALPN.
-				 * Since most (all?) major browsers only support HTTP/2 using
-				 * ALPN, this is hard to test and very low priority.
-				 * Deactivate it (at least for now).
-				 */
+				/* A HTTP/1.1 request should be upgraded to HTTP/2 ("h2c").
+				 * With TLS, HTTP/2 is negotiated using ALPN instead. */
+#if defined(USE_HTTP2)
+				if (is_http2_upgrade_acceptable(conn)) {
+					/* This request becomes HTTP/2 stream 1, the connection
+					 * continues with HTTP/2 frames */
+					process_http2_upgrade(conn);
+					break;
+				}
+#endif
+				/* Otherwise the request is answered using HTTP/1.1 */
 				conn->protocol_type = PROTOCOL_TYPE_HTTP1;
 			}
 		}
@@ -20169,23 +21028,281 @@ consume_socket(struct mg_context *ctx,
 	return 0;
 }
 
-#else /* ALTERNATIVE_QUEUE */
+#elif defined(LOCKFREE_QUEUE)
+
+/* Bounded multi-producer multi-consumer ring (D. Vyukov). Cell i of lap n
+ * has seq == i + n * sq_size while it is free for the producer of position
+ * i + n * sq_size, and seq == that position + 1 once it holds a socket. A
+ * thread claims a position with a CAS on sq_head or sq_tail and then owns
+ * the cell until it publishes the new seq. */
+
+static void
+sq_futex_wait(int *addr, int val)
+{
+	/* Returns at once if *addr != val, or on a wakeup or signal: callers
+	 * recheck. */
+	(void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+
+static void
+sq_futex_wake(int *addr, int count)
+{
+	(void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
 
-/* Worker threads take accepted socket from the queue */
 static int
-consume_socket(struct mg_context *ctx,
-               struct socket *sp,
-               int thread_index,
-               int counter_was_preincremented)
+sq_alloc(struct mg_context *ctx, int size)
 {
-	(void)thread_index;
+	uint64_t cells = 1, i;
 
-	DEBUG_TRACE("%s", "going idle");
-	(void)pthread_mutex_lock(&ctx->thread_mutex);
-	if (counter_was_preincremented
-	    == 0) { /* first call only: the master-thread pre-incremented this
-		           before he spawned us */
-		ctx->idle_worker_thread_count++;
+	/* Round up to a power of 2, so a position maps to a cell by masking */
+	while (cells < (uint64_t)size) {
+		cells <<= 1;
+	}
+	ctx->sq_cells =
+	    (struct sq_cell *)mg_calloc((size_t)cells, sizeof(struct sq_cell));
+	if (ctx->sq_cells == NULL) {
+		return 0;
+	}
+	for (i = 0; i < cells; i++) {
+		ctx->sq_cells[i].seq = i;
+	}
+	ctx->sq_mask = cells - 1;
+	ctx->sq_size = (int)cells;
+	ctx->sq_head = 0;
+	ctx->sq_tail = 0;
+	ctx->sq_full = 0;
+	ctx->sq_empty = 0;
+	ctx->sq_idle_waiting = 0;
+	ctx->sq_producers_waiting = 0;
+	return 1;
+}
+
+
+static int
+sq_filled(const struct mg_context *ctx)
+{
+	uint64_t tail = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+	return (head > tail) ? (int)(head - tail) : 0;
+}
+
+
+/* Returns 1 if the socket was queued, 0 if the queue is full */
+static int
+sq_push(struct mg_context *ctx, const struct socket *sp)
+{
+	uint64_t pos = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+	struct sq_cell *cell;
+
+	for (;;) {
+		int64_t dif;
+		cell = &ctx->sq_cells[pos & ctx->sq_mask];
+		dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ctx->sq_head,
+			                                &pos,
+			                                pos + 1,
+			                                1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return 0; /* the consumer of the previous lap is not done */
+		} else {
+			pos = __atomic_load_n(&ctx->sq_head, __ATOMIC_RELAXED);
+		}
+	}
+	cell->sock = *sp;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+/* Returns 1 if a socket was taken, 0 if the queue is empty */
+static int
+sq_pop(struct mg_context *ctx, struct socket *sp)
+{
+	uint64_t pos = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+	struct sq_cell *cell;
+
+	for (;;) {
+		int64_t dif;
+		cell = &ctx->sq_cells[pos & ctx->sq_mask];
+		dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)
+		                - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ctx->sq_tail,
+			                                &pos,
+			                                pos + 1,
+			                                1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return 0; /* the producer has not filled this cell yet */
+		} else {
+			pos = __atomic_load_n(&ctx->sq_tail, __ATOMIC_RELAXED);
+		}
+	}
+	*sp = cell->sock;
+	__atomic_store_n(&cell->seq, pos + ctx->sq_mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+/* Wake all threads sleeping on the queue, e.g. to let them see stop_flag */
+static void
+sq_wake_all(struct mg_context *ctx)
+{
+	__atomic_add_fetch(&ctx->sq_full, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ctx->sq_empty, 1, __ATOMIC_SEQ_CST);
+	sq_futex_wake(&ctx->sq_full, INT_MAX);
+	sq_futex_wake(&ctx->sq_empty, INT_MAX);
+}
+
+
+/* Close sockets still queued when the server stops */
+static void
+sq_drain(struct mg_context *ctx)
+{
+	struct socket so;
+	while (sq_pop(ctx, &so)) {
+		closesocket(so.sock);
+	}
+}
+
+
+/* Worker threads take accepted socket from the queue */
+static int
+consume_socket(struct mg_context *ctx,
+               struct socket *sp,
+               int thread_index,
+               int counter_was_preincremented)
+{
+	int got = 0;
+	(void)thread_index;
+
+	DEBUG_TRACE("%s", "going idle");
+	if (counter_was_preincremented
+	    == 0) { /* first call only: the master-thread pre-incremented this
+		           before he spawned us */
+		__atomic_add_fetch(&ctx->idle_worker_thread_count,
+		                   1,
+		                   __ATOMIC_SEQ_CST);
+	}
+
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		int ticket;
+		if (sq_pop(ctx, sp)) {
+			got = 1;
+			break;
+		}
+		/* Announce the wait, then look again: a producer either sees
+		 * sq_idle_waiting and wakes us, or its socket is visible to the
+		 * second sq_pop, or it changed sq_full before the futex wait. */
+		ticket = __atomic_load_n(&ctx->sq_full, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&ctx->sq_idle_waiting, 1, __ATOMIC_SEQ_CST);
+		if (sq_pop(ctx, sp)) {
+			__atomic_sub_fetch(&ctx->sq_idle_waiting, 1, __ATOMIC_SEQ_CST);
+			got = 1;
+			break;
+		}
+		if (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			sq_futex_wait(&ctx->sq_full, ticket);
+		}
+		__atomic_sub_fetch(&ctx->sq_idle_waiting, 1, __ATOMIC_SEQ_CST);
+	}
+
+	/* A cell is free again: let a blocked producer in. With several
+	 * acceptor threads more than one may sleep; each freed cell wakes one
+	 * of them, and one that has not slept yet sees sq_empty change. */
+	__atomic_add_fetch(&ctx->sq_empty, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->sq_producers_waiting, __ATOMIC_SEQ_CST) > 0) {
+		sq_futex_wake(&ctx->sq_empty, 1);
+	}
+
+	__atomic_sub_fetch(&ctx->idle_worker_thread_count, 1, __ATOMIC_SEQ_CST);
+
+	if (!got) {
+		return 0;
+	}
+	if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		/* must consume */
+		closesocket(sp->sock);
+		return 0;
+	}
+	DEBUG_TRACE("grabbed socket %d, going busy", sp->sock);
+	return 1;
+}
+
+
+/* Master thread or acceptor threads add an accepted socket to the queue */
+static void
+produce_socket(struct mg_context *ctx, const struct socket *sp)
+{
+	int queue_filled;
+
+	while (!sq_push(ctx, sp)) {
+		int ticket;
+		if (!STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+			closesocket(sp->sock);
+			return;
+		}
+		/* Queue full: sleep until a worker takes a socket */
+		ticket = __atomic_load_n(&ctx->sq_empty, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&ctx->sq_producers_waiting, 1, __ATOMIC_SEQ_CST);
+#if defined(USE_SERVER_STATS)
+		ctx->sq_max_fill = ctx->sq_size;
+#endif
+		if (sq_filled(ctx) >= ctx->sq_size) {
+			sq_futex_wait(&ctx->sq_empty, ticket);
+		}
+		__atomic_sub_fetch(&ctx->sq_producers_waiting, 1, __ATOMIC_SEQ_CST);
+	}
+	DEBUG_TRACE("queued socket %d", sp ? sp->sock : -1);
+
+	queue_filled = sq_filled(ctx);
+#if defined(USE_SERVER_STATS)
+	if (queue_filled > ctx->sq_max_fill) {
+		ctx->sq_max_fill = queue_filled;
+	}
+#endif
+
+	__atomic_add_fetch(&ctx->sq_full, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->sq_idle_waiting, __ATOMIC_SEQ_CST) > 0) {
+		sq_futex_wake(&ctx->sq_full, 1);
+	}
+
+	/* Start another worker only if the idle ones cannot take all queued
+	 * sockets; checked here without taking thread_mutex. */
+	if (__atomic_load_n(&ctx->idle_worker_thread_count, __ATOMIC_SEQ_CST)
+	    <= (unsigned)queue_filled) {
+		(void)mg_start_worker_thread(ctx, 1);
+	}
+}
+
+#else /* ALTERNATIVE_QUEUE */
+
+/* Worker threads take accepted socket from the queue */
+static int
+consume_socket(struct mg_context *ctx,
+               struct socket *sp,
+               int thread_index,
+               int counter_was_preincremented)
+{
+	(void)thread_index;
+
+	DEBUG_TRACE("%s", "going idle");
+	(void)pthread_mutex_lock(&ctx->thread_mutex);
+	if (counter_was_preincremented
+	    == 0) { /* first call only: the master-thread pre-incremented this
+		           before he spawned us */
+		ctx->idle_worker_thread_count++;
 	}
 
 	/* If the queue is empty, wait. We're idle at this point. */
@@ -20318,6 +21435,14 @@ worker_thread_run(struct mg_connection *conn)
 	}
 	conn->buf_size = (int)ctx->max_request_size;
 
+#if defined(ASYNC_ACCESS_LOG)
+	conn->access_log_ring = access_log_attach(ctx, thread_index);
+#endif
+#if defined(REQUEST_METRICS)
+	conn->metrics = metrics_attach(ctx, thread_index);
+#endif
+	conn->trace = trace_attach(ctx);
+
 	conn->dom_ctx = &(ctx->dd); /* Use default domain and default host */
 
 	conn->tls_user_ptr = tls.user_ptr; /* store ptr for quick access */
@@ -20343,6 +21468,9 @@ worker_thread_run(struct mg_connection *conn)
 	    ctx, &conn->client, thread_index, first_call_to_consume_socket)) {
 		first_call_to_consume_socket = 0;
 
+		conn->queue_shed = admission_check_queue_wait(ctx, &conn->client);
+		trace_connection(conn);
+
 		/* New connections must start with new protocol negotiation */
 		tls.alpn_proto = NULL;
 
@@ -20501,6 +21629,12 @@ worker_thread_run(struct mg_connection *conn)
 	conn->buf_size = 0;
 	mg_free(conn->buf);
 	conn->buf = NULL;
+	mg_free(conn->trace);
+	conn->trace = NULL;
+
+#if defined(USE_ZLIB)
+	response_deflate_free(conn);
+#endif
 
 	/* Free cleaned URI (if any) */
 	if (conn->request_info.local_uri != conn->request_info.local_uri_raw) {
@@ -20543,8 +21677,10 @@ worker_thread(void *thread_func_param)
 
 
 /* This is an internal function, thus all arguments are expected to be
- * valid - a NULL check is not required. */
-static void
+ * valid - a NULL check is not required.
+ * Returns 1 if a connection was passed to the workers, 2 if one was
+ * accepted but refused (ACL or load shedding), 0 if there was none. */
+static int
 accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 {
 	struct socket so;
@@ -20557,6 +21693,7 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 
 	if ((so.sock = accept(listener->sock, &so.rsa.sa, &len))
 	    == INVALID_SOCKET) {
+		return 0;
 	} else if (check_acl(ctx, &so.rsa) != 1) {
 		sockaddr_to_string(src_addr, sizeof(src_addr), &so.rsa);
 		mg_cry_ctx_internal(ctx,
@@ -20564,6 +21701,7 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 		                    __func__,
 		                    src_addr);
 		closesocket(so.sock);
+		return 2;
 	} else {
 		/* Put so socket structure into the queue */
 		DEBUG_TRACE("Accepted socket %d", (int)so.sock);
@@ -20627,9 +21765,180 @@ accept_new_connection(const struct socket *listener, struct mg_context *ctx)
 		set_non_blocking_mode(so.sock);
 
 		so.in_use = 0;
+		so.accept_time = mg_get_monotonic_time_ns();
+		if (admission_shed_on_accept(ctx, &so)) {
+			return 2;
+		}
 		produce_socket(ctx, &so);
 	}
+	return 1;
+}
+
+
+#if defined(MULTI_ACCEPTOR)
+/* Update the accept rate of an acceptor, called by its thread */
+static void
+acceptor_sample(struct mg_acceptor *acc)
+{
+	uint64_t now = mg_get_current_time_ns();
+	uint64_t dt = now - acc->sample_time;
+	int64_t accepted;
+
+	if (dt < (uint64_t)ACCEPTOR_SAMPLE_MS * 1000000u) {
+		return;
+	}
+	accepted = __atomic_load_n(&acc->accepted, __ATOMIC_RELAXED);
+	__atomic_store_n(&acc->accept_rate,
+	                 (int64_t)((double)(accepted - acc->sample_accepted) * 1e9
+	                           / (double)dt),
+	                 __ATOMIC_RELAXED);
+	acc->sample_accepted = accepted;
+	acc->sample_time = now;
+}
+
+
+static void *
+acceptor_thread(void *thread_func_param)
+{
+	struct mg_acceptor *acc = (struct mg_acceptor *)thread_func_param;
+	struct mg_context *ctx = acc->ctx;
+	struct mg_workerTLS tls;
+	struct epoll_event events[16];
+	int i, n, k;
+
+	mg_set_thread_name("accept");
+
+	memset(&tls, 0, sizeof(tls));
+	tls.is_master = 1;
+	tls.thread_idx = (unsigned)mg_atomic_inc(&thread_idx_max);
+	pthread_setspecific(sTlsKey, &tls);
+
+	if (ctx->callbacks.init_thread) {
+		/* Acceptor threads are internal threads (type 2) */
+		tls.user_ptr = ctx->callbacks.init_thread(ctx, 2);
+	}
+
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+		n = epoll_wait(acc->epfd,
+		               events,
+		               (int)ARRAY_SIZE(events),
+		               ACCEPTOR_SAMPLE_MS);
+		for (i = 0; i < n; i++) {
+			unsigned int idx = events[i].data.u32;
+			int rc;
+			if (idx >= acc->num_sockets) {
+				continue; /* thread_shutdown_notification_socket */
+			}
+			/* The sockets are level triggered: what is left after a
+			 * batch is reported again by the next epoll_wait. Refused
+			 * connections are not counted. */
+			for (k = 0; (k < ACCEPTOR_BATCH)
+			            && STOP_FLAG_IS_ZERO(&ctx->stop_flag)
+			            && (rc = accept_new_connection(&acc->sockets[idx],
+			                                           ctx))
+			                   != 0;
+			     k++) {
+				if (rc == 1) {
+					__atomic_add_fetch(&acc->accepted, 1, __ATOMIC_RELAXED);
+				}
+			}
+		}
+		acceptor_sample(acc);
+	}
+
+	if (ctx->callbacks.exit_thread) {
+		ctx->callbacks.exit_thread(ctx, 2, tls.user_ptr);
+	}
+	pthread_setspecific(sTlsKey, NULL);
+	return NULL;
+}
+
+
+/* Start the thread of an acceptor. Returns 0 on error. */
+static int
+acceptor_start(struct mg_acceptor *acc)
+{
+	struct mg_context *ctx = acc->ctx;
+	struct epoll_event ev;
+	unsigned int i;
+
+	acc->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (acc->epfd < 0) {
+		return 0;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	for (i = 0; i <= acc->num_sockets; i++) {
+		/* The last one makes mg_stop wake up the thread */
+		int fd = (i < acc->num_sockets)
+		             ? (int)acc->sockets[i].sock
+		             : ctx->thread_shutdown_notification_socket;
+		ev.data.u32 = i;
+		if (epoll_ctl(acc->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			break;
+		}
+	}
+	if ((i <= acc->num_sockets)
+	    || (mg_start_thread_with_id(acceptor_thread, acc, &acc->thread_id)
+	        != 0)) {
+		close(acc->epfd);
+		acc->epfd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Run the acceptor threads until mg_stop is called. Returns at once if
+ * acceptor 0 cannot be started: then the master thread accepts for it. */
+static void
+acceptors_run(struct mg_context *ctx)
+{
+	struct mg_pollfd pfd;
+	unsigned int i;
+
+	for (i = 0; i < ctx->num_acceptors; i++) {
+		if (!acceptor_start(&ctx->acceptors[i])) {
+			mg_cry_ctx_internal(ctx,
+			                    "Cannot start acceptor thread %u: %s",
+			                    i,
+			                    strerror(ERRNO));
+			/* Let the kernel pass its connections to the others */
+			acceptor_close_sockets(&ctx->acceptors[i]);
+		}
+	}
+	if (ctx->acceptors[0].epfd < 0) {
+		ctx->acceptors[0].sockets = ctx->listening_sockets;
+		ctx->acceptors[0].num_sockets = ctx->num_listening_sockets;
+		return;
+	}
+
+	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+#if defined(USE_ZLIB)
+		gzip_update_level(ctx);
+#endif
+		pfd.fd = ctx->thread_shutdown_notification_socket;
+		pfd.events = POLLIN;
+		(void)mg_poll(&pfd, 1, SOCKET_TIMEOUT_QUANTUM, &(ctx->stop_flag));
+	}
+}
+
+
+/* Join the acceptor threads and close their sockets */
+static void
+acceptors_exit(struct mg_context *ctx)
+{
+	unsigned int i;
+	for (i = 0; i < ctx->num_acceptors; i++) {
+		if (ctx->acceptors[i].epfd >= 0) {
+			mg_join_thread(ctx->acceptors[i].thread_id);
+			close(ctx->acceptors[i].epfd);
+			ctx->acceptors[i].epfd = -1;
+		}
+	}
+	acceptors_free(ctx);
 }
+#endif
 
 
 static void
@@ -20711,9 +22020,19 @@ master_thread_run(struct mg_context *ctx)
 	/* Server starts *now* */
 	ctx->start_time = time(NULL);
 
+#if defined(MULTI_ACCEPTOR)
+	if (ctx->num_acceptors > 1) {
+		acceptors_run(ctx);
+	}
+#endif
+
 	/* Server accept loop */
 	pfd = ctx->listening_socket_fds;
 	while (STOP_FLAG_IS_ZERO(&ctx->stop_flag)) {
+#if defined(USE_ZLIB)
+		/* Adapt the compression level of dynamic content to the load */
+		gzip_update_level(ctx);
+#endif
 		for (i = 0; i < ctx->num_listening_sockets; i++) {
 			pfd[i].fd = ctx->listening_sockets[i].sock;
 			pfd[i].events = POLLIN;
@@ -20740,17 +22059,35 @@ master_thread_run(struct mg_context *ctx)
 				 * Therefore, we're checking pfd[i].revents & POLLIN, not
 				 * pfd[i].revents == POLLIN. */
 				if (STOP_FLAG_IS_ZERO(&ctx->stop_flag)
-				    && (pfd[i].revents & POLLIN)) {
-					accept_new_connection(&ctx->listening_sockets[i], ctx);
+				    && (pfd[i].revents & POLLIN)
+				    && (accept_new_connection(&ctx->listening_sockets[i],
+				                              ctx)
+				        == 1)) {
+#if defined(MULTI_ACCEPTOR)
+					/* The master thread is acceptor 0 */
+					if (ctx->acceptors) {
+						__atomic_add_fetch(&ctx->acceptors[0].accepted,
+						                   1,
+						                   __ATOMIC_RELAXED);
+					}
+#endif
 				}
 			}
 		}
+#if defined(MULTI_ACCEPTOR)
+		if (ctx->acceptors) {
+			acceptor_sample(&ctx->acceptors[0]);
+		}
+#endif
 	}
 
 	/* Here stop_flag is 1 - Initiate shutdown. */
 	DEBUG_TRACE("%s", "stopping workers");
 
 	/* Stop signal received: somebody called mg_stop. Quit. */
+#if defined(MULTI_ACCEPTOR)
+	acceptors_exit(ctx);
+#endif
 	close_all_listening_sockets(ctx);
 
 	/* Wakeup workers that are waiting for connections to handle. */
@@ -20758,6 +22095,8 @@ master_thread_run(struct mg_context *ctx)
 	for (i = 0; i < ctx->spawned_worker_threads; i++) {
 		event_signal(ctx->client_wait_events[i]);
 	}
+#elif defined(LOCKFREE_QUEUE)
+	sq_wake_all(ctx);
 #else
 	(void)pthread_mutex_lock(&ctx->thread_mutex);
 	pthread_cond_broadcast(&ctx->sq_full);
@@ -20771,6 +22110,13 @@ master_thread_run(struct mg_context *ctx)
 			mg_join_thread(ctx->worker_threadids[i]);
 		}
 	}
+#if defined(LOCKFREE_QUEUE)
+	sq_drain(ctx);
+#endif
+#if defined(ASYNC_ACCESS_LOG)
+	/* After the workers: their last lines are written */
+	access_log_stop(ctx);
+#endif
 
 #if defined(USE_LUA)
 	/* Free Lua state of lua background task */
@@ -20851,6 +22197,7 @@ free_context(struct mg_context *ctx)
 {
 	int i;
 	struct mg_handler_info *tmp_rh;
+	struct mg_domain_context *dom;
 
 	if (ctx == NULL) {
 		return;
@@ -20874,12 +22221,26 @@ free_context(struct mg_context *ctx)
 		}
 		mg_free(ctx->client_wait_events);
 	}
+#elif defined(LOCKFREE_QUEUE)
+	mg_free(ctx->sq_cells);
 #else
 	(void)pthread_cond_destroy(&ctx->sq_empty);
 	(void)pthread_cond_destroy(&ctx->sq_full);
 	mg_free(ctx->squeue);
 #endif
 
+#if defined(MULTI_ACCEPTOR)
+	acceptors_free(ctx);
+#endif
+	admission_free(ctx);
+#if defined(ASYNC_ACCESS_LOG)
+	access_log_free(ctx);
+#endif
+#if defined(REQUEST_METRICS)
+	metrics_free(ctx);
+#endif
+	trace_free(ctx);
+
 	/* Destroy other context global data structures mutex */
 	(void)pthread_mutex_destroy(&ctx->nonce_mutex);
 
@@ -20906,6 +22267,10 @@ free_context(struct mg_context *ctx)
 	}
 
 	/* Deallocate request handlers */
+	for (dom = &(ctx->dd); dom != NULL; dom = dom->next) {
+		routes_free(dom->routes);
+		dom->routes = NULL;
+	}
 	while (ctx->dd.handlers) {
 		tmp_rh = ctx->dd.handlers;
 		ctx->dd.handlers = tmp_rh->next;
@@ -21159,10 +22524,19 @@ mg_start_worker_thread(struct mg_context *ctx, int only_if_no_idle_threads)
 		return -1; /* Oops, we hit our worker-thread limit!  No more worker
 		              threads, ever! */
 	}
+#if defined(MULTI_ACCEPTOR)
+	if ((only_if_no_idle_threads) && (ctx->num_acceptors > 1)) {
+		return -1; /* All workers were started by mg_start2 */
+	}
+#endif
 
 	(void)pthread_mutex_lock(&ctx->thread_mutex);
 #if defined(ALTERNATIVE_QUEUE)
 	if ((only_if_no_idle_threads) && (ctx->idle_worker_thread_count > 0)) {
+#elif defined(LOCKFREE_QUEUE)
+	if ((only_if_no_idle_threads)
+	    && (__atomic_load_n(&ctx->idle_worker_thread_count, __ATOMIC_SEQ_CST)
+	        > (unsigned)sq_filled(ctx))) {
 #else
 	if ((only_if_no_idle_threads)
 	    && (ctx->idle_worker_thread_count
@@ -21172,9 +22546,14 @@ mg_start_worker_thread(struct mg_context *ctx, int only_if_no_idle_threads)
 		return -2; /* There are idle threads available, so no need to spawn a
 		              new worker thread now */
 	}
+#if defined(LOCKFREE_QUEUE)
+	/* Workers change the count without thread_mutex */
+	__atomic_add_fetch(&ctx->idle_worker_thread_count, 1, __ATOMIC_SEQ_CST);
+#else
 	ctx->idle_worker_thread_count++; /* we do this here to avoid a race
 	                                    condition while the thread is starting
 	                                    up */
+#endif
 	(void)pthread_mutex_unlock(&ctx->thread_mutex);
 
 	ctx->worker_connections[i].phys_ctx = ctx;
@@ -21186,9 +22565,15 @@ mg_start_worker_thread(struct mg_context *ctx, int only_if_no_idle_threads)
 		                                  the table */
 		DEBUG_TRACE("Started worker_thread #%i", ctx->spawned_worker_threads);
 	} else {
+#if defined(LOCKFREE_QUEUE)
+		__atomic_sub_fetch(&ctx->idle_worker_thread_count,
+		                   1,
+		                   __ATOMIC_SEQ_CST); /* whoops, roll-back on error */
+#else
 		(void)pthread_mutex_lock(&ctx->thread_mutex);
 		ctx->idle_worker_thread_count--; /* whoops, roll-back on error */
 		(void)pthread_mutex_unlock(&ctx->thread_mutex);
+#endif
 	}
 	return ret;
 }
@@ -21266,7 +22651,7 @@ mg_start2(struct mg_init_data *init, struct mg_error_data *error)
 	pthread_setspecific(sTlsKey, &tls);
 
 	ok = (0 == pthread_mutex_init(&ctx->thread_mutex, &pthread_mutex_attr));
-#if !defined(ALTERNATIVE_QUEUE)
+#if !defined(ALTERNATIVE_QUEUE) && !defined(LOCKFREE_QUEUE)
 	ok &= (0 == pthread_cond_init(&ctx->sq_empty, NULL));
 	ok &= (0 == pthread_cond_init(&ctx->sq_full, NULL));
 	ctx->sq_blocked = 0;
@@ -21319,7 +22704,9 @@ mg_start2(struct mg_init_data *init, struct mg_error_data *error)
 	}
 	ctx->user_data = ((init != NULL) ? (init->user_data) : (NULL));
 	ctx->dd.handlers = NULL;
+	ctx->dd.routes = NULL;
 	ctx->dd.next = NULL;
+	ctx->route_epoch = 1;
 
 #if defined(USE_LUA)
 	lua_ctx_init(ctx);
@@ -21425,9 +22812,13 @@ mg_start2(struct mg_init_data *init, struct mg_error_data *error)
 		pthread_setspecific(sTlsKey, NULL);
 		return NULL;
 	}
+#if defined(LOCKFREE_QUEUE)
+	if (!sq_alloc(ctx, itmp)) {
+#else
 	ctx->squeue =
 	    (struct socket *)mg_calloc((unsigned int)itmp, sizeof(struct socket));
 	if (ctx->squeue == NULL) {
+#endif
 		mg_cry_ctx_internal(ctx,
 		                    "Out of memory: Cannot allocate %s",
 		                    config_options[CONNECTION_QUEUE_SIZE].name);
@@ -21446,9 +22837,31 @@ mg_start2(struct mg_init_data *init, struct mg_error_data *error)
 		pthread_setspecific(sTlsKey, NULL);
 		return NULL;
 	}
+#if !defined(LOCKFREE_QUEUE)
 	ctx->sq_size = itmp;
+#endif
 #endif
 
+	if (!admission_init(ctx)) {
+		mg_cry_ctx_internal(ctx,
+		                    "Out of memory: Cannot allocate %s",
+		                    config_options[REQUEST_RATE].name);
+		if (error != NULL) {
+			error->code = MG_ERROR_DATA_CODE_OUT_OF_MEMORY;
+			error->code_sub = (unsigned)sizeof(struct mg_rate_limiter);
+			mg_snprintf(NULL,
+			            NULL, /* No truncation check for error buffers */
+			            error->text,
+			            error->text_buffer_size,
+			            "Out of memory: Cannot allocate %s",
+			            config_options[REQUEST_RATE].name);
+		}
+
+		free_context(ctx);
+		pthread_setspecific(sTlsKey, NULL);
+		return NULL;
+	}
+
 	/* Worker thread count option */
 	workerthreadcount = atoi(ctx->dd.config[NUM_THREADS]);
 	prespawnthreadcount = atoi(ctx->dd.config[PRESPAWN_THREADS]);
@@ -21680,6 +23093,10 @@ mg_start2(struct mg_init_data *init, struct mg_error_data *error)
 		return NULL;
 	}
 
+#if defined(MULTI_ACCEPTOR)
+	acceptors_init(ctx);
+#endif
+
 #if !defined(_WIN32) && !defined(__ZEPHYR__)
 	if (!set_uid_option(ctx)) {
 		const char *err_msg = "Failed to run as configured user";
@@ -21891,6 +23308,24 @@ mg_start2(struct mg_init_data *init, struct mg_error_data *error)
 	ctx->callbacks.exit_context = exit_callback;
 	ctx->context_type = CONTEXT_SERVER; /* server context */
 
+#if defined(MULTI_ACCEPTOR)
+	/* Several acceptor threads produce sockets, but only one thread at a
+	 * time may call mg_start_worker_thread: start all workers now, and
+	 * none on demand. */
+	if (ctx->num_acceptors > 1) {
+		prespawnthreadcount = workerthreadcount;
+	}
+#endif
+
+#if defined(ASYNC_ACCESS_LOG)
+	/* Before the workers, which take their log ring when they start */
+	access_log_init(ctx);
+#endif
+#if defined(REQUEST_METRICS)
+	metrics_init(ctx);
+#endif
+	trace_init(ctx);
+
 	/* Start worker threads */
 	for (i = 0; (int)i < prespawnthreadcount; i++) {
 		/* worker_thread sets up the other fields */
@@ -22094,6 +23529,7 @@ mg_start_domain2(struct mg_context *ctx,
 	}
 
 	new_dom->handlers = ctx->dd.handlers;
+	new_dom->routes = NULL;
 	new_dom->next = NULL;
 	new_dom->nonce_count = 0;
 	new_dom->auth_nonce_mask = get_random() ^ (get_random() << 31);
@@ -22151,6 +23587,7 @@ mg_start_domain2(struct mg_context *ctx,
 
 		if (dom->next == NULL) {
 			dom->next = new_dom;
+			routes_update(ctx);
 			break;
 		}
 		dom = dom->next;
@@ -22706,11 +24143,23 @@ mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen)
 		            eol,
 		            ctx->sq_size,
 		            eol,
+#if defined(LOCKFREE_QUEUE)
+		            sq_filled(ctx),
+#else
 		            ctx->sq_head - ctx->sq_tail,
+#endif
 		            eol,
 		            ctx->sq_max_fill,
 		            eol,
+#if defined(LOCKFREE_QUEUE)
+		            (__atomic_load_n(&ctx->sq_producers_waiting,
+		                             __ATOMIC_RELAXED)
+		                     > 0
+		                 ? "true"
+		                 : "false"),
+#else
 		            (ctx->sq_blocked ? "true" : "false"),
+#endif
 		            eol);
 		context_info_length += mg_str_append(&buffer, end, block);
 #endif
@@ -22803,6 +24252,28 @@ mg_disable_connection_keep_alive(struct mg_connection *conn)
 }
 
 
+CIVETWEB_API int
+mg_should_keep_alive(const struct mg_connection *conn)
+{
+	if ((conn == NULL) || (conn->protocol_type != PROTOCOL_TYPE_HTTP1)
+	    || !should_keep_alive(conn)) {
+		return 0;
+	}
+
+	/* Same condition as in process_new_connection: the connection can only
+	 * be reused if the request body has been read completely, or is
+	 * completely buffered and can be discarded. */
+	if ((conn->content_len < 0) || (conn->request_len <= 0)) {
+		return 0;
+	}
+	if (conn->is_chunked) {
+		return (conn->is_chunked == 4);
+	}
+	return (conn->consumed_content == conn->content_len)
+	       || ((conn->request_len + conn->content_len) <= conn->data_len);
+}
+
+
 #if defined(MG_EXPERIMENTAL_INTERFACES)
 /* Get connection information. It can be printed or stored by the caller.
  * Return the size of available information. */
@@ -735,6 +735,116 @@ CIVETWEB_API int mg_get_server_ports(const struct mg_context *ctx,
                                      struct mg_server_port *ports);
 
 
+struct mg_acceptor_stat {
+	long long accepted;    /* connections passed to the workers since the
+	                          server started; refused ones are not counted */
+	long long accept_rate; /* connections per second, sampled every second */
+	int backlog;           /* connections waiting in the kernel accept queue */
+	int backlog_max;       /* size of the kernel accept queue */
+};
+
+/* Get the accept statistics of the acceptor threads (see the
+   "acceptor_threads" option). With a single acceptor, the master thread
+   is acceptor 0. The parameter max_stats is the size of the stats array.
+   This function returns the number of acceptors, which may be larger than
+   max_stats, or 0 if the statistics are not available (not on Linux). */
+CIVETWEB_API int mg_get_acceptor_stats(const struct mg_context *ctx,
+                                       struct mg_acceptor_stat *stats,
+                                       int max_stats);
+
+
+/* Admission control statistics, see the options "max_queue_wait_ms" and
+   "request_rate". */
+struct mg_admission_stat {
+	long long shed_queue_full; /* connections answered 503 on accept, since
+	                              the socket queue was full */
+	long long shed_queue_wait; /* requests answered 503, since they waited
+	                              longer than max_queue_wait_ms */
+	long long rate_limited;    /* requests answered 429 */
+	int queue_wait_ms;         /* smoothed time connections wait for a
+	                              worker */
+	int queue_depth;           /* connections waiting for a worker */
+	int queue_size;            /* size of the socket queue */
+};
+
+/* Get the admission control statistics of the server.
+   Return:
+     0 on success, -1 on a parameter error. */
+CIVETWEB_API int mg_get_admission_stats(const struct mg_context *ctx,
+                                        struct mg_admission_stat *stat);
+
+
+/* Access log statistics, see the option "access_log_file". */
+struct mg_access_log_stat {
+	long long lines;     /* lines written */
+	long long bytes;     /* bytes written */
+	long long dropped;   /* lines dropped, since the writer fell behind */
+	long long rotations; /* log files rotated */
+};
+
+/* Get the statistics of the access log writer thread.
+   Return:
+     0 on success, -1 if there is no access log, or the workers write it
+     themselves (compiled with NO_ASYNC_ACCESS_LOG or not with GCC). */
+CIVETWEB_API int mg_get_access_log_stats(const struct mg_context *ctx,
+                                         struct mg_access_log_stat *stat);
+
+
+/* Get the request metrics of the server in the Prometheus text format:
+   requests by handler URI and status class, a latency histogram for every
+   handler, and the worker threads and socket queue.
+   Parameters:
+     ctx: Context handle
+     buffer: Store the metrics here.
+     buflen: Length of buffer (including a byte required for a terminating 0).
+   Return:
+     Available size of the metrics, excluding a terminating 0, like
+     mg_get_context_info. -1 if there are no metrics (compiled with
+     NO_REQUEST_METRICS or not with GCC). */
+CIVETWEB_API int
+mg_get_metrics(const struct mg_context *ctx, char *buffer, int buflen);
+
+
+/* Request tracing, see the options "trace_sample" and "trace_slow_ms".
+   Mark the end of a stage of the current request: the stage took the time
+   since the previous stage ended. stage must be a string constant. Does
+   nothing if tracing is off. */
+CIVETWEB_API void mg_trace_stage(const struct mg_connection *conn,
+                                 const char *stage);
+
+
+/* Leave the current request out of tracing, neither kept as slow nor
+   sampled. For handlers of long-lived responses such as event streams,
+   which would always be slow. */
+CIVETWEB_API void mg_trace_skip(const struct mg_connection *conn);
+
+
+/* Get the recent traces of slow requests (slow != 0) or of sampled ones,
+   newest first, as JSON:
+     {"traces":[{"start_ms":..., "method":..., "uri":..., "status":...,
+                 "total_us":..., "stages":[{"stage":..., "start_us":...,
+                                            "us":...}, ...]}, ...]}
+   Return:
+     Available size of the traces, excluding a terminating 0, like
+     mg_get_context_info. -1 if tracing is off. */
+CIVETWEB_API int mg_get_traces(const struct mg_context *ctx,
+                               int slow,
+                               char *buffer,
+                               int buflen);
+
+
+/* Run action(arg) on the timer thread every period seconds, first after one
+   period, for as long as it returns 1 and the server runs. Actions share the
+   thread and should be short.
+   Return:
+     0 on success, -1 on error or if there is no timer thread (compiled
+     without USE_TIMERS). */
+CIVETWEB_API int mg_set_timer(struct mg_context *ctx,
+                              double period,
+                              int (*action)(void *arg),
+                              void *arg);
+
+
 /* Add, edit or delete the entry in the passwords file.
  *
  * This function allows an application to manipulate .htpasswd files on the
@@ -801,6 +911,24 @@ mg_get_response_info(const struct mg_connection *);
 CIVETWEB_API int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+/* Buffer descriptor for mg_writev. */
+struct mg_iovec {
+	const void *buf;
+	size_t len;
+};
+
+
+/* Send data from several buffers to the client, as mg_write would send
+   their concatenation. For plain sockets the buffers are sent without
+   copying, with a single system call (sendmsg/WSASend) where possible.
+   Return:
+    0   when the connection has been closed
+    -1  on error
+    >0  number of bytes written on success */
+CIVETWEB_API int
+mg_writev(struct mg_connection *, const struct mg_iovec *iov, int iovcnt);
+
+
 /* Send data to a websocket client wrapped in a websocket frame.  Uses
    mg_lock_connection to ensure that the transmission is not interrupted,
    i.e., when the application is proactively communicating and responding to
@@ -1614,6 +1742,70 @@ CIVETWEB_API int mg_response_header_add_lines(struct mg_connection *conn,
 CIVETWEB_API int mg_response_header_send(struct mg_connection *conn);
 
 
+/* Send http response headers and a complete body held in memory.
+ * Use this function instead of mg_response_header_send followed by mg_write.
+ * It adds the Content-Length header. If civetweb is built with USE_ZLIB,
+ * the client accepts gzip and the body is at least "compression_min_size"
+ * bytes, the body is compressed on the fly instead.
+ * Parameters:
+ *   conn: Current connection handle.
+ *   data: Response body.
+ *   len: Length of the response body.
+ * Return:
+ *   0:    ok
+ *  -1:    parameter error
+ *  -2:    invalid connection type
+ *  -3:    invalid connection status
+ *  -4:    sending failed (network error)
+ *  -5:    out of memory
+ */
+CIVETWEB_API int mg_response_send_body(struct mg_connection *conn,
+                                       const void *data,
+                                       size_t len);
+
+
+/* Send a complete response from a prebuilt block of header lines and a
+ * body held in memory. Use this function instead of mg_response_header_start,
+ * mg_response_header_add and mg_response_send_body for fixed sets of
+ * headers: for HTTP/1.x, the status line, the headers and the body are sent
+ * with one mg_writev call, without copying the body or allocating memory.
+ * Content-Length (not for status 204 and 304), Date and Connection headers
+ * are added, and the body is compressed like in mg_response_send_body.
+ * Parameters:
+ *   conn: Current connection handle.
+ *   status: HTTP status code (e.g., 200 for "OK").
+ *   headers: Zero terminated header lines in the form "name: value\r\n",
+ *            usually a constant.
+ *   headers_len: Length of headers, excluding the terminating zero.
+ *   body: Response body.
+ *   body_len: Length of the response body.
+ * Return:
+ *   0:    ok
+ *  -1:    parameter error
+ *  -2:    invalid connection type
+ *  -3:    invalid connection status
+ *  -4:    sending failed (network error)
+ *  -5:    out of memory
+ */
+CIVETWEB_API int mg_send_response(struct mg_connection *conn,
+                                  int status,
+                                  const char *headers,
+                                  size_t headers_len,
+                                  const void *body,
+                                  size_t body_len);
+
+
+/* Like mg_send_response, but the body is sent unchanged, never compressed.
+ * For bodies that are precompressed (the headers then contain
+ * "Content-Encoding: gzip") or not worth compressing, e.g. images. */
+CIVETWEB_API int mg_send_response_as_is(struct mg_connection *conn,
+                                        int status,
+                                        const char *headers,
+                                        size_t headers_len,
+                                        const void *body,
+                                        size_t body_len);
+
+
 /* Check which features where set when the civetweb library has been compiled.
    The function explicitly addresses compile time defines used when building
    the library - it does not mean, the feature has been initialized using a
@@ -1691,6 +1883,19 @@ mg_get_context_info(const struct mg_context *ctx, char *buffer, int buflen);
 CIVETWEB_API void mg_disable_connection_keep_alive(struct mg_connection *conn);
 
 
+/* Check if the current connection will be kept open after this request.
+   Takes the "enable_keep_alive" and "keep_alive_max_requests" options, the
+   "Connection" header sent by the client and the state of the request body
+   into account. Handlers writing raw HTTP responses should use this to set
+   the "Connection" response header.
+   Parameters:
+     conn: Current connection handle.
+   Return:
+     1: keep-alive, 0: the connection will be closed.
+*/
+CIVETWEB_API int mg_should_keep_alive(const struct mg_connection *conn);
+
+
 #if defined(MG_EXPERIMENTAL_INTERFACES)
 /* Get connection information. Useful for server diagnosis.
    Parameters:
@@ -1,5 +1,5 @@
 @echo off
-gcc -Wall -Wextra -std=c11 -I. -DNO_SSL -D_WIN32_WINNT=0x0600 sqlite-amalgamation-3460100/sqlite3.c civetweb.c main.c db.c auth.c materials.c subjects.c -o eknows_backend.exe -lmingw32 -lws2_32
+gcc -Wall -Wextra -std=c11 -I. -DNO_SSL -DUSE_HTTP2 -DUSE_TIMERS -D_WIN32_WINNT=0x0600 sqlite-amalgamation-3460100/sqlite3.c civetweb.c main.c db.c auth.c materials.c subjects.c json.c arena.c events.c sync.c dbpool.c assets.c capture.c -o eknows_backend.exe -lmingw32 -lws2_32
 if %errorlevel% neq 0 (
     echo Compilation failed
     pause
@@ -1,13 +1,27 @@
 #include "db.h"
+#include "events.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 sqlite3 *db = NULL;
 
+// Threads of the DB executor pool (dbpool.c) have a connection of their own,
+// everybody else uses the shared one.
+static _Thread_local sqlite3 *thread_db = NULL;
+
+static sqlite3 *conn(void) {
+    return thread_db ? thread_db : db;
+}
+
+// Wait this long for a lock held by another connection before failing
+#ifndef DB_BUSY_TIMEOUT_MS
+#define DB_BUSY_TIMEOUT_MS 5000
+#endif
+
 static int execute_sql(const char *sql) {
     char *errmsg = NULL;
-    int rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    int rc = sqlite3_exec(conn(), sql, NULL, NULL, &errmsg);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "SQL error: %s\n", errmsg);
         sqlite3_free(errmsg);
@@ -15,12 +29,97 @@ static int execute_sql(const char *sql) {
     return rc;
 }
 
+// Change events for the dashboards (events.c). Inside a transaction they are
+// held back until db_commit and dropped by db_rollback. A transaction stays
+// on the thread that began it (see db_begin), so its state is per thread.
+#define DB_MAX_PENDING_EVENTS 64
+
+typedef struct {
+    unsigned types;
+    int teacher_id;
+    char program[100];
+} db_event;
+
+static _Thread_local int in_transaction = 0;
+static _Thread_local db_event pending_events[DB_MAX_PENDING_EVENTS];
+static _Thread_local int num_pending_events = 0;
+static _Thread_local unsigned pending_overflow = 0; // types sent to everybody at commit
+
+static void notify(unsigned types, int teacher_id, const char *program) {
+    if (!in_transaction) {
+        events_publish(types, teacher_id, program);
+    } else if (num_pending_events < DB_MAX_PENDING_EVENTS) {
+        db_event *ev = &pending_events[num_pending_events++];
+        ev->types = types;
+        ev->teacher_id = teacher_id;
+        ev->program[0] = '\0';
+        if (program) {
+            strncat(ev->program, program, sizeof(ev->program) - 1);
+        }
+    } else {
+        pending_overflow |= types;
+    }
+}
+
+// End of a transaction, called with the connection mutex held
+static void end_transaction(int committed) {
+    if (committed) {
+        for (int i = 0; i < num_pending_events; i++) {
+            const db_event *ev = &pending_events[i];
+            events_publish(ev->types, ev->teacher_id, ev->program);
+        }
+        if (pending_overflow) {
+            events_publish(pending_overflow, 0, NULL);
+        }
+    }
+    num_pending_events = 0;
+    pending_overflow = 0;
+    in_transaction = 0;
+}
+
+// Teacher and program of a subject, for event filtering; 0 and "" if unknown
+static void subject_owner(int subject_id, int *teacher_id, char *program, size_t size) {
+    sqlite3_stmt *stmt;
+    *teacher_id = 0;
+    program[0] = '\0';
+    if (sqlite3_prepare_v2(conn(), "SELECT teacher_id, program FROM subjects WHERE id = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+        return;
+    }
+    sqlite3_bind_int(stmt, 1, subject_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *teacher_id = sqlite3_column_int(stmt, 0);
+        if (sqlite3_column_text(stmt, 1)) {
+            strncat(program, (const char *)sqlite3_column_text(stmt, 1), size - 1);
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+static int material_subject(int id) {
+    sqlite3_stmt *stmt;
+    int subject_id = 0;
+    if (sqlite3_prepare_v2(conn(), "SELECT subject_id FROM materials WHERE id = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_int(stmt, 1, id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        subject_id = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return subject_id;
+}
+
 int db_init(const char *filename) {
     int rc = sqlite3_open(filename, &db);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
         return rc;
     }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+
+    // Readers on the executor connections do not block the writer, nor
+    // the writer them
+    execute_sql("PRAGMA journal_mode=WAL;");
 
     // Create users table
     const char *sql_users = "CREATE TABLE IF NOT EXISTS users ("
@@ -101,6 +200,29 @@ int db_init(const char *filename) {
     return SQLITE_OK;
 }
 
+sqlite3 *db_open_thread_connection(void) {
+    const char *filename = db ? sqlite3_db_filename(db, "main") : NULL;
+    sqlite3 *c = NULL;
+    if (!filename || thread_db) {
+        return NULL;
+    }
+    if (sqlite3_open_v2(filename, &c, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", c ? sqlite3_errmsg(c) : "out of memory");
+        sqlite3_close(c);
+        return NULL;
+    }
+    sqlite3_busy_timeout(c, DB_BUSY_TIMEOUT_MS);
+    thread_db = c;
+    return c;
+}
+
+void db_close_thread_connection(void) {
+    if (thread_db) {
+        sqlite3_close(thread_db);
+        thread_db = NULL;
+    }
+}
+
 void db_close(void) {
     if (db) {
         sqlite3_close(db);
@@ -108,10 +230,41 @@ void db_close(void) {
     }
 }
 
+// Threads outside the executor pool share one connection, so a transaction
+// holds the connection mutex from BEGIN to COMMIT/ROLLBACK. Statements of
+// other threads wait instead of ending up inside it. The mutex is recursive,
+// the db_* functions can be called in between.
+int db_begin(void) {
+    sqlite3_mutex_enter(sqlite3_db_mutex(conn()));
+    int rc = execute_sql("BEGIN IMMEDIATE;");
+    if (rc != SQLITE_OK) {
+        sqlite3_mutex_leave(sqlite3_db_mutex(conn()));
+        return rc;
+    }
+    in_transaction = 1;
+    return rc;
+}
+
+int db_commit(void) {
+    int rc = execute_sql("COMMIT;");
+    if (rc != SQLITE_OK) {
+        execute_sql("ROLLBACK;");
+    }
+    end_transaction(rc == SQLITE_OK);
+    sqlite3_mutex_leave(sqlite3_db_mutex(conn()));
+    return rc;
+}
+
+void db_rollback(void) {
+    execute_sql("ROLLBACK;");
+    end_transaction(0);
+    sqlite3_mutex_leave(sqlite3_db_mutex(conn()));
+}
+
 int db_check_user_credentials(const char *username, const char *password) {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT COUNT(*) FROM users WHERE username = ? AND password = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "Failed to prepare statement\n");
         return 0;
@@ -130,9 +283,12 @@ int db_check_user_credentials(const char *username, const char *password) {
 
 // Materials CRUD
 int db_create_material(int subject_id, const char *category, const char *original_filename, const char *file_data) {
+    int teacher_id;
+    char program[100];
+    subject_owner(subject_id, &teacher_id, program, sizeof(program));
     sqlite3_stmt *stmt;
     const char *sql = "INSERT INTO materials (subject_id, category, original_filename, file_data) VALUES (?, ?, ?, ?);";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, subject_id);
     sqlite3_bind_text(stmt, 2, category, -1, SQLITE_STATIC);
@@ -140,13 +296,15 @@ int db_create_material(int subject_id, const char *category, const char *origina
     sqlite3_bind_text(stmt, 4, file_data, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_MATERIALS | EVENT_TRACKING, teacher_id, program);
+    return SQLITE_OK;
 }
 
 int db_read_material(int id, int *subject_id, char *category, char *original_filename, char *file_data) {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT subject_id, category, original_filename, file_data FROM materials WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, id);
     rc = sqlite3_step(stmt);
@@ -161,9 +319,13 @@ int db_read_material(int id, int *subject_id, char *category, char *original_fil
 }
 
 int db_update_material(int id, int subject_id, const char *category, const char *original_filename, const char *file_data) {
+    int old_teacher_id, teacher_id;
+    char old_program[100], program[100];
+    subject_owner(material_subject(id), &old_teacher_id, old_program, sizeof(old_program));
+    subject_owner(subject_id, &teacher_id, program, sizeof(program));
     sqlite3_stmt *stmt;
     const char *sql = "UPDATE materials SET subject_id = ?, category = ?, original_filename = ?, file_data = ? WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, subject_id);
     sqlite3_bind_text(stmt, 2, category, -1, SQLITE_STATIC);
@@ -172,25 +334,33 @@ int db_update_material(int id, int subject_id, const char *category, const char
     sqlite3_bind_int(stmt, 5, id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_MATERIALS, old_teacher_id, old_program);
+    notify(EVENT_MATERIALS, teacher_id, program);
+    return SQLITE_OK;
 }
 
 int db_delete_material(int id) {
+    int teacher_id;
+    char program[100];
+    subject_owner(material_subject(id), &teacher_id, program, sizeof(program));
     sqlite3_stmt *stmt;
     const char *sql = "DELETE FROM materials WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_MATERIALS | EVENT_TRACKING, teacher_id, program);
+    return SQLITE_OK;
 }
 
 // Subjects CRUD
 int db_create_subject(const char *program, const char *grade_level, const char *semester, const char *subject, int teacher_id) {
     sqlite3_stmt *stmt;
     const char *sql = "INSERT INTO subjects (program, grade_level, semester, subject, teacher_id) VALUES (?, ?, ?, ?, ?);";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_text(stmt, 1, program, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, grade_level, -1, SQLITE_STATIC);
@@ -199,13 +369,15 @@ int db_create_subject(const char *program, const char *grade_level, const char *
     sqlite3_bind_int(stmt, 5, teacher_id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_SUBJECTS | EVENT_TRACKING, teacher_id, program);
+    return SQLITE_OK;
 }
 
 int db_read_subject(int id, char *program, char *grade_level, char *semester, char *subject, int *teacher_id) {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT program, grade_level, semester, subject, teacher_id FROM subjects WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, id);
     rc = sqlite3_step(stmt);
@@ -221,9 +393,12 @@ int db_read_subject(int id, char *program, char *grade_level, char *semester, ch
 }
 
 int db_update_subject(int id, const char *program, const char *grade_level, const char *semester, const char *subject, int teacher_id) {
+    int old_teacher_id;
+    char old_program[100];
+    subject_owner(id, &old_teacher_id, old_program, sizeof(old_program));
     sqlite3_stmt *stmt;
     const char *sql = "UPDATE subjects SET program = ?, grade_level = ?, semester = ?, subject = ?, teacher_id = ? WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_text(stmt, 1, program, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, grade_level, -1, SQLITE_STATIC);
@@ -233,148 +408,155 @@ int db_update_subject(int id, const char *program, const char *grade_level, cons
     sqlite3_bind_int(stmt, 6, id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_SUBJECTS, old_teacher_id, old_program);
+    notify(EVENT_SUBJECTS, teacher_id, program);
+    return SQLITE_OK;
 }
 
 int db_delete_subject(int id) {
+    int teacher_id;
+    char program[100];
+    subject_owner(id, &teacher_id, program, sizeof(program));
     sqlite3_stmt *stmt;
     const char *sql = "DELETE FROM subjects WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_SUBJECTS | EVENT_TRACKING, teacher_id, program);
+    return SQLITE_OK;
 }
 
 // Additional query functions
-char* db_get_materials_by_teacher_json(int teacher_id) {
+
+// End of a *_json row loop: rc is the last sqlite3_step result. A loop
+// that stopped on an error (e.g. SQLITE_BUSY) left out rows, so the JSON
+// must not be sent.
+static int finish_json_rows(sqlite3_stmt *stmt, int rc, const arena_buf *out) {
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return rc;
+    return out->data ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+int db_get_materials_by_teacher_json(arena_buf *out, int teacher_id) {
     const char *sql = "SELECT m.id, m.subject_id, m.category, m.original_filename, m.uploaded_at, s.program, s.subject "
                       "FROM materials m JOIN subjects s ON m.subject_id = s.id WHERE s.teacher_id = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, teacher_id);
 
-    char *json = malloc(4096); // Allocate buffer
-    strcpy(json, "[");
+    arena_buf_puts(out, "[");
     int first = 1;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        if (!first) strcat(json, ",");
-        char item[512];
-        sprintf(item, "{\"id\":%d,\"subject_id\":%d,\"category\":\"%s\",\"file_name\":\"%s\",\"uploaded_at\":\"%s\",\"program_name\":\"%s\",\"subject_name\":\"%s\"}",
+        if (!first) arena_buf_puts(out, ",");
+        arena_buf_printf(out, "{\"id\":%d,\"subject_id\":%d,\"category\":\"%s\",\"file_name\":\"%s\",\"uploaded_at\":\"%s\",\"program_name\":\"%s\",\"subject_name\":\"%s\"}",
                 sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
                 sqlite3_column_text(stmt, 2), sqlite3_column_text(stmt, 3),
                 sqlite3_column_text(stmt, 4), sqlite3_column_text(stmt, 5), sqlite3_column_text(stmt, 6));
-        strcat(json, item);
         first = 0;
     }
-    strcat(json, "]");
-    sqlite3_finalize(stmt);
-    return json;
+    arena_buf_puts(out, "]");
+    return finish_json_rows(stmt, rc, out);
 }
 
-char* db_get_subjects_by_teacher_json(int teacher_id) {
+int db_get_subjects_by_teacher_json(arena_buf *out, int teacher_id) {
     const char *sql = "SELECT id, program, grade_level, semester, subject FROM subjects WHERE teacher_id = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, teacher_id);
 
-    char *json = malloc(4096);
-    strcpy(json, "[");
+    arena_buf_puts(out, "[");
     int first = 1;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        if (!first) strcat(json, ",");
-        char item[512];
-        sprintf(item, "{\"id\":%d,\"program\":\"%s\",\"grade_level\":\"%s\",\"semester\":\"%s\",\"subject\":\"%s\"}",
+        if (!first) arena_buf_puts(out, ",");
+        arena_buf_printf(out, "{\"id\":%d,\"program\":\"%s\",\"grade_level\":\"%s\",\"semester\":\"%s\",\"subject\":\"%s\"}",
                 sqlite3_column_int(stmt, 0), sqlite3_column_text(stmt, 1),
                 sqlite3_column_text(stmt, 2), sqlite3_column_text(stmt, 3),
                 sqlite3_column_text(stmt, 4));
-        strcat(json, item);
         first = 0;
     }
-    strcat(json, "]");
-    sqlite3_finalize(stmt);
-    return json;
+    arena_buf_puts(out, "]");
+    return finish_json_rows(stmt, rc, out);
 }
 
-char* db_get_all_subjects_json(void) {
+int db_get_all_subjects_json(arena_buf *out) {
     const char *sql = "SELECT id, program, grade_level, semester, subject, teacher_id FROM subjects;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
 
-    char *json = malloc(4096);
-    strcpy(json, "[");
+    arena_buf_puts(out, "[");
     int first = 1;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        if (!first) strcat(json, ",");
-        char item[512];
-        sprintf(item, "{\"id\":%d,\"program\":\"%s\",\"grade_level\":\"%s\",\"semester\":\"%s\",\"subject\":\"%s\",\"teacher_id\":%d}",
+        if (!first) arena_buf_puts(out, ",");
+        arena_buf_printf(out, "{\"id\":%d,\"program\":\"%s\",\"grade_level\":\"%s\",\"semester\":\"%s\",\"subject\":\"%s\",\"teacher_id\":%d}",
                 sqlite3_column_int(stmt, 0), sqlite3_column_text(stmt, 1),
                 sqlite3_column_text(stmt, 2), sqlite3_column_text(stmt, 3),
                 sqlite3_column_text(stmt, 4), sqlite3_column_int(stmt, 5));
-        strcat(json, item);
         first = 0;
     }
-    strcat(json, "]");
-    sqlite3_finalize(stmt);
-    return json;
+    arena_buf_puts(out, "]");
+    return finish_json_rows(stmt, rc, out);
 }
 
-char* db_get_dashboard_data_json(int teacher_id) {
+int db_get_dashboard_data_json(arena_buf *out, int teacher_id) {
     // Get total materials
     const char *sql_total = "SELECT COUNT(*) FROM materials m JOIN subjects s ON m.subject_id = s.id WHERE s.teacher_id = ?;";
     sqlite3_stmt *stmt_total;
-    int rc = sqlite3_prepare_v2(db, sql_total, -1, &stmt_total, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql_total, -1, &stmt_total, NULL);
+    if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt_total, 1, teacher_id);
     rc = sqlite3_step(stmt_total);
     int total = 0;
     if (rc == SQLITE_ROW) total = sqlite3_column_int(stmt_total, 0);
     sqlite3_finalize(stmt_total);
+    if (rc != SQLITE_ROW) return rc; // COUNT(*) always has a row
 
     // Get stats by category
     const char *sql_stats = "SELECT m.category, COUNT(*) FROM materials m JOIN subjects s ON m.subject_id = s.id WHERE s.teacher_id = ? GROUP BY m.category;";
     sqlite3_stmt *stmt_stats;
-    rc = sqlite3_prepare_v2(db, sql_stats, -1, &stmt_stats, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    rc = sqlite3_prepare_v2(conn(), sql_stats, -1, &stmt_stats, NULL);
+    if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt_stats, 1, teacher_id);
 
-    char stats[1024] = "{";
+    arena_buf_printf(out, "{\"total\":%d,\"stats\":{", total);
     int first = 1;
     while ((rc = sqlite3_step(stmt_stats)) == SQLITE_ROW) {
-        if (!first) strcat(stats, ",");
-        char item[128];
-        sprintf(item, "\"%s\":%d", sqlite3_column_text(stmt_stats, 0), sqlite3_column_int(stmt_stats, 1));
-        strcat(stats, item);
+        if (!first) arena_buf_puts(out, ",");
+        arena_buf_printf(out, "\"%s\":%d", sqlite3_column_text(stmt_stats, 0), sqlite3_column_int(stmt_stats, 1));
         first = 0;
     }
-    strcat(stats, "}");
-    sqlite3_finalize(stmt_stats);
-
-    char *json = malloc(2048);
-    sprintf(json, "{\"total\":%d,\"stats\":%s}", total, stats);
-    return json;
+    arena_buf_puts(out, "}}");
+    return finish_json_rows(stmt_stats, rc, out);
 }
 
 int db_assign_subject_to_teacher(int subject_id, int teacher_id) {
+    int old_teacher_id;
+    char program[100];
+    subject_owner(subject_id, &old_teacher_id, program, sizeof(program));
     sqlite3_stmt *stmt;
     const char *sql = "UPDATE subjects SET teacher_id = ? WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, teacher_id);
     sqlite3_bind_int(stmt, 2, subject_id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_SUBJECTS, old_teacher_id, program);
+    notify(EVENT_SUBJECTS, teacher_id, program);
+    return SQLITE_OK;
 }
 
 int db_get_user_id_by_username(const char *username) {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT id FROM users WHERE username = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return -1;
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
@@ -386,25 +568,28 @@ int db_get_user_id_by_username(const char *username) {
     return id;
 }
 
-const char* db_get_user_role(const char *username) {
+int db_get_user_role(const char *username, char *role, size_t size) {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT role FROM users WHERE username = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return -1;
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
-    const char *role = NULL;
-    if (rc == SQLITE_ROW) {
-        role = (const char *)sqlite3_column_text(stmt, 0);
+    int found = -1;
+    if (rc == SQLITE_ROW && size > 0) {
+        // The text belongs to the statement, copy it before finalizing
+        const char *text = (const char *)sqlite3_column_text(stmt, 0);
+        snprintf(role, size, "%s", text ? text : "");
+        found = 0;
     }
     sqlite3_finalize(stmt);
-    return role;
+    return found;
 }
 
 int db_get_login_attempts(const char *username) {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT login_attempts FROM users WHERE username = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return -1;
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
@@ -419,7 +604,7 @@ int db_get_login_attempts(const char *username) {
 int db_increment_login_attempts(const char *username) {
     sqlite3_stmt *stmt;
     const char *sql = "UPDATE users SET login_attempts = login_attempts + 1 WHERE username = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
@@ -430,7 +615,7 @@ int db_increment_login_attempts(const char *username) {
 int db_reset_login_attempts(const char *username) {
     sqlite3_stmt *stmt;
     const char *sql = "UPDATE users SET login_attempts = 0 WHERE username = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
@@ -439,60 +624,52 @@ int db_reset_login_attempts(const char *username) {
 }
 
 // Admin functions
-char* db_get_all_programs_json(void) {
+int db_get_all_programs_json(arena_buf *out) {
     const char *sql = "SELECT id, name FROM programs;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
 
-    char *json = malloc(4096);
-    strcpy(json, "[");
+    arena_buf_puts(out, "[");
     int first = 1;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        if (!first) strcat(json, ",");
-        char item[256];
-        sprintf(item, "{\"id\":%d,\"name\":\"%s\"}",
+        if (!first) arena_buf_puts(out, ",");
+        arena_buf_printf(out, "{\"id\":%d,\"name\":\"%s\"}",
                 sqlite3_column_int(stmt, 0), sqlite3_column_text(stmt, 1));
-        strcat(json, item);
         first = 0;
     }
-    strcat(json, "]");
-    sqlite3_finalize(stmt);
-    return json;
+    arena_buf_puts(out, "]");
+    return finish_json_rows(stmt, rc, out);
 }
 
-char* db_get_all_teachers_json(void) {
+int db_get_all_teachers_json(arena_buf *out) {
     const char *sql = "SELECT id, name, username, password, access_code FROM users WHERE role = 'teacher';";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
 
-    char *json = malloc(4096);
-    strcpy(json, "[");
+    arena_buf_puts(out, "[");
     int first = 1;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        if (!first) strcat(json, ",");
-        char item[512];
-        sprintf(item, "{\"id\":%d,\"name\":\"%s\",\"username\":\"%s\",\"password\":\"%s\",\"access_code\":\"%s\"}",
+        if (!first) arena_buf_puts(out, ",");
+        arena_buf_printf(out, "{\"id\":%d,\"name\":\"%s\",\"username\":\"%s\",\"password\":\"%s\",\"access_code\":\"%s\"}",
                 sqlite3_column_int(stmt, 0), sqlite3_column_text(stmt, 1), sqlite3_column_text(stmt, 2),
                 sqlite3_column_text(stmt, 3), sqlite3_column_text(stmt, 4));
-        strcat(json, item);
         first = 0;
     }
-    strcat(json, "]");
-    sqlite3_finalize(stmt);
-    return json;
+    arena_buf_puts(out, "]");
+    return finish_json_rows(stmt, rc, out);
 }
 
-char* db_get_tracking_data_json(void) {
+int db_get_tracking_data_json(arena_buf *out) {
     // Get total users, subjects, materials
     const char *sql_stats = "SELECT "
                             "(SELECT COUNT(*) FROM users WHERE role = 'teacher') as teachers,"
                             "(SELECT COUNT(*) FROM subjects) as subjects,"
                             "(SELECT COUNT(*) FROM materials) as materials;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql_stats, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    int rc = sqlite3_prepare_v2(conn(), sql_stats, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
     rc = sqlite3_step(stmt);
     int teachers = 0, subjects = 0, materials = 0;
     if (rc == SQLITE_ROW) {
@@ -501,38 +678,42 @@ char* db_get_tracking_data_json(void) {
         materials = sqlite3_column_int(stmt, 2);
     }
     sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW) return rc;
 
-    char *json = malloc(512);
-    sprintf(json, "{\"teachers\":%d,\"subjects\":%d,\"materials\":%d}", teachers, subjects, materials);
-    return json;
+    arena_buf_printf(out, "{\"teachers\":%d,\"subjects\":%d,\"materials\":%d}", teachers, subjects, materials);
+    return out->data ? SQLITE_OK : SQLITE_NOMEM;
 }
 
 int db_create_program(const char *name, const char *subjects_json) {
     sqlite3_stmt *stmt;
     const char *sql = "INSERT INTO programs (name) VALUES (?);";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_PROGRAMS, 0, name);
+    return SQLITE_OK;
 }
 
 int db_delete_program(int id) {
     sqlite3_stmt *stmt;
     const char *sql = "DELETE FROM programs WHERE id = ?;";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_PROGRAMS, 0, NULL);
+    return SQLITE_OK;
 }
 
 int db_create_teacher(const char *name, const char *username, const char *password, const char *access_code) {
     sqlite3_stmt *stmt;
     const char *sql = "INSERT INTO users (name, username, password, role, access_code) VALUES (?, ?, ?, 'teacher', ?);";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
@@ -540,16 +721,20 @@ int db_create_teacher(const char *name, const char *username, const char *passwo
     sqlite3_bind_text(stmt, 4, access_code, -1, SQLITE_STATIC);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_TEACHERS | EVENT_TRACKING, 0, NULL);
+    return SQLITE_OK;
 }
 
 int db_delete_teacher(int id) {
     sqlite3_stmt *stmt;
     const char *sql = "DELETE FROM users WHERE id = ? AND role = 'teacher';";
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(conn(), sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) return rc;
     sqlite3_bind_int(stmt, 1, id);
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_DONE) return rc;
+    notify(EVENT_TEACHERS | EVENT_TRACKING, id, NULL);
+    return SQLITE_OK;
 }
@@ -2,7 +2,9 @@
 #define DB_H
 
 #include "sqlite-amalgamation-3460100/sqlite3.h"
+#include "arena.h"
 
+// Shared connection, used by every thread without one of its own
 extern sqlite3 *db;
 
 // Initialize the SQLite database connection and create tables if not exist
@@ -11,6 +13,18 @@ int db_init(const char *filename);
 // Close the SQLite database connection
 void db_close(void);
 
+// Give the calling thread its own connection to the database opened by
+// db_init; the db_* functions called on this thread use it from then on.
+// Returns it, or NULL on failure (the thread keeps the shared one).
+sqlite3 *db_open_thread_connection(void);
+void db_close_thread_connection(void);
+
+// Transactions: db_begin starts one and keeps the connection to this thread
+// until db_commit or db_rollback. db_commit rolls back if the commit fails.
+int db_begin(void);
+int db_commit(void);
+void db_rollback(void);
+
 // User-related database functions
 int db_check_user_credentials(const char *username, const char *password);
 int db_get_login_attempts(const char *username);
@@ -29,19 +43,23 @@ int db_read_subject(int id, char *program, char *grade_level, char *semester, ch
 int db_update_subject(int id, const char *program, const char *grade_level, const char *semester, const char *subject, int teacher_id);
 int db_delete_subject(int id);
 
-// Additional query functions for API
-char* db_get_materials_by_teacher_json(int teacher_id);
-char* db_get_subjects_by_teacher_json(int teacher_id);
-char* db_get_all_subjects_json(void);
-char* db_get_dashboard_data_json(int teacher_id);
+// Additional query functions for API. The *_json functions append to out
+// and return SQLITE_OK, or an SQLite error code if any step failed; out is
+// then incomplete.
+int db_get_materials_by_teacher_json(arena_buf *out, int teacher_id);
+int db_get_subjects_by_teacher_json(arena_buf *out, int teacher_id);
+int db_get_all_subjects_json(arena_buf *out);
+int db_get_dashboard_data_json(arena_buf *out, int teacher_id);
 int db_assign_subject_to_teacher(int subject_id, int teacher_id);
 int db_get_user_id_by_username(const char *username);
-const char* db_get_user_role(const char *username);
+// Copy the role of a user into role[size]. Returns 0, or -1 if there is no
+// such user.
+int db_get_user_role(const char *username, char *role, size_t size);
 
 // Admin functions
-char* db_get_all_programs_json(void);
-char* db_get_all_teachers_json(void);
-char* db_get_tracking_data_json(void);
+int db_get_all_programs_json(arena_buf *out);
+int db_get_all_teachers_json(arena_buf *out);
+int db_get_tracking_data_json(arena_buf *out);
 int db_create_program(const char *name, const char *subjects_json);
 int db_delete_program(int id);
 int db_create_teacher(const char *name, const char *username, const char *password, const char *access_code);
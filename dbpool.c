@@ -0,0 +1,310 @@
+#include "dbpool.h"
+#include "db.h"
+#include "sync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A running statement checks its deadline every this many VM instructions
+#define DBPOOL_PROGRESS_OPS 1000
+
+const int dbpool_wait_bounds_ms[DBPOOL_WAIT_BUCKETS] = { 1, 5, 25, 100, 500, 2500 };
+
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+
+typedef struct {
+    dbpool *pool;
+    sync_thread thread;
+    long long deadline;  // of the running job
+    int interrupted;     // the running job hit its deadline
+} executor;
+
+typedef struct {
+    dbpool_job *head;
+    dbpool_job *tail;
+} job_list;
+
+struct dbpool {
+    const char *name;
+    sync_mutex lock;
+    sync_cond work;  // a job was queued, or shutdown
+    sync_cond done;  // a job finished
+    job_list queues[DBPOOL_PRIORITIES];
+    executor *executors;
+    int num_executors;
+    int max_queued;
+    int running_low; // DBPOOL_LOW jobs running now
+    int stopped;
+    dbpool_stats stats;
+};
+
+// sqlite3_progress_handler callback: non-zero interrupts the statement
+static int check_deadline(void *arg) {
+    executor *ex = arg;
+    if (sync_now_ms() >= ex->deadline) {
+        ex->interrupted = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void finish(dbpool *pool, dbpool_job *job, int result) {
+    job->result = result;
+    job->state = JOB_DONE;
+    if (result == DBPOOL_TIMEOUT) {
+        pool->stats.timeouts++;
+    } else if (result != DBPOOL_STOPPED) {
+        pool->stats.completed++;
+    }
+    sync_cond_broadcast(&pool->done);
+}
+
+static void unlink_job(dbpool *pool, dbpool_job *job) {
+    job_list *q = &pool->queues[job->priority];
+    dbpool_job *prev = NULL;
+    for (dbpool_job *j = q->head; j; prev = j, j = j->next) {
+        if (j == job) {
+            if (prev) {
+                prev->next = job->next;
+            } else {
+                q->head = job->next;
+            }
+            if (q->tail == job) {
+                q->tail = prev;
+            }
+            pool->stats.queued--;
+            return;
+        }
+    }
+}
+
+// Next job by priority, called with the lock held. Jobs past their
+// deadline are dropped on the way. Reports leave one executor free, so
+// single-teacher queries do not wait behind them.
+static dbpool_job *take_job(dbpool *pool) {
+    long long now = sync_now_ms();
+    for (int p = 0; p < DBPOOL_PRIORITIES; p++) {
+        job_list *q = &pool->queues[p];
+        if (p == DBPOOL_LOW && pool->num_executors > 1 && pool->running_low >= pool->num_executors - 1) {
+            break;
+        }
+        while (q->head) {
+            dbpool_job *job = q->head;
+            q->head = job->next;
+            if (!q->head) {
+                q->tail = NULL;
+            }
+            pool->stats.queued--;
+            if (job->deadline > now) {
+                return job;
+            }
+            finish(pool, job, DBPOOL_TIMEOUT);
+        }
+    }
+    return NULL;
+}
+
+static void record_wait(dbpool_stats *stats, long long wait_us) {
+    int b = 0;
+    while (b < DBPOOL_WAIT_BUCKETS && wait_us > dbpool_wait_bounds_ms[b] * 1000LL) {
+        b++;
+    }
+    stats->wait_buckets[b]++;
+    stats->wait_us += (unsigned long long)wait_us;
+}
+
+static void executor_main(void *arg) {
+    executor *ex = arg;
+    dbpool *pool = ex->pool;
+    sqlite3 *c = db_open_thread_connection();
+    if (c) {
+        sqlite3_progress_handler(c, DBPOOL_PROGRESS_OPS, check_deadline, ex);
+    }
+
+    sync_mutex_lock(&pool->lock);
+    for (;;) {
+        dbpool_job *job = NULL;
+        while (!pool->stopped && !(job = take_job(pool))) {
+            sync_cond_wait(&pool->work, &pool->lock, -1);
+        }
+        if (!job) {
+            break;
+        }
+        job->state = JOB_RUNNING;
+        pool->stats.running++;
+        if (job->priority == DBPOOL_LOW) {
+            pool->running_low++;
+        }
+        long long start = sync_now_us();
+        record_wait(&pool->stats, start - job->submitted);
+        ex->deadline = job->deadline;
+        ex->interrupted = 0;
+        sync_mutex_unlock(&pool->lock);
+
+        int result = job->fn(job->arg);
+
+        sync_mutex_lock(&pool->lock);
+        pool->stats.running--;
+        pool->stats.busy_us += (unsigned long long)(sync_now_us() - start);
+        if (job->priority == DBPOOL_LOW) {
+            // An idle executor may take the next report now
+            pool->running_low--;
+            sync_cond_broadcast(&pool->work);
+        }
+        finish(pool, job, ex->interrupted ? DBPOOL_TIMEOUT : result);
+    }
+    sync_mutex_unlock(&pool->lock);
+
+    db_close_thread_connection();
+}
+
+dbpool *dbpool_create(const char *name, int threads, int queue_size) {
+    if (threads < 1 || queue_size < 1) {
+        return NULL;
+    }
+    dbpool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->executors = calloc((size_t)threads, sizeof(*pool->executors));
+    if (!pool->executors || sync_mutex_init(&pool->lock) != 0) {
+        free(pool->executors);
+        free(pool);
+        return NULL;
+    }
+    if (sync_cond_init(&pool->work) != 0 || sync_cond_init(&pool->done) != 0) {
+        sync_mutex_destroy(&pool->lock);
+        free(pool->executors);
+        free(pool);
+        return NULL;
+    }
+    pool->name = name;
+    pool->max_queued = queue_size;
+
+    sync_mutex_lock(&pool->lock);
+    for (int i = 0; i < threads; i++) {
+        executor *ex = &pool->executors[pool->num_executors];
+        ex->pool = pool;
+        if (sync_thread_start(&ex->thread, executor_main, ex) != 0) {
+            fprintf(stderr, "Failed to start %s executor %d\n", name, i);
+            break;
+        }
+        pool->num_executors++;
+    }
+    pool->stats.threads = pool->num_executors;
+    sync_mutex_unlock(&pool->lock);
+
+    if (pool->num_executors == 0) {
+        dbpool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void dbpool_destroy(dbpool *pool) {
+    if (!pool) {
+        return;
+    }
+    sync_mutex_lock(&pool->lock);
+    pool->stopped = 1;
+    for (int p = 0; p < DBPOOL_PRIORITIES; p++) {
+        while (pool->queues[p].head) {
+            dbpool_job *job = pool->queues[p].head;
+            unlink_job(pool, job);
+            finish(pool, job, DBPOOL_STOPPED);
+        }
+    }
+    sync_cond_broadcast(&pool->work);
+    sync_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_executors; i++) {
+        sync_thread_join(pool->executors[i].thread);
+    }
+    sync_cond_destroy(&pool->done);
+    sync_cond_destroy(&pool->work);
+    sync_mutex_destroy(&pool->lock);
+    free(pool->executors);
+    free(pool);
+}
+
+int dbpool_submit(dbpool *pool, dbpool_job *job, int priority, int timeout_ms, dbpool_fn fn, void *arg) {
+    if (priority < 0 || priority >= DBPOOL_PRIORITIES) {
+        priority = DBPOOL_LOW;
+    }
+    job->next = NULL;
+    job->fn = fn;
+    job->arg = arg;
+    job->submitted = sync_now_us();
+    job->deadline = sync_now_ms() + timeout_ms;
+    job->priority = priority;
+    job->state = JOB_QUEUED;
+    job->result = 0;
+    if (!pool) {
+        return DBPOOL_STOPPED;
+    }
+
+    sync_mutex_lock(&pool->lock);
+    if (pool->stopped) {
+        sync_mutex_unlock(&pool->lock);
+        return DBPOOL_STOPPED;
+    }
+    if (pool->stats.queued >= pool->max_queued) {
+        pool->stats.rejected++;
+        sync_mutex_unlock(&pool->lock);
+        return DBPOOL_BUSY;
+    }
+    job_list *q = &pool->queues[priority];
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    pool->stats.queued++;
+    sync_cond_signal(&pool->work);
+    sync_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int dbpool_wait(dbpool *pool, dbpool_job *job) {
+    sync_mutex_lock(&pool->lock);
+    while (job->state != JOB_DONE) {
+        if (job->state == JOB_QUEUED) {
+            long long left = job->deadline - sync_now_ms();
+            if (left <= 0) {
+                // Nobody picked it up in time
+                unlink_job(pool, job);
+                finish(pool, job, DBPOOL_TIMEOUT);
+                break;
+            }
+            sync_cond_wait(&pool->done, &pool->lock, (int)left);
+        } else {
+            // Running: it stops at the deadline at the latest
+            sync_cond_wait(&pool->done, &pool->lock, -1);
+        }
+    }
+    sync_mutex_unlock(&pool->lock);
+    return job->result;
+}
+
+int dbpool_run(dbpool *pool, int priority, int timeout_ms, dbpool_fn fn, void *arg) {
+    dbpool_job job;
+    int rc = dbpool_submit(pool, &job, priority, timeout_ms, fn, arg);
+    if (rc == DBPOOL_STOPPED) {
+        return fn(arg);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return dbpool_wait(pool, &job);
+}
+
+void dbpool_get_stats(dbpool *pool, dbpool_stats *out) {
+    if (!pool) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    sync_mutex_lock(&pool->lock);
+    *out = pool->stats;
+    sync_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,86 @@
+#ifndef DBPOOL_H
+#define DBPOOL_H
+
+// Executor threads for database work.
+//
+// Handlers pass their queries to a small pool of threads instead of running
+// them on the civetweb worker. Each executor has a connection of its own
+// (the database is in WAL mode), so reads run side by side and a long report
+// does not hold the shared connection. Jobs are queued by priority and have
+// a deadline: a job that has not started by then is dropped, a running one
+// is interrupted. The queue is bounded; a job that finds it full is refused
+// at once.
+//
+// main.c runs two pools: one for the read queries and one for logins, so a
+// whole school logging in at once (and a deliberately slow password hash)
+// does not take the executors of downloads and dashboards.
+
+// Priorities, highest first
+#define DBPOOL_HIGH   0 // logins
+#define DBPOOL_NORMAL 1 // data of one teacher
+#define DBPOOL_LOW    2 // reports over whole tables
+#define DBPOOL_PRIORITIES 3
+
+// Results of a job besides those of its function
+#define DBPOOL_BUSY    (-1001) // queue full
+#define DBPOOL_TIMEOUT (-1002) // deadline passed
+#define DBPOOL_STOPPED (-1003) // pool not running
+#define DBPOOL_ERROR(rc) ((rc) <= DBPOOL_BUSY && (rc) >= DBPOOL_STOPPED)
+
+// Upper bounds of the queue wait histogram, in milliseconds
+#define DBPOOL_WAIT_BUCKETS 6
+extern const int dbpool_wait_bounds_ms[DBPOOL_WAIT_BUCKETS];
+
+typedef struct dbpool dbpool;
+
+typedef int (*dbpool_fn)(void *arg);
+
+// A job belongs to the submitter, usually on its stack, and must stay valid
+// until dbpool_wait returns.
+typedef struct dbpool_job {
+    struct dbpool_job *next;
+    dbpool_fn fn;
+    void *arg;
+    long long submitted; // sync_now_us() time
+    long long deadline;  // sync_now_ms() time
+    int priority;
+    int state;
+    int result;
+} dbpool_job;
+
+// Start 'threads' executors with room for 'queue_size' waiting jobs. name
+// is for error messages. Returns NULL on failure.
+dbpool *dbpool_create(const char *name, int threads, int queue_size);
+
+// Fail the waiting jobs with DBPOOL_STOPPED, let the running ones finish,
+// stop the executors and free the pool. pool may be NULL.
+void dbpool_destroy(dbpool *pool);
+
+// Queue fn(arg), to be done within timeout_ms. Returns 0, DBPOOL_BUSY or
+// DBPOOL_STOPPED.
+int dbpool_submit(dbpool *pool, dbpool_job *job, int priority, int timeout_ms, dbpool_fn fn, void *arg);
+
+// Wait for a submitted job. Returns what fn returned, or DBPOOL_TIMEOUT if
+// the job was dropped or interrupted at its deadline.
+int dbpool_wait(dbpool *pool, dbpool_job *job);
+
+// Submit and wait. Without a pool (NULL), fn is called right here.
+int dbpool_run(dbpool *pool, int priority, int timeout_ms, dbpool_fn fn, void *arg);
+
+typedef struct {
+    int threads;
+    int queued;                    // jobs waiting now
+    int running;                   // jobs running now
+    unsigned long long completed;
+    unsigned long long timeouts;   // dropped or interrupted at the deadline
+    unsigned long long rejected;   // queue full
+    unsigned long long wait_us;    // queue wait of the started jobs
+    unsigned long long busy_us;    // time spent running them
+    // Started jobs by queue wait, the last one over all bounds
+    unsigned long long wait_buckets[DBPOOL_WAIT_BUCKETS + 1];
+} dbpool_stats;
+
+// All zero for a NULL pool
+void dbpool_get_stats(dbpool *pool, dbpool_stats *stats);
+
+#endif // DBPOOL_H
@@ -0,0 +1,128 @@
+#include "events.h"
+#include "sync.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct events_subscriber {
+    events_subscriber *next;
+    int teacher_id;
+    char program[100];
+    unsigned pending;
+};
+
+static sync_mutex lock;
+static sync_cond changed;
+
+static events_subscriber *subscribers = NULL;
+static int num_subscribers = 0;
+static int max_subscribers = 0;
+static int stopped = 0;
+
+int events_init(int max) {
+    max_subscribers = max;
+    if (sync_mutex_init(&lock) != 0) return -1;
+    if (sync_cond_init(&changed) != 0) {
+        sync_mutex_destroy(&lock);
+        return -1;
+    }
+    return 0;
+}
+
+void events_shutdown(void) {
+    sync_mutex_lock(&lock);
+    stopped = 1;
+    sync_cond_broadcast(&changed);
+    sync_mutex_unlock(&lock);
+}
+
+static int matches(const events_subscriber *sub, int teacher_id, const char *program) {
+    if (sub->teacher_id != 0 && teacher_id != 0 && sub->teacher_id != teacher_id) {
+        return 0;
+    }
+    if (sub->program[0] && program && program[0] && strcmp(sub->program, program) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+void events_publish(unsigned types, int teacher_id, const char *program) {
+    int woken = 0;
+    sync_mutex_lock(&lock);
+    for (events_subscriber *sub = subscribers; sub; sub = sub->next) {
+        if (matches(sub, teacher_id, program)) {
+            sub->pending |= types;
+            woken = 1;
+        }
+    }
+    if (woken) {
+        sync_cond_broadcast(&changed);
+    }
+    sync_mutex_unlock(&lock);
+}
+
+events_subscriber *events_subscribe(int teacher_id, const char *program) {
+    events_subscriber *sub = calloc(1, sizeof(*sub));
+    if (!sub) return NULL;
+    sub->teacher_id = teacher_id;
+    if (program) {
+        strncpy(sub->program, program, sizeof(sub->program) - 1);
+    }
+
+    sync_mutex_lock(&lock);
+    if (stopped || num_subscribers >= max_subscribers) {
+        sync_mutex_unlock(&lock);
+        free(sub);
+        return NULL;
+    }
+    sub->next = subscribers;
+    subscribers = sub;
+    num_subscribers++;
+    sync_mutex_unlock(&lock);
+    return sub;
+}
+
+void events_unsubscribe(events_subscriber *sub) {
+    sync_mutex_lock(&lock);
+    for (events_subscriber **p = &subscribers; *p; p = &(*p)->next) {
+        if (*p == sub) {
+            *p = sub->next;
+            num_subscribers--;
+            break;
+        }
+    }
+    sync_mutex_unlock(&lock);
+    free(sub);
+}
+
+int events_wait(events_subscriber *sub, int timeout_ms, int coalesce_ms) {
+    long long deadline = sync_now_ms() + timeout_ms;
+    int types;
+
+    sync_mutex_lock(&lock);
+    while (!sub->pending && !stopped) {
+        long long left = deadline - sync_now_ms();
+        if (left <= 0) break;
+        sync_cond_wait(&changed, &lock, (int)left);
+    }
+    if (sub->pending && !stopped && coalesce_ms > 0) {
+        // Let the rest of a burst (e.g. a batch or a page of deletes) in
+        sync_mutex_unlock(&lock);
+        sync_sleep_ms(coalesce_ms);
+        sync_mutex_lock(&lock);
+    }
+    types = stopped ? -1 : (int)sub->pending;
+    sub->pending = 0;
+    sync_mutex_unlock(&lock);
+    return types;
+}
+
+const char *events_name(unsigned type) {
+    switch (type) {
+    case EVENT_SUBJECTS: return "subjects";
+    case EVENT_MATERIALS: return "materials";
+    case EVENT_PROGRAMS: return "programs";
+    case EVENT_TEACHERS: return "teachers";
+    case EVENT_TRACKING: return "tracking";
+    default: return "unknown";
+    }
+}
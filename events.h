@@ -0,0 +1,48 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+// Change notifications for the dashboards.
+//
+// The write paths in db.c publish an event once their change is committed.
+// Each event has a type and, when known, the teacher and program it
+// concerns. Subscribers (the /api/events stream) may filter on a teacher_id
+// and/or program; an event without a teacher or program reaches everybody.
+// Events are coalesced: a subscriber only sees which types changed since it
+// last looked, not every single write.
+
+// Event types, as a bit mask
+#define EVENT_SUBJECTS  0x01
+#define EVENT_MATERIALS 0x02
+#define EVENT_PROGRAMS  0x04
+#define EVENT_TEACHERS  0x08
+#define EVENT_TRACKING  0x10 // the counts of /api/admin/get-tracking-data
+#define EVENT_ALL       0x1F
+
+typedef struct events_subscriber events_subscriber;
+
+// Set up the event hub for at most max subscribers. Each stream keeps a
+// worker thread busy, so max must stay below the number of workers.
+// Returns 0 on success.
+int events_init(int max);
+
+// Wake up all subscribers and make events_wait return -1 from now on.
+void events_shutdown(void);
+
+// Report a committed change. teacher_id 0 and program NULL mean unknown.
+void events_publish(unsigned types, int teacher_id, const char *program);
+
+// Register a subscriber. teacher_id 0 and program NULL or "" mean any.
+// Returns NULL if there are max subscribers already or on allocation
+// failure.
+events_subscriber *events_subscribe(int teacher_id, const char *program);
+void events_unsubscribe(events_subscriber *sub);
+
+// Wait up to timeout_ms for events. Once one arrives, wait another
+// coalesce_ms to collect the rest of a burst. Returns the mask of event
+// types (0 on timeout), or -1 after events_shutdown.
+int events_wait(events_subscriber *sub, int timeout_ms, int coalesce_ms);
+
+// Name of a single event type, e.g. "materials"
+const char *events_name(unsigned type);
+
+#endif // EVENTS_H
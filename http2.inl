@@ -1,5 +1,11 @@
-/* Prototype implementation for HTTP2. Do not use in production.
- * There may be memory leaks, security vulnerabilities, ...
+/* HTTP/2 server implementation (RFC 7540, RFC 7541).
+ *
+ * HTTP/2 is available via TLS (ALPN "h2"), and for cleartext connections
+ * using the "Upgrade: h2c" mechanism or with prior knowledge. Flow control,
+ * HPACK with the dynamic table, CONTINUATION frames and stream priorities
+ * are supported. Requests of one connection are answered one after the
+ * other by the worker thread owning the connection: complete requests are
+ * answered in order of their priority. Server push is not supported.
  */
 
 
@@ -27,7 +33,8 @@ static struct mg_header hpack_predefined[62] = {{NULL, NULL},
                                                 {":status", "404"},
                                                 {":status", "500"},
                                                 {"accept-charset", NULL},
-                                                {"accept-encoding", NULL},
+                                                {"accept-encoding",
+                                                 "gzip, deflate"},
                                                 {"accept-language", NULL},
                                                 {"accept-ranges", NULL},
                                                 {"accept", NULL},
@@ -37,8 +44,8 @@ static struct mg_header hpack_predefined[62] = {{NULL, NULL},
                                                 {"allow", NULL},
                                                 {"authorization", NULL},
                                                 {"cache-control", NULL},
-                                                {"content-encoding", NULL},
                                                 {"content-disposition", NULL},
+                                                {"content-encoding", NULL},
                                                 {"content-language", NULL},
                                                 {"content-length", NULL},
                                                 {"content-location", NULL},
@@ -620,38 +627,50 @@ uint8_t hpack_huff_start_index[] = {0,   10,  36,  68,  0,   74,  79, 82,  84,
 /* Integers have a variable size encoding, according to the RFC.
  * The integer starts at index *i, idx_mask masks the available bits in
  * the first byte. The index *i is advanced until the end of the
- * encoded integer.
+ * encoded integer. Returns 0 if the integer is truncated or exceeds
+ * 2^28, which is far beyond any value accepted by this server.
  */
-static uint64_t
+static int
 hpack_getnum(const uint8_t *buf,
              int *i,
+             int max_i,
              uint8_t idx_mask,
-             struct mg_context *ctx)
+             uint64_t *num)
 {
-	uint64_t num = (buf[*i] & idx_mask);
-
-	(void)ctx;
+	if (*i >= max_i) {
+		return 0;
+	}
+	*num = (buf[*i] & idx_mask);
 
-	if (num == idx_mask) {
+	if (*num == idx_mask) {
 		/* Algorithm from https://tools.ietf.org/html/rfc7541#section-5.1 */
 		uint32_t M = 0;
 		do {
 			(*i)++;
-			num = num + ((buf[*i] & 0x7F) << M);
+			if ((*i >= max_i) || (M > 21)) {
+				return 0;
+			}
+			*num = *num + ((uint64_t)(buf[*i] & 0x7F) << M);
 			M += 7;
 		} while ((buf[*i] & 0x80) == 0x80);
 	}
 
 	(*i)++;
-	return num;
+	return 1;
 }
 
 
+/* Strings in a HPACK header block are limited to this length */
+#if !defined(HTTP2_MAX_HEADER_STRING)
+#define HTTP2_MAX_HEADER_STRING (8192)
+#endif
+
+
 /* Function to decode a string from a HPACK encoded block */
 /* Strings have a variable size and can be either encoded directly (8 bits
  * per char), or using huffman encoding (variable bits per char).
  * The string starts at index *i. This index is advanced until the end of
- * the encoded string.
+ * the encoded string. Returns NULL for invalid or oversized strings.
  */
 static char *
 hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
@@ -659,12 +678,18 @@ hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
 	uint64_t byte_len64;
 	int byte_len;
 	int bit_len;
-	uint8_t is_huff = ((buf[*i] & 0x80) == 0x80);
+	uint8_t is_huff;
+
+	(void)ctx;
+
+	if (*i >= max_i) {
+		return NULL;
+	}
+	is_huff = ((buf[*i] & 0x80) == 0x80);
 
 	/* Get length of string in bytes */
-	byte_len64 = hpack_getnum(buf, i, 0x7f, ctx);
-	if (byte_len64 > 1024) {
-		/* TODO */
+	if (!hpack_getnum(buf, i, max_i, 0x7f, &byte_len64)
+	    || (byte_len64 > HTTP2_MAX_HEADER_STRING)) {
 		return NULL;
 	}
 	byte_len = (int)byte_len64;
@@ -692,40 +717,47 @@ hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
 		    buf + (*i);           /* begin pointer of bit input string */
 		int bitRead = 0;          /* number of encoded bits read */
 		uint32_t bytesStored = 0; /* number of decoded bytes stored */
-		uint8_t str[2048];        /* storage buffer for decoded string */
+		/* The shortest huffman code has 5 bits */
+		char *str = (char *)mg_malloc_ctx((bit_len / 5) + 1, ctx);
+
+		if (str == NULL) {
+			return NULL;
+		}
 
 		for (;;) {
-			uint32_t accu = 0; /* accu register: collect bits */
-			uint8_t bc = 0;    /* number of bits collected */
-			int n;
+			uint32_t accu = 0; /* accumulated bits */
+			uint8_t bc = 0;    /* bit counter */
+			uint32_t n;
 
-			/* Collect bits in this loop, until we have a valid huff code in
-			 * accu */
 			do {
+				if (bitRead >= bit_len) {
+					/* All bits consumed. The remaining bits must be a
+					 * prefix of EOS (all ones) shorter than 8 bits, see
+					 * https://tools.ietf.org/html/rfc7541#section-5.2 */
+					if ((bc > 7) || (accu != ((1u << bc) - 1u))) {
+						mg_free(str);
+						return NULL;
+					}
+					str[bytesStored] = 0;
+					(*i) += byte_len;
+					return str;
+				}
 				accu <<= 1;
 				accu |= (pData[bitRead / 8] >> (7 - (bitRead & 7))) & 1;
 				bitRead++;
 				bc++;
-				if (bitRead > bit_len) {
-					/* We used all bits. Return the decoded string. */
-					str[bytesStored] = 0; /* Terminate string */
-					(*i) += byte_len;     /* Advance parsing index */
-					return mg_strdup_ctx((char *)str,
-					                     ctx); /* Return a string copy */
-				}
 			} while ((bc < 5) || (accu > hpack_huff_end_code[bc - 5]));
 
-			/* Find matching code in huffman encoding table */
 			for (n = hpack_huff_start_index[bc - 5]; n < 256; n++) {
 				if (accu == hpack_huff_dec[n].encoded) {
-					str[bytesStored] = hpack_huff_dec[n].decoded;
-					bytesStored++;
+					str[bytesStored++] = (char)hpack_huff_dec[n].decoded;
 					break;
 				}
 			}
-			if (bytesStored == sizeof(str)) {
-				/* too long */
-				return 0;
+			if (n >= 256) {
+				/* Invalid code, or EOS inside the string */
+				mg_free(str);
+				return NULL;
 			}
 		}
 	}
@@ -761,65 +793,104 @@ append_bits(uint8_t *target,
 }
 
 
+/* Position of every character in hpack_huff_dec, for encoding */
+static uint8_t hpack_huff_enc_index[256];
+static volatile int hpack_huff_enc_index_ready = 0;
+
+static void
+hpack_init_encoder(void)
+{
+	int idx;
+
+	if (hpack_huff_enc_index_ready) {
+		return;
+	}
+	/* Several threads may run this at the same time. They all store the
+	 * same values, so this is harmless. */
+	for (idx = 0; idx < 256; idx++) {
+		hpack_huff_enc_index[hpack_huff_dec[idx].decoded] = (uint8_t)idx;
+	}
+	hpack_huff_enc_index_ready = 1;
+}
+
+
+/* Encode an integer with a prefix of prefix_bits bits, see
+ * https://tools.ietf.org/html/rfc7541#section-5.1
+ * The bits of the first byte not used by the prefix are taken from flags.
+ * Returns the number of bytes stored (at most 6 for 32 bit values).
+ */
 static int
-hpack_encode(uint8_t *store, const char *load, int lower)
+hpack_putnum(uint8_t *store, uint32_t num, uint8_t prefix_bits, uint8_t flags)
 {
-	uint32_t nohuff_len = strlen(load);
+	uint32_t max_prefix = (1u << prefix_bits) - 1u;
+	int n = 0;
+
+	if (num < max_prefix) {
+		store[n++] = (uint8_t)(flags | num);
+		return n;
+	}
+	store[n++] = (uint8_t)(flags | max_prefix);
+	num -= max_prefix;
+	while (num >= 0x80) {
+		store[n++] = (uint8_t)((num & 0x7F) | 0x80);
+		num >>= 7;
+	}
+	store[n++] = (uint8_t)num;
+	return n;
+}
+
 
+/* Encode a string literal, using huffman encoding if it is shorter.
+ * The store must hold at least strlen(load) + 6 bytes.
+ * Returns the number of bytes stored.
+ */
+static int
+hpack_encode(uint8_t *store, const char *load, int lower)
+{
+	uint32_t nohuff_len = (uint32_t)strlen(load);
 	uint32_t len_bits = 0;
 	uint32_t len_bytes;
 	uint32_t spare_bits;
 	uint32_t i;
-
-	memset(store, 0, nohuff_len + 1);
+	int n;
 
 	for (i = 0; i < nohuff_len; i++) {
-		uint8_t b = (uint8_t)((char)(lower ? tolower(load[i]) : load[i]));
-		int idx;
-
-		for (idx = 0; idx <= 255; idx++) {
-			if (hpack_huff_dec[idx].decoded == b) {
-				append_bits((uint8_t *)store + 1,
-				            len_bits,
-				            hpack_huff_dec[idx].encoded,
-				            hpack_huff_dec[idx].bitcount);
-				len_bits += hpack_huff_dec[idx].bitcount;
-				break;
-			}
-		}
+		uint8_t b = (uint8_t)(lower ? tolower((uint8_t)load[i]) : load[i]);
+		len_bits += hpack_huff_dec[hpack_huff_enc_index[b]].bitcount;
 	}
-
 	len_bytes = (len_bits + 7) / 8;
-	spare_bits = len_bytes * 8 - len_bits;
-	if (spare_bits) {
-		append_bits((uint8_t *)store + 1, len_bits, 0xFFFFFFFF, spare_bits);
+
+	if (len_bytes >= nohuff_len) {
+		/* Huffman encoding does not help: store directly */
+		n = hpack_putnum(store, nohuff_len, 7, 0x00);
+		for (i = 0; i < nohuff_len; i++) {
+			store[n + i] =
+			    (uint8_t)(lower ? tolower((uint8_t)load[i]) : load[i]);
+		}
+		return n + (int)nohuff_len;
 	}
 
-	if (len_bytes >= 127) {
-		// TODO: Shift string and encode len in more bytes
-		return 0;
+	n = hpack_putnum(store, len_bytes, 7, 0x80);
+	memset(store + n, 0, len_bytes);
+	len_bits = 0;
+	for (i = 0; i < nohuff_len; i++) {
+		uint8_t b = (uint8_t)(lower ? tolower((uint8_t)load[i]) : load[i]);
+		int idx = hpack_huff_enc_index[b];
+
+		append_bits(store + n,
+		            len_bits,
+		            hpack_huff_dec[idx].encoded,
+		            hpack_huff_dec[idx].bitcount);
+		len_bits += hpack_huff_dec[idx].bitcount;
 	}
-	*store = 0x80 + (uint8_t)len_bytes;
 
-	if ((len_bytes >= nohuff_len) && (0)) {
-		*store = (uint8_t)nohuff_len;
-		if (lower) {
-			for (i = 1; i <= nohuff_len; i++) {
-				store[i] = tolower(load[i]);
-			}
-		} else {
-			memcpy(store + 1, load, nohuff_len);
-		}
-		return nohuff_len + 1;
-	} else {
-		/*
-		int i = 0;
-		char *test = hpack_decode(store, &i, NULL);
-		i = i; // breakpoint for debugging / testing
-		*/
+	/* Pad with the most significant bits of EOS */
+	spare_bits = len_bytes * 8 - len_bits;
+	if (spare_bits) {
+		append_bits(store + n, len_bits, 0xFFFFFFFF, (uint8_t)spare_bits);
 	}
 
-	return len_bytes + 1;
+	return n + (int)len_bytes;
 }
 
 
@@ -831,64 +902,52 @@ hpack_encode(uint8_t *store, const char *load, int lower)
 static const char http2_pri[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
 static const unsigned char http2_pri_len = 24; /* = strlen(http2_pri) */
 
+/* Part of the preface read as HTTP/1.x request head ("prior knowledge") */
+static const unsigned char http2_pri_head_len = 18;
 
-/* Read and check the HTTP/2 primer/preface:
- * See https://tools.ietf.org/html/rfc7540#section-3.5 */
-static int
-is_valid_http2_primer(struct mg_connection *conn)
-{
-	size_t pri_len = http2_pri_len;
-	char buf[32]; /* Buffer must hold 24 bytes primer */
-
-	int read_pri_len = mg_read(conn, buf, pri_len);
-	if (read_pri_len != (int)pri_len) {
-		/* Size does not match.
-		 * This includes cases where mg_read returns error codes */
-		return 0;
-	}
-	if (0 != memcmp(buf, http2_pri, pri_len)) {
-		/* Primer does not match */
-		return 0;
-	}
-	/* Primer does match */
-	return 1;
-}
-
-
-#define mg_xwrite(conn, data, len)                                             \
-	push_all((conn)->phys_ctx,                                                 \
-	         NULL,                                                             \
-	         (conn)->client.sock,                                              \
-	         (conn)->ssl,                                                      \
-	         (const char *)(data),                                             \
-	         (int)(len))
-
-
-static void
-http2_settings_acknowledge(struct mg_connection *conn)
-{
-	unsigned char http2_set_ackn_frame[9] = {0, 0, 0, 4, 1, 0, 0, 0, 0};
 
-	DEBUG_TRACE("%s", "Sending settings frame");
-	mg_xwrite(conn, http2_set_ackn_frame, 9);
-}
+/* Limits of this server */
+#if !defined(HTTP2_MAX_STREAMS)
+#define HTTP2_MAX_STREAMS (32) /* concurrent streams per connection */
+#endif
+#if !defined(HTTP2_MAX_REQUEST_BODY)
+#define HTTP2_MAX_REQUEST_BODY (16 * 1024 * 1024)
+#endif
+#if !defined(HTTP2_MAX_HEADER_BLOCK)
+#define HTTP2_MAX_HEADER_BLOCK (65536)
+#endif
+#define HTTP2_MAX_FRAME_SIZE (16384)   /* SETTINGS_MAX_FRAME_SIZE sent */
+#define HTTP2_HEADER_TABLE_SIZE (4096) /* SETTINGS_HEADER_TABLE_SIZE sent */
+#define HTTP2_DEFAULT_WINDOW (65535)
+#define HTTP2_MAX_WINDOW (0x7FFFFFFF)
 
 
-struct http2_settings {
-	uint32_t settings_header_table_size;
-	uint32_t settings_enable_push;
-	uint32_t settings_max_concurrent_streams;
-	uint32_t settings_initial_window_size;
-	uint32_t settings_max_frame_size;
-	uint32_t settings_max_header_list_size;
+/* Stream states. Only states relevant for a server answering one stream
+ * after the other are distinguished. */
+enum {
+	HTTP2_STREAM_FREE = 0,   /* slot not in use */
+	HTTP2_STREAM_HEADERS,    /* receiving the request header block */
+	HTTP2_STREAM_OPEN,       /* receiving the request body */
+	HTTP2_STREAM_READY,      /* request complete, waiting for an answer */
+	HTTP2_STREAM_RESPONDING, /* request handler running */
+	HTTP2_STREAM_CLOSED      /* reset while the request handler is running */
 };
 
 
-const struct http2_settings http2_default_settings =
-    {4096, 1, UINT32_MAX, 65535, 16384, UINT32_MAX};
-
-const struct http2_settings http2_civetweb_server_settings =
-    {4096, 0, 100, 65535, 16384, 65535};
+struct mg_http2_stream {
+	uint32_t id;
+	int state;
+	uint32_t depends_on; /* priority: parent stream */
+	uint16_t weight;     /* priority: 1 .. 256 */
+	uint32_t seq;        /* arrival order */
+	int64_t send_window;
+	int headers_sent;
+	int num_headers;
+	struct mg_header *headers; /* MG_MAX_HEADERS entries */
+	char *body;
+	size_t body_len;
+	size_t body_size;
+};
 
 
 enum {
@@ -909,233 +968,317 @@ enum {
 };
 
 
-static void
-http2_send_settings(struct mg_connection *conn,
-                    const struct http2_settings *set)
-{
-	uint16_t id;
-	uint32_t data;
-	uint8_t http2_settings_frame[9] = {0, 0, 36, 4, 0, 0, 0, 0, 0};
-	mg_xwrite(conn, http2_settings_frame, 9);
-
-	id = htons(1);
-	data = htonl(set->settings_header_table_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_enable_push);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_concurrent_streams);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_initial_window_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_frame_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_header_list_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
+#define mg_xwrite(conn, data, len)                                             \
+	push_all((conn)->phys_ctx,                                                 \
+	         NULL,                                                             \
+	         (conn)->client.sock,                                              \
+	         (conn)->ssl,                                                      \
+	         (const char *)(data),                                             \
+	         (int)(len))
 
-	DEBUG_TRACE("%s", "HTTP2 settings sent");
+
+static uint32_t
+http2_get_u32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] * 0x1000000u) + ((uint32_t)p[1] * 0x10000u)
+	       + ((uint32_t)p[2] * 0x100u) + ((uint32_t)p[3]);
 }
 
 
-static int
-http2_send_response_headers(struct mg_connection *conn)
+static void
+http2_frame_head(uint8_t *head,
+                 uint32_t frame_size,
+                 uint8_t frame_type,
+                 uint8_t frame_flags,
+                 uint32_t stream_id)
 {
-	unsigned char http2_header_frame[9] = {0, 0, 0, 1, 4, 0, 0, 0, 0};
-	uint8_t header_bin[1024];
-	uint16_t header_len = 0;
-	int has_date = 0;
-	int has_connection_header = 0;
-	int i, ok;
+	head[0] = (uint8_t)((frame_size & 0xFF0000u) >> 16);
+	head[1] = (uint8_t)((frame_size & 0xFF00u) >> 8);
+	head[2] = (uint8_t)(frame_size & 0xFFu);
+	head[3] = frame_type;
+	head[4] = frame_flags;
+	head[5] = (uint8_t)((stream_id & 0x7F000000u) >> 24);
+	head[6] = (uint8_t)((stream_id & 0xFF0000u) >> 16);
+	head[7] = (uint8_t)((stream_id & 0xFF00u) >> 8);
+	head[8] = (uint8_t)(stream_id & 0xFFu);
+}
 
-	if ((conn->status_code < 100) || (conn->status_code > 999)) {
-		/* Invalid status: Set status to "Internal Server Error" */
-		conn->status_code = 500;
-	}
 
-	switch (conn->status_code) {
-	case 200:
-		header_bin[header_len++] = 0x88;
-		break;
-	case 204:
-		header_bin[header_len++] = 0x89;
-		break;
-	case 206:
-		header_bin[header_len++] = 0x8A;
-		break;
-	case 304:
-		header_bin[header_len++] = 0x8B;
-		break;
-	case 400:
-		header_bin[header_len++] = 0x8C;
-		break;
-	case 404:
-		header_bin[header_len++] = 0x8D;
-		break;
-	case 500:
-		header_bin[header_len++] = 0x8E;
-		break;
-	default:
-		header_bin[header_len++] = 0x48;
-		header_bin[header_len++] = 0x03;
-		header_bin[header_len++] = 0x30 + (conn->status_code / 100);
-		header_bin[header_len++] = 0x30 + ((conn->status_code / 10) % 10);
-		header_bin[header_len++] = 0x30 + (conn->status_code % 10);
-		break;
-	}
+/* Read exactly len bytes from the connection.
+ * Data is read through conn->buf, so several small frames are received
+ * with one system call. Data already buffered while reading a HTTP/1.x
+ * request (h2c upgrade, prior knowledge) is used first. */
+static int
+http2_read_raw(struct mg_connection *conn, uint8_t *buf, uint32_t len)
+{
+	double timeout = -1.0;
+	uint64_t start_time;
+
+	while (len > 0) {
+		int avail = conn->data_len - conn->request_len
+		            - (int)conn->consumed_content;
+
+		if (avail > 0) {
+			uint32_t n = ((uint32_t)avail < len) ? (uint32_t)avail : len;
+			memcpy(buf,
+			       conn->buf + conn->request_len + conn->consumed_content,
+			       n);
+			conn->consumed_content += n;
+			buf += n;
+			len -= n;
+			continue;
+		}
 
-	/* Add all headers */
-	for (i = 0; i < conn->response_info.num_headers; i++) {
-		uint16_t predef = 0;
-		uint16_t j;
+		/* Buffer is empty: refill it */
+		conn->data_len = 0;
+		conn->request_len = 0;
+		conn->consumed_content = 0;
 
-		/* Filter headers not valid in HTTP/2 */
-		if (!mg_strcasecmp("Connection",
-		                   conn->response_info.http_headers[i].name)) {
-			has_connection_header = 1;
-			continue; /* do not send */
+		if (timeout < 0.0) {
+			const char *cfg = conn->dom_ctx->config[REQUEST_TIMEOUT];
+			if (cfg == NULL) {
+				cfg = config_options[REQUEST_TIMEOUT].default_value;
+			}
+			timeout = atoi(cfg) / 1000.0;
 		}
-
-		/* Check if this header is known in HPACK (static table index 15 to 61)
-		 * see https://tools.ietf.org/html/rfc7541#appendix-A */
-		for (j = 15; j <= 61; j++) {
-			if (!mg_strcasecmp(hpack_predefined[j].name,
-			                   conn->response_info.http_headers[i].name)) {
-				predef = j;
+		start_time = mg_get_current_time_ns();
+		for (;;) {
+			int n;
+			if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+				return 0;
+			}
+			n = pull_inner(NULL, conn, conn->buf, conn->buf_size, timeout);
+			if (n > 0) {
+				conn->data_len = n;
 				break;
 			}
-		}
-
-		if (predef) {
-			/* Predefined header found */
-			header_bin[header_len++] = 0x40 + predef;
-		} else {
-			/* Rare header, do not index */
-			header_bin[header_len++] = 0x10;
-			j = hpack_encode(header_bin + header_len,
-			                 conn->response_info.http_headers[i].name,
-			                 1);
-			header_len += j;
-		}
-
-		j = hpack_encode(header_bin + header_len,
-		                 conn->response_info.http_headers[i].value,
-		                 0);
-		header_len += j;
-
-		/* Mark required headers as sent */
-		if (!mg_strcasecmp("Date", conn->response_info.http_headers[i].name)) {
-			has_date = 1;
+			if ((n != -1)
+			    || ((mg_get_current_time_ns() - start_time)
+			        > (uint64_t)(timeout * 1.0E9))) {
+				/* Error, connection closed or timeout */
+				return 0;
+			}
+			/* TLS layer needs more data */
 		}
 	}
+	return 1;
+}
 
-	/* Add required headers, if they have not been sent yet */
-	if (!has_date) {
-		/* Create header frame */
-		char date[64];
-		uint8_t date_len;
-		time_t curtime = time(NULL);
 
-		gmt_time_string(date, sizeof(date), &curtime);
-		date_len = (uint8_t)strlen(date);
+/* Check if more data can be read without blocking */
+static int
+http2_data_pending(struct mg_connection *conn)
+{
+	struct mg_pollfd pfd;
 
-		header_bin[header_len++] =
-		    0x61; /* "Date" predefined HPACK index 33 (0x21) + 0x40 */
-		header_bin[header_len++] = date_len;
-		memcpy(header_bin + header_len, date, date_len);
-		header_len += date_len;
+	if (conn->data_len - conn->request_len - (int)conn->consumed_content
+	    > 0) {
+		return 1;
 	}
+#if !defined(NO_SSL)
+	if ((conn->ssl != NULL) && (SSL_pending(conn->ssl) > 0)) {
+		return 1;
+	}
+#endif
+	pfd.fd = conn->client.sock;
+	pfd.events = POLLIN;
+	return (mg_poll(&pfd, 1, 0, &(conn->phys_ctx->stop_flag)) > 0);
+}
 
-	http2_header_frame[1] = (header_len & 0xFF00) >> 8;
-	http2_header_frame[2] = (header_len & 0xFF);
 
-	http2_header_frame[5] = (conn->http2.stream_id & 0xFF000000u) >> 24;
-	http2_header_frame[6] = (conn->http2.stream_id & 0xFF0000u) >> 16;
-	http2_header_frame[7] = (conn->http2.stream_id & 0xFF00u) >> 8;
-	http2_header_frame[8] = (conn->http2.stream_id & 0xFFu);
+/* Read and check the HTTP/2 primer/preface:
+ * See https://tools.ietf.org/html/rfc7540#section-3.5 */
+static int
+is_valid_http2_primer(struct mg_connection *conn,
+                      const char *expected,
+                      size_t pri_len)
+{
+	uint8_t buf[32]; /* Buffer must hold 24 bytes primer */
 
-	/* Send header frame */
-	ok = 1;
-	if (mg_xwrite(conn, http2_header_frame, 9) != 9) {
-		ok = 0;
-	} else if (mg_xwrite(conn, header_bin, header_len) != header_len) {
-		ok = 0;
+	if (!http2_read_raw(conn, buf, (uint32_t)pri_len)) {
+		/* This includes cases where the peer closed the connection */
+		return 0;
 	}
-	if (ok) {
-		DEBUG_TRACE("HTTP2 response header sent: stream %u",
-		            conn->http2.stream_id);
-	} else {
-		DEBUG_TRACE("HTTP2 response header sending error: stream %u",
-		            conn->http2.stream_id);
+	if (0 != memcmp(buf, expected, pri_len)) {
+		/* Primer does not match */
+		return 0;
 	}
+	/* Primer does match */
+	return 1;
+}
 
-	(void)has_connection_header; /* ignore for the moment */
 
-	return ok;
+/* Check if a HTTP/1.x request head is the start of a HTTP/2 connection
+ * preface ("prior knowledge", RFC 7540, 3.4) */
+static int
+is_http2_prior_knowledge(const struct mg_connection *conn)
+{
+	if (conn->client.is_ssl || (conn->handled_requests > 0)
+	    || (conn->request_len != http2_pri_head_len)
+	    || (conn->data_len < http2_pri_head_len)) {
+		/* For TLS, HTTP/2 is negotiated using ALPN */
+		return 0;
+	}
+	if (memcmp(conn->buf, http2_pri, http2_pri_head_len)) {
+		return 0;
+	}
+	return (0 == strcmp(conn->dom_ctx->config[ENABLE_HTTP2], "yes"));
 }
 
 
 static void
-http2_data_frame_head(struct mg_connection *conn,
-                      uint32_t frame_size,
-                      int is_final)
+http2_settings_acknowledge(struct mg_connection *conn)
 {
-	unsigned char http2_data_frame[9];
-	uint32_t stream_id = conn->http2.stream_id;
+	unsigned char http2_set_ackn_frame[9] = {0, 0, 0, 4, 1, 0, 0, 0, 0};
 
-	http2_data_frame[0] = (frame_size & 0xFF0000) >> 16;
-	http2_data_frame[1] = (frame_size & 0xFF00) >> 8;
-	http2_data_frame[2] = (frame_size & 0xFF);
+	DEBUG_TRACE("%s", "Sending settings frame");
+	mg_xwrite(conn, http2_set_ackn_frame, 9);
+}
 
-	http2_data_frame[3] = 0; /* frame type "DATA" */
-	http2_data_frame[4] = (is_final ? 1 : 0);
 
-	http2_data_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_data_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_data_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_data_frame[8] = (stream_id & 0xFFu);
+struct http2_settings {
+	uint32_t settings_header_table_size;
+	uint32_t settings_enable_push;
+	uint32_t settings_max_concurrent_streams;
+	uint32_t settings_initial_window_size;
+	uint32_t settings_max_frame_size;
+	uint32_t settings_max_header_list_size;
+};
 
-	DEBUG_TRACE("HTTP2 begin data frame: stream %u, frame_size %u (final: %i)",
-	            stream_id,
-	            frame_size,
-	            is_final);
 
-	mg_xwrite(conn, http2_data_frame, 9);
-}
+const struct http2_settings http2_civetweb_server_settings =
+    {HTTP2_HEADER_TABLE_SIZE,
+     0,
+     HTTP2_MAX_STREAMS,
+     HTTP2_DEFAULT_WINDOW,
+     HTTP2_MAX_FRAME_SIZE,
+     HTTP2_MAX_HEADER_BLOCK};
 
 
 static void
-http2_send_window(struct mg_connection *conn,
-                  uint32_t stream_id,
-                  uint32_t window_size)
+http2_send_settings(struct mg_connection *conn,
+                    const struct http2_settings *set)
+{
+	uint8_t frame[9 + 36];
+	uint32_t val[6];
+	int i;
+
+	val[0] = set->settings_header_table_size;
+	val[1] = set->settings_enable_push;
+	val[2] = set->settings_max_concurrent_streams;
+	val[3] = set->settings_initial_window_size;
+	val[4] = set->settings_max_frame_size;
+	val[5] = set->settings_max_header_list_size;
+
+	http2_frame_head(frame, 36, 4, 0, 0);
+	for (i = 0; i < 6; i++) {
+		uint8_t *p = frame + 9 + 6 * i;
+		p[0] = 0;
+		p[1] = (uint8_t)(i + 1); /* setting identifiers are 1 to 6 */
+		p[2] = (uint8_t)(val[i] >> 24);
+		p[3] = (uint8_t)(val[i] >> 16);
+		p[4] = (uint8_t)(val[i] >> 8);
+		p[5] = (uint8_t)val[i];
+	}
+	mg_xwrite(conn, frame, sizeof(frame));
+
+	DEBUG_TRACE("%s", "HTTP2 settings sent");
+}
+
+
+/* Apply a SETTINGS frame payload of the peer.
+ * Returns HTTP2_ERR_NO_ERROR or the connection error to report. */
+static uint32_t
+http2_apply_settings(struct mg_connection *conn,
+                     const uint8_t *buf,
+                     uint32_t size)
+{
+	uint32_t i;
+
+	if (size % 6) {
+		return HTTP2_ERR_FRAME_SIZE_ERROR;
+	}
+	for (i = 0; i < size; i += 6) {
+		uint16_t id = (uint16_t)(((uint16_t)buf[i] * 0x100u) + buf[i + 1]);
+		uint32_t val = http2_get_u32(buf + i + 2);
+
+		switch (id) {
+		case 2: /* ENABLE_PUSH. We never push. */
+			if (val > 1) {
+				return HTTP2_ERR_PROTOCOL_ERROR;
+			}
+			break;
+		case 4: /* INITIAL_WINDOW_SIZE */
+			if (val > HTTP2_MAX_WINDOW) {
+				return HTTP2_ERR_FLOW_CONTROL_ERROR;
+			} else {
+				/* Adjust the windows of all open streams by the change,
+				 * see https://tools.ietf.org/html/rfc7540#section-6.9.2 */
+				int64_t delta =
+				    (int64_t)val - conn->http2.initial_window_size;
+				int s;
+				for (s = 0; s < HTTP2_MAX_STREAMS; s++) {
+					if (conn->http2.streams[s].state != HTTP2_STREAM_FREE) {
+						conn->http2.streams[s].send_window += delta;
+					}
+				}
+				conn->http2.initial_window_size = val;
+			}
+			break;
+		case 5: /* MAX_FRAME_SIZE */
+			if ((val < 16384) || (val > 16777215)) {
+				return HTTP2_ERR_PROTOCOL_ERROR;
+			}
+			conn->http2.max_frame_size = val;
+			break;
+		default:
+			/* HEADER_TABLE_SIZE is irrelevant, since the response
+			 * encoder does not use the dynamic table of the peer.
+			 * MAX_CONCURRENT_STREAMS only limits server push.
+			 * MAX_HEADER_LIST_SIZE is advisory.
+			 * Unknown settings must be ignored. */
+			DEBUG_TRACE("HTTP2 setting %u: %u", id, val);
+			break;
+		}
+	}
+	return HTTP2_ERR_NO_ERROR;
+}
+
+
+static void
+http2_send_window(struct mg_connection *conn,
+                  uint32_t stream_id,
+                  uint32_t window_size)
 {
-	unsigned char http2_window_frame[9] = {0, 0, 4, 8, 0, 0, 0, 0, 0};
-	uint32_t data = htonl(window_size);
+	uint8_t frame[13];
 
-	DEBUG_TRACE("HTTP2 send window_size: stream %u, error %u",
+	DEBUG_TRACE("HTTP2 send window_size: stream %u, size %u",
 	            stream_id,
 	            window_size);
 
-	http2_window_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_window_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_window_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_window_frame[8] = (stream_id & 0xFFu);
-	mg_xwrite(conn, http2_window_frame, 9);
-	mg_xwrite(conn, &data, 4);
+	http2_frame_head(frame, 4, 8, 0, stream_id);
+	frame[9] = (uint8_t)((window_size >> 24) & 0x7F);
+	frame[10] = (uint8_t)(window_size >> 16);
+	frame[11] = (uint8_t)(window_size >> 8);
+	frame[12] = (uint8_t)window_size;
+	mg_xwrite(conn, frame, sizeof(frame));
+}
+
+
+static struct mg_http2_stream *
+http2_find_stream(struct mg_connection *conn, uint32_t stream_id)
+{
+	int i;
+	if (stream_id == 0) {
+		return NULL;
+	}
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		if ((conn->http2.streams[i].state != HTTP2_STREAM_FREE)
+		    && (conn->http2.streams[i].id == stream_id)) {
+			return &conn->http2.streams[i];
+		}
+	}
+	return NULL;
 }
 
 
@@ -1144,17 +1287,56 @@ http2_reset_stream(struct mg_connection *conn,
                    uint32_t stream_id,
                    uint32_t error_id)
 {
-	unsigned char http2_reset_frame[9] = {0, 0, 4, 3, 0, 0, 0, 0, 0};
-	uint32_t val = htonl(error_id);
+	uint8_t frame[13];
+	struct mg_http2_stream *s = conn->http2.current;
 
 	DEBUG_TRACE("HTTP2 send reset: stream %u, error %u", stream_id, error_id);
 
-	http2_reset_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_reset_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_reset_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_reset_frame[8] = (stream_id & 0xFFu);
-	mg_xwrite(conn, http2_reset_frame, 9);
-	mg_xwrite(conn, &val, 4);
+	if ((s != NULL) && (s->id == stream_id)) {
+		/* No further frames must be sent for this stream */
+		s->state = HTTP2_STREAM_CLOSED;
+	}
+
+	http2_frame_head(frame, 4, 3, 0, stream_id);
+	frame[9] = (uint8_t)(error_id >> 24);
+	frame[10] = (uint8_t)(error_id >> 16);
+	frame[11] = (uint8_t)(error_id >> 8);
+	frame[12] = (uint8_t)error_id;
+	mg_xwrite(conn, frame, sizeof(frame));
+}
+
+
+static void
+http2_send_goaway(struct mg_connection *conn, uint32_t error_id)
+{
+	uint8_t frame[17];
+	uint32_t last_stream = conn->http2.max_stream_id;
+
+	DEBUG_TRACE("HTTP2 send goaway: error %u", error_id);
+
+	http2_frame_head(frame, 8, 7, 0, 0);
+	frame[9] = (uint8_t)((last_stream >> 24) & 0x7F);
+	frame[10] = (uint8_t)(last_stream >> 16);
+	frame[11] = (uint8_t)(last_stream >> 8);
+	frame[12] = (uint8_t)last_stream;
+	frame[13] = (uint8_t)(error_id >> 24);
+	frame[14] = (uint8_t)(error_id >> 16);
+	frame[15] = (uint8_t)(error_id >> 8);
+	frame[16] = (uint8_t)error_id;
+	mg_xwrite(conn, frame, sizeof(frame));
+}
+
+
+/* Connection error: send GOAWAY, the connection will be closed.
+ * Always returns 0, so it can be used as "return http2_conn_error(...)". */
+static int
+http2_conn_error(struct mg_connection *conn, uint32_t error_id)
+{
+	if (!conn->http2.closed) {
+		http2_send_goaway(conn, error_id);
+		conn->http2.closed = 1;
+	}
+	return 0;
 }
 
 
@@ -1162,7 +1344,9 @@ static void
 http2_must_use_http1(struct mg_connection *conn)
 {
 	DEBUG_TRACE("HTTP2 not available for this URL (%s)", conn->path_info);
-	http2_reset_stream(conn, conn->http2.stream_id, 0xd);
+	http2_reset_stream(conn,
+	                   conn->http2.stream_id,
+	                   HTTP2_ERR_HTTP_1_1_REQUIRED);
 }
 
 
@@ -1193,27 +1377,108 @@ static int mem_d_count = 0;
 #endif
 
 
+/* The dynamic header table (https://tools.ietf.org/html/rfc7541#section-2.3.2)
+ * is a ring buffer. The newest entry is stored at dyn_table_first and has
+ * the HPACK index 62. Its size is accounted in octets as defined in
+ * https://tools.ietf.org/html/rfc7541#section-4.1
+ */
+static uint32_t
+hpack_entry_octets(const struct mg_header *h)
+{
+	return (uint32_t)(strlen(h->name) + strlen(h->value) + 32);
+}
+
+
+static const struct mg_header *
+hpack_dyn_entry(const struct mg_connection *conn, uint64_t idx)
+{
+	uint64_t k = idx - 62; /* 0 = newest entry */
+	if ((idx < 62) || (k >= conn->http2.dyn_table_size)) {
+		return NULL;
+	}
+	return &conn->http2
+	            .dyn_table[(conn->http2.dyn_table_first + k)
+	                       % HTTP2_DYN_TABLE_SIZE];
+}
+
+
+/* Remove the oldest entry */
+static void
+hpack_dyn_evict(struct mg_connection *conn)
+{
+	uint32_t pos = (conn->http2.dyn_table_first + conn->http2.dyn_table_size
+	                - 1)
+	               % HTTP2_DYN_TABLE_SIZE;
+	struct mg_header *h = &conn->http2.dyn_table[pos];
+
+	conn->http2.dyn_table_octets -= hpack_entry_octets(h);
+	conn->http2.dyn_table_size--;
+
+	CHECK_LEAK_DYN_FREE(h->name);
+	CHECK_LEAK_DYN_FREE(h->value);
+	mg_free((void *)h->name);
+	mg_free((void *)h->value);
+	h->name = NULL;
+	h->value = NULL;
+}
+
+
 /* The dynamic header table may be resized on a HTTP2 client request.
- * A tablesize=0 will free all memory.
+ * A tableSize=0 will free all memory.
  */
 static void
 purge_dynamic_header_table(struct mg_connection *conn, uint32_t tableSize)
 {
-	DEBUG_TRACE("HTTP2 dynamic header table set to %u", tableSize);
-	while (conn->http2.dyn_table_size > tableSize) {
-		conn->http2.dyn_table_size--;
+	DEBUG_TRACE("HTTP2 dynamic header table set to %u octets", tableSize);
+	conn->http2.dyn_table_max_octets = tableSize;
+	while ((conn->http2.dyn_table_size > 0)
+	       && (conn->http2.dyn_table_octets > tableSize)) {
+		hpack_dyn_evict(conn);
+	}
+}
+
 
-		CHECK_LEAK_DYN_FREE(
-		    conn->http2.dyn_table[conn->http2.dyn_table_size].name);
-		CHECK_LEAK_DYN_FREE(
-		    conn->http2.dyn_table[conn->http2.dyn_table_size].value);
+/* Add a new entry. Returns 0 if out of memory. */
+static int
+hpack_dyn_insert(struct mg_connection *conn, const char *key, const char *val)
+{
+	uint32_t octets = (uint32_t)(strlen(key) + strlen(val) + 32);
+	struct mg_header *h;
+
+	while ((conn->http2.dyn_table_size > 0)
+	       && ((conn->http2.dyn_table_octets + octets
+	            > conn->http2.dyn_table_max_octets)
+	           || (conn->http2.dyn_table_size >= HTTP2_DYN_TABLE_SIZE))) {
+		hpack_dyn_evict(conn);
+	}
+	if (octets > conn->http2.dyn_table_max_octets) {
+		/* An entry larger than the table empties the table */
+		return 1;
+	}
 
-		mg_free((void *)conn->http2.dyn_table[conn->http2.dyn_table_size].name);
-		conn->http2.dyn_table[conn->http2.dyn_table_size].name = 0;
-		mg_free(
-		    (void *)conn->http2.dyn_table[conn->http2.dyn_table_size].value);
-		conn->http2.dyn_table[conn->http2.dyn_table_size].value = 0;
+	conn->http2.dyn_table_first =
+	    (conn->http2.dyn_table_first + HTTP2_DYN_TABLE_SIZE - 1)
+	    % HTTP2_DYN_TABLE_SIZE;
+	h = &conn->http2.dyn_table[conn->http2.dyn_table_first];
+	h->name = mg_strdup_ctx(key, conn->phys_ctx);
+	h->value = mg_strdup_ctx(val, conn->phys_ctx);
+	conn->http2.dyn_table_size++;
+	if ((h->name == NULL) || (h->value == NULL)) {
+		mg_free((void *)h->name);
+		mg_free((void *)h->value);
+		h->name = h->value = "";
+		conn->http2.dyn_table_octets += 32;
+		hpack_dyn_evict(conn);
+		return 0;
 	}
+	CHECK_LEAK_DYN_ALLOC(h->name);
+	CHECK_LEAK_DYN_ALLOC(h->value);
+	conn->http2.dyn_table_octets += octets;
+
+	DEBUG_TRACE("HTTP2 new dynamic header table entry (key: %s, value: %s)",
+	            key,
+	            val);
+	return 1;
 }
 
 
@@ -1247,639 +1512,1311 @@ free_buffered_request_header_list(struct mg_connection *conn)
 }
 
 
-/* HTTP2 requires a different handling loop */
+/* Add a header to a stream. Key and value are taken over (freed on error). */
 static void
-handle_http2(struct mg_connection *conn)
+http2_stream_add_header(struct mg_http2_stream *s, char *key, char *val)
 {
-	unsigned char http2_frame_head[9];
-	uint32_t http2_frame_size;
-	uint8_t http2_frame_type;
-	uint8_t http2_frame_flags;
-	uint32_t http2_frame_stream_id;
-	uint32_t http_window_length = 0;
-	int bytes_read;
-	uint8_t *buf;
-	int my_settings_accepted = 0;
-	const char *my_hpack_headers[128];
-
-	struct http2_settings client_settings = http2_default_settings;
-	struct http2_settings server_settings = http2_default_settings;
-
-	/* Send own settings */
-	http2_send_settings(conn, &http2_civetweb_server_settings);
-	// http2_send_window(conn, 0, /* 0x3fff0001 */ 1024*1024);
-
-	/* initialize hpack header table with predefined header fields */
-	memset((void *)my_hpack_headers, 0, sizeof(my_hpack_headers));
-	memcpy((void *)my_hpack_headers,
-	       hpack_predefined,
-	       sizeof(hpack_predefined));
-
-	buf = (uint8_t *)mg_malloc_ctx(server_settings.settings_max_frame_size,
-	                               conn->phys_ctx);
-	if (!buf) {
-		/* Out of memory */
-		DEBUG_TRACE("%s", "Out of memory for HTTP2 frame");
-		return;
+	if ((s != NULL) && (key != NULL) && (val != NULL)
+	    && (s->num_headers < MG_MAX_HEADERS)) {
+		s->headers[s->num_headers].name = key;
+		s->headers[s->num_headers].value = val;
+		s->num_headers++;
+		CHECK_LEAK_HDR_ALLOC(key);
+		CHECK_LEAK_HDR_ALLOC(val);
+		DEBUG_TRACE("HTTP2 request header (key: %s, value: %s)", key, val);
+	} else {
+		/* - either the stream is refused or already has all headers,
+		 * - or key or value are NULL (out of memory) */
+		mg_free(key);
+		mg_free(val);
 	}
+}
 
-	for (;;) {
-		/* HTTP/2 is handled frame by frame */
-		int frame_is_end_stream = 0;
-		int frame_is_end_headers = 0;
-		int frame_is_padded = 0;
-		int frame_is_priority = 0;
 
-#if defined(USE_SERVER_STATS)
-		conn->conn_state = 3; /* HTTP/2 ready */
-#endif
+/* Decode a complete header block.
+ * The block must be decoded even if the stream is not accepted (s == NULL),
+ * since decoding modifies the dynamic table.
+ * Returns 0 on a compression error. */
+static int
+http2_decode_header_block(struct mg_connection *conn,
+                          const uint8_t *buf,
+                          int len,
+                          struct mg_http2_stream *s)
+{
+	int i = 0;
+
+	while (i < len) {
+		uint8_t idx_mask;
+		uint64_t idx;
+		int value_known = 0, indexing = 0;
+		char *key = NULL, *val = NULL;
+
+		if ((buf[i] & 0x80) == 0x80) {
+			/* 6.1 Indexed Header Field Representation */
+			idx_mask = 0x7f;
+			value_known = 1;
+		} else if ((buf[i] & 0xC0) == 0x40) {
+			/* 6.2.1 Literal Header Field with Incremental Indexing */
+			idx_mask = 0x3f;
+			indexing = 1;
+		} else if ((buf[i] & 0xE0) == 0x20) {
+			/* 6.3 Dynamic Table Size Update */
+			if (!hpack_getnum(buf, &i, len, 0x1f, &idx)
+			    || (idx > HTTP2_HEADER_TABLE_SIZE)) {
+				/* Must not exceed our SETTINGS_HEADER_TABLE_SIZE */
+				return 0;
+			}
+			purge_dynamic_header_table(conn, (uint32_t)idx);
+			continue;
+		} else {
+			/* 6.2.2 Literal Header Field without Indexing and
+			 * 6.2.3 Literal Header Field Never Indexed */
+			idx_mask = 0x0f;
+		}
+
+		if (!hpack_getnum(buf, &i, len, idx_mask, &idx)) {
+			return 0;
+		}
 
-		bytes_read = mg_read(conn, http2_frame_head, sizeof(http2_frame_head));
-		if (bytes_read != sizeof(http2_frame_head)) {
-			/* TODO: errormsg */
-			goto clean_http2;
-		}
-
-		/* Extract data from frame header */
-		http2_frame_size = ((uint32_t)http2_frame_head[0] * 0x10000u)
-		                   + ((uint32_t)http2_frame_head[1] * 0x100u)
-		                   + ((uint32_t)http2_frame_head[2]);
-		http2_frame_type = http2_frame_head[3];
-		http2_frame_flags = http2_frame_head[4];
-		http2_frame_stream_id = ((uint32_t)http2_frame_head[5] * 0x1000000u)
-		                        + ((uint32_t)http2_frame_head[6] * 0x10000u)
-		                        + ((uint32_t)http2_frame_head[7] * 0x100u)
-		                        + ((uint32_t)http2_frame_head[8]);
-
-		frame_is_end_stream = (0 != (http2_frame_flags & 0x01));
-		frame_is_end_headers = (0 != (http2_frame_flags & 0x04));
-		frame_is_padded = (0 != (http2_frame_flags & 0x08));
-		frame_is_priority = (0 != (http2_frame_flags & 0x20));
-
-		if (http2_frame_size > server_settings.settings_max_frame_size) {
-			/* TODO: Error Message */
-			DEBUG_TRACE("HTTP2 frame too large (%lu)",
-			            (unsigned long)http2_frame_size);
-			goto clean_http2;
-		}
-		bytes_read = mg_read(conn, buf, http2_frame_size);
-		if (bytes_read != (int)http2_frame_size) {
-			/* TODO: Error Message - or read again? */
-			DEBUG_TRACE("HTTP2 read error (%li != %li)",
-			            (signed long int)bytes_read,
-			            (signed long int)http2_frame_size);
-			goto clean_http2;
-		}
-
-		DEBUG_TRACE("HTTP2 frame type %u, size %u, stream %u, flags %02x",
-		            http2_frame_type,
-		            http2_frame_size,
-		            http2_frame_stream_id,
-		            http2_frame_flags);
-
-		/* Further processing according to frame type. See definition: */
-		/* https://tools.ietf.org/html/rfc7540#section-6 */
-		switch (http2_frame_type) {
-
-		case 0: /* DATA */
-		{
-			/* TODO */
-			DEBUG_TRACE("%s", "HTTP2 DATA frame?");
-		} break;
-
-		case 1: /* HEADERS */
-		{
-			int i = 0;
-			uint8_t padding = 0;
-			uint32_t dependency = 0;
-			uint8_t weight = 0;
-			uint8_t exclusive = 0;
-
-			/* Request start time */
-			clock_gettime(CLOCK_MONOTONIC, &(conn->req_time));
-
-			if (frame_is_padded) {
-				padding = buf[i];
-				i++;
-				DEBUG_TRACE("HTTP2 frame padded by %u bytes", padding);
+		if (idx == 0) {
+			/* Literal name. Invalid for an indexed header field. */
+			if (value_known) {
+				return 0;
 			}
-			if (frame_is_priority) {
-				uint32_t val = ((uint32_t)buf[0 + i] * 0x1000000u)
-				               + ((uint32_t)buf[1 + i] * 0x10000u)
-				               + ((uint32_t)buf[2 + i] * 0x100u)
-				               + ((uint32_t)buf[3 + i]);
-				dependency = (val & 0x7FFFFFFFu);
-				exclusive = ((val & 0x80000000u) != 0);
-				weight = buf[4 + i];
-				i += 5;
-				DEBUG_TRACE(
-				    "HTTP2 frame weight %u, dependency %u (exclusive: %i)",
-				    weight,
-				    dependency,
-				    exclusive);
+			key = hpack_decode(buf, &i, len, conn->phys_ctx);
+			if (key == NULL) {
+				return 0;
 			}
-
-			conn->request_info.num_headers = 0;
-
-			while (i < (int)http2_frame_size - (int)padding) {
-				const char *key = 0;
-				const char *val = 0;
-				uint8_t idx_mask = 0;
-				uint8_t value_known = 0;
-				uint8_t indexing = 0;
-				uint64_t idx = 0;
-
-				/* Classify next entry by checking the bit mask */
-				if ((buf[i] & 0x80u) == 0x80u) {
-					/* Indexed Header Field Representation:
-					 * https://tools.ietf.org/html/rfc7541#section-6.1 */
-					idx_mask = 0x7fu;
-					value_known = 1;
-
-				} else if ((buf[i] & 0xC0u) == 0x40u) {
-					/* Literal Header Field with Incremental Indexing:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.1 */
-					idx_mask = 0x3fu;
-					indexing = 1;
-
-				} else if ((buf[i] & 0xF0u) == 0x00u) {
-					/* Literal Header Field without Indexing:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.2 */
-					idx_mask = 0x0fu;
-
-				} else if ((buf[i] & 0xF0u) == 0x10u) {
-					/* Literal Header Field Never Indexed:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.3 */
-					idx_mask = 0x0fu;
-
-				} else if ((buf[i] & 0xE0u) == 0x20u) {
-					uint64_t tableSize;
-					/* Dynamic Table Size Update:
-					 * https://tools.ietf.org/html/rfc7541#section-6.3 */
-					idx_mask = 0x1fu;
-					tableSize = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
-
-					/* TODO: check if tablesize > allowed table size */
-
-					/* Purge additional table entries */
-					purge_dynamic_header_table(conn, (uint32_t)tableSize);
-
-					/* Process next frame */
-					continue;
-
-				} else {
-					DEBUG_TRACE("HTTP2 unknown start pattern %02x", buf[i]);
-					goto clean_http2;
+		} else {
+			const struct mg_header *h =
+			    (idx < 62) ? &hpack_predefined[idx]
+			               : hpack_dyn_entry(conn, idx);
+			if (h == NULL) {
+				/* Index not in table */
+				return 0;
+			}
+			key = mg_strdup_ctx(h->name, conn->phys_ctx);
+			if (value_known) {
+				if (h->value == NULL) {
+					/* Fully indexed, but the static entry has a name
+					 * only (RFC 7541 Appendix A). Entries referenced for
+					 * their name take the literal value below. */
+					mg_free(key);
+					return 0;
 				}
+				val = mg_strdup_ctx(h->value, conn->phys_ctx);
+			}
+		}
 
-				/* Get the header name table index */
-				idx = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
-
-				/* Get Header name "key" */
-				if (idx == 0) {
-					/* Index 0: Header name encoded in following bytes */
-					key =
-					    hpack_decode(buf, &i, (int)bytes_read, conn->phys_ctx);
-					CHECK_LEAK_HDR_ALLOC(key);
-					if (!key) {
-						DEBUG_TRACE("%s", "HTTP2 key decoding error");
-						goto clean_http2;
-					}
-				} else if (/*(idx >= 15) &&*/ (idx <= 61)) {
-					/* Take key name from predefined header table */
-					key = mg_strdup_ctx(hpack_predefined[idx].name,
-					                    conn->phys_ctx); /* leak? */
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else if ((idx >= 62)
-				           && ((idx - 61) <= conn->http2.dyn_table_size)) {
-					/* Take from dynamic header table */
-					uint32_t local_table_idx = (uint32_t)idx - 62;
-					key = mg_strdup_ctx(
-					    conn->http2.dyn_table[local_table_idx].name,
-					    conn->phys_ctx);
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else {
-					/* protocol violation */
-					DEBUG_TRACE("HTTP2 invalid index %lu", (unsigned long)idx);
-					goto clean_http2;
-				}
-				/* key is allocated now and must be freed later */
-
-				/* Get header value */
-				if (value_known) {
-					/* Server must already know the value */
-					if (idx <= 61) {
-						if (hpack_predefined[idx].value) {
-							val = mg_strdup_ctx(hpack_predefined[idx].value,
-							                    conn->phys_ctx); /* leak? */
-							CHECK_LEAK_HDR_ALLOC(val);
-						} else {
-							/* protocol violation */
-							DEBUG_TRACE("HTTP2 indexed header %lu has no value "
-							            "(key: %s)",
-							            (unsigned long)idx,
-							            key);
-							CHECK_LEAK_HDR_FREE(key);
-							mg_free((void *)key);
-							goto clean_http2;
-						}
-					} else if ((idx >= 62)
-					           && ((idx - 61) <= conn->http2.dyn_table_size)) {
-						uint32_t local_table_idx = (uint32_t)idx - 62;
-						val = mg_strdup_ctx(
-						    conn->http2.dyn_table[local_table_idx].value,
-						    conn->phys_ctx);
-						CHECK_LEAK_HDR_ALLOC(val);
-					} else {
-						/* protocol violation */
-						DEBUG_TRACE(
-						    "HTTP2 indexed header %lu out of range (key: %s)",
-						    (unsigned long)idx,
-						    key);
-						CHECK_LEAK_HDR_FREE(key);
-						mg_free((void *)key);
-						goto clean_http2;
-					}
+		if (!value_known) {
+			val = hpack_decode(buf, &i, len, conn->phys_ctx);
+			if (val == NULL) {
+				mg_free(key);
+				return 0;
+			}
+		}
 
-				} else {
-					/* Read value from HTTP2 stream */
-					val = hpack_decode(buf,
-					                   &i,
-					                   (int)bytes_read,
-					                   conn->phys_ctx); /* leak? */
-					CHECK_LEAK_HDR_ALLOC(val);
-					if (!val) {
-						DEBUG_TRACE("%s", "HTTP2 value decoding error");
-						mg_free((void *)key);
-						goto clean_http2;
-					}
+		if (indexing && (key != NULL)) {
+			hpack_dyn_insert(conn, key, val);
+		}
 
-					if (indexing) {
-						/* Add to index */
-						if (conn->http2.dyn_table_size
-						    >= HTTP2_DYN_TABLE_SIZE) {
-							/* Too many elements */
-							DEBUG_TRACE("HTTP2 index table is full (key: %s, "
-							            "value: %s)",
-							            key,
-							            val);
-
-							CHECK_LEAK_HDR_FREE(key);
-							CHECK_LEAK_HDR_FREE(val);
-
-							mg_free((void *)key);
-							mg_free((void *)val);
-							goto clean_http2;
-						}
-
-						/* Add to table of dynamic headers */
-						conn->http2.dyn_table[conn->http2.dyn_table_size].name =
-						    mg_strdup_ctx(key, conn->phys_ctx); /* leak */
-						conn->http2.dyn_table[conn->http2.dyn_table_size]
-						    .value =
-						    mg_strdup_ctx(val, conn->phys_ctx); /* leak */
-
-						CHECK_LEAK_DYN_ALLOC(
-						    conn->http2.dyn_table[conn->http2.dyn_table_size]
-						        .name);
-						CHECK_LEAK_DYN_ALLOC(
-						    conn->http2.dyn_table[conn->http2.dyn_table_size]
-						        .value);
-
-						conn->http2.dyn_table_size++;
-
-						DEBUG_TRACE("HTTP2 new dynamic header table entry %i "
-						            "(key: %s, value: %s)",
-						            (int)conn->http2.dyn_table_size,
-						            key,
-						            val);
-					}
-				}
-				/* val and key are allocated now and must be freed later */
-				/* Store these pointers in conn->request_info[].http_headers,
-				 * free_buffered_header_list(conn) will clean up later. */
-
-				/* Add header for this request */
-				if ((key != NULL) && (val != NULL)
-				    && (conn->request_info.num_headers < MG_MAX_HEADERS)) {
-					conn->request_info
-					    .http_headers[conn->request_info.num_headers]
-					    .name = key;
-					conn->request_info
-					    .http_headers[conn->request_info.num_headers]
-					    .value = val;
-					conn->request_info.num_headers++;
-
-					/* Some headers need to be stored in the request structure
-					 */
-					if (!strcmp(":method", key)) {
-						conn->request_info.request_method = val;
-					} else if (!strcmp(":path", key)) {
-						conn->request_info.local_uri = val;
-						conn->request_info.request_uri = val;
-						conn->request_info.local_uri_raw = val;
-					} else if (!strcmp(":status", key)) {
-						conn->status_code = atoi(val);
-					}
+		/* key and val are either stored in the stream or freed */
+		http2_stream_add_header(s, key, val);
+	}
+	return 1;
+}
 
-					DEBUG_TRACE("HTTP2 request header (key: %s, value: %s)",
-					            key,
-					            val);
-
-				} else {
-					/* - either key or value are NULL (out of memory)
-					 * - or the max. number of headers is reached
-					 * in both cases free all memory
-					 */
-					DEBUG_TRACE("%s", "HTTP2 cannot add header");
-					CHECK_LEAK_HDR_FREE(key);
-					CHECK_LEAK_HDR_FREE(val);
-
-					mg_free((void *)key);
-					key = NULL;
-					mg_free((void *)val);
-					val = NULL;
-				}
+
+/* Take a free stream slot for a new stream */
+static struct mg_http2_stream *
+http2_new_stream(struct mg_connection *conn, uint32_t stream_id)
+{
+	int i;
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		struct mg_http2_stream *s = &conn->http2.streams[i];
+		if (s->state == HTTP2_STREAM_FREE) {
+			s->headers = (struct mg_header *)
+			    mg_calloc_ctx(MG_MAX_HEADERS,
+			                  sizeof(struct mg_header),
+			                  conn->phys_ctx);
+			if (s->headers == NULL) {
+				return NULL;
 			}
+			s->id = stream_id;
+			s->state = HTTP2_STREAM_HEADERS;
+			s->depends_on = 0;
+			s->weight = 16; /* default, RFC 7540, 5.3.5 */
+			s->seq = conn->http2.stream_seq++;
+			s->send_window = conn->http2.initial_window_size;
+			s->headers_sent = 0;
+			s->num_headers = 0;
+			s->body = NULL;
+			s->body_len = 0;
+			s->body_size = 0;
+			return s;
+		}
+	}
+	return NULL;
+}
 
-			/* stream id */
-			conn->http2.stream_id = http2_frame_stream_id;
 
-			/* header parsed */
-			DEBUG_TRACE("HTTP2 handle_request (stream %u)",
-			            http2_frame_stream_id);
-			handle_request_stat_log(conn);
+static void
+http2_release_stream(struct mg_http2_stream *s)
+{
+	while (s->num_headers > 0) {
+		s->num_headers--;
+		mg_free((void *)s->headers[s->num_headers].name);
+		mg_free((void *)s->headers[s->num_headers].value);
+	}
+	mg_free(s->headers);
+	mg_free(s->body);
+	memset(s, 0, sizeof(*s));
+}
 
-			/* Send "final" frame */
-			DEBUG_TRACE("HTTP2 handle_request done (stream %u)",
-			            http2_frame_stream_id);
-			http2_data_frame_head(conn, 0, 1);
-			free_buffered_response_header_list(conn);
-			free_buffered_request_header_list(conn);
-		} break;
-
-		case 2: /* PRIORITY */
-		{
-			uint32_t dependStream =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			uint8_t weight = buf[4];
-			DEBUG_TRACE("HTTP2 priority %u dependent stream %u",
-			            weight,
-			            dependStream);
-		} break;
-
-		case 3: /* RST_STREAM */
-		{
-			uint32_t errorId =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			DEBUG_TRACE("HTTP2 reset with error %u", errorId);
-		} break;
-
-		case 4: /* SETTINGS */
-			if (http2_frame_stream_id != 0) {
-				/* Send protocol error */
-				http2_reset_stream(conn,
-				                   http2_frame_stream_id,
-				                   HTTP2_ERR_PROTOCOL_ERROR);
-				DEBUG_TRACE("%s", "HTTP2 received invalid settings frame");
-			} else if (http2_frame_flags) {
-				/* ACK frame. Do not reply. */
-				my_settings_accepted++;
-				DEBUG_TRACE("%s", "CivetWeb settings confirmed by peer");
-			} else {
-				int i;
-				for (i = 0; i < (int)http2_frame_size; i += 6) {
-					uint16_t id =
-					    ((uint16_t)buf[i] * 0x100u) + ((uint16_t)buf[i + 1]);
-					uint32_t val = ((uint32_t)buf[i + 2] * 0x1000000u)
-					               + ((uint32_t)buf[i + 3] * 0x10000u)
-					               + ((uint32_t)buf[i + 4] * 0x100u)
-					               + ((uint32_t)buf[i + 5]);
-					switch (id) {
-					case 1:
-						client_settings.settings_header_table_size = val;
-						DEBUG_TRACE("Received settings header_table_size: %u",
-						            val);
-						break;
-					case 2:
-						client_settings.settings_enable_push = (val != 0);
-						DEBUG_TRACE("Received settings enable_push: %u", val);
-						break;
-					case 3:
-						client_settings.settings_max_concurrent_streams = val;
-						DEBUG_TRACE(
-						    "Received settings max_concurrent_streams: %u",
-						    val);
-						break;
-					case 4:
-						client_settings.settings_initial_window_size = val;
-						DEBUG_TRACE("Received settings initial_window_size: %u",
-						            val);
-						break;
-					case 5:
-						client_settings.settings_max_frame_size = val;
-						DEBUG_TRACE("Received settings max_frame_size: %u",
-						            val);
-						break;
-					case 6:
-						client_settings.settings_max_header_list_size = val;
-						DEBUG_TRACE(
-						    "Received settings max_header_list_size: %u", val);
-						break;
-					default:
-						/* Unknown setting. Ignore it. */
-						DEBUG_TRACE("Received unknown settings id=%u: %u",
-						            id,
-						            val);
-						break;
-					}
-				}
 
-				/* Every settings frame must be acknowledged */
-				http2_settings_acknowledge(conn);
-			}
-			break;
+/* Priority information from a HEADERS or PRIORITY frame:
+ * 4 bytes exclusive flag + stream dependency, 1 byte weight. */
+static void
+http2_set_priority(struct mg_http2_stream *s, const uint8_t *buf)
+{
+	uint32_t depends_on = http2_get_u32(buf) & 0x7FFFFFFFu;
 
-		case 5: /* PUSH_PROMISE */
-			DEBUG_TRACE("%s", "Push promise not supported");
-			break;
+	if (s == NULL) {
+		/* Priority of an unknown (idle or closed) stream: ignore */
+		return;
+	}
+	/* A stream cannot depend on itself (RFC 7540, 5.3.1).
+	 * Treat it like no dependency. */
+	s->depends_on = (depends_on == s->id) ? 0 : depends_on;
+	s->weight = (uint16_t)(buf[4] + 1);
+	DEBUG_TRACE("HTTP2 priority stream %u: weight %u depends on %u",
+	            s->id,
+	            s->weight,
+	            s->depends_on);
+}
 
-		case 6: /* PING */
-			if (http2_frame_flags == 0) {
-				/* Set "reply" flag, and send same data back */
-				DEBUG_TRACE("%s", "Replying to ping");
-				http2_frame_head[4] = 1;
-				mg_xwrite(conn, http2_frame_head, sizeof(http2_frame_head));
-				mg_xwrite(conn, buf, http2_frame_size);
-			}
-			break;
 
-		case 7: /* GOAWAY */
-		{
-			uint32_t lastStream =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			uint32_t errorId =
-			    ((uint32_t)buf[4] * 0x1000000u) + ((uint32_t)buf[5] * 0x10000u)
-			    + ((uint32_t)buf[6] * 0x100u) + ((uint32_t)buf[7]);
-			; /* followed by debug data */
-			uint32_t debugDataLen = http2_frame_size - 8;
-			char *debugData = (char *)buf + 8;
-
-			DEBUG_TRACE("HTTP2 goaway stream %u, error %u (%.*s)",
-			            lastStream,
-			            errorId,
-			            debugDataLen,
-			            debugData);
-
-		} break;
-
-		case 8: /* WINDOW_UPDATE */
-		{
-			uint32_t val = ((uint32_t)buf[0] * 0x1000000u)
-			               + ((uint32_t)buf[1] * 0x10000u)
-			               + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			http_window_length = (val & 0x7FFFFFFFu);
-
-			DEBUG_TRACE("HTTP2 window update stream %u, length %u",
-			            http2_frame_stream_id,
-			            http_window_length);
-		} break;
-
-		case 9: /* CONTINUATION */
-			DEBUG_TRACE("%s", "HTTP2 Continue");
-			break;
+/* Header block complete (END_HEADERS) */
+static int
+http2_headers_complete(struct mg_connection *conn,
+                       uint32_t stream_id,
+                       const uint8_t *block,
+                       uint32_t len,
+                       int end_stream)
+{
+	struct mg_http2_stream *s = http2_find_stream(conn, stream_id);
+	int is_request_header = ((s != NULL) && (s->state == HTTP2_STREAM_HEADERS));
+
+	/* Trailers are decoded, but not passed to the handler */
+	if (!http2_decode_header_block(conn,
+	                               block,
+	                               (int)len,
+	                               is_request_header ? s : NULL)) {
+		return http2_conn_error(conn, HTTP2_ERR_COMPRESSION_ERROR);
+	}
 
-		default:
-			/* TODO: Error Message */
-			DEBUG_TRACE("%s", "Unknown frame type");
-			goto clean_http2;
+	if (s == NULL) {
+		/* No stream slot available */
+		http2_reset_stream(conn, stream_id, HTTP2_ERR_REFUSED_STREAM);
+	} else if (is_request_header) {
+		s->state = end_stream ? HTTP2_STREAM_READY : HTTP2_STREAM_OPEN;
+	} else {
+		/* Trailers end the stream */
+		s->state = HTTP2_STREAM_READY;
+	}
+	return 1;
+}
+
+
+static int
+http2_on_headers(struct mg_connection *conn,
+                 uint32_t stream_id,
+                 uint8_t flags,
+                 const uint8_t *buf,
+                 uint32_t size)
+{
+	struct mg_http2_stream *s;
+	uint32_t pad_len = 0;
+	int end_stream = ((flags & 0x01) != 0);
+
+	if ((stream_id == 0) || ((stream_id & 1) == 0)) {
+		/* Client streams have odd numbers */
+		return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+	}
+	if (flags & 0x08) {
+		/* PADDED */
+		if (size < 1) {
+			return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
+		}
+		pad_len = buf[0];
+		buf++;
+		size--;
+	}
+	if (flags & 0x20) {
+		/* PRIORITY */
+		if (size < 5) {
+			return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
 		}
+	}
+	if (pad_len + ((flags & 0x20) ? 5 : 0) > size) {
+		return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+	}
+	size -= pad_len;
+
+	s = http2_find_stream(conn, stream_id);
+	if (s != NULL) {
+		/* Trailers: only allowed to end an open stream */
+		if ((s->state != HTTP2_STREAM_OPEN) || !end_stream) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		}
+	} else {
+		if (stream_id <= conn->http2.max_stream_id) {
+			/* Stream ids must increase (RFC 7540, 5.1.1) */
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		}
+		conn->http2.max_stream_id = stream_id;
+		if (!conn->http2.goaway_received) {
+			/* NULL if all slots are used. The stream is refused
+			 * after its header block has been decoded. */
+			s = http2_new_stream(conn, stream_id);
+		}
+	}
 
-		/* not used in the moment */
-		(void)frame_is_end_stream;
-		(void)frame_is_end_headers;
-		(void)client_settings;
+	if (flags & 0x20) {
+		http2_set_priority(s, buf);
+		buf += 5;
+		size -= 5;
 	}
 
-clean_http2:
-	DEBUG_TRACE("%s", "HTTP2 free buffer, connection handler finished");
-	mg_free(buf);
+	if (flags & 0x04) {
+		/* END_HEADERS */
+		return http2_headers_complete(conn, stream_id, buf, size, end_stream);
+	}
+
+	/* Header block continues in CONTINUATION frames */
+	conn->http2.hdr_block =
+	    (uint8_t *)mg_malloc_ctx(HTTP2_MAX_HEADER_BLOCK, conn->phys_ctx);
+	if (conn->http2.hdr_block == NULL) {
+		return http2_conn_error(conn, HTTP2_ERR_INTERNAL_ERROR);
+	}
+	memcpy(conn->http2.hdr_block, buf, size);
+	conn->http2.hdr_block_len = size;
+	conn->http2.hdr_block_stream = stream_id;
+	conn->http2.hdr_block_end_stream = end_stream;
+	return 1;
 }
 
 
-#if 0
-static void
-HPACK_TEST()
+static int
+http2_on_continuation(struct mg_connection *conn,
+                      uint8_t flags,
+                      const uint8_t *buf,
+                      uint32_t size)
+{
+	int ret = 1;
+
+	if (conn->http2.hdr_block_len + size > HTTP2_MAX_HEADER_BLOCK) {
+		return http2_conn_error(conn, HTTP2_ERR_ENHANCE_YOUR_CALM);
+	}
+	memcpy(conn->http2.hdr_block + conn->http2.hdr_block_len, buf, size);
+	conn->http2.hdr_block_len += size;
+
+	if (flags & 0x04) {
+		/* END_HEADERS */
+		ret = http2_headers_complete(conn,
+		                             conn->http2.hdr_block_stream,
+		                             conn->http2.hdr_block,
+		                             conn->http2.hdr_block_len,
+		                             conn->http2.hdr_block_end_stream);
+		mg_free(conn->http2.hdr_block);
+		conn->http2.hdr_block = NULL;
+		conn->http2.hdr_block_len = 0;
+		conn->http2.hdr_block_stream = 0;
+	}
+	return ret;
+}
+
+
+static int
+http2_on_data(struct mg_connection *conn,
+              uint32_t stream_id,
+              uint8_t flags,
+              const uint8_t *buf,
+              uint32_t size)
 {
-	uint64_t test;
+	struct mg_http2_stream *s = http2_find_stream(conn, stream_id);
+	uint32_t frame_size = size;
+	uint32_t pad_len = 0;
+
+	if ((stream_id == 0) || (stream_id > conn->http2.max_stream_id)) {
+		/* DATA on an idle stream */
+		return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+	}
+	if (flags & 0x08) {
+		/* PADDED */
+		if ((size < 1) || (buf[0] >= size)) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		}
+		pad_len = buf[0];
+		buf++;
+		size -= pad_len + 1;
+	}
 
-	for (test = 0;; test++) {
-		char in[32] = {0};
-		uint8_t out[32] = {0};
-		char *check;
-		int i;
-		int l;
+	/* The whole frame counts for flow control. Give the connection
+	 * window back at once: the body is buffered in memory, its size is
+	 * limited per stream. */
+	if (frame_size > 0) {
+		http2_send_window(conn, 0, frame_size);
+	}
 
-		memcpy(in, &test, sizeof(test));
-		l = hpack_encode(out, in, 0);
-		i = 0;
-		check = hpack_decode(out, &i, NULL);
+	if ((s == NULL) || (s->state != HTTP2_STREAM_OPEN)) {
+		/* Stream closed, refused or reset */
+		http2_reset_stream(conn, stream_id, HTTP2_ERR_STREAM_CLOSED);
+		return 1;
+	}
 
-		if (strcmp(in, check)) {
-			printf("Error\n");
+	if (size > 0) {
+		if (s->body_len + size > HTTP2_MAX_REQUEST_BODY) {
+			/* Request body too large */
+			http2_reset_stream(conn, stream_id, HTTP2_ERR_REFUSED_STREAM);
+			http2_release_stream(s);
+			return 1;
 		}
-		mg_free(check);
+		if (s->body_len + size > s->body_size) {
+			size_t new_size = (s->body_size > 0) ? (s->body_size * 2) : 16384;
+			char *new_body;
+			while (new_size < s->body_len + size) {
+				new_size *= 2;
+			}
+			new_body = (char *)mg_realloc_ctx(s->body, new_size, conn->phys_ctx);
+			if (new_body == NULL) {
+				http2_reset_stream(conn, stream_id, HTTP2_ERR_INTERNAL_ERROR);
+				http2_release_stream(s);
+				return 1;
+			}
+			s->body = new_body;
+			s->body_size = new_size;
+		}
+		memcpy(s->body + s->body_len, buf, size);
+		s->body_len += size;
+	}
+
+	if (flags & 0x01) {
+		/* END_STREAM: request complete */
+		s->state = HTTP2_STREAM_READY;
+	} else if (frame_size > 0) {
+		http2_send_window(conn, stream_id, frame_size);
 	}
+	return 1;
 }
 
-static void
-HPACK_TABLE_TEST()
-{
-	int i;
 
-	uint32_t hpack_huff_end_code_expected[32] = { 0 };
-	uint8_t hpack_huff_start_index_expected[32] = { 0 };
-	int reverse_map[256] = { 0 };
+static int
+http2_on_window_update(struct mg_connection *conn,
+                       uint32_t stream_id,
+                       const uint8_t *buf,
+                       uint32_t size)
+{
+	uint32_t inc;
+	int64_t *window;
+	struct mg_http2_stream *s = NULL;
 
-	for (i = 0; i < 256; i++) {
-		reverse_map[i] = -1;
+	if (size != 4) {
+		return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
 	}
+	inc = http2_get_u32(buf) & 0x7FFFFFFFu;
 
-	for (i = 0; i < 256; i++) {
-		uint8_t bits = hpack_huff_dec[i].bitcount;
-		uint8_t dec = hpack_huff_dec[i].decoded;
-		if (bits > hpack_huff_dec[i + 1].bitcount) {
-			ck_abort_msg("hpack_huff_dec disorder at index %i", i);
-		}
-		if (hpack_huff_dec[i].encoded & (0xFFFFFFFFul << bits)) {
-			ck_abort_msg("hpack_huff_dec bits inconsistent at index %i", i);
+	if (stream_id == 0) {
+		window = &conn->http2.send_window;
+	} else {
+		s = http2_find_stream(conn, stream_id);
+		if (s == NULL) {
+			/* Stream already closed: ignore */
+			return 1;
 		}
-		if ((bits < 5) || (bits > 30)) {
-			ck_abort_msg("hpack_huff_dec bits out of range at index %i", i);
+		window = &s->send_window;
+	}
+
+	if (inc == 0) {
+		if (s == NULL) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
 		}
-		if (reverse_map[dec] != -1) {
-			ck_abort_msg("hpack_huff_dec duplicate: %i", hpack_huff_dec[i].decoded);
+		http2_reset_stream(conn, stream_id, HTTP2_ERR_PROTOCOL_ERROR);
+		return 1;
+	}
+	if (*window + inc > HTTP2_MAX_WINDOW) {
+		if (s == NULL) {
+			return http2_conn_error(conn, HTTP2_ERR_FLOW_CONTROL_ERROR);
 		}
-		reverse_map[dec] = i;
+		http2_reset_stream(conn, stream_id, HTTP2_ERR_FLOW_CONTROL_ERROR);
+		return 1;
+	}
+	*window += inc;
+
+	DEBUG_TRACE("HTTP2 window update stream %u, length %u", stream_id, inc);
+	return 1;
+}
 
-		hpack_huff_end_code_expected[bits - 5] = hpack_huff_dec[i].encoded;
+
+/* Read and process one frame.
+ * Returns 1 on success, 0 if the connection must be closed. */
+static int
+http2_process_frame(struct mg_connection *conn)
+{
+	uint8_t head[9];
+	uint8_t *buf = conn->http2.frame_buf;
+	uint32_t size, stream_id;
+	uint8_t type, flags;
+
+	if (conn->http2.closed) {
+		return 0;
+	}
+	if (!http2_read_raw(conn, head, sizeof(head))) {
+		/* Connection closed by the peer, timeout or error */
+		conn->http2.closed = 1;
+		return 0;
 	}
 
-	for (i = 255; i >= 0; i--) {
-		uint8_t bits = hpack_huff_dec[i].bitcount;
-		hpack_huff_start_index_expected[bits - 5] = i;
+	size = ((uint32_t)head[0] * 0x10000u) + ((uint32_t)head[1] * 0x100u)
+	       + ((uint32_t)head[2]);
+	type = head[3];
+	flags = head[4];
+	stream_id = http2_get_u32(head + 5) & 0x7FFFFFFFu;
+
+	if (size > HTTP2_MAX_FRAME_SIZE) {
+		DEBUG_TRACE("HTTP2 frame too large (%lu)", (unsigned long)size);
+		return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
 	}
+	if (!http2_read_raw(conn, buf, size)) {
+		conn->http2.closed = 1;
+		return 0;
+	}
+
+	DEBUG_TRACE("HTTP2 frame type %u, flags %u, stream %u, size %u",
+	            type,
+	            flags,
+	            stream_id,
+	            size);
 
-	for (i = 0; i < 256; i++) {
-		if (reverse_map[i] == -1) {
-			ck_abort_msg("reverse map at %i missing", i);
+	/* A header block must not be interrupted by other frames,
+	 * see https://tools.ietf.org/html/rfc7540#section-6.10 */
+	if (conn->http2.hdr_block_stream != 0) {
+		if ((type != 9) || (stream_id != conn->http2.hdr_block_stream)) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
 		}
+	} else if (type == 9) {
+		/* CONTINUATION without HEADERS */
+		return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
 	}
 
-	i = sizeof(hpack_huff_start_index) / sizeof(hpack_huff_start_index[0]);
-	if (i != 27) {
-		ck_abort_msg("hpack_huff_start_index size error: ", i);
-	}
+	switch (type) {
+	case 0: /* DATA */
+		return http2_on_data(conn, stream_id, flags, buf, size);
 
-	i = sizeof(hpack_huff_end_code) / sizeof(hpack_huff_end_code[0]);
-	if (i != 27) {
-		ck_abort_msg("hpack_huff_end_code size error: ", i);
-	}
+	case 1: /* HEADERS */
+		return http2_on_headers(conn, stream_id, flags, buf, size);
 
-	for (i = 0; i < 27; i++) {
-		if (hpack_huff_start_index_expected[i] != hpack_huff_start_index[i]) {
-			ck_abort_msg("hpack_huff_start_index error at %i", i);
+	case 2: /* PRIORITY */
+		if (stream_id == 0) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		}
+		if (size != 5) {
+			http2_reset_stream(conn, stream_id, HTTP2_ERR_FRAME_SIZE_ERROR);
+			return 1;
+		}
+		http2_set_priority(http2_find_stream(conn, stream_id), buf);
+		return 1;
+
+	case 3: /* RST_STREAM */
+	{
+		struct mg_http2_stream *s;
+		if ((stream_id == 0) || (stream_id > conn->http2.max_stream_id)) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
 		}
-		if (hpack_huff_end_code_expected[i] != hpack_huff_end_code[i]) {
-			ck_abort_msg("hpack_huff_end_code error at %i", i);
+		if (size != 4) {
+			return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
 		}
+		DEBUG_TRACE("HTTP2 reset stream %u with error %u",
+		            stream_id,
+		            http2_get_u32(buf));
+		s = http2_find_stream(conn, stream_id);
+		if (s == conn->http2.current) {
+			if (s != NULL) {
+				/* The handler is running: discard further output */
+				s->state = HTTP2_STREAM_CLOSED;
+			}
+		} else if (s != NULL) {
+			http2_release_stream(s);
+		}
+		return 1;
 	}
 
-}
-#endif
+	case 4: /* SETTINGS */
+		if (stream_id != 0) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		}
+		if (flags & 0x01) {
+			/* ACK frame. Do not reply. */
+			if (size != 0) {
+				return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
+			}
+			DEBUG_TRACE("%s", "CivetWeb settings confirmed by peer");
+		} else {
+			uint32_t err = http2_apply_settings(conn, buf, size);
+			if (err != HTTP2_ERR_NO_ERROR) {
+				return http2_conn_error(conn, err);
+			}
+			/* Every settings frame must be acknowledged */
+			http2_settings_acknowledge(conn);
+		}
+		return 1;
 
+	case 5: /* PUSH_PROMISE */
+		/* Clients must not send push promises */
+		return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
 
-static void
-process_new_http2_connection(struct mg_connection *conn)
-{
-	if (!is_valid_http2_primer(conn)) {
-		/* Primer does not match expectation from RFC.
-		 * See https://tools.ietf.org/html/rfc7540#section-3.5 */
-		DEBUG_TRACE("%s", "No valid HTTP2 primer");
-		mg_send_http_error(conn, 400, "%s", "Invalid HTTP/2 primer");
+	case 6: /* PING */
+		if (stream_id != 0) {
+			return http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		}
+		if (size != 8) {
+			return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
+		}
+		if ((flags & 0x01) == 0) {
+			/* Set "reply" flag, and send same data back */
+			uint8_t pong[9 + 8];
+			DEBUG_TRACE("%s", "Replying to ping");
+			http2_frame_head(pong, 8, 6, 1, 0);
+			memcpy(pong + 9, buf, 8);
+			mg_xwrite(conn, pong, sizeof(pong));
+		}
+		return 1;
 
-	} else {
-		/* Valid HTTP/2 primer received */
-		DEBUG_TRACE("%s", "Start handling HTTP2");
-		handle_http2(conn);
+	case 7: /* GOAWAY */
+		if (size < 8) {
+			return http2_conn_error(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
+		}
+		DEBUG_TRACE("HTTP2 goaway stream %u, error %u (%.*s)",
+		            http2_get_u32(buf) & 0x7FFFFFFFu,
+		            http2_get_u32(buf + 4),
+		            (int)(size - 8),
+		            (const char *)buf + 8);
+		/* Answer the streams already received, but no new ones */
+		conn->http2.goaway_received = 1;
+		return 1;
 
-		/* Free memory allocated for headers, if not done yet */
-		DEBUG_TRACE("%s", "Free remaining HTTP2 header memory");
-		free_buffered_response_header_list(conn);
-		free_buffered_request_header_list(conn);
-		purge_dynamic_header_table(conn, 0);
+	case 8: /* WINDOW_UPDATE */
+		return http2_on_window_update(conn, stream_id, buf, size);
+
+	case 9: /* CONTINUATION */
+		return http2_on_continuation(conn, flags, buf, size);
+
+	default:
+		/* Unknown frame types must be ignored (RFC 7540, 4.1) */
+		DEBUG_TRACE("HTTP2 ignoring frame type %u", type);
+		return 1;
+	}
+}
+
+
+/* Send a header block in a HEADERS frame, followed by CONTINUATION frames
+ * if it exceeds the maximum frame size of the peer. */
+static int
+http2_send_header_block(struct mg_connection *conn,
+                        const uint8_t *block,
+                        size_t len,
+                        int end_stream)
+{
+	uint8_t head[9];
+	uint8_t type = 1; /* HEADERS */
+	size_t pos = 0;
+
+	do {
+		size_t chunk = len - pos;
+		uint8_t flags = 0;
+
+		if (chunk > conn->http2.max_frame_size) {
+			chunk = conn->http2.max_frame_size;
+		}
+		if (pos + chunk == len) {
+			flags |= 0x04; /* END_HEADERS */
+		}
+		if ((type == 1) && end_stream) {
+			flags |= 0x01; /* END_STREAM */
+		}
+		http2_frame_head(head, (uint32_t)chunk, type, flags, conn->http2.stream_id);
+		if ((mg_xwrite(conn, head, 9) != 9)
+		    || (mg_xwrite(conn, block + pos, chunk) != (int)chunk)) {
+			return 0;
+		}
+		pos += chunk;
+		type = 9; /* CONTINUATION */
+	} while (pos < len);
+
+	return 1;
+}
+
+
+/* Headers that must not be sent in HTTP/2 (RFC 7540, 8.1.2.2) */
+static int
+http2_is_connection_header(const char *name)
+{
+	return !mg_strcasecmp(name, "Connection")
+	       || !mg_strcasecmp(name, "Keep-Alive")
+	       || !mg_strcasecmp(name, "Proxy-Connection")
+	       || !mg_strcasecmp(name, "Transfer-Encoding")
+	       || !mg_strcasecmp(name, "Upgrade");
+}
+
+
+static int
+http2_send_response_headers(struct mg_connection *conn)
+{
+	struct mg_http2_stream *s = conn->http2.current;
+	uint8_t *header_bin;
+	size_t header_size = 64;
+	size_t header_len = 0;
+	int has_date = 0;
+	int i, ok;
+
+	if (s != NULL) {
+		if (s->headers_sent) {
+			return 1;
+		}
+		s->headers_sent = 1;
+		if (s->state != HTTP2_STREAM_RESPONDING) {
+			/* Stream has been reset */
+			return 1;
+		}
+	}
+
+	if ((conn->status_code < 100) || (conn->status_code > 999)) {
+		/* Invalid status: Set status to "Internal Server Error" */
+		conn->status_code = 500;
+	}
+
+	/* Every header needs at most 2 * 6 bytes in addition to its text */
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		header_size += strlen(conn->response_info.http_headers[i].name)
+		               + strlen(conn->response_info.http_headers[i].value)
+		               + 12;
+	}
+	header_bin = (uint8_t *)mg_malloc_ctx(header_size, conn->phys_ctx);
+	if (header_bin == NULL) {
+		return 0;
+	}
+
+	switch (conn->status_code) {
+	case 200:
+		header_bin[header_len++] = 0x88;
+		break;
+	case 204:
+		header_bin[header_len++] = 0x89;
+		break;
+	case 206:
+		header_bin[header_len++] = 0x8A;
+		break;
+	case 304:
+		header_bin[header_len++] = 0x8B;
+		break;
+	case 400:
+		header_bin[header_len++] = 0x8C;
+		break;
+	case 404:
+		header_bin[header_len++] = 0x8D;
+		break;
+	case 500:
+		header_bin[header_len++] = 0x8E;
+		break;
+	default:
+		/* ":status" (index 8) without indexing */
+		header_bin[header_len++] = 0x08;
+		header_bin[header_len++] = 0x03;
+		header_bin[header_len++] = 0x30 + (conn->status_code / 100);
+		header_bin[header_len++] = 0x30 + ((conn->status_code / 10) % 10);
+		header_bin[header_len++] = 0x30 + (conn->status_code % 10);
+		break;
+	}
+
+	/* Add all headers */
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		const char *name = conn->response_info.http_headers[i].name;
+		uint16_t predef = 0;
+		uint16_t j;
+
+		/* Filter headers not valid in HTTP/2 */
+		if (http2_is_connection_header(name)) {
+			continue; /* do not send */
+		}
+
+		/* Check if this header is known in HPACK (static table index 15 to 61)
+		 * see https://tools.ietf.org/html/rfc7541#appendix-A */
+		for (j = 15; j <= 61; j++) {
+			if (!mg_strcasecmp(hpack_predefined[j].name, name)) {
+				predef = j;
+				break;
+			}
+		}
+
+		/* Literal without indexing: the encoder does not maintain
+		 * the dynamic table of the peer */
+		if (predef) {
+			header_len += hpack_putnum(header_bin + header_len, predef, 4, 0);
+		} else {
+			header_bin[header_len++] = 0x00;
+			header_len += hpack_encode(header_bin + header_len, name, 1);
+		}
+		header_len +=
+		    hpack_encode(header_bin + header_len,
+		                 conn->response_info.http_headers[i].value,
+		                 0);
+
+		/* Mark required headers as sent */
+		if (!mg_strcasecmp("Date", name)) {
+			has_date = 1;
+		}
+	}
+
+	/* Add required headers, if they have not been sent yet */
+	if (!has_date) {
+		char date[64];
+		time_t curtime = time(NULL);
+
+		gmt_time_string(date, sizeof(date), &curtime);
+		/* "date" is predefined HPACK index 33 */
+		header_len += hpack_putnum(header_bin + header_len, 33, 4, 0);
+		header_len += hpack_encode(header_bin + header_len, date, 0);
+	}
+
+	ok = http2_send_header_block(conn, header_bin, header_len, 0);
+	mg_free(header_bin);
+
+	if (ok) {
+		DEBUG_TRACE("HTTP2 response header sent: stream %u",
+		            conn->http2.stream_id);
+	} else {
+		DEBUG_TRACE("HTTP2 response header sending error: stream %u",
+		            conn->http2.stream_id);
+	}
+	return ok;
+}
+
+
+static void
+http2_data_frame_head(struct mg_connection *conn,
+                      uint32_t frame_size,
+                      int is_final)
+{
+	unsigned char http2_data_frame[9];
+	uint32_t stream_id = conn->http2.stream_id;
+
+	http2_frame_head(http2_data_frame,
+	                 frame_size,
+	                 0, /* frame type "DATA" */
+	                 (uint8_t)(is_final ? 1 : 0),
+	                 stream_id);
+
+	DEBUG_TRACE("HTTP2 begin data frame: stream %u, frame_size %u (final: %i)",
+	            stream_id,
+	            frame_size,
+	            is_final);
+
+	mg_xwrite(conn, http2_data_frame, 9);
+}
+
+
+/* mg_write for HTTP/2: send data in DATA frames, respecting the flow
+ * control windows of the connection and the stream and the maximum frame
+ * size of the peer. */
+static int
+http2_send_data(struct mg_connection *conn, const char *buf, size_t len)
+{
+	struct mg_http2_stream *s = conn->http2.current;
+	size_t sent = 0;
+
+	if (s == NULL) {
+		return -1;
+	}
+	if (!s->headers_sent) {
+		/* A response body without a response header cannot be sent in
+		 * HTTP/2. The handler most likely wrote a HTTP/1.x response. */
+		mg_cry_internal(conn,
+		                "%s",
+		                "HTTP2 data sent before response header");
+		if (!http2_send_response_headers(conn)) {
+			return -1;
+		}
+	}
+
+	while (sent < len) {
+		int64_t chunk = (int64_t)(len - sent);
+
+		if (s->state != HTTP2_STREAM_RESPONDING) {
+			/* Stream reset by the peer: discard the response */
+			break;
+		}
+		if (chunk > (int64_t)conn->http2.max_frame_size) {
+			chunk = (int64_t)conn->http2.max_frame_size;
+		}
+		if (chunk > conn->http2.send_window) {
+			chunk = conn->http2.send_window;
+		}
+		if (chunk > s->send_window) {
+			chunk = s->send_window;
+		}
+		if (chunk <= 0) {
+			/* Flow control window exhausted: process frames of the
+			 * peer until it sends a WINDOW_UPDATE */
+			if (!http2_process_frame(conn)) {
+				return -1;
+			}
+			continue;
+		}
+
+		http2_data_frame_head(conn, (uint32_t)chunk, 0);
+		if (mg_xwrite(conn, buf + sent, chunk) != (int)chunk) {
+			conn->http2.closed = 1;
+			return -1;
+		}
+		conn->http2.send_window -= chunk;
+		s->send_window -= chunk;
+		sent += (size_t)chunk;
+	}
+
+	conn->num_bytes_sent += (int64_t)len;
+	return (int)len;
+}
+
+
+/* mg_read for HTTP/2: the request body has been received completely */
+static int
+http2_read_body(struct mg_connection *conn, void *buf, size_t len)
+{
+	struct mg_http2_stream *s = conn->http2.current;
+	size_t avail;
+
+	if ((s == NULL) || (s->body == NULL)) {
+		return 0;
+	}
+	avail = s->body_len - (size_t)conn->http2.body_read;
+	if (len > avail) {
+		len = avail;
+	}
+	memcpy(buf, s->body + conn->http2.body_read, len);
+	conn->http2.body_read += len;
+	return (int)len;
+}
+
+
+/* Select the next stream to answer: all complete requests are answered in
+ * order of their priority (RFC 7540, 5.3). A stream depending on another
+ * stream that is also complete waits for its parent. Among the others, the
+ * highest weight goes first, ties in arrival order. */
+static struct mg_http2_stream *
+http2_next_stream(struct mg_connection *conn)
+{
+	struct mg_http2_stream *best = NULL, *oldest = NULL;
+	int i;
+
+	for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+		struct mg_http2_stream *s = &conn->http2.streams[i];
+		struct mg_http2_stream *parent;
+
+		if (s->state != HTTP2_STREAM_READY) {
+			continue;
+		}
+		if ((oldest == NULL) || (s->seq < oldest->seq)) {
+			oldest = s;
+		}
+		parent = http2_find_stream(conn, s->depends_on);
+		if ((parent != NULL) && (parent->state == HTTP2_STREAM_READY)) {
+			continue;
+		}
+		if ((best == NULL) || (s->weight > best->weight)
+		    || ((s->weight == best->weight) && (s->seq < best->seq))) {
+			best = s;
+		}
+	}
+
+	/* Dependency cycle: answer in arrival order */
+	return (best != NULL) ? best : oldest;
+}
+
+
+/* forward */
+static int header_accepts_gzip(const char *accept_encoding);
+
+
+/* Answer one stream using the standard request handling */
+static void
+http2_answer_stream(struct mg_connection *conn, struct mg_http2_stream *s)
+{
+	struct mg_request_info *ri = &conn->request_info;
+	const char *method = NULL, *path = NULL, *accept_encoding = NULL;
+	int i;
+
+	conn->http2.stream_id = s->id;
+	conn->http2.current = s;
+	conn->http2.body_read = 0;
+	s->state = HTTP2_STREAM_RESPONDING;
+
+	/* Move the request headers to the request info */
+	free_buffered_request_header_list(conn);
+	for (i = 0; i < s->num_headers; i++) {
+		ri->http_headers[i] = s->headers[i];
+		if (!strcmp(s->headers[i].name, ":method")) {
+			method = s->headers[i].value;
+		} else if (!strcmp(s->headers[i].name, ":path")) {
+			path = s->headers[i].value;
+		} else if (!strcmp(s->headers[i].name, "accept-encoding")) {
+			accept_encoding = s->headers[i].value;
+		}
+	}
+	ri->num_headers = s->num_headers;
+	s->num_headers = 0;
+
+	/* Callback handlers do not pass interpret_uri, see get_request */
+	conn->accept_gzip =
+	    (accept_encoding != NULL) && header_accepts_gzip(accept_encoding);
+
+	ri->request_method = method;
+	ri->request_uri = path;
+	ri->local_uri_raw = path;
+	ri->local_uri = path;
+	ri->query_string = NULL;
+	ri->remote_user = NULL;
+	ri->http_version = "2.0";
+	ri->content_length = (long long)s->body_len;
+
+	conn->status_code = 0;
+	conn->request_state = 0;
+	conn->num_bytes_sent = 0;
+	conn->handled_requests++;
+	clock_gettime(CLOCK_MONOTONIC, &(conn->req_time));
+	conn->req_read_time = conn->req_time;
+
+	if ((method == NULL) || (path == NULL) || (path[0] != '/')) {
+		/* Mandatory pseudo header missing (RFC 7540, 8.1.2.3) */
+		http2_reset_stream(conn, s->id, HTTP2_ERR_PROTOCOL_ERROR);
+	} else {
+		DEBUG_TRACE("HTTP2 handle_request (stream %u)", s->id);
+		handle_request_stat_log(conn);
+		DEBUG_TRACE("HTTP2 handle_request done (stream %u)", s->id);
+
+		if (s->state == HTTP2_STREAM_RESPONDING) {
+			if (!s->headers_sent) {
+				/* The handler did not send anything */
+				if (conn->status_code < 100) {
+					conn->status_code = 500;
+				}
+				http2_send_response_headers(conn);
+			}
+			/* Send "final" frame */
+			http2_data_frame_head(conn, 0, 1);
+		}
+	}
+
+	/* Free per request memory */
+	free_buffered_response_header_list(conn);
+	if (ri->local_uri != ri->local_uri_raw) {
+		/* Copy created by handle_request */
+		mg_free((void *)ri->local_uri);
+	}
+	if (ri->remote_user != NULL) {
+		mg_free((void *)ri->remote_user);
+	}
+	ri->request_method = ri->request_uri = ri->local_uri_raw = NULL;
+	ri->local_uri = ri->query_string = ri->remote_user = NULL;
+	free_buffered_request_header_list(conn);
+
+	conn->http2.current = NULL;
+	http2_release_stream(s);
+}
+
+
+/* HTTP2 requires a different handling loop */
+static void
+handle_http2(struct mg_connection *conn, const char *preface, size_t pri_len)
+{
+	/* Send own settings. This must be the first frame sent. */
+	http2_send_settings(conn, &http2_civetweb_server_settings);
+
+	if ((pri_len > 0) && !is_valid_http2_primer(conn, preface, pri_len)) {
+		/* Primer does not match expectation from RFC.
+		 * See https://tools.ietf.org/html/rfc7540#section-3.5 */
+		DEBUG_TRACE("%s", "No valid HTTP2 primer");
+		http2_conn_error(conn, HTTP2_ERR_PROTOCOL_ERROR);
+		return;
+	}
+
+	DEBUG_TRACE("%s", "Start handling HTTP2");
+
+	for (;;) {
+		struct mg_http2_stream *s = http2_next_stream(conn);
+
+#if defined(USE_SERVER_STATS)
+		conn->conn_state = 3; /* HTTP/2 ready */
+#endif
+
+		if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+			/* Server shutdown */
+			http2_conn_error(conn, HTTP2_ERR_NO_ERROR);
+			break;
+		}
+
+		if (s == NULL) {
+			if (conn->http2.goaway_received) {
+				/* All streams answered */
+				break;
+			}
+			/* Nothing to answer: wait for the next frame */
+			if (!http2_process_frame(conn)) {
+				break;
+			}
+		} else if (http2_data_pending(conn)) {
+			/* Read all frames already received first, so requests
+			 * sent at the same time are answered by priority */
+			if (!http2_process_frame(conn)) {
+				break;
+			}
+		} else {
+			http2_answer_stream(conn, s);
+			if (conn->http2.closed) {
+				break;
+			}
+		}
+	}
+
+	DEBUG_TRACE("%s", "HTTP2 connection handler finished");
+}
+
+
+/* Prepare a connection for HTTP/2 frames */
+static int
+http2_init_connection(struct mg_connection *conn)
+{
+	hpack_init_encoder();
+
+	memset(&conn->http2, 0, sizeof(conn->http2));
+	conn->protocol_type = PROTOCOL_TYPE_HTTP2;
+	conn->content_len = -1; /* content length is not predefined */
+	conn->is_chunked = 0;   /* HTTP2 is never chunked */
+	conn->http2.dyn_table_max_octets = HTTP2_HEADER_TABLE_SIZE;
+	conn->http2.send_window = HTTP2_DEFAULT_WINDOW;
+	conn->http2.initial_window_size = HTTP2_DEFAULT_WINDOW;
+	conn->http2.max_frame_size = HTTP2_MAX_FRAME_SIZE;
+	conn->http2.streams = (struct mg_http2_stream *)
+	    mg_calloc_ctx(HTTP2_MAX_STREAMS,
+	                  sizeof(struct mg_http2_stream),
+	                  conn->phys_ctx);
+	conn->http2.frame_buf =
+	    (uint8_t *)mg_malloc_ctx(HTTP2_MAX_FRAME_SIZE, conn->phys_ctx);
+
+	if ((conn->http2.streams == NULL) || (conn->http2.frame_buf == NULL)) {
+		/* Out of memory */
+		DEBUG_TRACE("%s", "Out of memory for HTTP2 connection");
+		mg_free(conn->http2.streams);
+		mg_free(conn->http2.frame_buf);
+		conn->http2.streams = NULL;
+		conn->http2.frame_buf = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+
+static void
+http2_exit_connection(struct mg_connection *conn)
+{
+	int i;
+
+	/* Free memory allocated for headers, if not done yet */
+	DEBUG_TRACE("%s", "Free remaining HTTP2 memory");
+	free_buffered_response_header_list(conn);
+	free_buffered_request_header_list(conn);
+	purge_dynamic_header_table(conn, 0);
+
+	if (conn->http2.streams != NULL) {
+		for (i = 0; i < HTTP2_MAX_STREAMS; i++) {
+			http2_release_stream(&conn->http2.streams[i]);
+		}
+	}
+	mg_free(conn->http2.streams);
+	mg_free(conn->http2.frame_buf);
+	mg_free(conn->http2.hdr_block);
+	conn->http2.streams = NULL;
+	conn->http2.frame_buf = NULL;
+	conn->http2.hdr_block = NULL;
+	conn->http2.current = NULL;
+}
+
+
+/* Remove len bytes of a HTTP/1.x request from the connection buffer */
+static void
+http2_discard_http1_request(struct mg_connection *conn, int64_t len)
+{
+	if (len > conn->data_len) {
+		len = conn->data_len;
+	}
+	memmove(conn->buf, conn->buf + len, (size_t)(conn->data_len - len));
+	conn->data_len -= (int)len;
+	conn->request_len = 0;
+	conn->consumed_content = 0;
+}
+
+
+/* HTTPS connection with "h2" negotiated by ALPN */
+static void
+process_new_http2_connection(struct mg_connection *conn)
+{
+	if (!http2_init_connection(conn)) {
+		return;
+	}
+	handle_http2(conn, http2_pri, http2_pri_len);
+	http2_exit_connection(conn);
+}
+
+
+/* Cleartext connection starting with the HTTP/2 preface ("prior
+ * knowledge"). The first part of the preface has been read as a HTTP/1.x
+ * request head, see is_http2_prior_knowledge. */
+static void
+process_http2_prior_knowledge(struct mg_connection *conn)
+{
+	http2_discard_http1_request(conn, http2_pri_head_len);
+	if (!http2_init_connection(conn)) {
+		return;
+	}
+	handle_http2(conn,
+	             http2_pri + http2_pri_head_len,
+	             http2_pri_len - http2_pri_head_len);
+	http2_exit_connection(conn);
+}
+
+
+/* Check if a HTTP/1.1 request with "Upgrade: h2c" can be switched to
+ * HTTP/2 (RFC 7540, 3.2). The request body must have been buffered
+ * completely, since it becomes the body of stream 1. */
+static int
+is_http2_upgrade_acceptable(const struct mg_connection *conn)
+{
+	const char *upgrade = mg_get_header(conn, "Upgrade");
+
+	if (conn->client.is_ssl || (upgrade == NULL)
+	    || (mg_get_header(conn, "HTTP2-Settings") == NULL)
+	    || (0 == mg_strcasestr(upgrade, "h2c"))
+	    || strcmp(conn->dom_ctx->config[ENABLE_HTTP2], "yes")) {
+		return 0;
+	}
+	if (conn->is_chunked) {
+		return 0;
+	}
+	return (conn->content_len <= 0)
+	       || (conn->request_len + conn->content_len <= conn->data_len);
+}
+
+
+/* Switch a HTTP/1.1 connection to HTTP/2 ("Upgrade: h2c").
+ * The request carrying the upgrade becomes stream 1. */
+static void
+process_http2_upgrade(struct mg_connection *conn)
+{
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+	                                "Connection: Upgrade\r\n"
+	                                "Upgrade: h2c\r\n\r\n";
+	struct mg_request_info *ri = &conn->request_info;
+	const char *settings = mg_get_header(conn, "HTTP2-Settings");
+	const char *host = mg_get_header(conn, "Host");
+	int64_t body_len = (conn->content_len > 0) ? conn->content_len : 0;
+	char b64[256];
+	unsigned char settings_bin[192];
+	size_t settings_len = sizeof(settings_bin);
+	struct mg_http2_stream *s;
+	uint32_t err;
+	int i;
+
+	/* HTTP2-Settings is base64url encoded, without padding */
+	for (i = 0; (settings[i] != 0) && (i < (int)sizeof(b64) - 4); i++) {
+		b64[i] = (settings[i] == '-')   ? '+'
+		         : (settings[i] == '_') ? '/'
+		                                : settings[i];
+	}
+	if (settings[i] != 0) {
+		/* More settings than defined by the RFC */
+		i = -1;
+	} else {
+		while (i % 4) {
+			b64[i++] = '=';
+		}
+		b64[i] = 0;
+	}
+	if ((i < 0)
+	    || (mg_base64_decode(b64, (size_t)i, settings_bin, &settings_len)
+	        != -1)) {
+		mg_send_http_error(conn, 400, "%s", "Invalid HTTP2-Settings");
+		return;
+	}
+	settings_len--; /* terminating zero added by mg_base64_decode */
+
+	/* The HTTP/1.1 request becomes stream 1 */
+	if (!http2_init_connection(conn)) {
+		return;
+	}
+	s = http2_new_stream(conn, 1);
+	conn->http2.max_stream_id = 1;
+	http2_stream_add_header(s,
+	                        mg_strdup_ctx(":method", conn->phys_ctx),
+	                        mg_strdup_ctx(ri->request_method, conn->phys_ctx));
+	http2_stream_add_header(s,
+	                        mg_strdup_ctx(":path", conn->phys_ctx),
+	                        mg_strdup_ctx(ri->request_uri, conn->phys_ctx));
+	http2_stream_add_header(s,
+	                        mg_strdup_ctx(":scheme", conn->phys_ctx),
+	                        mg_strdup_ctx("http", conn->phys_ctx));
+	if (host != NULL) {
+		http2_stream_add_header(s,
+		                        mg_strdup_ctx(":authority", conn->phys_ctx),
+		                        mg_strdup_ctx(host, conn->phys_ctx));
+	}
+	for (i = 0; i < ri->num_headers; i++) {
+		const char *name = ri->http_headers[i].name;
+		if (http2_is_connection_header(name)
+		    || !mg_strcasecmp(name, "HTTP2-Settings")) {
+			continue;
+		}
+		http2_stream_add_header(
+		    s,
+		    mg_strdup_ctx(name, conn->phys_ctx),
+		    mg_strdup_ctx(ri->http_headers[i].value, conn->phys_ctx));
+	}
+	if ((s != NULL) && (body_len > 0)) {
+		s->body = (char *)mg_malloc_ctx((size_t)body_len, conn->phys_ctx);
+		if (s->body != NULL) {
+			memcpy(s->body, conn->buf + conn->request_len, (size_t)body_len);
+			s->body_len = s->body_size = (size_t)body_len;
+		}
+	}
+	if (s != NULL) {
+		/* The request has been sent completely (RFC 7540, 8.1.1) */
+		s->state = HTTP2_STREAM_READY;
+	}
+
+	/* The request_info still points into the HTTP/1.1 request buffer */
+	ri->num_headers = 0;
+	ri->request_method = ri->request_uri = ri->local_uri_raw = NULL;
+	ri->local_uri = ri->query_string = NULL;
+	http2_discard_http1_request(conn, conn->request_len + body_len);
+
+	DEBUG_TRACE("%s", "Switching to HTTP2 (h2c)");
+	if (mg_xwrite(conn, switching, sizeof(switching) - 1)
+	    == (int)sizeof(switching) - 1) {
+		err = http2_apply_settings(conn, settings_bin, (uint32_t)settings_len);
+		if (err != HTTP2_ERR_NO_ERROR) {
+			http2_send_settings(conn, &http2_civetweb_server_settings);
+			http2_conn_error(conn, err);
+		} else {
+			handle_http2(conn, http2_pri, http2_pri_len);
+		}
 	}
+	http2_exit_connection(conn);
 }
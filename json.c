@@ -0,0 +1,428 @@
+#include "json.h"
+#include <limits.h>
+#include <string.h>
+
+#define JSON_MAX_BIND_FIELDS 32
+
+typedef struct {
+    const char *p;
+    const char *end;
+} json_reader;
+
+static void skip_ws(json_reader *r) {
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) {
+        r->p++;
+    }
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Validate the escape sequence at p (the character after the backslash).
+// Returns the position behind it, or NULL.
+static const char *skip_escape(const char *p, const char *end) {
+    if (p >= end) return NULL;
+    switch (*p) {
+    case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+        return p + 1;
+    case 'u':
+        if (end - p < 5) return NULL;
+        for (int i = 1; i <= 4; i++) {
+            if (hex_value(p[i]) < 0) return NULL;
+        }
+        return p + 5;
+    default:
+        return NULL;
+    }
+}
+
+// Read a string starting at the opening quote; the span excludes the quotes.
+// Control characters are accepted unescaped.
+static int read_string(json_reader *r, json_span *out) {
+    const char *start = ++r->p;
+    const char *p = start;
+    const char *end = r->end;
+    const char *short_end = (end - p > 16) ? p + 16 : end;
+
+    out->ptr = start;
+    out->type = JSON_STRING;
+    out->escaped = 0;
+
+    // Keys and most values are short: scan the first bytes inline
+    while (p < short_end && *p != '"' && *p != '\\') {
+        p++;
+    }
+    for (;;) {
+        if (p < end && *p == '"') {
+            out->len = (size_t)(p - start);
+            r->p = p + 1;
+            return 0;
+        }
+        if (p < end && *p == '\\') {
+            out->escaped = 1;
+            if ((p = skip_escape(p + 1, end)) == NULL) return -1;
+            continue;
+        }
+        if (p >= end) return -1;
+
+        // Long string: let memchr find the next quote or backslash
+        const char *quote = memchr(p, '"', (size_t)(end - p));
+        if (quote == NULL) return -1;
+        const char *esc = memchr(p, '\\', (size_t)(quote - p));
+        p = (esc != NULL) ? esc : quote;
+    }
+}
+
+static int read_number(json_reader *r, json_span *out) {
+    const char *start = r->p;
+    if (r->p < r->end && *r->p == '-') r->p++;
+    if (r->p >= r->end || !is_digit(*r->p)) return -1;
+    if (*r->p == '0') {
+        r->p++;
+    } else {
+        while (r->p < r->end && is_digit(*r->p)) r->p++;
+    }
+    if (r->p < r->end && *r->p == '.') {
+        r->p++;
+        if (r->p >= r->end || !is_digit(*r->p)) return -1;
+        while (r->p < r->end && is_digit(*r->p)) r->p++;
+    }
+    if (r->p < r->end && (*r->p == 'e' || *r->p == 'E')) {
+        r->p++;
+        if (r->p < r->end && (*r->p == '+' || *r->p == '-')) r->p++;
+        if (r->p >= r->end || !is_digit(*r->p)) return -1;
+        while (r->p < r->end && is_digit(*r->p)) r->p++;
+    }
+    out->ptr = start;
+    out->len = (size_t)(r->p - start);
+    out->type = JSON_NUMBER;
+    out->escaped = 0;
+    return 0;
+}
+
+static int read_literal(json_reader *r, const char *word, json_type type, json_span *out) {
+    size_t n = strlen(word);
+    if ((size_t)(r->end - r->p) < n || memcmp(r->p, word, n) != 0) return -1;
+    out->ptr = r->p;
+    out->len = n;
+    out->type = type;
+    out->escaped = 0;
+    r->p += n;
+    return 0;
+}
+
+// Skip a nested object or array, checking brackets and strings on the way.
+static int read_container(json_reader *r, json_span *out) {
+    char stack[64];
+    int depth = 0;
+    const char *start = r->p;
+    json_span s;
+
+    out->type = (*r->p == '{') ? JSON_OBJECT : JSON_ARRAY;
+    out->escaped = 0;
+    while (r->p < r->end) {
+        char c = *r->p;
+        if (c == '"') {
+            if (read_string(r, &s) != 0) return -1;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            if (depth == (int)sizeof(stack)) return -1;
+            stack[depth++] = (c == '{') ? '}' : ']';
+        } else if (c == '}' || c == ']') {
+            if (depth == 0 || stack[depth - 1] != c) return -1;
+            if (--depth == 0) {
+                r->p++;
+                out->ptr = start;
+                out->len = (size_t)(r->p - start);
+                return 0;
+            }
+        }
+        r->p++;
+    }
+    return -1;
+}
+
+static int read_value(json_reader *r, json_span *out) {
+    if (r->p >= r->end) return -1;
+    switch (*r->p) {
+    case '"':
+        return read_string(r, out);
+    case '{':
+    case '[':
+        return read_container(r, out);
+    case 't':
+        return read_literal(r, "true", JSON_TRUE, out);
+    case 'f':
+        return read_literal(r, "false", JSON_FALSE, out);
+    case 'n':
+        return read_literal(r, "null", JSON_NULL, out);
+    default:
+        return read_number(r, out);
+    }
+}
+
+static int parse_object(const char *json, size_t len, json_member_cb cb, void *arg) {
+    json_reader r = { json, json + len };
+    json_span key, value;
+
+    skip_ws(&r);
+    if (r.p >= r.end || *r.p != '{') return -1;
+    r.p++;
+    skip_ws(&r);
+    if (r.p < r.end && *r.p == '}') {
+        r.p++;
+    } else {
+        for (;;) {
+            if (r.p >= r.end || *r.p != '"' || read_string(&r, &key) != 0) return -1;
+            skip_ws(&r);
+            if (r.p >= r.end || *r.p != ':') return -1;
+            r.p++;
+            skip_ws(&r);
+            if (read_value(&r, &value) != 0) return -1;
+            if (cb && cb(&key, &value, arg)) return 0;
+            skip_ws(&r);
+            if (r.p < r.end && *r.p == ',') {
+                r.p++;
+                skip_ws(&r);
+                continue;
+            }
+            if (r.p < r.end && *r.p == '}') {
+                r.p++;
+                break;
+            }
+            return -1;
+        }
+    }
+    skip_ws(&r);
+    return (r.p == r.end) ? 0 : -1;
+}
+
+int json_parse_object(const char *json, size_t len, json_member_cb cb, void *arg) {
+    return parse_object(json, len, cb, arg);
+}
+
+int json_parse_array(const char *json, size_t len, json_element_cb cb, void *arg) {
+    json_reader r = { json, json + len };
+    json_span value;
+    size_t index = 0;
+
+    skip_ws(&r);
+    if (r.p >= r.end || *r.p != '[') return -1;
+    r.p++;
+    skip_ws(&r);
+    if (r.p < r.end && *r.p == ']') {
+        r.p++;
+    } else {
+        for (;;) {
+            if (read_value(&r, &value) != 0) return -1;
+            if (cb && cb(&value, index, arg)) return 0;
+            index++;
+            skip_ws(&r);
+            if (r.p < r.end && *r.p == ',') {
+                r.p++;
+                skip_ws(&r);
+                continue;
+            }
+            if (r.p < r.end && *r.p == ']') {
+                r.p++;
+                break;
+            }
+            return -1;
+        }
+    }
+    skip_ws(&r);
+    return (r.p == r.end) ? 0 : -1;
+}
+
+static size_t put_utf8(char *out, unsigned long cp) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static unsigned long read_hex4(const char *p) {
+    return ((unsigned long)hex_value(p[0]) << 12) | ((unsigned long)hex_value(p[1]) << 8)
+           | ((unsigned long)hex_value(p[2]) << 4) | (unsigned long)hex_value(p[3]);
+}
+
+int json_span_to_string(const json_span *span, char *buf, size_t size) {
+    const char *p = span->ptr;
+    const char *end = span->ptr + span->len;
+    size_t n = 0;
+
+    if (size == 0) return -1;
+    if (span->type == JSON_NUMBER) {
+        if (span->len >= size) return -1;
+        memcpy(buf, span->ptr, span->len);
+        buf[span->len] = '\0';
+        return (int)span->len;
+    }
+    if (span->type != JSON_STRING) return -1;
+
+    // The span was validated by the tokenizer, escapes are complete
+    while (p < end) {
+        char tmp[4];
+        size_t tlen = 1;
+        if (*p != '\\') {
+            tmp[0] = *p++;
+        } else {
+            p++;
+            switch (*p++) {
+            case 'b': tmp[0] = '\b'; break;
+            case 'f': tmp[0] = '\f'; break;
+            case 'n': tmp[0] = '\n'; break;
+            case 'r': tmp[0] = '\r'; break;
+            case 't': tmp[0] = '\t'; break;
+            case 'u': {
+                unsigned long cp = read_hex4(p);
+                p += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    unsigned long lo = read_hex4(p + 2);
+                    if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                }
+                if (cp == 0 || (cp >= 0xD800 && cp <= 0xDFFF)) {
+                    return -1; // embedded NUL or lone surrogate
+                }
+                tlen = put_utf8(tmp, cp);
+                break;
+            }
+            default: tmp[0] = p[-1]; break; // \" \\ \/
+            }
+        }
+        if (n + tlen >= size) return -1;
+        memcpy(buf + n, tmp, tlen);
+        n += tlen;
+    }
+    buf[n] = '\0';
+    return (int)n;
+}
+
+int json_span_to_int(const json_span *span, int *value) {
+    const char *p = span->ptr;
+    const char *end = span->ptr + span->len;
+    long long v = 0;
+    int neg = 0;
+
+    if (span->type != JSON_NUMBER && span->type != JSON_STRING) return -1;
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p >= end || !is_digit(*p)) return -1;
+    while (p < end && is_digit(*p)) {
+        v = v * 10 + (*p++ - '0');
+        if (v > (long long)INT_MAX + 1) return -1;
+    }
+    if (span->type == JSON_STRING && p != end) return -1;
+    if (neg) v = -v;
+    if (v > INT_MAX || v < INT_MIN) return -1;
+    *value = (int)v;
+    return 0;
+}
+
+typedef struct {
+    const json_field *fields;
+    size_t num_fields;
+    char *out;
+    unsigned char bound[JSON_MAX_BIND_FIELDS];
+    int count;
+    int too_long; // a string did not fit its member
+} bind_state;
+
+// Find the field for a key. Keys are compared as they appear in the input
+// unless they contain escapes.
+static int find_field(const bind_state *st, const json_span *key) {
+    const char *k = key->ptr;
+    size_t klen = key->len;
+    char buf[64];
+
+    if (key->escaped) {
+        int len = json_span_to_string(key, buf, sizeof(buf));
+        if (len < 0) return -1;
+        k = buf;
+        klen = (size_t)len;
+    }
+    for (size_t i = 0; i < st->num_fields; i++) {
+        const json_field *f = &st->fields[i];
+        if (f->key_len == klen && memcmp(f->key, k, klen) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+
+static int bind_member(const json_span *key, const json_span *value, void *arg) {
+    bind_state *st = (bind_state *)arg;
+    int i = find_field(st, key);
+    if (i < 0 || st->bound[i]) {
+        return 0;
+    }
+
+    const json_field *f = &st->fields[i];
+    char *dest = st->out + f->offset;
+    if (f->type == JSON_BIND_STRING) {
+        if (value->type != JSON_STRING) return 0;
+        if (value->len < f->size && !value->escaped) {
+            memcpy(dest, value->ptr, value->len);
+            dest[value->len] = '\0';
+        } else if (json_span_to_string(value, dest, f->size) < 0) {
+            // Cutting it would change e.g. a name or password: fail the bind
+            dest[0] = '\0';
+            st->too_long = 1;
+            return 1;
+        }
+    } else if (f->type == JSON_BIND_INT) {
+        int v;
+        if (json_span_to_int(value, &v) != 0) return 0;
+        memcpy(dest, &v, sizeof(v));
+    } else {
+        if (value->type != JSON_ARRAY) return 0;
+        memcpy(dest, value, sizeof(*value));
+    }
+    st->bound[i] = 1;
+    st->count++;
+    return 0;
+}
+
+int json_bind(const char *json, size_t len, const json_field *fields, size_t num_fields,
+              void *out) {
+    bind_state st;
+
+    if (num_fields > JSON_MAX_BIND_FIELDS) return -1;
+    memset(&st, 0, sizeof(st));
+    st.fields = fields;
+    st.num_fields = num_fields;
+    st.out = (char *)out;
+    if (parse_object(json, len, bind_member, &st) != 0 || st.too_long) return -1;
+    return st.count;
+}
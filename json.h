@@ -0,0 +1,88 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+
+// Single-pass JSON reader for request bodies.
+//
+// json_parse_object walks a JSON object once and reports each top-level
+// member as a (key, value) pair of spans pointing into the input buffer.
+// Nothing is copied or allocated; nested objects and arrays are reported as
+// one span. json_bind builds on it and stores the members listed in a field
+// table into a request struct.
+
+typedef enum {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+    JSON_OBJECT,
+    JSON_ARRAY
+} json_type;
+
+// A token in the input. For strings ptr/len exclude the quotes and are still
+// escaped; use json_span_to_string to decode.
+typedef struct {
+    const char *ptr;
+    size_t len;
+    json_type type;
+    int escaped; // string contains escape sequences
+} json_span;
+
+// Called for every member of the object. Return non-zero to stop parsing.
+typedef int (*json_member_cb)(const json_span *key, const json_span *value, void *arg);
+
+// Called for every element of an array. Return non-zero to stop parsing.
+typedef int (*json_element_cb)(const json_span *value, size_t index, void *arg);
+
+// Parse a JSON object. Returns 0 on success, -1 on malformed input.
+int json_parse_object(const char *json, size_t len, json_member_cb cb, void *arg);
+
+// Parse a JSON array, e.g. the span of an array member. Returns 0 on
+// success, -1 on malformed input.
+int json_parse_array(const char *json, size_t len, json_element_cb cb, void *arg);
+
+// Decode a string span (or copy a number span) into buf, NUL terminated.
+// Returns the decoded length, or -1 if it does not fit or is not a string.
+int json_span_to_string(const json_span *span, char *buf, size_t size);
+
+// Convert a number, or a string holding a number, to int. The fraction of a
+// non-integer number is dropped. Returns 0 on success, -1 otherwise.
+int json_span_to_int(const json_span *span, int *value);
+
+// Field binding: a table per endpoint maps JSON keys to struct members.
+typedef enum {
+    JSON_BIND_STRING, // char array member, size is the array size
+    JSON_BIND_INT,    // int member
+    JSON_BIND_ARRAY   // json_span member, for json_parse_array
+} json_bind_type;
+
+typedef struct {
+    const char *key;
+    size_t key_len;
+    json_bind_type type;
+    size_t offset;
+    size_t size;
+} json_field;
+
+// Field named like the struct member it is stored in.
+#define JSON_FIELD_STRING(type, member) \
+    { #member, sizeof(#member) - 1, JSON_BIND_STRING, offsetof(type, member), \
+      sizeof(((type *)0)->member) }
+#define JSON_FIELD_INT(type, member) \
+    { #member, sizeof(#member) - 1, JSON_BIND_INT, offsetof(type, member), sizeof(int) }
+
+#define JSON_FIELD_ARRAY(type, member) \
+    { #member, sizeof(#member) - 1, JSON_BIND_ARRAY, offsetof(type, member), sizeof(json_span) }
+
+#define JSON_FIELD_COUNT(fields) (sizeof(fields) / sizeof((fields)[0]))
+
+// Parse json and store the listed fields in *out. Members not in the table
+// are skipped, values of the wrong type are ignored, and for duplicate keys
+// the first one counts. Returns the number of fields stored, or -1 on
+// malformed JSON or a string too long for its member.
+int json_bind(const char *json, size_t len, const json_field *fields, size_t num_fields,
+              void *out);
+
+#endif // JSON_H
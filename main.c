@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -12,44 +13,331 @@
 #include "auth.h"
 #include "materials.h"
 #include "subjects.h"
+#include "json.h"
+#include "arena.h"
+#include "events.h"
+#include "dbpool.h"
+#include "assets.h"
+#include "capture.h"
 
 #include "civetweb.h"
 
 #define PORT "8080"
 #define BUFFER_SIZE 4096
 
+// The frontend files, served from memory by the asset cache (assets.c)
+#define FRONTEND_DIR "../frontend"
+
+// HTTP keep-alive settings, override at compile time with -D...
+#ifndef KEEP_ALIVE_TIMEOUT_MS
+#define KEEP_ALIVE_TIMEOUT_MS "5000"
+#endif
+#ifndef KEEP_ALIVE_MAX_REQUESTS
+#define KEEP_ALIVE_MAX_REQUESTS "1000"
+#endif
+
+// Responses of at least this many bytes are gzip compressed when the client
+// accepts it. Requires a civetweb build with USE_ZLIB.
+#ifndef COMPRESSION_MIN_SIZE
+#define COMPRESSION_MIN_SIZE "1024"
+#endif
+
+// DB executor pool (dbpool.c): threads, waiting jobs, and how long a query
+// may take from submission before it is answered with 504.
+#ifndef DBPOOL_THREADS
+#define DBPOOL_THREADS 4
+#endif
+#ifndef DBPOOL_QUEUE_SIZE
+#define DBPOOL_QUEUE_SIZE 64
+#endif
+#ifndef DB_QUERY_TIMEOUT_MS
+#define DB_QUERY_TIMEOUT_MS 10000
+#endif
+
+// Login pool, a second dbpool.c pool: threads verifying passwords, logins
+// waiting for them, and how long a login may take before it is answered
+// with 504. A login that finds the queue full gets 503 and Retry-After right
+// away.
+#ifndef LOGIN_POOL_THREADS
+#define LOGIN_POOL_THREADS 2
+#endif
+#ifndef LOGIN_POOL_QUEUE_SIZE
+#define LOGIN_POOL_QUEUE_SIZE 32
+#endif
+#ifndef LOGIN_TIMEOUT_MS
+#define LOGIN_TIMEOUT_MS 5000
+#endif
+#define LOGIN_RETRY_AFTER_S "1"
+
+// civetweb worker threads. Each /api/events stream holds one for as long as
+// the dashboard stays open, so streams may take all workers but
+// EVENTS_RESERVED_WORKERS, which are left for the API requests; one stream
+// more is answered with 503.
+#ifndef WORKER_THREADS
+#define WORKER_THREADS "50"
+#endif
+#ifndef EVENTS_RESERVED_WORKERS
+#define EVENTS_RESERVED_WORKERS 16
+#endif
+
+// Threads accepting connections, each with its own SO_REUSEPORT socket.
+// One means the civetweb master thread accepts (Linux only).
+#ifndef ACCEPTOR_COUNT
+#define ACCEPTOR_COUNT "1"
+#endif
+
+// Admission control. A connection that waits longer than MAX_QUEUE_WAIT_MS
+// for a worker, or arrives while the socket queue is full, is answered with
+// 503 and Retry-After instead of hanging until the client gives up.
+// REQUEST_RATE_LIMIT limits the requests per second of each client address
+// (civetweb "request_rate", same syntax as "throttle"); over it, 429.
+// Behind a reverse proxy all clients share its address: build with
+// -DREQUEST_RATE_LIMIT='""' and limit at the proxy instead.
+#ifndef MAX_QUEUE_WAIT_MS
+#define MAX_QUEUE_WAIT_MS "1000"
+#endif
+#ifndef REQUEST_RATE_LIMIT
+#define REQUEST_RATE_LIMIT "*=200"
+#endif
+
+// Request tracing: one in TRACE_SAMPLE_EVERY requests, and every request that
+// takes TRACE_SLOW_MS or longer, is kept with the time of its stages (queue,
+// headers, auth, body, sql, build, send) for /api/admin/get-traces.
+#ifndef TRACE_SAMPLE_EVERY
+#define TRACE_SAMPLE_EVERY "1000"
+#endif
+#ifndef TRACE_SLOW_MS
+#define TRACE_SLOW_MS "500"
+#endif
+
+// HTTP/2 (h2c upgrade and prior knowledge) is off unless EKNOWS_HTTP2=1
+// is set in the environment. Requires a civetweb build with USE_HTTP2.
+#define HTTP2_ENV "EKNOWS_HTTP2"
+
+// Access log, off unless EKNOWS_ACCESS_LOG names the file. It is written
+// by a civetweb thread in batches and rotated at ACCESS_LOG_ROTATE_BYTES
+// bytes or once a day.
+#define ACCESS_LOG_ENV "EKNOWS_ACCESS_LOG"
+#ifndef ACCESS_LOG_ROTATE_BYTES
+#define ACCESS_LOG_ROTATE_BYTES "104857600"
+#endif
+#define ACCESS_LOG_ROTATE_MS "86400000"
+
+// Signed login tokens (see auth.h), if EKNOWS_TOKEN_SECRET is set to a
+// secret of at least 16 bytes. Servers sharing the secret accept each
+// other's tokens.
+#define TOKEN_SECRET_ENV "EKNOWS_TOKEN_SECRET"
+
+// Traffic capture for replay.c, off unless EKNOWS_CAPTURE names the file.
+// Passwords, tokens and file contents are left out (see capture.h).
+#define CAPTURE_ENV "EKNOWS_CAPTURE"
+
+// GET /api/admin/get-traces: extra room for traces kept between sizing and
+// writing the response
+#define TRACES_SLACK (16 * 1024)
+
+// GET /metrics: extra room for the civetweb metrics, which grow by a
+// histogram when a route gets its first request, and room for the DB pool,
+// the login pool and the sessions
+#define METRICS_SLACK (16 * 1024)
+#define METRICS_APP_SIZE 4096
+
 static struct mg_context *ctx = NULL;
 
+// The executor pools (dbpool.h). Without them, queries and logins run on the
+// workers.
+static dbpool *db_executors = NULL;
+static dbpool *login_verifiers = NULL;
+
+// Set by SIGINT/SIGTERM: main stops the server, so the access log and the
+// database are closed cleanly
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
 // Helper function to validate token from Authorization header
 static int validate_token_from_header(struct mg_connection *conn) {
-    const struct mg_request_info *req_info = mg_get_request_info(conn);
     const char *auth_header = mg_get_header(conn, "Authorization");
-    if (!auth_header || strncmp(auth_header, "Bearer ", 7) != 0) {
-        return -1; // No token or invalid format
+    int user_id = -1; // No token or invalid format
+    if (auth_header && strncmp(auth_header, "Bearer ", 7) == 0) {
+        user_id = auth_validate_token(auth_header + 7); // Skip "Bearer "
     }
-    const char *token = auth_header + 7; // Skip "Bearer "
-    return auth_validate_token(token);
+    mg_trace_stage(conn, "auth");
+    return user_id;
 }
 
-// Send HTTP response with status code, content type, and body including CORS
+// Fixed response headers, built once. send_response picks the block for the
+// content type; civetweb adds Content-Length, Date and Connection and sends
+// everything with one writev, without copying the body.
+#define CORS_HEADERS "Access-Control-Allow-Origin: *\r\n" \
+                     "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n" \
+                     "Access-Control-Allow-Headers: Content-Type\r\n"
+static const char json_headers[] = CORS_HEADERS "Content-Type: application/json\r\n";
+static const char text_headers[] = CORS_HEADERS "Content-Type: text/plain\r\n";
+
+// Send HTTP response with status code, content type, and body including CORS.
+// Bodies from COMPRESSION_MIN_SIZE bytes on are gzipped for clients sending
+// Accept-Encoding: gzip.
 static void send_response(struct mg_connection *conn, int status_code,
                           const char *content_type, const char *body) {
-    mg_printf(conn,
-              "HTTP/1.1 %d %s\r\n"
-              "Access-Control-Allow-Origin: *\r\n"
-              "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-              "Access-Control-Allow-Headers: Content-Type\r\n"
-              "Content-Type: %s\r\n"
-              "Content-Length: %lu\r\n"
-              "Connection: close\r\n"
-              "\r\n"
-              "%s",
-              status_code,
-              (status_code == 200) ? "OK" :
-              (status_code == 400) ? "Bad Request" :
-              (status_code == 401) ? "Unauthorized" :
-              (status_code == 404) ? "Not Found" : "Error",
-              content_type, (unsigned long)strlen(body), body);
+    mg_trace_stage(conn, "build");
+    if (strcmp(content_type, "application/json") == 0) {
+        mg_send_response(conn, status_code, json_headers, sizeof(json_headers) - 1,
+                         body, strlen(body));
+    } else if (strcmp(content_type, "text/plain") == 0) {
+        mg_send_response(conn, status_code, text_headers, sizeof(text_headers) - 1,
+                         body, strlen(body));
+    } else {
+        char headers[256];
+        int len = snprintf(headers, sizeof(headers), CORS_HEADERS "Content-Type: %s\r\n",
+                           content_type);
+        if (len < 0 || (size_t)len >= sizeof(headers)) {
+            mg_send_http_error(conn, 500, "Internal Server Error");
+            return;
+        }
+        mg_send_response(conn, status_code, headers, (size_t)len, body, strlen(body));
+    }
+    mg_trace_stage(conn, "send");
+}
+
+// Per-request memory. Every worker thread owns an arena (see
+// init_worker_thread); handlers take request bodies, large request structs
+// and responses from it, and end_request resets it after the response.
+static arena *request_arena(struct mg_connection *conn) {
+    return (arena *)mg_get_thread_pointer(conn);
+}
+
+// Read the request body into the request arena, NUL terminated, cut at
+// max - 1 bytes. Returns the body length, 0 or less if there is none.
+static int read_body_max(struct mg_connection *conn, char **body, size_t max) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    size_t size = max;
+    if (req_info->content_length >= 0 && (unsigned long long)req_info->content_length < max) {
+        size = (size_t)req_info->content_length + 1;
+    }
+    *body = arena_alloc(request_arena(conn), size);
+    if (!*body) {
+        return -1;
+    }
+    int len = mg_read(conn, *body, size - 1);
+    (*body)[len > 0 ? len : 0] = '\0';
+    if (len > 0) {
+        capture_body(*body, (size_t)len);
+    }
+    mg_trace_stage(conn, "body");
+    return len;
+}
+
+// Read a body of up to BUFFER_SIZE - 1 bytes. The body is the first
+// allocation of a request and fits in the block the arena keeps, so this
+// only fails if that is missing.
+static int read_body(struct mg_connection *conn, char **body) {
+    return read_body_max(conn, body, BUFFER_SIZE);
+}
+
+// Answer a job the DB executor pool did not run. Returns the status sent.
+static int send_dbpool_error(struct mg_connection *conn, int rc) {
+    if (rc == DBPOOL_TIMEOUT) {
+        send_response(conn, 504, "application/json", "{\"message\":\"Database timeout\"}");
+        return 504;
+    }
+    send_response(conn, 503, "application/json", "{\"message\":\"Database busy\"}");
+    return 503;
+}
+
+// A db_get_*_json call, run on the executor pool
+typedef struct {
+    int (*by_teacher)(arena_buf *out, int teacher_id);
+    int (*all)(arena_buf *out);
+    arena_buf *out;
+    int teacher_id;
+} json_query;
+
+static int run_json_query(void *arg) {
+    json_query *q = arg;
+    return q->by_teacher ? q->by_teacher(q->out, q->teacher_id) : q->all(q->out);
+}
+
+// The "sql" stage of a request trace includes the wait for an executor
+static int query_teacher_json(struct mg_connection *conn, int priority, int (*fn)(arena_buf *, int),
+                              arena_buf *out, int teacher_id) {
+    json_query q = { fn, NULL, out, teacher_id };
+    int rc = dbpool_run(db_executors, priority, DB_QUERY_TIMEOUT_MS, run_json_query, &q);
+    mg_trace_stage(conn, "sql");
+    return rc;
+}
+
+static int query_all_json(struct mg_connection *conn, int priority, int (*fn)(arena_buf *), arena_buf *out) {
+    json_query q = { NULL, fn, out, 0 };
+    int rc = dbpool_run(db_executors, priority, DB_QUERY_TIMEOUT_MS, run_json_query, &q);
+    mg_trace_stage(conn, "sql");
+    return rc;
+}
+
+// Send a JSON response built by one of the db_get_*_json functions.
+static int send_json_result(struct mg_connection *conn, const arena_buf *out, int rc) {
+    if (DBPOOL_ERROR(rc)) {
+        return send_dbpool_error(conn, rc);
+    }
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        send_response(conn, 503, "application/json", "{\"message\":\"Database busy\"}");
+        return 503;
+    }
+    if (rc != SQLITE_OK) {
+        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
+        return 500;
+    }
+    if (!out->data) {
+        send_response(conn, 500, "application/json", "{\"message\":\"Memory error\"}");
+        return 500;
+    }
+    send_response(conn, 200, "application/json", out->data);
+    return 200;
+}
+
+// Does an Accept-Encoding header allow gzip? "gzip;q=0" does not.
+static int accepts_gzip(const char *accept_encoding) {
+    const char *p = accept_encoding ? strstr(accept_encoding, "gzip") : NULL;
+    if (!p) return 0;
+    p += 4;
+    while (*p == ' ') p++;
+    if (*p != ';') return 1;
+    p = strstr(p, "q=");
+    return !p || atof(p + 2) > 0;
+}
+
+// Frontend files from the asset cache, written with one writev. Files that
+// are not cached and other methods fall through to civetweb (return 0).
+static int handle_asset(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0 && strcmp(req_info->request_method, "HEAD") != 0) {
+        return 0;
+    }
+    const asset *a = assets_acquire(req_info->local_uri);
+    if (!a) {
+        return 0;
+    }
+
+    int gzip = a->gzip && accepts_gzip(mg_get_header(conn, "Accept-Encoding"));
+    const char *etag = gzip ? a->gzip_etag : a->etag;
+    const char *if_none_match = mg_get_header(conn, "If-None-Match");
+    int status = (if_none_match && (strstr(if_none_match, etag) || strcmp(if_none_match, "*") == 0)) ? 304 : 200;
+    const char *body = NULL;
+    size_t body_len = 0;
+    if (status == 200) {
+        body = gzip ? a->gzip : a->data;
+        body_len = gzip ? a->gzip_size : a->size;
+    }
+    mg_send_response_as_is(conn, status,
+                           gzip ? a->gzip_headers : a->headers,
+                           gzip ? a->gzip_headers_len : a->headers_len,
+                           body, body_len);
+    mg_trace_stage(conn, "send");
+    assets_release(a);
+    return status;
 }
 
 // Handler for /health GET endpoint
@@ -63,6 +351,94 @@ static int handle_health(struct mg_connection *conn, void *cbdata) {
     return 200;
 }
 
+// Handler for /api/logout POST: ends the session of the bearer token, or
+// revokes it if it is a signed one
+static int handle_api_logout(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "POST") != 0) {
+        send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+    const char *auth_header = mg_get_header(conn, "Authorization");
+    int rc = auth_header && strncmp(auth_header, "Bearer ", 7) == 0 ? auth_revoke_token(auth_header + 7) : -1;
+    if (rc == AUTH_REVOKED_FULL) {
+        // The token stays valid: the client must not take this for a logout
+        send_response(conn, 503, "application/json", "{\"success\":false,\"message\":\"Logout not possible now, try again\"}");
+        return 503;
+    }
+    if (rc != 0) {
+        send_response(conn, 401, "application/json", "{\"success\":false,\"message\":\"Invalid token\"}");
+        return 401;
+    }
+    send_response(conn, 200, "application/json", "{\"success\":true}");
+    return 200;
+}
+
+// auth_handle_login and the user id and role lookups, as one job for the
+// login pool
+typedef struct {
+    const char *username;
+    const char *password;
+    int result;
+    int user_id;
+    int role;
+} login_job;
+
+static int run_login(void *arg) {
+    login_job *job = arg;
+    job->result = auth_handle_login(job->username, job->password);
+    if (job->result == 1) {
+        job->user_id = auth_get_user_id(job->username);
+        job->role = auth_get_user_role(job->username);
+    }
+    return SQLITE_OK;
+}
+
+// Check credentials on the login pool. Returns like auth_handle_login, or a
+// DBPOOL_* error. role gets the user's role from the database (AUTH_ROLE_*,
+// 0 for none), which is what a token may carry.
+static int pool_login(struct mg_connection *conn, const char *username, const char *password,
+                      int *user_id, int *role) {
+    login_job job = { username, password, 0, -1, 0 };
+    int rc = dbpool_run(login_verifiers, DBPOOL_HIGH, LOGIN_TIMEOUT_MS, run_login, &job);
+    mg_trace_stage(conn, "sql");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    if (user_id) {
+        *user_id = job.user_id;
+    }
+    if (role) {
+        *role = job.role;
+    }
+    return job.result;
+}
+
+static const char login_busy_headers[] =
+    CORS_HEADERS "Content-Type: application/json\r\nRetry-After: " LOGIN_RETRY_AFTER_S "\r\n";
+
+// Answer a login the login pool did not run. Returns the status sent.
+static int send_login_pool_error(struct mg_connection *conn, int rc, int with_success) {
+    if (rc == DBPOOL_TIMEOUT) {
+        send_response(conn, 504, "application/json", with_success
+                      ? "{\"success\":false,\"message\":\"Login timeout\"}"
+                      : "{\"message\":\"Login timeout\"}");
+        return 504;
+    }
+    if (rc == DBPOOL_STOPPED) {
+        send_response(conn, 503, "application/json", with_success
+                      ? "{\"success\":false,\"message\":\"Server is shutting down\"}"
+                      : "{\"message\":\"Server is shutting down\"}");
+        return 503;
+    }
+    const char *body = with_success ? "{\"success\":false,\"message\":\"Too many logins, try again\"}"
+                                    : "{\"message\":\"Too many logins, try again\"}";
+    mg_trace_stage(conn, "build");
+    mg_send_response(conn, 503, login_busy_headers, sizeof(login_busy_headers) - 1, body, strlen(body));
+    mg_trace_stage(conn, "send");
+    return 503;
+}
+
 // Handler for /login POST endpoint - expects form data username=...&password=...
 static int handle_login(struct mg_connection *conn, void *cbdata) {
     const struct mg_request_info *req_info = mg_get_request_info(conn);
@@ -70,13 +446,12 @@ static int handle_login(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
     char username[100] = {0};
     char password[100] = {0};
@@ -91,7 +466,10 @@ static int handle_login(struct mg_connection *conn, void *cbdata) {
         return 400;
     }
 
-    int success = auth_handle_login(username, password);
+    int success = pool_login(conn, username, password, NULL, NULL);
+    if (DBPOOL_ERROR(success)) {
+        return send_login_pool_error(conn, success, 0);
+    }
     if (success) {
         send_response(conn, 200, "application/json", "{\"message\": \"Login successful\"}");
     } else {
@@ -100,123 +478,120 @@ static int handle_login(struct mg_connection *conn, void *cbdata) {
     return success ? 200 : 401;
 }
 
-// Simple JSON credentials parser - expects {"username":"...","password":"..."}
-static int parse_json_credentials(const char *json, char *username, char *password) {
-    const char *u_key = "\"username\":\"";
-    const char *p_key = "\"password\":\"";
-    const char *u_start = strstr(json, u_key);
-    const char *p_start = strstr(json, p_key);
-    if (!u_start || !p_start) return 0;
-    u_start += strlen(u_key);
-    p_start += strlen(p_key);
-    const char *u_end = strchr(u_start, '"');
-    const char *p_end = strchr(p_start, '"');
-    if (!u_end || !p_end) return 0;
-    int u_len = (int)(u_end - u_start);
-    int p_len = (int)(p_end - p_start);
-    if (u_len >= 100 || p_len >= 100) return 0;
-    strncpy(username, u_start, u_len);
-    username[u_len] = '\0';
-    strncpy(password, p_start, p_len);
-    password[p_len] = '\0';
-    return 1;
-}
-
-// Helper function to parse subject JSON - expects {"program":"...","grade_level":"...","semester":"...","subject":"...","teacher_id":...}
-static int parse_subject_json(const char *json, char *program, char *grade_level, char *semester, char *subject, int *teacher_id) {
-    const char *prog_key = "\"program\":\"";
-    const char *prog_start = strstr(json, prog_key);
-    if (prog_start) {
-        prog_start += strlen(prog_key);
-        const char *prog_end = strchr(prog_start, '"');
-        if (prog_end) {
-            int len = prog_end - prog_start;
-            if (len < 100) {
-                strncpy(program, prog_start, len);
-                program[len] = '\0';
-            }
-        }
-    }
-
-    const char *gl_key = "\"grade_level\":\"";
-    const char *gl_start = strstr(json, gl_key);
-    if (gl_start) {
-        gl_start += strlen(gl_key);
-        const char *gl_end = strchr(gl_start, '"');
-        if (gl_end) {
-            int len = gl_end - gl_start;
-            if (len < 50) {
-                strncpy(grade_level, gl_start, len);
-                grade_level[len] = '\0';
-            }
-        }
-    }
-
-    const char *sem_key = "\"semester\":\"";
-    const char *sem_start = strstr(json, sem_key);
-    if (sem_start) {
-        sem_start += strlen(sem_key);
-        const char *sem_end = strchr(sem_start, '"');
-        if (sem_end) {
-            int len = sem_end - sem_start;
-            if (len < 50) {
-                strncpy(semester, sem_start, len);
-                semester[len] = '\0';
-            }
-        }
-    }
-
-    const char *sub_key = "\"subject\":\"";
-    const char *sub_start = strstr(json, sub_key);
-    if (sub_start) {
-        sub_start += strlen(sub_key);
-        const char *sub_end = strchr(sub_start, '"');
-        if (sub_end) {
-            int len = sub_end - sub_start;
-            if (len < 100) {
-                strncpy(subject, sub_start, len);
-                subject[len] = '\0';
-            }
-        }
-    }
-
-    const char *tid_key = "\"teacher_id\":";
-    const char *tid_start = strstr(json, tid_key);
-    if (tid_start) {
-        tid_start += strlen(tid_key);
-        *teacher_id = atoi(tid_start);
-    }
-
-    return (program[0] && grade_level[0] && semester[0] && subject[0] && *teacher_id != 0) ? 1 : 0;
-}
-
-// Helper function to parse delete JSON - expects {"id":...}
-static int parse_delete_json(const char *json, int *id) {
-    const char *id_key = "\"id\":";
-    const char *id_start = strstr(json, id_key);
-    if (!id_start) return 0;
-    id_start += strlen(id_key);
-    *id = atoi(id_start);
-    return (*id != 0) ? 1 : 0;
-}
+// JSON request bodies. Each endpoint binds its fields into a request struct
+// with a field table; see json.h. Fields missing from the body stay zero.
+
+// {"username":"...","password":"..."}
+typedef struct {
+    char username[100];
+    char password[100];
+} credentials_request;
+
+static const json_field credentials_fields[] = {
+    JSON_FIELD_STRING(credentials_request, username),
+    JSON_FIELD_STRING(credentials_request, password),
+};
+
+// {"id":...,"program":"...","grade_level":"...","semester":"...","subject":"...","teacher_id":...}
+typedef struct {
+    int id;
+    char program[100];
+    char grade_level[50];
+    char semester[50];
+    char subject[100];
+    int teacher_id;
+} subject_request;
+
+static const json_field subject_fields[] = {
+    JSON_FIELD_INT(subject_request, id),
+    JSON_FIELD_STRING(subject_request, program),
+    JSON_FIELD_STRING(subject_request, grade_level),
+    JSON_FIELD_STRING(subject_request, semester),
+    JSON_FIELD_STRING(subject_request, subject),
+    JSON_FIELD_INT(subject_request, teacher_id),
+};
+
+// {"id":...}
+typedef struct {
+    int id;
+} id_request;
+
+static const json_field id_fields[] = {
+    JSON_FIELD_INT(id_request, id),
+};
+
+// {"teacher_id":...}
+typedef struct {
+    int teacher_id;
+} teacher_id_request;
+
+static const json_field teacher_id_fields[] = {
+    JSON_FIELD_INT(teacher_id_request, teacher_id),
+};
+
+// {"subject_id":...,"teacher_id":...}
+typedef struct {
+    int subject_id;
+    int teacher_id;
+} assign_request;
 
-// Helper function to parse assign JSON - expects {"subject_id":...,"teacher_id":...}
-static int parse_assign_json(const char *json, int *subject_id, int *teacher_id) {
-    const char *sid_key = "\"subject_id\":";
-    const char *sid_start = strstr(json, sid_key);
-    if (sid_start) {
-        sid_start += strlen(sid_key);
-        *subject_id = atoi(sid_start);
-    }
+static const json_field assign_fields[] = {
+    JSON_FIELD_INT(assign_request, subject_id),
+    JSON_FIELD_INT(assign_request, teacher_id),
+};
 
-    const char *tid_key = "\"teacher_id\":";
-    const char *tid_start = strstr(json, tid_key);
-    if (tid_start) {
-        tid_start += strlen(tid_key);
-        *teacher_id = atoi(tid_start);
+// {"subject_id":1,"category":"...","file_name":"...","file_base64":"..."}
+typedef struct {
+    int subject_id;
+    char category[100];
+    char file_name[256];
+    char file_base64[BUFFER_SIZE];
+} material_request;
+
+static const json_field material_fields[] = {
+    JSON_FIELD_INT(material_request, subject_id),
+    JSON_FIELD_STRING(material_request, category),
+    JSON_FIELD_STRING(material_request, file_name),
+    JSON_FIELD_STRING(material_request, file_base64),
+};
+
+// {"name":"...","subjects_json":"..."}
+typedef struct {
+    char name[100];
+    char subjects_json[BUFFER_SIZE];
+} program_request;
+
+static const json_field program_fields[] = {
+    JSON_FIELD_STRING(program_request, name),
+    JSON_FIELD_STRING(program_request, subjects_json),
+};
+
+// {"name":"...","username":"...","password":"...","access_code":"..."}
+typedef struct {
+    char name[100];
+    char username[100];
+    char password[100];
+    char access_code[100];
+} teacher_request;
+
+static const json_field teacher_fields[] = {
+    JSON_FIELD_STRING(teacher_request, name),
+    JSON_FIELD_STRING(teacher_request, username),
+    JSON_FIELD_STRING(teacher_request, password),
+    JSON_FIELD_STRING(teacher_request, access_code),
+};
+
+#define BIND_JSON(body, len, fields, req) \
+    json_bind((body), (size_t)(len), (fields), JSON_FIELD_COUNT(fields), (req))
+
+// New token for a login. If the session table is full, answers 503 and
+// returns -1.
+static int start_session(struct mg_connection *conn, char *token, size_t size, int user_id, int role) {
+    if (auth_issue_token(token, size, user_id, role) != 0) {
+        send_response(conn, 503, "application/json", "{\"success\":false,\"message\":\"Too many sessions\"}");
+        return -1;
     }
-
-    return (*subject_id != 0 && *teacher_id != 0) ? 1 : 0;
+    return 0;
 }
 
 // Handler for /api/admin/login POST with JSON body
@@ -226,31 +601,36 @@ static int handle_api_admin_login(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    char username[100] = {0};
-    char password[100] = {0};
-    if (!parse_json_credentials(post_data, username, password)) {
+    credentials_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, credentials_fields, &req) < 0
+        || !req.username[0] || !req.password[0]) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
         return 400;
     }
 
-    int login_result = auth_handle_login(username, password);
-    if (login_result == 1) {
-        int user_id = auth_get_user_id(username);
-        char token[65];
-        auth_generate_token(token, sizeof(token));
-        auth_store_token(token, user_id);
+    int user_id = -1, role = 0;
+    int login_result = pool_login(conn, req.username, req.password, &user_id, &role);
+    if (login_result == 1 && role != AUTH_ROLE_ADMIN) {
+        send_response(conn, 403, "application/json", "{\"success\":false,\"message\":\"Not an administrator\"}");
+        return 403;
+    } else if (login_result == 1) {
+        char token[AUTH_TOKEN_MAX + 1];
+        if (start_session(conn, token, sizeof(token), user_id, role) != 0) {
+            return 503;
+        }
         char response[256];
         sprintf(response, "{\"success\":true,\"id\":%d,\"token\":\"%s\",\"name\":\"Admin\",\"redirect\":\"./admin_panel.html\"}", user_id, token);
         send_response(conn, 200, "application/json", response);
         return 200;
+    } else if (DBPOOL_ERROR(login_result)) {
+        return send_login_pool_error(conn, login_result, 1);
     } else if (login_result == -2) {
         send_response(conn, 423, "application/json", "{\"success\":false,\"message\":\"Account locked due to too many failed attempts\"}");
         return 423;
@@ -267,31 +647,36 @@ static int handle_api_teacher_login(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    char username[100] = {0};
-    char password[100] = {0};
-    if (!parse_json_credentials(post_data, username, password)) {
+    credentials_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, credentials_fields, &req) < 0
+        || !req.username[0] || !req.password[0]) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
         return 400;
     }
 
-    int login_result = auth_handle_login(username, password);
-    if (login_result == 1) {
-        int user_id = auth_get_user_id(username);
-        char token[65];
-        auth_generate_token(token, sizeof(token));
-        auth_store_token(token, user_id);
+    int user_id = -1, role = 0;
+    int login_result = pool_login(conn, req.username, req.password, &user_id, &role);
+    if (login_result == 1 && role == 0) {
+        send_response(conn, 403, "application/json", "{\"success\":false,\"message\":\"No role for this account\"}");
+        return 403;
+    } else if (login_result == 1) {
+        char token[AUTH_TOKEN_MAX + 1];
+        if (start_session(conn, token, sizeof(token), user_id, role) != 0) {
+            return 503;
+        }
         char response[256];
         sprintf(response, "{\"success\":true,\"token\":\"%s\",\"name\":\"Teacher\",\"redirect\":\"./teacher_panel.html\"}", token);
         send_response(conn, 200, "application/json", response);
         return 200;
+    } else if (DBPOOL_ERROR(login_result)) {
+        return send_login_pool_error(conn, login_result, 1);
     } else if (login_result == -2) {
         send_response(conn, 423, "application/json", "{\"success\":false,\"message\":\"Account locked due to too many failed attempts\"}");
         return 423;
@@ -314,32 +699,23 @@ static int handle_api_teacher_dashboard_data(struct mg_connection *conn, void *c
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    // Parse teacher_id from JSON
-    const char *tid_key = "\"teacher_id\":";
-    const char *tid_start = strstr(post_data, tid_key);
-    if (!tid_start) {
+    teacher_id_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, teacher_id_fields, &req) < 1) {
         send_response(conn, 400, "application/json", "{\"message\":\"Missing teacher_id\"}");
         return 400;
     }
-    tid_start += strlen(tid_key);
-    int teacher_id = atoi(tid_start);
 
-    char *json = db_get_dashboard_data_json(teacher_id);
-    if (json) {
-        send_response(conn, 200, "application/json", json);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    int rc = query_teacher_json(conn, DBPOOL_NORMAL, db_get_dashboard_data_json, &out, req.teacher_id);
+    return send_json_result(conn, &out, rc);
 }
 
 
@@ -351,76 +727,29 @@ static int handle_upload_material(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
-
-    // Parse JSON: {"subject_id":1,"category":"...","file_name":"...","file_base64":"..."}
-    int subject_id = 0;
-    char category[100] = {0};
-    char file_name[256] = {0};
-    char file_base64[BUFFER_SIZE] = {0};
-
-    // Simple parsing
-    const char *sid_key = "\"subject_id\":";
-    const char *sid_start = strstr(post_data, sid_key);
-    if (sid_start) {
-        sid_start += strlen(sid_key);
-        subject_id = atoi(sid_start);
-    }
-
-    const char *cat_key = "\"category\":\"";
-    const char *cat_start = strstr(post_data, cat_key);
-    if (cat_start) {
-        cat_start += strlen(cat_key);
-        const char *cat_end = strchr(cat_start, '"');
-        if (cat_end) {
-            int len = cat_end - cat_start;
-            if (len < sizeof(category)) {
-                strncpy(category, cat_start, len);
-                category[len] = '\0';
-            }
-        }
-    }
 
-    const char *fn_key = "\"file_name\":\"";
-    const char *fn_start = strstr(post_data, fn_key);
-    if (fn_start) {
-        fn_start += strlen(fn_key);
-        const char *fn_end = strchr(fn_start, '"');
-        if (fn_end) {
-            int len = fn_end - fn_start;
-            if (len < sizeof(file_name)) {
-                strncpy(file_name, fn_start, len);
-                file_name[len] = '\0';
-            }
-        }
+    material_request *req = arena_calloc(request_arena(conn), sizeof(*req));
+    if (!req) {
+        send_response(conn, 500, "application/json", "{\"success\":false,\"message\":\"Memory error\"}");
+        return 500;
     }
-
-    const char *fb_key = "\"file_base64\":\"";
-    const char *fb_start = strstr(post_data, fb_key);
-    if (fb_start) {
-        fb_start += strlen(fb_key);
-        const char *fb_end = strchr(fb_start, '"');
-        if (fb_end) {
-            int len = fb_end - fb_start;
-            if (len < sizeof(file_base64)) {
-                strncpy(file_base64, fb_start, len);
-                file_base64[len] = '\0';
-            }
-        }
+    if (BIND_JSON(post_data, post_data_len, material_fields, req) < 0) {
+        send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+        return 400;
     }
 
-    if (subject_id == 0 || !category[0] || !file_name[0] || !file_base64[0]) {
+    if (req->subject_id == 0 || !req->category[0] || !req->file_name[0] || !req->file_base64[0]) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing required fields\"}");
         return 400;
     }
 
-    int rc = materials_create(subject_id, category, file_name, file_base64);
+    int rc = materials_create(req->subject_id, req->category, req->file_name, req->file_base64);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Material uploaded\"}");
     } else {
@@ -436,24 +765,20 @@ static int handle_delete_material(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    const char *id_key = "\"id\":";
-    const char *id_start = strstr(post_data, id_key);
-    if (!id_start) {
+    id_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, id_fields, &req) < 1) {
         send_response(conn, 400, "application/json", "{\"message\":\"Missing id\"}");
         return 400;
     }
-    id_start += strlen(id_key);
-    int id = atoi(id_start);
 
-    int rc = materials_delete(id);
+    int rc = materials_delete(req.id);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"message\":\"Deleted\"}");
     } else {
@@ -481,7 +806,11 @@ static int handle_download_material(struct mg_connection *conn, void *cbdata) {
     int subject_id;
     char category[100];
     char original_filename[256];
-    char file_data[BUFFER_SIZE];
+    char *file_data = arena_alloc(request_arena(conn), BUFFER_SIZE);
+    if (!file_data) {
+        send_response(conn, 500, "text/plain", "Internal Server Error");
+        return 500;
+    }
     int rc = materials_read(id, &subject_id, category, original_filename, file_data);
     if (rc != SQLITE_OK) {
         send_response(conn, 404, "text/plain", "Not Found");
@@ -489,15 +818,17 @@ static int handle_download_material(struct mg_connection *conn, void *cbdata) {
     }
 
     // Assume base64, but for simplicity, send as is. In real, decode if needed.
-    mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-                    "Access-Control-Allow-Origin: *\r\n"
-                    "Content-Type: application/octet-stream\r\n"
-                    "Content-Disposition: attachment; filename=\"%s\"\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Connection: close\r\n"
-                    "\r\n"
-                    "%s",
-                    original_filename, strlen(file_data), file_data);
+    char headers[512];
+    int len = snprintf(headers, sizeof(headers),
+                       "Access-Control-Allow-Origin: *\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Disposition: attachment; filename=\"%s\"\r\n",
+                       original_filename);
+    if (len < 0 || (size_t)len >= sizeof(headers)) {
+        send_response(conn, 500, "text/plain", "Internal Server Error");
+        return 500;
+    }
+    mg_send_response(conn, 200, headers, (size_t)len, file_data, strlen(file_data));
     return 200;
 }
 
@@ -517,24 +848,12 @@ static int handle_get_subjects(struct mg_connection *conn, void *cbdata) {
     }
     int teacher_id = atoi(teacher_id_str);
 
-    char *json = db_get_subjects_by_teacher_json(teacher_id);
-    if (json) {
-        size_t json_len = strlen(json);
-        size_t response_len = json_len + 13; // strlen("{\"subjects\":}") + 1 for null
-        char *response = malloc(response_len);
-        if (!response) {
-            send_response(conn, 500, "application/json", "{\"message\":\"Memory error\"}");
-            free(json);
-            return 500;
-        }
-        sprintf(response, "{\"subjects\":%s}", json);
-        send_response(conn, 200, "application/json", response);
-        free(response);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_puts(&out, "{\"subjects\":");
+    int rc = query_teacher_json(conn, DBPOOL_NORMAL, db_get_subjects_by_teacher_json, &out, teacher_id);
+    arena_buf_puts(&out, "}");
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /create-subject POST with JSON body
@@ -544,26 +863,22 @@ static int handle_create_subject(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
-
-    char program[100] = {0};
-    char grade_level[50] = {0};
-    char semester[50] = {0};
-    char subject[100] = {0};
-    int teacher_id = 0;
 
-    if (!parse_subject_json(post_data, program, grade_level, semester, subject, &teacher_id)) {
+    subject_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, subject_fields, &req) < 0
+        || !req.program[0] || !req.grade_level[0] || !req.semester[0] || !req.subject[0]
+        || req.teacher_id == 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing required fields\"}");
         return 400;
     }
 
-    int rc = subjects_create(program, grade_level, semester, subject, teacher_id);
+    int rc = subjects_create(req.program, req.grade_level, req.semester, req.subject, req.teacher_id);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Subject created\"}");
     } else {
@@ -579,36 +894,26 @@ static int handle_update_subject(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    int id = 0;
-    if (!parse_delete_json(post_data, &id)) {
+    subject_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, subject_fields, &req) < 0 || req.id == 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing id\"}");
         return 400;
     }
 
-    char program[100] = {0};
-    char grade_level[50] = {0};
-    char semester[50] = {0};
-    char subject[100] = {0};
-    int teacher_id = 0;
-    if (!parse_subject_json(post_data, program, grade_level, semester, subject, &teacher_id)) {
-        send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing required fields\"}");
-        return 400;
-    }
-
-    if (id == 0 || !program[0] || !grade_level[0] || !semester[0] || !subject[0] || teacher_id == 0) {
+    if (!req.program[0] || !req.grade_level[0] || !req.semester[0] || !req.subject[0] || req.teacher_id == 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing required fields\"}");
         return 400;
     }
 
-    int rc = subjects_update(id, program, grade_level, semester, subject, teacher_id);
+    int rc = subjects_update(req.id, req.program, req.grade_level, req.semester, req.subject,
+                             req.teacher_id);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Subject updated\"}");
     } else {
@@ -624,24 +929,20 @@ static int handle_delete_subject(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    const char *id_key = "\"id\":";
-    const char *id_start = strstr(post_data, id_key);
-    if (!id_start) {
+    id_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, id_fields, &req) < 1) {
         send_response(conn, 400, "application/json", "{\"message\":\"Missing id\"}");
         return 400;
     }
-    id_start += strlen(id_key);
-    int id = atoi(id_start);
 
-    int rc = subjects_delete(id);
+    int rc = subjects_delete(req.id);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"message\":\"Deleted\"}");
     } else {
@@ -657,37 +958,22 @@ static int handle_assign_subject(struct mg_connection *conn, void *cbdata) {
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    int subject_id = 0;
-    int teacher_id = 0;
-
-    const char *sid_key = "\"subject_id\":";
-    const char *sid_start = strstr(post_data, sid_key);
-    if (sid_start) {
-        sid_start += strlen(sid_key);
-        subject_id = atoi(sid_start);
-    }
-
-    const char *tid_key = "\"teacher_id\":";
-    const char *tid_start = strstr(post_data, tid_key);
-    if (tid_start) {
-        tid_start += strlen(tid_key);
-        teacher_id = atoi(tid_start);
-    }
-
-    if (subject_id == 0 || teacher_id == 0) {
+    assign_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, assign_fields, &req) < 0
+        || req.subject_id == 0 || req.teacher_id == 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing ids\"}");
         return 400;
     }
 
-    int rc = db_assign_subject_to_teacher(subject_id, teacher_id);
+    int rc = db_assign_subject_to_teacher(req.subject_id, req.teacher_id);
+    mg_trace_stage(conn, "sql");
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Assigned\"}");
     } else {
@@ -696,12 +982,6 @@ static int handle_assign_subject(struct mg_connection *conn, void *cbdata) {
     return rc == SQLITE_OK ? 200 : 500;
 }
 
-
-
-
-
-
-
 // Handler for /get-materials GET endpoint - expects query teacher_id
 static int handle_get_materials(struct mg_connection *conn, void *cbdata) {
     const struct mg_request_info *req_info = mg_get_request_info(conn);
@@ -717,14 +997,10 @@ static int handle_get_materials(struct mg_connection *conn, void *cbdata) {
         return 400;
     }
 
-    char *json = db_get_materials_by_teacher_json(teacher_id);
-    if (json) {
-        send_response(conn, 200, "application/json", json);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    int rc = query_teacher_json(conn, DBPOOL_NORMAL, db_get_materials_by_teacher_json, &out, teacher_id);
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /api/teacher/get-subjects GET endpoint - expects query teacher_id
@@ -748,24 +1024,12 @@ static int handle_api_teacher_get_subjects(struct mg_connection *conn, void *cbd
         return 400;
     }
 
-    char *json = db_get_subjects_by_teacher_json(teacher_id);
-    if (json) {
-        size_t json_len = strlen(json);
-        size_t response_len = json_len + 13; // strlen("{\"subjects\":}") + 1 for null
-        char *response = malloc(response_len);
-        if (!response) {
-            send_response(conn, 500, "application/json", "{\"message\":\"Memory error\"}");
-            free(json);
-            return 500;
-        }
-        sprintf(response, "{\"subjects\":%s}", json);
-        send_response(conn, 200, "application/json", response);
-        free(response);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_puts(&out, "{\"subjects\":");
+    int rc = query_teacher_json(conn, DBPOOL_NORMAL, db_get_subjects_by_teacher_json, &out, teacher_id);
+    arena_buf_puts(&out, "}");
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /api/teacher/add-subject POST endpoint - expects JSON {program, grade_level, semester, subject, teacher_id}
@@ -781,90 +1045,22 @@ static int handle_api_teacher_add_subject(struct mg_connection *conn, void *cbda
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    char program[100] = {0};
-    char grade_level[50] = {0};
-    char semester[50] = {0};
-    char subject[100] = {0};
-    int teacher_id = 0;
-
-    // Simple parsing
-    const char *prog_key = "\"program\":\"";
-    const char *prog_start = strstr(post_data, prog_key);
-    if (prog_start) {
-        prog_start += strlen(prog_key);
-        const char *prog_end = strchr(prog_start, '"');
-        if (prog_end) {
-            int len = prog_end - prog_start;
-            if (len < sizeof(program)) {
-                strncpy(program, prog_start, len);
-                program[len] = '\0';
-            }
-        }
-    }
-
-    const char *gl_key = "\"grade_level\":\"";
-    const char *gl_start = strstr(post_data, gl_key);
-    if (gl_start) {
-        gl_start += strlen(gl_key);
-        const char *gl_end = strchr(gl_start, '"');
-        if (gl_end) {
-            int len = gl_end - gl_start;
-            if (len < sizeof(grade_level)) {
-                strncpy(grade_level, gl_start, len);
-                grade_level[len] = '\0';
-            }
-        }
-    }
-
-    const char *sem_key = "\"semester\":\"";
-    const char *sem_start = strstr(post_data, sem_key);
-    if (sem_start) {
-        sem_start += strlen(sem_key);
-        const char *sem_end = strchr(sem_start, '"');
-        if (sem_end) {
-            int len = sem_end - sem_start;
-            if (len < sizeof(semester)) {
-                strncpy(semester, sem_start, len);
-                semester[len] = '\0';
-            }
-        }
-    }
-
-    const char *sub_key = "\"subject\":\"";
-    const char *sub_start = strstr(post_data, sub_key);
-    if (sub_start) {
-        sub_start += strlen(sub_key);
-        const char *sub_end = strchr(sub_start, '"');
-        if (sub_end) {
-            int len = sub_end - sub_start;
-            if (len < sizeof(subject)) {
-                strncpy(subject, sub_start, len);
-                subject[len] = '\0';
-            }
-        }
-    }
-
-    const char *tid_key = "\"teacher_id\":";
-    const char *tid_start = strstr(post_data, tid_key);
-    if (tid_start) {
-        tid_start += strlen(tid_key);
-        teacher_id = atoi(tid_start);
-    }
-
-    if (!program[0] || !grade_level[0] || !semester[0] || !subject[0] || teacher_id == 0) {
+    subject_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, subject_fields, &req) < 0
+        || !req.program[0] || !req.grade_level[0] || !req.semester[0] || !req.subject[0]
+        || req.teacher_id == 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing required fields\"}");
         return 400;
     }
 
-    int rc = subjects_create(program, grade_level, semester, subject, teacher_id);
+    int rc = subjects_create(req.program, req.grade_level, req.semester, req.subject, req.teacher_id);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Subject added\"}");
     } else {
@@ -886,24 +1082,20 @@ static int handle_api_teacher_delete_subject(struct mg_connection *conn, void *c
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    const char *id_key = "\"id\":";
-    const char *id_start = strstr(post_data, id_key);
-    if (!id_start) {
+    id_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, id_fields, &req) < 1) {
         send_response(conn, 400, "application/json", "{\"message\":\"Missing id\"}");
         return 400;
     }
-    id_start += strlen(id_key);
-    int id = atoi(id_start);
 
-    int rc = subjects_delete(id);
+    int rc = subjects_delete(req.id);
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"message\":\"Deleted\"}");
     } else {
@@ -920,24 +1112,12 @@ static int handle_api_admin_get_subjects(struct mg_connection *conn, void *cbdat
         return 405;
     }
 
-    char *json = db_get_all_subjects_json();
-    if (json) {
-        size_t json_len = strlen(json);
-        size_t response_len = json_len + 13; // strlen("{\"subjects\":}") + 1 for null
-        char *response = malloc(response_len);
-        if (!response) {
-            send_response(conn, 500, "application/json", "{\"message\":\"Memory error\"}");
-            free(json);
-            return 500;
-        }
-        sprintf(response, "{\"subjects\":%s}", json);
-        send_response(conn, 200, "application/json", response);
-        free(response);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_puts(&out, "{\"subjects\":");
+    int rc = query_all_json(conn, DBPOOL_LOW, db_get_all_subjects_json, &out);
+    arena_buf_puts(&out, "}");
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /api/teacher/assign-subject POST endpoint - expects JSON {subject_id, teacher_id}
@@ -953,37 +1133,22 @@ static int handle_api_teacher_assign_subject(struct mg_connection *conn, void *c
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
-
-    int subject_id = 0;
-    int teacher_id = 0;
-
-    const char *sid_key = "\"subject_id\":";
-    const char *sid_start = strstr(post_data, sid_key);
-    if (sid_start) {
-        sid_start += strlen(sid_key);
-        subject_id = atoi(sid_start);
-    }
-
-    const char *tid_key = "\"teacher_id\":";
-    const char *tid_start = strstr(post_data, tid_key);
-    if (tid_start) {
-        tid_start += strlen(tid_key);
-        teacher_id = atoi(tid_start);
-    }
 
-    if (subject_id == 0 || teacher_id == 0) {
+    assign_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, assign_fields, &req) < 0
+        || req.subject_id == 0 || req.teacher_id == 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing ids\"}");
         return 400;
     }
 
-    int rc = db_assign_subject_to_teacher(subject_id, teacher_id);
+    int rc = db_assign_subject_to_teacher(req.subject_id, req.teacher_id);
+    mg_trace_stage(conn, "sql");
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Assigned\"}");
     } else {
@@ -1000,16 +1165,12 @@ static int handle_api_admin_get_programs(struct mg_connection *conn, void *cbdat
         return 405;
     }
 
-    char *json = db_get_all_programs_json();
-    if (json) {
-        char response[4096];
-        sprintf(response, "{\"programs\":%s}", json);
-        send_response(conn, 200, "application/json", response);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_puts(&out, "{\"programs\":");
+    int rc = query_all_json(conn, DBPOOL_LOW, db_get_all_programs_json, &out);
+    arena_buf_puts(&out, "}");
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /api/admin/get-teachers GET endpoint
@@ -1020,16 +1181,12 @@ static int handle_api_admin_get_teachers(struct mg_connection *conn, void *cbdat
         return 405;
     }
 
-    char *json = db_get_all_teachers_json();
-    if (json) {
-        char response[4096];
-        sprintf(response, "{\"teachers\":%s}", json);
-        send_response(conn, 200, "application/json", response);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_puts(&out, "{\"teachers\":");
+    int rc = query_all_json(conn, DBPOOL_LOW, db_get_all_teachers_json, &out);
+    arena_buf_puts(&out, "}");
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /api/admin/get-tracking-data GET endpoint
@@ -1040,16 +1197,12 @@ static int handle_api_admin_get_tracking_data(struct mg_connection *conn, void *
         return 405;
     }
 
-    char *json = db_get_tracking_data_json();
-    if (json) {
-        char response[4096];
-        sprintf(response, "{\"tracking_data\":%s}", json);
-        send_response(conn, 200, "application/json", response);
-        free(json);
-    } else {
-        send_response(conn, 500, "application/json", "{\"message\":\"Database error\"}");
-    }
-    return 200;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), 256);
+    arena_buf_puts(&out, "{\"tracking_data\":");
+    int rc = query_all_json(conn, DBPOOL_LOW, db_get_tracking_data_json, &out);
+    arena_buf_puts(&out, "}");
+    return send_json_result(conn, &out, rc);
 }
 
 // Handler for /api/admin/add-program POST endpoint - expects JSON {name, subjects_json}
@@ -1059,51 +1212,25 @@ static int handle_api_admin_add_program(struct mg_connection *conn, void *cbdata
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
-
-    char name[100] = {0};
-    char subjects_json[BUFFER_SIZE] = {0};
-
-    const char *name_key = "\"name\":\"";
-    const char *name_start = strstr(post_data, name_key);
-    if (name_start) {
-        name_start += strlen(name_key);
-        const char *name_end = strchr(name_start, '"');
-        if (name_end) {
-            int len = name_end - name_start;
-            if (len < sizeof(name)) {
-                strncpy(name, name_start, len);
-                name[len] = '\0';
-            }
-        }
-    }
 
-    const char *subjects_key = "\"subjects_json\":\"";
-    const char *subjects_start = strstr(post_data, subjects_key);
-    if (subjects_start) {
-        subjects_start += strlen(subjects_key);
-        const char *subjects_end = strchr(subjects_start, '"');
-        if (subjects_end) {
-            int len = subjects_end - subjects_start;
-            if (len < sizeof(subjects_json)) {
-                strncpy(subjects_json, subjects_start, len);
-                subjects_json[len] = '\0';
-            }
-        }
+    program_request *req = arena_calloc(request_arena(conn), sizeof(*req));
+    if (!req) {
+        send_response(conn, 500, "application/json", "{\"success\":false,\"message\":\"Memory error\"}");
+        return 500;
     }
-
-    if (!name[0]) {
+    if (BIND_JSON(post_data, post_data_len, program_fields, req) < 0 || !req->name[0]) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing name\"}");
         return 400;
     }
 
-    int rc = db_create_program(name, subjects_json);
+    int rc = db_create_program(req->name, req->subjects_json);
+    mg_trace_stage(conn, "sql");
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Program added\"}");
     } else {
@@ -1119,21 +1246,21 @@ static int handle_api_admin_delete_program(struct mg_connection *conn, void *cbd
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    int id = 0;
-    if (!parse_delete_json(post_data, &id)) {
+    id_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, id_fields, &req) < 0 || req.id == 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"Missing id\"}");
         return 400;
     }
 
-    int rc = db_delete_program(id);
+    int rc = db_delete_program(req.id);
+    mg_trace_stage(conn, "sql");
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"message\":\"Deleted\"}");
     } else {
@@ -1149,81 +1276,22 @@ static int handle_api_admin_add_teacher(struct mg_connection *conn, void *cbdata
         send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
-
-    char name[100] = {0};
-    char username[100] = {0};
-    char password[100] = {0};
-    char access_code[100] = {0};
-
-    const char *name_key = "\"name\":\"";
-    const char *name_start = strstr(post_data, name_key);
-    if (name_start) {
-        name_start += strlen(name_key);
-        const char *name_end = strchr(name_start, '"');
-        if (name_end) {
-            int len = name_end - name_start;
-            if (len < sizeof(name)) {
-                strncpy(name, name_start, len);
-                name[len] = '\0';
-            }
-        }
-    }
-
-    const char *username_key = "\"username\":\"";
-    const char *username_start = strstr(post_data, username_key);
-    if (username_start) {
-        username_start += strlen(username_key);
-        const char *username_end = strchr(username_start, '"');
-        if (username_end) {
-            int len = username_end - username_start;
-            if (len < sizeof(username)) {
-                strncpy(username, username_start, len);
-                username[len] = '\0';
-            }
-        }
-    }
-
-    const char *password_key = "\"password\":\"";
-    const char *password_start = strstr(post_data, password_key);
-    if (password_start) {
-        password_start += strlen(password_key);
-        const char *password_end = strchr(password_start, '"');
-        if (password_end) {
-            int len = password_end - password_start;
-            if (len < sizeof(password)) {
-                strncpy(password, password_start, len);
-                password[len] = '\0';
-            }
-        }
-    }
-
-    const char *access_code_key = "\"access_code\":\"";
-    const char *access_code_start = strstr(post_data, access_code_key);
-    if (access_code_start) {
-        access_code_start += strlen(access_code_key);
-        const char *access_code_end = strchr(access_code_start, '"');
-        if (access_code_end) {
-            int len = access_code_end - access_code_start;
-            if (len < sizeof(access_code)) {
-                strncpy(access_code, access_code_start, len);
-                access_code[len] = '\0';
-            }
-        }
-    }
 
-    if (!name[0] || !username[0] || !password[0] || !access_code[0]) {
+    teacher_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, teacher_fields, &req) < 0
+        || !req.name[0] || !req.username[0] || !req.password[0] || !req.access_code[0]) {
         send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Missing required fields\"}");
         return 400;
     }
 
-    int rc = db_create_teacher(name, username, password, access_code);
+    int rc = db_create_teacher(req.name, req.username, req.password, req.access_code);
+    mg_trace_stage(conn, "sql");
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"success\":true,\"message\":\"Teacher added\"}");
     } else {
@@ -1239,21 +1307,21 @@ static int handle_api_admin_delete_teacher(struct mg_connection *conn, void *cbd
         send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
         return 405;
     }
-    char post_data[BUFFER_SIZE] = {0};
-    int post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+    char *post_data;
+    int post_data_len = read_body(conn, &post_data);
     if (post_data_len <= 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"No body data\"}");
         return 400;
     }
-    post_data[post_data_len] = '\0';
 
-    int id = 0;
-    if (!parse_delete_json(post_data, &id)) {
+    id_request req = {0};
+    if (BIND_JSON(post_data, post_data_len, id_fields, &req) < 0 || req.id == 0) {
         send_response(conn, 400, "application/json", "{\"message\":\"Missing id\"}");
         return 400;
     }
 
-    int rc = db_delete_teacher(id);
+    int rc = db_delete_teacher(req.id);
+    mg_trace_stage(conn, "sql");
     if (rc == SQLITE_OK) {
         send_response(conn, 200, "application/json", "{\"message\":\"Deleted\"}");
     } else {
@@ -1262,6 +1330,597 @@ static int handle_api_admin_delete_teacher(struct mg_connection *conn, void *cbd
     return rc == SQLITE_OK ? 200 : 500;
 }
 
+// Batch API: {"ops":[{"op":"assign-subject","subject_id":1,"teacher_id":2},...]}
+// Every operation carries the fields of the endpoint it replaces. All
+// operations run in one transaction: either all are committed or none.
+#define BATCH_MAX_OPS 100
+#define BATCH_MAX_BODY (256 * 1024)
+
+typedef struct {
+    json_span ops;
+} batch_request;
+
+static const json_field batch_fields[] = {
+    JSON_FIELD_ARRAY(batch_request, ops),
+};
+
+typedef struct {
+    char op[32];
+    int id;
+    int subject_id;
+    int teacher_id;
+    char program[100];
+    char grade_level[50];
+    char semester[50];
+    char subject[100];
+    char name[100];
+    char username[100];
+    char password[100];
+    char access_code[100];
+    char subjects_json[1024];
+} batch_op;
+
+static const json_field batch_op_fields[] = {
+    JSON_FIELD_STRING(batch_op, op),
+    JSON_FIELD_INT(batch_op, id),
+    JSON_FIELD_INT(batch_op, subject_id),
+    JSON_FIELD_INT(batch_op, teacher_id),
+    JSON_FIELD_STRING(batch_op, program),
+    JSON_FIELD_STRING(batch_op, grade_level),
+    JSON_FIELD_STRING(batch_op, semester),
+    JSON_FIELD_STRING(batch_op, subject),
+    JSON_FIELD_STRING(batch_op, name),
+    JSON_FIELD_STRING(batch_op, username),
+    JSON_FIELD_STRING(batch_op, password),
+    JSON_FIELD_STRING(batch_op, access_code),
+    JSON_FIELD_STRING(batch_op, subjects_json),
+};
+
+static int batch_has_subject(const batch_op *op) {
+    return op->program[0] && op->grade_level[0] && op->semester[0] && op->subject[0]
+           && op->teacher_id != 0;
+}
+
+static int batch_has_subject_id(const batch_op *op) {
+    return op->id != 0 && batch_has_subject(op);
+}
+
+static int batch_has_id(const batch_op *op) {
+    return op->id != 0;
+}
+
+static int batch_has_assignment(const batch_op *op) {
+    return op->subject_id != 0 && op->teacher_id != 0;
+}
+
+static int batch_has_name(const batch_op *op) {
+    return op->name[0] != '\0';
+}
+
+static int batch_has_teacher(const batch_op *op) {
+    return op->name[0] && op->username[0] && op->password[0] && op->access_code[0];
+}
+
+static int batch_add_subject(const batch_op *op) {
+    return db_create_subject(op->program, op->grade_level, op->semester, op->subject, op->teacher_id);
+}
+
+static int batch_update_subject(const batch_op *op) {
+    return db_update_subject(op->id, op->program, op->grade_level, op->semester, op->subject,
+                             op->teacher_id);
+}
+
+static int batch_delete_subject(const batch_op *op) {
+    return db_delete_subject(op->id);
+}
+
+static int batch_assign_subject(const batch_op *op) {
+    return db_assign_subject_to_teacher(op->subject_id, op->teacher_id);
+}
+
+static int batch_add_program(const batch_op *op) {
+    return db_create_program(op->name, op->subjects_json);
+}
+
+static int batch_delete_program(const batch_op *op) {
+    return db_delete_program(op->id);
+}
+
+static int batch_add_teacher(const batch_op *op) {
+    return db_create_teacher(op->name, op->username, op->password, op->access_code);
+}
+
+static int batch_delete_teacher(const batch_op *op) {
+    return db_delete_teacher(op->id);
+}
+
+static int batch_delete_material(const batch_op *op) {
+    return db_delete_material(op->id);
+}
+
+// Operations accepted in a batch, named after the single endpoints
+typedef struct {
+    const char *name;
+    int (*valid)(const batch_op *op);
+    int (*run)(const batch_op *op);
+} batch_handler;
+
+static const batch_handler batch_handlers[] = {
+    { "add-subject", batch_has_subject, batch_add_subject },
+    { "update-subject", batch_has_subject_id, batch_update_subject },
+    { "delete-subject", batch_has_id, batch_delete_subject },
+    { "assign-subject", batch_has_assignment, batch_assign_subject },
+    { "add-program", batch_has_name, batch_add_program },
+    { "delete-program", batch_has_id, batch_delete_program },
+    { "add-teacher", batch_has_teacher, batch_add_teacher },
+    { "delete-teacher", batch_has_id, batch_delete_teacher },
+    { "delete-material", batch_has_id, batch_delete_material },
+};
+
+static const batch_handler *find_batch_handler(const char *name) {
+    for (size_t i = 0; i < sizeof(batch_handlers) / sizeof(batch_handlers[0]); i++) {
+        if (strcmp(batch_handlers[i].name, name) == 0) {
+            return &batch_handlers[i];
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    arena *a;
+    batch_op *ops[BATCH_MAX_OPS];
+    const batch_handler *handlers[BATCH_MAX_OPS];
+    size_t count;
+    int error; // 0, or the HTTP status to fail with
+} batch_state;
+
+static int bind_batch_op(const json_span *value, size_t index, void *arg) {
+    batch_state *st = (batch_state *)arg;
+    if (index >= BATCH_MAX_OPS) {
+        st->error = 413;
+        return 1;
+    }
+    batch_op *op = arena_calloc(st->a, sizeof(*op));
+    if (!op) {
+        st->error = 500;
+        return 1;
+    }
+    if (value->type != JSON_OBJECT
+        || json_bind(value->ptr, value->len, batch_op_fields, JSON_FIELD_COUNT(batch_op_fields), op) < 0) {
+        st->error = 400;
+        return 1;
+    }
+    st->ops[st->count++] = op;
+    return 0;
+}
+
+// Per-operation results. Without a failure all are "ok". Otherwise the
+// failed operation is "error" with a message, the ones before it get the
+// status 'before' ("rolled_back" or "skipped") and the rest "skipped".
+static void batch_results(arena_buf *out, const batch_state *st, size_t failed,
+                          const char *before, const char *message) {
+    arena_buf_puts(out, ",\"results\":[");
+    for (size_t i = 0; i < st->count; i++) {
+        const char *status = "ok";
+        if (failed < st->count) {
+            status = (i < failed) ? before : (i == failed) ? "error" : "skipped";
+        }
+        arena_buf_printf(out, "%s{\"op\":\"%s\",\"status\":\"%s\"", i ? "," : "",
+                         st->handlers[i] ? st->handlers[i]->name : "unknown", status);
+        if (i == failed) {
+            arena_buf_printf(out, ",\"message\":\"%s\"", message);
+        }
+        arena_buf_puts(out, "}");
+    }
+    arena_buf_puts(out, "]}");
+}
+
+// Handler for /api/batch POST endpoint - expects JSON {ops:[{op, ...}, ...]}
+static int handle_api_batch(struct mg_connection *conn, void *cbdata) {
+    int user_id = validate_token_from_header(conn);
+    if (user_id == -1) {
+        send_response(conn, 401, "application/json", "{\"message\":\"Unauthorized\"}");
+        return 401;
+    }
+
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "POST") != 0) {
+        send_response(conn, 405, "application/json", "{\"success\":false,\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+    if (req_info->content_length >= BATCH_MAX_BODY) {
+        send_response(conn, 413, "application/json", "{\"success\":false,\"message\":\"Batch too large\"}");
+        return 413;
+    }
+    char *post_data;
+    int post_data_len = read_body_max(conn, &post_data, BATCH_MAX_BODY);
+    if (post_data_len <= 0) {
+        send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"No body data\"}");
+        return 400;
+    }
+
+    batch_request req = {0};
+    batch_state *st = arena_calloc(request_arena(conn), sizeof(*st));
+    if (!st) {
+        send_response(conn, 500, "application/json", "{\"success\":false,\"message\":\"Memory error\"}");
+        return 500;
+    }
+    st->a = request_arena(conn);
+    if (BIND_JSON(post_data, post_data_len, batch_fields, &req) < 1
+        || json_parse_array(req.ops.ptr, req.ops.len, bind_batch_op, st) < 0 || st->error == 400) {
+        send_response(conn, 400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+        return 400;
+    }
+    if (st->error != 0) {
+        send_response(conn, st->error, "application/json",
+                      st->error == 413 ? "{\"success\":false,\"message\":\"Too many operations\"}"
+                                       : "{\"success\":false,\"message\":\"Memory error\"}");
+        return st->error;
+    }
+
+    arena_buf out;
+    arena_buf_init(&out, st->a, BUFFER_SIZE);
+
+    // Check every operation before anything is written
+    for (size_t i = 0; i < st->count; i++) {
+        st->handlers[i] = find_batch_handler(st->ops[i]->op);
+    }
+    for (size_t i = 0; i < st->count; i++) {
+        const batch_handler *h = st->handlers[i];
+        if (!h || !h->valid(st->ops[i])) {
+            arena_buf_printf(&out, "{\"success\":false,\"message\":\"Invalid operation %d\"", (int)i);
+            batch_results(&out, st, i, "skipped", h ? "Missing required fields" : "Unknown op");
+            send_response(conn, 400, "application/json", out.data ? out.data : "{\"success\":false}");
+            return 400;
+        }
+    }
+
+    if (db_begin() != SQLITE_OK) {
+        send_response(conn, 500, "application/json", "{\"success\":false,\"message\":\"Database error\"}");
+        return 500;
+    }
+    for (size_t i = 0; i < st->count; i++) {
+        if (st->handlers[i]->run(st->ops[i]) != SQLITE_OK) {
+            db_rollback();
+            arena_buf_printf(&out, "{\"success\":false,\"message\":\"Operation %d failed\"", (int)i);
+            batch_results(&out, st, i, "rolled_back", "Database error");
+            send_response(conn, 500, "application/json", out.data ? out.data : "{\"success\":false}");
+            return 500;
+        }
+    }
+    int rc = db_commit();
+    mg_trace_stage(conn, "sql");
+    if (rc != SQLITE_OK) {
+        send_response(conn, 500, "application/json", "{\"success\":false,\"message\":\"Database error\"}");
+        return 500;
+    }
+
+    arena_buf_puts(&out, "{\"success\":true");
+    batch_results(&out, st, st->count, NULL, NULL);
+    return send_json_result(conn, &out, SQLITE_OK);
+}
+
+// Server-sent events: /api/events pushes the type of every committed change
+// (see events.h) so dashboards re-fetch only when something changed instead
+// of polling. Optional query filters: teacher_id, program. It needs a login
+// token, as a Bearer header or, since EventSource cannot set headers, as the
+// token query parameter. Bursts are
+// coalesced over EVENTS_COALESCE_MS; an idle stream gets a comment line every
+// EVENTS_PING_MS, which also detects clients that went away.
+#define EVENTS_COALESCE_MS 200
+#define EVENTS_PING_MS 15000
+
+static int send_event_text(struct mg_connection *conn, const char *text) {
+    size_t len = strlen(text);
+    return mg_write(conn, text, len) == (int)len ? 0 : -1;
+}
+
+// Handler for /api/events GET endpoint - text/event-stream
+static int handle_api_events(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    char teacher_id_str[32] = {0};
+    char program[100] = {0};
+    char token[AUTH_TOKEN_MAX + 1] = {0};
+    if (req_info->query_string) {
+        size_t query_len = strlen(req_info->query_string);
+        mg_get_var(req_info->query_string, query_len, "teacher_id", teacher_id_str, sizeof(teacher_id_str));
+        mg_get_var(req_info->query_string, query_len, "program", program, sizeof(program));
+        mg_get_var(req_info->query_string, query_len, "token", token, sizeof(token));
+    }
+    int user_id = token[0] ? auth_validate_token(token) : validate_token_from_header(conn);
+    if (user_id < 0) {
+        send_response(conn, 401, "application/json", "{\"message\":\"Unauthorized\"}");
+        return 401;
+    }
+
+    events_subscriber *sub = events_subscribe(atoi(teacher_id_str), program);
+    if (!sub) {
+        send_response(conn, 503, "application/json", "{\"message\":\"Too many event streams\"}");
+        return 503;
+    }
+
+    // The stream lasts as long as the client stays: not a slow request
+    mg_trace_skip(conn);
+    mg_response_header_start(conn, 200);
+    mg_response_header_add_lines(conn, CORS_HEADERS
+                                 "Content-Type: text/event-stream\r\n"
+                                 "Cache-Control: no-cache\r\n"
+                                 "Connection: close\r\n");
+    mg_response_header_send(conn);
+
+    // Reconnect after 3 s if the stream breaks
+    int ok = send_event_text(conn, "retry: 3000\n\n") == 0;
+    while (ok) {
+        int types = events_wait(sub, EVENTS_PING_MS, EVENTS_COALESCE_MS);
+        if (types < 0) {
+            break; // server shutting down
+        }
+        if (types == 0) {
+            ok = send_event_text(conn, ": ping\n\n") == 0;
+            continue;
+        }
+        for (unsigned bit = 1; bit <= EVENT_ALL && ok; bit <<= 1) {
+            if (types & bit) {
+                char event[64];
+                snprintf(event, sizeof(event), "event: %s\ndata: {}\n\n", events_name(bit));
+                ok = send_event_text(conn, event) == 0;
+            }
+        }
+    }
+    events_unsubscribe(sub);
+    return 200;
+}
+
+// Handler for /api/admin/get-arena-stats GET endpoint - request memory usage
+static int handle_api_admin_get_arena_stats(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    arena_stats stats;
+    arena_get_stats(&stats);
+    char response[256];
+    snprintf(response, sizeof(response),
+             "{\"high_water\":%llu,\"reserved\":%llu,\"requests\":%llu,\"block_allocs\":%llu}",
+             (unsigned long long)stats.high_water, (unsigned long long)stats.reserved,
+             stats.resets, stats.block_allocs);
+    send_response(conn, 200, "application/json", response);
+    return 200;
+}
+
+// Handler for /api/admin/get-dbpool-stats GET endpoint - DB executor pool load
+static int handle_api_admin_get_dbpool_stats(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    dbpool_stats stats;
+    dbpool_get_stats(db_executors, &stats);
+    char response[256];
+    snprintf(response, sizeof(response),
+             "{\"threads\":%d,\"queued\":%d,\"running\":%d,\"completed\":%llu,"
+             "\"timeouts\":%llu,\"rejected\":%llu}",
+             stats.threads, stats.queued, stats.running, stats.completed,
+             stats.timeouts, stats.rejected);
+    send_response(conn, 200, "application/json", response);
+    return 200;
+}
+
+// Handler for /api/admin/get-acceptor-stats GET endpoint - accept rate and
+// kernel accept queue per acceptor thread
+static int handle_api_admin_get_acceptor_stats(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    struct mg_acceptor_stat stats[64];
+    int n = mg_get_acceptor_stats(mg_get_context(conn), stats, 64);
+    if (n > 64) n = 64;
+    long long accepted = 0, rate = 0;
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_puts(&out, "{\"acceptors\":[");
+    for (int i = 0; i < n; i++) {
+        arena_buf_printf(&out, "%s{\"accepted\":%lld,\"accept_rate\":%lld,\"backlog\":%d,\"backlog_max\":%d}",
+                         i ? "," : "", stats[i].accepted, stats[i].accept_rate,
+                         stats[i].backlog, stats[i].backlog_max);
+        accepted += stats[i].accepted;
+        rate += stats[i].accept_rate;
+    }
+    arena_buf_printf(&out, "],\"accepted\":%lld,\"accept_rate\":%lld}", accepted, rate);
+    return send_json_result(conn, &out, SQLITE_OK);
+}
+
+// Handler for /api/admin/get-admission-stats GET endpoint - requests shed
+// under overload or over the rate limit, and the socket queue
+static int handle_api_admin_get_admission_stats(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    struct mg_admission_stat stats;
+    if (mg_get_admission_stats(mg_get_context(conn), &stats) != 0) {
+        send_response(conn, 500, "application/json", "{\"message\":\"Statistics not available\"}");
+        return 500;
+    }
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_printf(&out, "{\"shed_queue_full\":%lld,\"shed_queue_wait\":%lld,\"rate_limited\":%lld,"
+                           "\"queue_wait_ms\":%d,\"queue_depth\":%d,\"queue_size\":%d}",
+                     stats.shed_queue_full, stats.shed_queue_wait, stats.rate_limited,
+                     stats.queue_wait_ms, stats.queue_depth, stats.queue_size);
+    return send_json_result(conn, &out, SQLITE_OK);
+}
+
+// Handler for /api/admin/get-access-log-stats GET endpoint - lines written
+// and dropped by the access log thread
+static int handle_api_admin_get_access_log_stats(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    struct mg_access_log_stat stats;
+    if (mg_get_access_log_stats(mg_get_context(conn), &stats) != 0) {
+        send_response(conn, 404, "application/json", "{\"message\":\"Access log is off\"}");
+        return 404;
+    }
+    arena_buf out;
+    arena_buf_init(&out, request_arena(conn), BUFFER_SIZE);
+    arena_buf_printf(&out, "{\"lines\":%lld,\"bytes\":%lld,\"dropped\":%lld,\"rotations\":%lld}",
+                     stats.lines, stats.bytes, stats.dropped, stats.rotations);
+    return send_json_result(conn, &out, SQLITE_OK);
+}
+
+// Handler for /api/admin/get-traces GET endpoint - stage timing of recent
+// slow requests, or of sampled ones with ?type=sampled
+static int handle_api_admin_get_traces(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    char type[16] = "slow";
+    if (req_info->query_string) {
+        mg_get_var(req_info->query_string, strlen(req_info->query_string), "type", type, sizeof(type));
+    }
+    int slow = strcmp(type, "sampled") != 0;
+    int len = mg_get_traces(mg_get_context(conn), slow, NULL, 0);
+    if (len < 0) {
+        send_response(conn, 404, "application/json", "{\"message\":\"Tracing is off\"}");
+        return 404;
+    }
+    // Room for traces kept meanwhile
+    int room = len + TRACES_SLACK;
+    char *text = arena_alloc(request_arena(conn), (size_t)room);
+    if (text) {
+        len = mg_get_traces(mg_get_context(conn), slow, text, room);
+    }
+    if (!text || len < 0 || len >= room) {
+        send_response(conn, 500, "application/json", "{\"message\":\"Memory error\"}");
+        return 500;
+    }
+    send_response(conn, 200, "application/json", text);
+    return 200;
+}
+
+// Handler for /metrics GET endpoint - per-route request counts and latency
+// histograms, worker threads, socket queue and DB pool in the Prometheus
+// text format
+static int handle_metrics(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "GET") != 0) {
+        send_response(conn, 405, "application/json", "{\"message\":\"Method Not Allowed\"}");
+        return 405;
+    }
+
+    int len = mg_get_metrics(mg_get_context(conn), NULL, 0);
+    if (len < 0) {
+        send_response(conn, 404, "application/json", "{\"message\":\"Metrics are off\"}");
+        return 404;
+    }
+    // Room for routes that get their first request meanwhile
+    int room = len + METRICS_SLACK;
+    size_t size = (size_t)room + METRICS_APP_SIZE;
+    char *text = arena_alloc(request_arena(conn), size);
+    if (text) {
+        len = mg_get_metrics(mg_get_context(conn), text, room);
+    }
+    if (!text || len >= room) {
+        send_response(conn, 500, "application/json", "{\"message\":\"Memory error\"}");
+        return 500;
+    }
+
+    dbpool_stats stats, logins;
+    auth_session_stats sessions;
+    dbpool_get_stats(db_executors, &stats);
+    dbpool_get_stats(login_verifiers, &logins);
+    auth_get_session_stats(&sessions);
+    len += snprintf(text + len, size - (size_t)len,
+             "# TYPE db_pool_threads gauge\n"
+             "db_pool_threads %d\n"
+             "# TYPE db_pool_jobs_queued gauge\n"
+             "db_pool_jobs_queued %d\n"
+             "# TYPE db_pool_jobs_running gauge\n"
+             "db_pool_jobs_running %d\n"
+             "# TYPE db_pool_jobs_completed_total counter\n"
+             "db_pool_jobs_completed_total %llu\n"
+             "# HELP db_pool_jobs_timeouts_total Jobs dropped or interrupted at their deadline.\n"
+             "# TYPE db_pool_jobs_timeouts_total counter\n"
+             "db_pool_jobs_timeouts_total %llu\n"
+             "# HELP db_pool_jobs_rejected_total Jobs rejected, since the queue was full.\n"
+             "# TYPE db_pool_jobs_rejected_total counter\n"
+             "db_pool_jobs_rejected_total %llu\n",
+             stats.threads, stats.queued, stats.running, stats.completed,
+             stats.timeouts, stats.rejected);
+    len += snprintf(text + len, size - (size_t)len,
+             "# TYPE login_pool_threads gauge\n"
+             "login_pool_threads %d\n"
+             "# TYPE login_pool_queued gauge\n"
+             "login_pool_queued %d\n"
+             "# TYPE login_pool_running gauge\n"
+             "login_pool_running %d\n"
+             "# HELP login_pool_verified_total Logins checked by the pool, valid or not.\n"
+             "# TYPE login_pool_verified_total counter\n"
+             "login_pool_verified_total %llu\n"
+             "# HELP login_pool_timeouts_total Logins answered with 504, since no thread took them in time.\n"
+             "# TYPE login_pool_timeouts_total counter\n"
+             "login_pool_timeouts_total %llu\n"
+             "# HELP login_pool_rejected_total Logins answered with 503, since the queue was full.\n"
+             "# TYPE login_pool_rejected_total counter\n"
+             "login_pool_rejected_total %llu\n"
+             "# HELP login_pool_verify_seconds_total Time the threads spent checking logins.\n"
+             "# TYPE login_pool_verify_seconds_total counter\n"
+             "login_pool_verify_seconds_total %.6f\n"
+             "# HELP login_pool_queue_wait_seconds Time from arrival until a thread took the login up.\n"
+             "# TYPE login_pool_queue_wait_seconds histogram\n",
+             logins.threads, logins.queued, logins.running, logins.completed,
+             logins.timeouts, logins.rejected, (double)logins.busy_us / 1e6);
+    unsigned long long waited = 0;
+    for (int i = 0; i <= DBPOOL_WAIT_BUCKETS; i++) {
+        waited += logins.wait_buckets[i];
+        if (i < DBPOOL_WAIT_BUCKETS) {
+            len += snprintf(text + len, size - (size_t)len,
+                            "login_pool_queue_wait_seconds_bucket{le=\"%g\"} %llu\n",
+                            dbpool_wait_bounds_ms[i] / 1000.0, waited);
+        }
+    }
+    len += snprintf(text + len, size - (size_t)len,
+             "login_pool_queue_wait_seconds_bucket{le=\"+Inf\"} %llu\n"
+             "login_pool_queue_wait_seconds_sum %.6f\n"
+             "login_pool_queue_wait_seconds_count %llu\n",
+             waited, (double)logins.wait_us / 1e6, waited);
+    snprintf(text + len, size - (size_t)len,
+             "# TYPE sessions gauge\n"
+             "sessions %llu\n"
+             "# TYPE sessions_expired_total counter\n"
+             "sessions_expired_total %llu\n"
+             "# HELP sessions_rejected_total Logins answered with 503, since the session table was full.\n"
+             "# TYPE sessions_rejected_total counter\n"
+             "sessions_rejected_total %llu\n"
+             "# HELP sessions_revoked Signed tokens logged out before they expire.\n"
+             "# TYPE sessions_revoked gauge\n"
+             "sessions_revoked %llu\n",
+             sessions.sessions, sessions.expired, sessions.rejected, sessions.revoked);
+    send_response(conn, 200, "text/plain; version=0.0.4", text);
+    return 200;
+}
+
 // Placeholder handlers for materials and subjects endpoints
 static int handle_materials(struct mg_connection *conn, void *cbdata) {
     // TODO: Implement CRUD operations based on request method
@@ -1275,35 +1934,182 @@ static int handle_subjects(struct mg_connection *conn, void *cbdata) {
     return 200;
 }
 
+// Worker threads get their request arena here. A worker without one answers
+// 503 (see begin_request).
+static void *init_worker_thread(const struct mg_context *ctx, int thread_type) {
+    (void)ctx;
+    if (thread_type != 1) {
+        return NULL;
+    }
+    arena *a = malloc(sizeof(*a));
+    if (a && arena_init(a, ARENA_BLOCK_SIZE) != 0) {
+        free(a);
+        a = NULL;
+    }
+    return a;
+}
+
+static void exit_worker_thread(const struct mg_context *ctx, int thread_type, void *thread_pointer) {
+    (void)ctx;
+    (void)thread_type;
+    arena *a = (arena *)thread_pointer;
+    capture_thread_exit();
+    if (a) {
+        arena_destroy(a);
+        free(a);
+    }
+}
+
+// Start the capture record of a request. Event streams are left out: they
+// last as long as the client stays and cannot be replayed.
+static void capture_request(const struct mg_connection *conn) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    const char *auth = mg_get_header(conn, "Authorization");
+    const char *type = mg_get_header(conn, "Content-Type");
+    unsigned flags = 0;
+
+    if (strcmp(req_info->local_uri, "/api/events") == 0) {
+        return;
+    }
+    if (auth && strncmp(auth, "Bearer ", 7) == 0) {
+        flags |= CAPTURE_TOKEN;
+    }
+    if (type && strncmp(type, "application/x-www-form-urlencoded", 33) == 0) {
+        flags |= CAPTURE_FORM;
+    }
+    if (accepts_gzip(mg_get_header(conn, "Accept-Encoding"))) {
+        flags |= CAPTURE_GZIP;
+    }
+    capture_begin(req_info->request_method, req_info->request_uri, req_info->query_string, flags);
+}
+
+static int begin_request(struct mg_connection *conn) {
+    if (!request_arena(conn)) {
+        send_response(conn, 503, "application/json", "{\"message\":\"Out of memory\"}");
+        return 503;
+    }
+    if (capture_running()) {
+        capture_request(conn);
+    }
+    return 0;
+}
+
+// Timer thread: free the sessions that expired
+static int sweep_sessions(void *arg) {
+    (void)arg;
+    auth_sweep_sessions();
+    return 1;
+}
+
+// Called after every request, once the response is sent
+static void end_request(const struct mg_connection *conn, int reply_status_code) {
+    arena *a = (arena *)mg_get_thread_pointer(conn);
+    capture_end(reply_status_code);
+    if (a) {
+        arena_reset(a);
+    }
+}
+
 int main() {
+    const char *http2_env = getenv(HTTP2_ENV);
+    const char *access_log = getenv(ACCESS_LOG_ENV);
+    if (access_log && !access_log[0]) access_log = NULL;
+    const char *capture = getenv(CAPTURE_ENV);
+
     if (db_init("eknows.db") != 0) {
         fprintf(stderr, "Failed to initialize database\n");
         return 1;
     }
+    int max_streams = atoi(WORKER_THREADS) - EVENTS_RESERVED_WORKERS;
+    if (events_init(max_streams > 0 ? max_streams : 0) != 0) {
+        fprintf(stderr, "Failed to initialize event hub\n");
+        db_close();
+        return 1;
+    }
     if (auth_init() != 0) {
         fprintf(stderr, "Failed to initialize authentication module\n");
         db_close();
         return 1;
     }
+    const char *token_secret = getenv(TOKEN_SECRET_ENV);
+    if (token_secret && token_secret[0]
+        && auth_set_token_secret(token_secret, strlen(token_secret)) != 0) {
+        fprintf(stderr, "%s must be at least %d bytes\n", TOKEN_SECRET_ENV, AUTH_SECRET_MIN);
+        auth_shutdown();
+        db_close();
+        return 1;
+    }
+    db_executors = dbpool_create("DB", DBPOOL_THREADS, DBPOOL_QUEUE_SIZE);
+    if (!db_executors) {
+        fprintf(stderr, "Failed to start DB executors, running queries on the workers\n");
+    }
+    login_verifiers = dbpool_create("login", LOGIN_POOL_THREADS, LOGIN_POOL_QUEUE_SIZE);
+    if (!login_verifiers) {
+        fprintf(stderr, "Failed to start login verifiers, checking logins on the workers\n");
+    }
+    if (assets_init(FRONTEND_DIR) < 0) {
+        fprintf(stderr, "Cannot read %s, frontend files are served from disk\n", FRONTEND_DIR);
+    }
+    if (capture && capture[0] && capture_start(capture) != 0) {
+        fprintf(stderr, "Cannot create %s, traffic is not captured\n", capture);
+    }
 
     const char *options[] = {
         "listening_ports", "127.0.0.1:8080",
-        "document_root", "../frontend",
+        "document_root", FRONTEND_DIR,
         "request_timeout_ms", "5000",
+        "num_threads", WORKER_THREADS,
+        "max_queue_wait_ms", MAX_QUEUE_WAIT_MS,
+        "request_rate", REQUEST_RATE_LIMIT,
+        "trace_sample", TRACE_SAMPLE_EVERY,
+        "trace_slow_ms", TRACE_SLOW_MS,
+        "enable_keep_alive", "yes",
+        "keep_alive_timeout_ms", KEEP_ALIVE_TIMEOUT_MS,
+        "keep_alive_max_requests", KEEP_ALIVE_MAX_REQUESTS,
+#if defined(USE_HTTP2)
+        "enable_http2", (http2_env && strcmp(http2_env, "1") == 0) ? "yes" : "no",
+#endif
+#if defined(USE_ZLIB)
+        "compression_min_size", COMPRESSION_MIN_SIZE,
+#endif
+#if defined(__linux__)
+        "acceptor_threads", ACCEPTOR_COUNT,
+#endif
+        "access_log_rotate_size", ACCESS_LOG_ROTATE_BYTES,
+        "access_log_rotate_ms", ACCESS_LOG_ROTATE_MS,
+        // Last: without a log file, the list ends here
+        access_log ? "access_log_file" : NULL, access_log,
         NULL
     };
 
-    ctx = mg_start(NULL, NULL, options);
+    struct mg_callbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.init_thread = init_worker_thread;
+    callbacks.exit_thread = exit_worker_thread;
+    callbacks.begin_request = begin_request;
+    callbacks.end_request = end_request;
+
+    ctx = mg_start(&callbacks, NULL, options);
     if (ctx == NULL) {
         fprintf(stderr, "Failed to start CivetWeb server\n");
+        capture_stop();
+        dbpool_destroy(login_verifiers);
+        dbpool_destroy(db_executors);
+        assets_shutdown();
+        auth_shutdown();
         db_close();
         return 1;
     }
 
+    if (mg_set_timer(ctx, AUTH_SWEEP_INTERVAL_S, sweep_sessions, NULL) != 0) {
+        fprintf(stderr, "No timer thread, expired sessions are only freed when used\n");
+    }
+
     mg_set_request_handler(ctx, "/health", handle_health, NULL);
     mg_set_request_handler(ctx, "/login", handle_login, NULL);
     mg_set_request_handler(ctx, "/api/admin/login", handle_api_admin_login, NULL);
     mg_set_request_handler(ctx, "/api/teacher/login", handle_api_teacher_login, NULL);
+    mg_set_request_handler(ctx, "/api/logout", handle_api_logout, NULL);
     mg_set_request_handler(ctx, "/api/teacher/dashboard-data", handle_api_teacher_dashboard_data, NULL);
     mg_set_request_handler(ctx, "/api/teacher/get-subjects", handle_api_teacher_get_subjects, NULL);
     mg_set_request_handler(ctx, "/api/teacher/add-subject", handle_api_teacher_add_subject, NULL);
@@ -1317,6 +2123,15 @@ int main() {
     mg_set_request_handler(ctx, "/api/admin/delete-program", handle_api_admin_delete_program, NULL);
     mg_set_request_handler(ctx, "/api/admin/add-teacher", handle_api_admin_add_teacher, NULL);
     mg_set_request_handler(ctx, "/api/admin/delete-teacher", handle_api_admin_delete_teacher, NULL);
+    mg_set_request_handler(ctx, "/api/batch", handle_api_batch, NULL);
+    mg_set_request_handler(ctx, "/api/events", handle_api_events, NULL);
+    mg_set_request_handler(ctx, "/api/admin/get-arena-stats", handle_api_admin_get_arena_stats, NULL);
+    mg_set_request_handler(ctx, "/api/admin/get-dbpool-stats", handle_api_admin_get_dbpool_stats, NULL);
+    mg_set_request_handler(ctx, "/api/admin/get-acceptor-stats", handle_api_admin_get_acceptor_stats, NULL);
+    mg_set_request_handler(ctx, "/api/admin/get-admission-stats", handle_api_admin_get_admission_stats, NULL);
+    mg_set_request_handler(ctx, "/api/admin/get-access-log-stats", handle_api_admin_get_access_log_stats, NULL);
+    mg_set_request_handler(ctx, "/api/admin/get-traces", handle_api_admin_get_traces, NULL);
+    mg_set_request_handler(ctx, "/metrics", handle_metrics, NULL);
     mg_set_request_handler(ctx, "/get-materials", handle_get_materials, NULL);
     mg_set_request_handler(ctx, "/upload-material", handle_upload_material, NULL);
     mg_set_request_handler(ctx, "/delete-material", handle_delete_material, NULL);
@@ -1326,12 +2141,18 @@ int main() {
     mg_set_request_handler(ctx, "/update-subject", handle_update_subject, NULL);
     mg_set_request_handler(ctx, "/delete-subject", handle_delete_subject, NULL);
     mg_set_request_handler(ctx, "/assign-subject", handle_assign_subject, NULL);
+    // Everything else: the frontend files. Registered last, so that any
+    // handler above is the better match.
+    mg_set_request_handler(ctx, "/", handle_asset, NULL);
 
     printf("Server running on port %s\n", PORT);
     printf("Server is running. Press Ctrl+C to stop.\n");
 
-    // Keep the server running indefinitely
-    while (1) {
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    // Keep the server running until it is asked to stop
+    while (!stop_requested) {
         // Sleep for a short time to avoid busy waiting
         #ifdef _WIN32
         Sleep(1000); // Windows sleep in milliseconds
@@ -1340,7 +2161,19 @@ int main() {
         #endif
     }
 
+    events_shutdown(); // end event streams, mg_stop waits for their workers
     mg_stop(ctx);
+    if (capture_running()) {
+        capture_stats cs;
+        capture_stop();
+        capture_get_stats(&cs);
+        printf("Captured %llu requests (%llu bytes) to %s, %llu dropped\n",
+               cs.records, cs.bytes, capture, cs.dropped);
+    }
+    dbpool_destroy(login_verifiers);
+    dbpool_destroy(db_executors);
+    assets_shutdown();
+    auth_shutdown();
     db_close();
 
     return 0;
@@ -0,0 +1,434 @@
+/* metrics.inl
+ *
+ * Request metrics in the Prometheus text format.
+ *
+ * This file is part of the CivetWeb project.
+ *
+ * Every request handler gets a route id when it is registered; requests
+ * not served by a handler (files, errors, admission rejects) count as the
+ * route "other". For every route the server counts the requests by status
+ * class (1xx .. 5xx) and keeps a latency histogram, measured from the time
+ * the request headers had been read to the end of handle_request.
+ *
+ * The histogram buckets are log-linear, as in HDR histograms: the range of
+ * every power of two (in microseconds) is split into METRICS_SUB linear
+ * buckets, so the relative error of a bucket bound is below 1/METRICS_SUB
+ * over the whole range, from 1 us up to about 67 s.
+ *
+ * The counters are per worker thread. A worker only writes its own, using
+ * relaxed loads and stores: no locked instruction and no shared cache line
+ * on the request path. mg_get_metrics adds up the counters of all workers
+ * when the metrics are scraped. The counters of a route are allocated by a
+ * worker for its first request on that route.
+ */
+
+
+#if defined(REQUEST_METRICS)
+
+/* Routes, including "other". Handlers beyond that count as "other". */
+#define METRICS_ROUTES (64)
+
+/* Linear buckets per power of two: 2^METRICS_SUB_BITS */
+#define METRICS_SUB_BITS (2)
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+
+/* Buckets up to 2^26 us. The last one also takes everything above. */
+#define METRICS_BUCKETS ((26 - METRICS_SUB_BITS + 1) * METRICS_SUB)
+
+/* Status classes */
+#define METRICS_CODES (6)
+static const char *const metrics_code[METRICS_CODES] =
+    {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+
+struct mg_route_counters {
+	uint64_t requests[METRICS_CODES];
+	uint64_t sum_us;
+	uint64_t bucket[METRICS_BUCKETS];
+};
+
+
+/* Counters of one worker thread */
+struct mg_thread_metrics {
+	int started;      /* The worker has started */
+	uint64_t busy_us; /* Time spent in requests */
+	struct mg_route_counters *route[METRICS_ROUTES];
+};
+
+
+struct mg_metrics {
+	struct mg_thread_metrics *threads; /* One per worker */
+	unsigned int num_threads;
+	char *route_name[METRICS_ROUTES]; /* Handler URIs, route 0 is "other" */
+	int num_routes;
+};
+
+
+/* Called by mg_start, before the workers start. A server without metrics
+ * just does not record any. */
+static void
+metrics_init(struct mg_context *ctx)
+{
+	struct mg_metrics *m =
+	    (struct mg_metrics *)mg_calloc_ctx(1, sizeof(*m), ctx);
+
+	if (m == NULL) {
+		return;
+	}
+	m->threads = (struct mg_thread_metrics *)mg_calloc_ctx(
+	    ctx->cfg_max_worker_threads, sizeof(struct mg_thread_metrics), ctx);
+	m->route_name[0] = mg_strdup_ctx("other", ctx);
+	if ((m->threads == NULL) || (m->route_name[0] == NULL)) {
+		mg_free(m->threads);
+		mg_free(m->route_name[0]);
+		mg_free(m);
+		return;
+	}
+	m->num_threads = ctx->cfg_max_worker_threads;
+	m->num_routes = 1;
+	ctx->metrics = m;
+}
+
+
+static void
+metrics_free(struct mg_context *ctx)
+{
+	struct mg_metrics *m = ctx->metrics;
+	unsigned int i, j;
+
+	if (m == NULL) {
+		return;
+	}
+	for (i = 0; i < m->num_threads; i++) {
+		for (j = 0; j < METRICS_ROUTES; j++) {
+			mg_free(m->threads[i].route[j]);
+		}
+	}
+	for (j = 0; j < METRICS_ROUTES; j++) {
+		mg_free(m->route_name[j]);
+	}
+	mg_free(m->threads);
+	mg_free(m);
+	ctx->metrics = NULL;
+}
+
+
+/* Called by a worker thread when it starts. Returns its counters. */
+static struct mg_thread_metrics *
+metrics_attach(struct mg_context *ctx, int thread_index)
+{
+	struct mg_thread_metrics *tm;
+
+	if ((ctx->metrics == NULL)
+	    || ((unsigned)thread_index >= ctx->metrics->num_threads)) {
+		return NULL;
+	}
+	tm = &ctx->metrics->threads[thread_index];
+	__atomic_store_n(&tm->started, 1, __ATOMIC_RELAXED);
+	return tm;
+}
+
+
+/* Route id of a handler URI, called by mg_set_handler_type with the
+ * context lock held. A URI keeps its id when its handler is replaced. */
+static int
+metrics_route_id(struct mg_context *ctx, const char *uri)
+{
+	struct mg_metrics *m = ctx->metrics;
+	int i, n;
+
+	if (m == NULL) {
+		return 0;
+	}
+	n = __atomic_load_n(&m->num_routes, __ATOMIC_RELAXED);
+	for (i = 1; i < n; i++) {
+		if (!strcmp(m->route_name[i], uri)) {
+			return i;
+		}
+	}
+	if ((n >= METRICS_ROUTES)
+	    || ((m->route_name[n] = mg_strdup_ctx(uri, ctx)) == NULL)) {
+		return 0;
+	}
+	/* Publish the name with the count */
+	__atomic_store_n(&m->num_routes, n + 1, __ATOMIC_RELEASE);
+	return n;
+}
+
+
+static unsigned int
+metrics_bucket(uint64_t us)
+{
+	unsigned int msb, i;
+
+	if (us < METRICS_SUB) {
+		return (unsigned int)us;
+	}
+	msb = 63 - (unsigned int)__builtin_clzll(us);
+	i = ((msb - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+	    + (unsigned int)((us >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+	return (i < METRICS_BUCKETS) ? i : (METRICS_BUCKETS - 1);
+}
+
+
+/* Largest value (us) that falls into bucket i */
+static uint64_t
+metrics_bucket_max(unsigned int i)
+{
+	unsigned int msb;
+
+	if (i < METRICS_SUB) {
+		return i;
+	}
+	msb = (i >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+	return ((uint64_t)(METRICS_SUB + (i & (METRICS_SUB - 1)) + 1)
+	        << (msb - METRICS_SUB_BITS))
+	       - 1;
+}
+
+
+/* Only the owning worker writes a counter, scrapes read it */
+static void
+metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter,
+	                 __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+	                 __ATOMIC_RELAXED);
+}
+
+
+/* Called by handle_request_stat_log after every request */
+static void
+metrics_record(struct mg_connection *conn)
+{
+	struct mg_thread_metrics *tm = conn->metrics;
+	struct mg_route_counters *rc;
+	struct timespec now;
+	uint64_t us;
+	int route = conn->metrics_route;
+	int code = conn->status_code / 100;
+
+	if (tm == NULL) {
+		return;
+	}
+	rc = tm->route[route];
+	if (rc == NULL) {
+		rc = (struct mg_route_counters *)mg_calloc_ctx(1,
+		                                               sizeof(*rc),
+		                                               conn->phys_ctx);
+		if (rc == NULL) {
+			return;
+		}
+		__atomic_store_n(&tm->route[route], rc, __ATOMIC_RELEASE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (uint64_t)(mg_difftimespec(&now, &conn->req_read_time) * 1e6);
+
+	metrics_add(&rc->requests[((code > 0) && (code < METRICS_CODES)) ? code
+	                                                                 : 0],
+	            1);
+	metrics_add(&rc->sum_us, us);
+	metrics_add(&rc->bucket[metrics_bucket(us)], 1);
+	metrics_add(&tm->busy_us, us);
+}
+
+
+static uint64_t
+metrics_load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+/* Worker threads started, and those not waiting for a connection */
+static void
+metrics_workers(struct mg_context *ctx, int *workers, int *busy)
+{
+	struct mg_metrics *m = ctx->metrics;
+	unsigned int i, idle;
+
+	*workers = 0;
+	for (i = 0; i < m->num_threads; i++) {
+		*workers += __atomic_load_n(&m->threads[i].started, __ATOMIC_RELAXED);
+	}
+#if defined(LOCKFREE_QUEUE)
+	idle = __atomic_load_n(&ctx->idle_worker_thread_count, __ATOMIC_SEQ_CST);
+#else
+	(void)pthread_mutex_lock(&ctx->thread_mutex);
+	idle = ctx->idle_worker_thread_count;
+	(void)pthread_mutex_unlock(&ctx->thread_mutex);
+#endif
+	/* Counted idle before they start */
+	*busy = ((int)idle < *workers) ? *workers - (int)idle : 0;
+}
+
+
+/* Route name as a label value: escape '\' and '"' */
+static void
+metrics_label(char *buf, size_t size, const char *name)
+{
+	size_t n = 0;
+
+	while ((*name != 0) && (n + 3 < size)) {
+		if ((*name == '\\') || (*name == '"')) {
+			buf[n++] = '\\';
+		}
+		buf[n++] = *name++;
+	}
+	buf[n] = 0;
+}
+
+
+static size_t
+metrics_route(struct mg_context *ctx, int route, char **buf, char *end)
+{
+	struct mg_metrics *m = ctx->metrics;
+	struct mg_route_counters sum, *rc;
+	char label[256], block[256];
+	uint64_t total = 0, cumulative = 0;
+	size_t len = 0;
+	unsigned int i, j;
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < m->num_threads; i++) {
+		rc = __atomic_load_n(&m->threads[i].route[route], __ATOMIC_ACQUIRE);
+		if (rc == NULL) {
+			continue;
+		}
+		for (j = 0; j < METRICS_CODES; j++) {
+			sum.requests[j] += metrics_load(&rc->requests[j]);
+		}
+		sum.sum_us += metrics_load(&rc->sum_us);
+		for (j = 0; j < METRICS_BUCKETS; j++) {
+			sum.bucket[j] += metrics_load(&rc->bucket[j]);
+		}
+	}
+	for (j = 0; j < METRICS_BUCKETS; j++) {
+		total += sum.bucket[j];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	metrics_label(label, sizeof(label), m->route_name[route]);
+	for (j = 0; j < METRICS_CODES; j++) {
+		if (sum.requests[j] == 0) {
+			continue;
+		}
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            "http_requests_total{route=\"%s\",code=\"%s\"} %" UINT64_FMT
+		            "\n",
+		            label,
+		            metrics_code[j],
+		            sum.requests[j]);
+		len += mg_str_append(buf, end, block);
+	}
+	/* The last bucket is open ended: it is only in +Inf */
+	for (j = 0; j + 1 < METRICS_BUCKETS; j++) {
+		cumulative += sum.bucket[j];
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            "http_request_duration_seconds_bucket{route=\"%s\",le=\"%."
+		            "6f\"} %" UINT64_FMT "\n",
+		            label,
+		            (double)metrics_bucket_max(j) * 1e-6,
+		            cumulative);
+		len += mg_str_append(buf, end, block);
+	}
+	mg_snprintf(NULL,
+	            NULL,
+	            block,
+	            sizeof(block),
+	            "http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} "
+	            "%" UINT64_FMT "\n"
+	            "http_request_duration_seconds_sum{route=\"%s\"} %.6f\n"
+	            "http_request_duration_seconds_count{route=\"%s\"} %" UINT64_FMT
+	            "\n",
+	            label,
+	            total,
+	            label,
+	            (double)sum.sum_us * 1e-6,
+	            label,
+	            total);
+	len += mg_str_append(buf, end, block);
+	return len;
+}
+
+#endif /* REQUEST_METRICS */
+
+
+CIVETWEB_API int
+mg_get_metrics(const struct mg_context *cctx, char *buffer, int buflen)
+{
+#if defined(REQUEST_METRICS)
+	struct mg_context *ctx = (struct mg_context *)cctx;
+	char block[512], *end;
+	uint64_t busy_us = 0;
+	size_t len = 0;
+	int route, num_routes, workers, busy, depth, size;
+	unsigned int i;
+
+	if ((ctx == NULL) || (ctx->metrics == NULL)) {
+		return -1;
+	}
+	if ((buffer == NULL) || (buflen < 1)) {
+		end = buffer;
+	} else {
+		*buffer = 0;
+		end = buffer + buflen;
+	}
+
+	len += mg_str_append(&buffer,
+	                     end,
+	                     "# HELP http_requests_total Requests by route and "
+	                     "status class.\n"
+	                     "# TYPE http_requests_total counter\n"
+	                     "# HELP http_request_duration_seconds Time from "
+	                     "reading the request to the end of the response.\n"
+	                     "# TYPE http_request_duration_seconds histogram\n");
+	num_routes = __atomic_load_n(&ctx->metrics->num_routes, __ATOMIC_ACQUIRE);
+	for (route = 0; route < num_routes; route++) {
+		len += metrics_route(ctx, route, &buffer, end);
+	}
+
+	for (i = 0; i < ctx->metrics->num_threads; i++) {
+		busy_us += metrics_load(&ctx->metrics->threads[i].busy_us);
+	}
+	metrics_workers(ctx, &workers, &busy);
+	depth = admission_queue_depth(ctx, &size);
+	mg_snprintf(NULL,
+	            NULL,
+	            block,
+	            sizeof(block),
+	            "# TYPE http_worker_threads gauge\n"
+	            "http_worker_threads %d\n"
+	            "# TYPE http_worker_threads_busy gauge\n"
+	            "http_worker_threads_busy %d\n"
+	            "# HELP http_worker_busy_seconds_total Time workers spent in "
+	            "requests.\n"
+	            "# TYPE http_worker_busy_seconds_total counter\n"
+	            "http_worker_busy_seconds_total %.6f\n"
+	            "# TYPE http_socket_queue_depth gauge\n"
+	            "http_socket_queue_depth %d\n"
+	            "# TYPE http_socket_queue_size gauge\n"
+	            "http_socket_queue_size %d\n",
+	            workers,
+	            busy,
+	            (double)busy_us * 1e-6,
+	            depth,
+	            size);
+	len += mg_str_append(&buffer, end, block);
+	return (int)len;
+#else
+	(void)cctx;
+	(void)buffer;
+	(void)buflen;
+	return -1;
+#endif
+}
@@ -127,6 +127,283 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 }
 
 
+
+/* Compression of dynamic content (mg_response_send_body).
+ * The compression level follows the CPU load of the server process:
+ * level 6 costs several times the CPU time of level 1 for a few percent
+ * better ratio, so a busy server trades ratio for throughput. */
+#if !defined(GZIP_LOAD_SAMPLE_INTERVAL_MS)
+#define GZIP_LOAD_SAMPLE_INTERVAL_MS (500)
+#endif
+
+
+/* CPU time (user + system) used by this process in ns */
+static uint64_t
+gzip_process_cpu_time_ns(void)
+{
+#if defined(_WIN32)
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	ULARGE_INTEGER k, u;
+
+	if (!GetProcessTimes(GetCurrentProcess(),
+	                     &creation_time,
+	                     &exit_time,
+	                     &kernel_time,
+	                     &user_time)) {
+		return 0;
+	}
+	k.LowPart = kernel_time.dwLowDateTime;
+	k.HighPart = kernel_time.dwHighDateTime;
+	u.LowPart = user_time.dwLowDateTime;
+	u.HighPart = user_time.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) * 100; /* 100 ns units */
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		return 0;
+	}
+	return ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec)
+	           * 1000000000
+	       + ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec)
+	             * 1000;
+#endif
+}
+
+
+/* Sample the process CPU load and adapt the compression level.
+ * Only called by the master thread, workers just read ctx->gzip_level. */
+static void
+gzip_update_level(struct mg_context *ctx)
+{
+	uint64_t wall = mg_get_current_time_ns();
+	uint64_t cpu, busy, elapsed;
+	int load;
+
+	if (ctx->gzip_num_cpus <= 0) {
+		/* First call: initialize */
+#if defined(_WIN32)
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		ctx->gzip_num_cpus = (int)si.dwNumberOfProcessors;
+#else
+		ctx->gzip_num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (ctx->gzip_num_cpus <= 0) {
+			ctx->gzip_num_cpus = 1;
+		}
+		ctx->gzip_level = 6;
+		ctx->gzip_sample_wall = wall;
+		ctx->gzip_sample_cpu = gzip_process_cpu_time_ns();
+		return;
+	}
+
+	if (wall < ctx->gzip_sample_wall) {
+		/* Clock has been set back: restart sampling */
+		ctx->gzip_sample_wall = wall;
+		return;
+	}
+	elapsed = wall - ctx->gzip_sample_wall;
+	if (elapsed < (uint64_t)GZIP_LOAD_SAMPLE_INTERVAL_MS * 1000000) {
+		return;
+	}
+
+	cpu = gzip_process_cpu_time_ns();
+	busy = (cpu > ctx->gzip_sample_cpu) ? (cpu - ctx->gzip_sample_cpu) : 0;
+	ctx->gzip_sample_wall = wall;
+	ctx->gzip_sample_cpu = cpu;
+
+	/* Load in percent of all CPUs */
+	load = (int)((busy * 100) / (elapsed * (uint64_t)ctx->gzip_num_cpus));
+	if (load < 25) {
+		ctx->gzip_level = 6;
+	} else if (load < 50) {
+		ctx->gzip_level = 4;
+	} else if (load < 75) {
+		ctx->gzip_level = 2;
+	} else {
+		ctx->gzip_level = 1;
+	}
+}
+
+
+/* Prepare the deflate state of this connection for a new response.
+ * The state is created once per worker thread and only reset afterwards,
+ * which avoids allocating and clearing ~400 kB for every response. */
+static int
+response_deflate_prepare(struct mg_connection *conn)
+{
+	z_stream *zstream = &conn->response_deflate_state;
+	int level = conn->phys_ctx->gzip_level;
+	int zret;
+
+	if (level <= 0) {
+		level = Z_DEFAULT_COMPRESSION;
+	}
+
+	if (!conn->response_deflate_initialized) {
+		memset(zstream, 0, sizeof(*zstream));
+		zstream->zalloc = zalloc;
+		zstream->zfree = zfree;
+		zstream->opaque = (void *)conn;
+
+		/* GZIP format (MAX_WBITS | 16) */
+		zret = deflateInit2(zstream,
+		                    level,
+		                    Z_DEFLATED,
+		                    MAX_WBITS | 16,
+		                    MEM_LEVEL,
+		                    Z_DEFAULT_STRATEGY);
+		if (zret != Z_OK) {
+			mg_cry_internal(conn,
+			                "GZIP init failed (%i): %s",
+			                zret,
+			                (zstream->msg ? zstream->msg
+			                              : "<no error message>"));
+			deflateEnd(zstream);
+			return -1;
+		}
+		conn->response_deflate_initialized = 1;
+		conn->response_deflate_level = level;
+		return 0;
+	}
+
+	if (deflateReset(zstream) != Z_OK) {
+		return -1;
+	}
+	if (level != conn->response_deflate_level) {
+		/* Nothing has been compressed since the reset, so this is cheap */
+		if (deflateParams(zstream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return -1;
+		}
+		conn->response_deflate_level = level;
+	}
+	return 0;
+}
+
+
+/* Compress a body held in memory and stream it to the client.
+ * response_deflate_prepare must have succeeded. HTTP/1.1 uses chunked
+ * encoding: "head" is the response header block, which is sent together
+ * with the first chunk, and every chunk including its framing (and the
+ * last-chunk marker) goes out with one write. For HTTP/2, the headers
+ * have been sent already and the output is written as DATA frames.
+ * Return: number of compressed bytes sent, or -1 on error. */
+static int64_t
+send_compressed_body(struct mg_connection *conn,
+                     const void *data,
+                     size_t len,
+                     const char *head,
+                     size_t head_len)
+{
+	z_stream *zstream = &conn->response_deflate_state;
+	unsigned char out_buf[MG_BUF_LEN];
+	const unsigned char *in = (const unsigned char *)data;
+	size_t remaining = len;
+	int64_t sent = 0;
+	int zret = Z_OK;
+	int do_flush;
+	unsigned bytes_avail;
+	int chunked = (conn->protocol_type != PROTOCOL_TYPE_HTTP2);
+	char *frame = NULL;
+	size_t frame_len = 0;
+
+	if (chunked) {
+		/* head + chunk size line + data + CRLF + "0\r\n\r\n" */
+		frame = (char *)mg_malloc_ctx(head_len + MG_BUF_LEN + 32,
+		                              conn->phys_ctx);
+		if (frame == NULL) {
+			return -1;
+		}
+		if (head_len > 0) {
+			memcpy(frame, head, head_len);
+			frame_len = head_len;
+		}
+	}
+
+	do {
+		/* avail_in is an uInt: feed very large bodies in slices */
+		uInt slice = (remaining > 0x40000000u) ? 0x40000000u : (uInt)remaining;
+
+		zstream->next_in = (unsigned char *)in;
+		zstream->avail_in = slice;
+		in += slice;
+		remaining -= slice;
+		do_flush = ((remaining == 0) ? Z_FINISH : Z_NO_FLUSH);
+
+		do {
+			zstream->avail_out = MG_BUF_LEN;
+			zstream->next_out = out_buf;
+			zret = deflate(zstream, do_flush);
+
+			if (zret == Z_STREAM_ERROR) {
+				mg_cry_internal(conn, "%s", "GZIP stream error");
+				mg_free(frame);
+				return -1;
+			}
+
+			bytes_avail = MG_BUF_LEN - zstream->avail_out;
+			sent += bytes_avail;
+			if (!chunked) {
+				if (bytes_avail
+				    && (mg_write(conn, out_buf, bytes_avail) < 0)) {
+					return -1;
+				}
+				continue;
+			}
+
+			if (bytes_avail) {
+				mg_snprintf(conn,
+				            NULL, /* buffer is large enough */
+				            frame + frame_len,
+				            16,
+				            "%x\r\n",
+				            bytes_avail);
+				frame_len += strlen(frame + frame_len);
+				memcpy(frame + frame_len, out_buf, bytes_avail);
+				frame_len += bytes_avail;
+				frame[frame_len++] = '\r';
+				frame[frame_len++] = '\n';
+			}
+			if (zret == Z_STREAM_END) {
+				/* "end of chunked data" marker */
+				memcpy(frame + frame_len, "0\r\n\r\n", 5);
+				frame_len += 5;
+			}
+			if (frame_len > 0) {
+				if (mg_write(conn, frame, frame_len) != (int)frame_len) {
+					mg_free(frame);
+					return -1;
+				}
+				frame_len = 0;
+			}
+		} while (zstream->avail_out == 0);
+	} while (remaining > 0);
+
+	mg_free(frame);
+
+	if (zret != Z_STREAM_END) {
+		mg_cry_internal(conn,
+		                "GZIP incomplete (%i): %s",
+		                zret,
+		                (zstream->msg ? zstream->msg : "<no error message>"));
+		return -1;
+	}
+	return sent;
+}
+
+
+/* Release the deflate state when the worker thread terminates */
+static void
+response_deflate_free(struct mg_connection *conn)
+{
+	if (conn->response_deflate_initialized) {
+		deflateEnd(&conn->response_deflate_state);
+		conn->response_deflate_initialized = 0;
+	}
+}
+
+
 #if defined(USE_WEBSOCKET) && defined(MG_EXPERIMENTAL_INTERFACES)
 static int
 websocket_deflate_initialize(struct mg_connection *conn, int server)
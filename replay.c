@@ -0,0 +1,678 @@
+// Replays captured traffic (capture.h) against a server.
+//
+// Reads a capture file (EKNOWS_CAPTURE) and sends its requests again, each
+// at its original offset from the start of the capture divided by the speed
+// (-x 10 replays an hour in six minutes), in the order they arrived, over
+// keep-alive connections with one thread per connection. Latency is counted
+// from the time a request was due, as in bench_load.c, so a server that
+// falls behind the schedule shows it in the percentiles. With -s and -d only
+// a window of the capture is replayed, e.g. the minutes of an incident.
+//
+// Tokens and passwords are not in the capture. With -u, the tool logs in as
+// that teacher first and sends its token with the requests that had one, and
+// sends logins whose password was masked with these credentials. Without
+// it, both go out as captured and fail. Replay against a copy of the
+// database the capture was made on, so ids in the requests exist.
+//
+// The summary goes to stderr, the results as one JSON object to stdout (or
+// -o): per path, requests, errors (no response or 5xx), responses whose
+// status differs from the captured one, and latency percentiles next to the
+// captured service times. Options:
+//   -H host -p port -c connections -x speed -s start second -d seconds
+//   -u user:password -l label -o file
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define DEFAULT_CONNECTIONS 32
+#define RESPONSE_MAX (16 * 1024 * 1024)
+#define IO_TIMEOUT_S 10
+#define MAX_ROUTES 128
+#define HEAD_MAX (CAPTURE_MAX_URI + 512)
+
+typedef struct {
+    uint64_t offset_us;
+    unsigned method, flags;
+    int status;          // captured
+    uint64_t service_us; // captured
+    const char *uri;
+    size_t uri_len;
+    const char *body;
+    size_t body_len;
+    int route;
+    // Replay results
+    int replay_status;
+    uint64_t latency_us, replay_service_us;
+} request;
+
+typedef struct {
+    pthread_t thread;
+    int fd;
+    char *buf;
+    uint64_t last_done;
+} worker;
+
+static struct {
+    const char *host;
+    const char *port;
+    int connections;
+    double speed;
+    double start, duration;
+    const char *user, *password;
+    const char *label;
+    const char *output;
+} opt;
+
+static struct addrinfo *server;
+static request *requests;
+static size_t num_requests;
+static char routes[MAX_ROUTES + 1][CAPTURE_MAX_URI];
+static int num_routes;
+static char token[128];
+static uint64_t start_ns, first_offset_us;
+static uint64_t next_index;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(t / 1000000000u);
+    ts.tv_nsec = (long)(t % 1000000000u);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int read_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Route of a request: its path, up to MAX_ROUTES different ones, then "other"
+static int route_of(const char *uri, size_t len)
+{
+    const char *q = memchr(uri, '?', len);
+    size_t path_len = q ? (size_t)(q - uri) : len;
+    for (int i = 0; i < num_routes; i++) {
+        if (strlen(routes[i]) == path_len && memcmp(routes[i], uri, path_len) == 0) {
+            return i;
+        }
+    }
+    if (num_routes == MAX_ROUTES) {
+        return MAX_ROUTES;
+    }
+    memcpy(routes[num_routes], uri, path_len);
+    routes[num_routes][path_len] = '\0';
+    return num_routes++;
+}
+
+static int cmp_offset(const void *a, const void *b)
+{
+    const request *x = a, *y = b;
+    if (x->offset_us != y->offset_us) {
+        return x->offset_us < y->offset_us ? -1 : 1;
+    }
+    return x->uri < y->uri ? -1 : x->uri > y->uri; // file order
+}
+
+// Load the requests of the window to replay. The file stays in memory, the
+// requests point into it.
+static int load_capture(const char *path, time_t *captured_at)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *data = NULL;
+    size_t size = 0, cap = 0, n;
+
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    do {
+        if (size == cap) {
+            cap = cap ? cap * 2 : 1 << 20;
+            unsigned char *p = realloc(data, cap);
+            if (!p) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
+            }
+            data = p;
+        }
+        n = fread(data + size, 1, cap - size, f);
+        size += n;
+    } while (n > 0);
+    fclose(f);
+
+    if (size < CAPTURE_MAGIC_LEN + 8 || memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        return -1;
+    }
+    uint64_t t = 0;
+    for (int i = 0; i < 8; i++) {
+        t |= (uint64_t)data[CAPTURE_MAGIC_LEN + i] << (8 * i);
+    }
+    *captured_at = (time_t)t;
+
+    uint64_t from = (uint64_t)(opt.start * 1e6);
+    uint64_t to = opt.duration > 0 ? from + (uint64_t)(opt.duration * 1e6) : UINT64_MAX;
+    const unsigned char *p = data + CAPTURE_MAGIC_LEN + 8, *end = data + size;
+    size_t max = 0;
+    while (p < end) {
+        request r = { 0 };
+        uint64_t status, uri_len, body_len;
+        if (read_varint(&p, end, &r.offset_us) != 0 || end - p < 2) {
+            break;
+        }
+        r.method = *p++;
+        r.flags = *p++;
+        if (read_varint(&p, end, &status) != 0 || read_varint(&p, end, &r.service_us) != 0
+            || read_varint(&p, end, &uri_len) != 0 || (uint64_t)(end - p) < uri_len) {
+            break;
+        }
+        r.uri = (const char *)p;
+        r.uri_len = (size_t)uri_len;
+        p += uri_len;
+        if (read_varint(&p, end, &body_len) != 0 || (uint64_t)(end - p) < body_len) {
+            break;
+        }
+        r.body = (const char *)p;
+        r.body_len = (size_t)body_len;
+        p += body_len;
+        r.status = (int)status;
+        if (r.method >= CAPTURE_NUM_METHODS || r.uri_len == 0 || r.uri_len >= CAPTURE_MAX_URI
+            || r.offset_us < from || r.offset_us >= to) {
+            continue;
+        }
+        if (num_requests == max) {
+            max = max ? max * 2 : 4096;
+            request *q = realloc(requests, max * sizeof(request));
+            if (!q) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
+            }
+            requests = q;
+        }
+        requests[num_requests++] = r;
+    }
+    if (p < end) {
+        fprintf(stderr, "%s: truncated record at byte %zu, ignoring the rest\n",
+                path, (size_t)(p - data));
+    }
+    if (num_requests == 0) {
+        fprintf(stderr, "No requests to replay in %s\n", path);
+        return -1;
+    }
+    // Records are in the order requests finished: replay them as they arrived
+    qsort(requests, num_requests, sizeof(request), cmp_offset);
+    first_offset_us = requests[0].offset_us;
+    for (size_t i = 0; i < num_requests; i++) {
+        requests[i].route = route_of(requests[i].uri, requests[i].uri_len);
+    }
+    return 0;
+}
+
+static int connect_server(void)
+{
+    struct timeval tv = { IO_TIMEOUT_S, 0 };
+    int one = 1;
+    int fd = socket(server->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, server->ai_addr, server->ai_addrlen) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void disconnect(worker *w)
+{
+    close(w->fd);
+    w->fd = -1;
+}
+
+// The rest of a response after its headers, which end at header_len. Bodies
+// without a Content-Length are chunked or end with the connection. Returns
+// the end of the body, or 0 on error.
+static size_t read_body(worker *w, size_t len, size_t header_len, int no_body, int *must_close)
+{
+    const char *cl = strcasestr(w->buf, "\r\nContent-Length:");
+    int chunked = strcasestr(w->buf, "\r\nTransfer-Encoding: chunked") != NULL;
+
+    if (no_body) {
+        return header_len;
+    }
+    if (cl) {
+        size_t want = header_len + (size_t)strtoull(cl + 17, NULL, 10);
+        if (want >= RESPONSE_MAX) {
+            return 0;
+        }
+        while (len < want) {
+            ssize_t n = recv(w->fd, w->buf + len, want - len, 0);
+            if (n <= 0) {
+                return 0;
+            }
+            len += (size_t)n;
+        }
+        return want;
+    }
+    // Chunked: up to the last chunk. Otherwise up to the end of the stream.
+    for (;;) {
+        if (chunked && len >= header_len + 5 && memcmp(w->buf + len - 5, "0\r\n\r\n", 5) == 0) {
+            return len;
+        }
+        ssize_t n = len < RESPONSE_MAX ? recv(w->fd, w->buf + len, RESPONSE_MAX - len, 0) : -1;
+        if (n == 0 && !chunked) {
+            *must_close = 1;
+            return len;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        len += (size_t)n;
+    }
+}
+
+// Send r on w's connection, reconnecting once if the server closed it.
+// Returns the status, or -1. The response body is in w->buf.
+static int send_request(worker *w, const request *r, const char *body, size_t body_len)
+{
+    char head[HEAD_MAX];
+    const char *method = capture_methods[r->method];
+    int use_token = (r->flags & CAPTURE_TOKEN) && token[0];
+    int head_len = snprintf(head, sizeof(head),
+                            "%s %.*s HTTP/1.1\r\nHost: %s\r\n%s%s%s%s%s"
+                            "Content-Length: %zu\r\n\r\n",
+                            method, (int)r->uri_len, r->uri, opt.host,
+                            body_len == 0 ? ""
+                            : (r->flags & CAPTURE_FORM) ? "Content-Type: application/x-www-form-urlencoded\r\n"
+                            : "Content-Type: application/json\r\n",
+                            (r->flags & CAPTURE_GZIP) ? "Accept-Encoding: gzip\r\n" : "",
+                            use_token ? "Authorization: Bearer " : "",
+                            use_token ? token : "", use_token ? "\r\n" : "", body_len);
+    if (head_len < 0 || (size_t)head_len >= sizeof(head)) {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (w->fd < 0 && (w->fd = connect_server()) < 0) {
+            return -1;
+        }
+        size_t len = 0;
+        char *end = NULL;
+        if (send_all(w->fd, head, (size_t)head_len) == 0 && send_all(w->fd, body, body_len) == 0) {
+            while (!(end = memmem(w->buf, len, "\r\n\r\n", 4))) {
+                ssize_t n = len < RESPONSE_MAX ? recv(w->fd, w->buf + len, RESPONSE_MAX - len, 0) : -1;
+                if (n <= 0) {
+                    break;
+                }
+                len += (size_t)n;
+            }
+        }
+        if (!end) {
+            disconnect(w);
+            if (len == 0) {
+                continue; // keep-alive connection closed meanwhile
+            }
+            return -1;
+        }
+
+        *end = '\0';
+        int status = atoi(w->buf + 9);
+        int must_close = strcasestr(w->buf, "\r\nConnection: close") != NULL;
+        int no_body = strcmp(method, "HEAD") == 0 || status == 204 || status == 304 || status < 200;
+        size_t header_len = (size_t)(end + 4 - w->buf);
+        size_t body_end = read_body(w, len, header_len, no_body, &must_close);
+        if (body_end == 0) {
+            disconnect(w);
+            return -1;
+        }
+        // Anything after the body would be a response to a request not sent
+        if (must_close || body_end != len) {
+            disconnect(w);
+        }
+        memmove(w->buf, w->buf + header_len, body_end - header_len);
+        w->buf[body_end - header_len] = '\0';
+        return status;
+    }
+    return -1;
+}
+
+static int is_login(const request *r)
+{
+    const char *q = memchr(r->uri, '?', r->uri_len);
+    size_t path_len = q ? (size_t)(q - r->uri) : r->uri_len;
+    return path_len >= 6 && memcmp(r->uri + path_len - 6, "/login", 6) == 0;
+}
+
+static void *worker_main(void *arg)
+{
+    worker *w = arg;
+    char credentials[512];
+
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+        if (i >= num_requests) {
+            break;
+        }
+        request *r = &requests[i];
+        uint64_t due = start_ns + (uint64_t)((double)(r->offset_us - first_offset_us) * 1000.0 / opt.speed);
+        sleep_until(due);
+
+        const char *body = r->body;
+        size_t body_len = r->body_len;
+        if ((r->flags & CAPTURE_CREDENTIALS) && opt.user && is_login(r)) {
+            int n = snprintf(credentials, sizeof(credentials),
+                             r->body_len > 0 && r->body[0] == '{'
+                                 ? "{\"username\":\"%s\",\"password\":\"%s\"}"
+                                 : "username=%s&password=%s",
+                             opt.user, opt.password);
+            body = credentials;
+            body_len = n > 0 && (size_t)n < sizeof(credentials) ? (size_t)n : 0;
+        }
+        uint64_t sent = now_ns();
+        r->replay_status = send_request(w, r, body, body_len);
+        uint64_t done = now_ns();
+        r->latency_us = (done - due) / 1000;
+        r->replay_service_us = (done - sent) / 1000;
+        w->last_done = done;
+    }
+    return NULL;
+}
+
+// Log in with -u for a token to send instead of the captured ones
+static int login(worker *w)
+{
+    char body[512];
+    request r = { 0 };
+    r.method = 1; // POST
+    r.uri = "/api/teacher/login";
+    r.uri_len = strlen(r.uri);
+    int n = snprintf(body, sizeof(body), "{\"username\":\"%s\",\"password\":\"%s\"}",
+                     opt.user, opt.password);
+    int status = send_request(w, &r, body, (size_t)n);
+    const char *t = status == 200 ? strstr(w->buf, "\"token\":\"") : NULL;
+    if (!t || sscanf(t + 9, "%127[^\"]", token) != 1) {
+        fprintf(stderr, "Cannot log in as %s (%d)\n", opt.user, status);
+        return -1;
+    }
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (double)n);
+    return sorted[i < n ? i : n - 1];
+}
+
+typedef struct {
+    size_t count;
+    uint64_t errors, changed;
+    uint64_t *latency, *service, *captured;
+} summary;
+
+// Results of one route, or of all (route < 0), sorted
+static summary summarize(int route, uint64_t *scratch)
+{
+    summary s = { 0 };
+    s.latency = scratch;
+    s.service = scratch + num_requests;
+    s.captured = scratch + 2 * num_requests;
+    for (size_t i = 0; i < num_requests; i++) {
+        const request *r = &requests[i];
+        if (route >= 0 && r->route != route) {
+            continue;
+        }
+        s.latency[s.count] = r->latency_us;
+        s.service[s.count] = r->replay_service_us;
+        s.captured[s.count] = r->service_us;
+        s.count++;
+        if (r->replay_status < 0 || r->replay_status >= 500) {
+            s.errors++;
+        }
+        if (r->replay_status != r->status) {
+            s.changed++;
+        }
+    }
+    qsort(s.latency, s.count, sizeof(uint64_t), cmp_u64);
+    qsort(s.service, s.count, sizeof(uint64_t), cmp_u64);
+    qsort(s.captured, s.count, sizeof(uint64_t), cmp_u64);
+    return s;
+}
+
+static void print_percentiles(FILE *out, const char *name, const uint64_t *v, size_t n)
+{
+    fprintf(out, "\"%s\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+            name, (unsigned long long)percentile(v, n, 0.5),
+            (unsigned long long)percentile(v, n, 0.9),
+            (unsigned long long)percentile(v, n, 0.99),
+            (unsigned long long)percentile(v, n, 0.999),
+            (unsigned long long)percentile(v, n, 1.0));
+}
+
+static void print_stats(FILE *out, const char *name, const summary *s, double seconds)
+{
+    // Paths are as the clients sent them
+    fputc('"', out);
+    for (const char *p = name; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', out);
+        }
+        fputc((unsigned char)*p < 0x20 ? '?' : *p, out);
+    }
+    fprintf(out, "\":{\"requests\":%zu,\"errors\":%llu,\"status_changed\":%llu,\"throughput\":%.1f,",
+            s->count, (unsigned long long)s->errors, (unsigned long long)s->changed,
+            (double)s->count / seconds);
+    print_percentiles(out, "latency_us", s->latency, s->count);
+    fprintf(out, ",");
+    print_percentiles(out, "service_us", s->service, s->count);
+    fprintf(out, ",");
+    print_percentiles(out, "captured_service_us", s->captured, s->count);
+    fprintf(out, "}");
+}
+
+static void print_summary(const char *name, const summary *s)
+{
+    fprintf(stderr, "  %-32.32s %8zu req  err %-5llu changed %-5llu p50 %7.2f  p99 %8.2f  p999 %8.2f ms"
+                    "  (captured p99 %7.2f)\n",
+            name, s->count, (unsigned long long)s->errors, (unsigned long long)s->changed,
+            (double)percentile(s->latency, s->count, 0.5) / 1000.0,
+            (double)percentile(s->latency, s->count, 0.99) / 1000.0,
+            (double)percentile(s->latency, s->count, 0.999) / 1000.0,
+            (double)percentile(s->captured, s->count, 0.99) / 1000.0);
+}
+
+static int cmp_route_count(const void *a, const void *b, void *counts)
+{
+    const size_t *c = counts;
+    int x = *(const int *)a, y = *(const int *)b;
+    return c[x] != c[y] ? (c[x] < c[y] ? 1 : -1) : x - y;
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = { 0 };
+    char user[128] = "";
+    FILE *out = stdout;
+    time_t captured_at;
+    int c;
+
+    opt.host = "127.0.0.1";
+    opt.port = "8080";
+    opt.connections = DEFAULT_CONNECTIONS;
+    opt.speed = 1;
+    opt.label = "";
+    while ((c = getopt(argc, argv, "H:p:c:x:s:d:u:l:o:")) != -1) {
+        switch (c) {
+        case 'H': opt.host = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'x': opt.speed = atof(optarg); break;
+        case 's': opt.start = atof(optarg); break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'u': snprintf(user, sizeof(user), "%s", optarg); break;
+        case 'l': opt.label = optarg; break;
+        case 'o': opt.output = optarg; break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    char *colon = strchr(user, ':');
+    if (optind != argc - 1 || opt.connections < 1 || opt.speed <= 0 || opt.start < 0
+        || opt.duration < 0 || (user[0] && !colon)) {
+        fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-x speed] "
+                        "[-s start second] [-d seconds] [-u user:password] [-l label] "
+                        "[-o file] capture\n", argv[0]);
+        return 2;
+    }
+    if (colon) {
+        *colon = '\0';
+        opt.user = user;
+        opt.password = colon + 1;
+    }
+    const char *capture = argv[optind];
+    if (load_capture(capture, &captured_at) != 0) {
+        return 1;
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opt.host, opt.port, &hints, &server) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", opt.host);
+        return 1;
+    }
+    worker *workers = calloc((size_t)opt.connections, sizeof(worker));
+    uint64_t *scratch = malloc(3 * num_requests * sizeof(uint64_t));
+    if (!workers || !scratch) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        workers[i].fd = -1;
+        workers[i].buf = malloc(RESPONSE_MAX + 1);
+        if (!workers[i].buf) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    if (opt.user && login(&workers[0]) != 0) {
+        return 1;
+    }
+
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&captured_at));
+    double span = (double)(requests[num_requests - 1].offset_us - first_offset_us) / 1e6;
+    fprintf(stderr, "%s%sreplaying %zu requests over %.1f s of %s (captured %s) at %gx, %d connections\n",
+            opt.label, opt.label[0] ? ": " : "", num_requests, span, capture, when, opt.speed,
+            opt.connections);
+
+    start_ns = now_ns() + 10000000; // let the threads start
+    for (int i = 0; i < opt.connections; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    for (int i = 0; i < opt.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (opt.output && !(out = fopen(opt.output, "w"))) {
+        fprintf(stderr, "Cannot write %s\n", opt.output);
+        return 1;
+    }
+    uint64_t last_done = start_ns;
+    for (int i = 0; i < opt.connections; i++) {
+        if (workers[i].last_done > last_done) {
+            last_done = workers[i].last_done;
+        }
+    }
+    double seconds = (double)(last_done - start_ns) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    summary all = summarize(-1, scratch);
+    fprintf(out, "{\"label\":\"%s\",\"capture\":\"%s\",\"captured_at\":%lld,\"speed\":%.2f,"
+                 "\"connections\":%d,\"span_s\":%.1f,\"duration_s\":%.1f,",
+            opt.label, capture, (long long)captured_at, opt.speed, opt.connections, span, seconds);
+    print_stats(out, "total", &all, seconds);
+    print_summary("total", &all);
+
+    // Routes, busiest first
+    size_t counts[MAX_ROUTES + 1] = { 0 };
+    int order[MAX_ROUTES + 1];
+    int n = num_routes + (num_routes == MAX_ROUTES);
+    snprintf(routes[MAX_ROUTES], sizeof(routes[MAX_ROUTES]), "other");
+    for (size_t i = 0; i < num_requests; i++) {
+        counts[requests[i].route]++;
+    }
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, (size_t)n, sizeof(int), cmp_route_count, counts);
+    fprintf(out, ",\"routes\":{");
+    for (int i = 0; i < n; i++) {
+        if (counts[order[i]] == 0) {
+            continue;
+        }
+        summary s = summarize(order[i], scratch);
+        fprintf(out, "%s", i ? "," : "");
+        print_stats(out, routes[order[i]], &s, seconds);
+        print_summary(routes[order[i]], &s);
+    }
+    fprintf(out, "}}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
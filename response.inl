@@ -36,6 +36,7 @@ free_buffered_response_header_list(struct mg_connection *conn)
 }
 
 
+#if defined(NO_RESPONSE_BUFFERING)
 /* Send first line of HTTP/1.x response */
 static int
 send_http1_response_status_line(struct mg_connection *conn)
@@ -63,6 +64,7 @@ send_http1_response_status_line(struct mg_connection *conn)
 	}
 	return 1;
 }
+#endif
 
 
 /* Initialize a new HTTP response
@@ -256,6 +258,149 @@ static int http2_send_response_headers(struct mg_connection *conn);
 #endif
 
 
+#if !defined(NO_RESPONSE_BUFFERING)
+/* Up to this body size, the body is copied behind the header block and
+ * both are sent with one write. Writing a short body separately would wait
+ * for the ACK of the header packet (Nagle algorithm vs. delayed ACK). */
+#if !defined(RESPONSE_COALESCE_LIMIT)
+#define RESPONSE_COALESCE_LIMIT (64 * 1024)
+#endif
+
+
+/* Format the status line and all buffered headers of a HTTP/1.x response
+ * into one memory block, followed by "reserve" unused bytes.
+ * Return: memory block (free with mg_free) or NULL if out of memory. */
+static char *
+format_http1_response_header(struct mg_connection *conn,
+                             size_t reserve,
+                             size_t *len)
+{
+	const char *http_version = conn->request_info.http_version;
+	const char *status_txt;
+	int status_code = conn->status_code;
+	int has_date = 0;
+	int has_connection = 0;
+	size_t size, pos;
+	char *buf;
+	int i;
+
+	if ((status_code < 100) || (status_code > 999)) {
+		/* Set invalid status code to "500 Internal Server Error" */
+		status_code = 500;
+	}
+	if (!http_version) {
+		http_version = "1.0";
+	}
+
+	/* mg_get_response_code_text will never return NULL */
+	status_txt = mg_get_response_code_text(conn, conn->status_code);
+
+	/* Status line, Date, Connection and the final CRLF */
+	size = strlen(http_version) + strlen(status_txt) + 128;
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		size += strlen(conn->response_info.http_headers[i].name)
+		        + strlen(conn->response_info.http_headers[i].value) + 4;
+	}
+
+	buf = (char *)mg_malloc_ctx(size + reserve, conn->phys_ctx);
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	mg_snprintf(conn,
+	            NULL, /* size is sufficient */
+	            buf,
+	            size,
+	            "HTTP/%s %i %s\r\n",
+	            http_version,
+	            status_code,
+	            status_txt);
+	pos = strlen(buf);
+
+	for (i = 0; i < conn->response_info.num_headers; i++) {
+		const char *name = conn->response_info.http_headers[i].name;
+		const char *value = conn->response_info.http_headers[i].value;
+		size_t name_len = strlen(name);
+		size_t value_len = strlen(value);
+
+		memcpy(buf + pos, name, name_len);
+		pos += name_len;
+		buf[pos++] = ':';
+		buf[pos++] = ' ';
+		memcpy(buf + pos, value, value_len);
+		pos += value_len;
+		buf[pos++] = '\r';
+		buf[pos++] = '\n';
+
+		/* Check for some special headers */
+		if (!mg_strcasecmp("Date", name)) {
+			has_date = 1;
+		}
+		if (!mg_strcasecmp("Connection", name)) {
+			has_connection = 1;
+		}
+	}
+
+	if (!has_date) {
+		time_t curtime = time(NULL);
+		char date[64];
+		gmt_time_string(date, sizeof(date), &curtime);
+		mg_snprintf(
+		    conn, NULL, buf + pos, size - pos, "Date: %s\r\n", date);
+		pos += strlen(buf + pos);
+	}
+	if (!has_connection) {
+		mg_snprintf(conn,
+		            NULL,
+		            buf + pos,
+		            size - pos,
+		            "Connection: %s\r\n",
+		            suggest_connection_header(conn));
+		pos += strlen(buf + pos);
+	}
+	buf[pos++] = '\r';
+	buf[pos++] = '\n';
+
+	*len = pos;
+	return buf;
+}
+
+
+/* Send the buffered HTTP/1.x response header. A short body is sent in
+ * the same write, a longer one right after it. */
+static int
+send_http1_response_header(struct mg_connection *conn,
+                           const void *body,
+                           size_t body_len)
+{
+	size_t reserve = (body_len <= RESPONSE_COALESCE_LIMIT) ? body_len : 0;
+	size_t len;
+	char *buf = format_http1_response_header(conn, reserve, &len);
+	int ret = 0;
+
+	free_buffered_response_header_list(conn);
+	if (buf == NULL) {
+		return -5;
+	}
+	if (reserve > 0) {
+		memcpy(buf + len, body, reserve);
+		len += reserve;
+	}
+
+	if (mg_write(conn, buf, len) != (int)len) {
+		ret = -4;
+	} else if ((body_len > reserve)
+	           && (mg_write(conn, body, body_len) != (int)body_len)) {
+		ret = -4;
+	}
+	mg_free(buf);
+
+	conn->request_state = 3;
+	return ret;
+}
+#endif
+
+
 /* Send http response
  * Parameters:
  *   conn: Current connection handle.
@@ -265,16 +410,11 @@ static int http2_send_response_headers(struct mg_connection *conn);
  *  -2:    invalid connection type
  *  -3:    invalid connection status
  *  -4:    network send failed
+ *  -5:    out of memory
  */
 int
 mg_response_header_send(struct mg_connection *conn)
 {
-#if !defined(NO_RESPONSE_BUFFERING)
-	int i;
-	int has_date = 0;
-	int has_connection = 0;
-#endif
-
 	if (conn == NULL) {
 		/* Parameter error */
 		return -1;
@@ -301,42 +441,331 @@ mg_response_header_send(struct mg_connection *conn)
 	}
 #endif
 
-	/* Send */
-	if (!send_http1_response_status_line(conn)) {
-		free_buffered_response_header_list(conn);
-		return -4;
-	};
-	for (i = 0; i < conn->response_info.num_headers; i++) {
-		mg_printf(conn,
-		          "%s: %s\r\n",
-		          conn->response_info.http_headers[i].name,
-		          conn->response_info.http_headers[i].value);
+	/* Send status line and headers with one write */
+	return send_http1_response_header(conn, NULL, 0);
+#else
+	mg_write(conn, "\r\n", 2);
+	conn->request_state = 3;
 
-		/* Check for some special headers */
-		if (!mg_strcasecmp("Date", conn->response_info.http_headers[i].name)) {
-			has_date = 1;
+	/* ok */
+	return 0;
+#endif
+}
+
+
+#if defined(USE_ZLIB)
+/* forward, see mod_zlib.inl */
+static int response_deflate_prepare(struct mg_connection *conn);
+static int64_t send_compressed_body(struct mg_connection *conn,
+                                    const void *data,
+                                    size_t len,
+                                    const char *head,
+                                    size_t head_len);
+
+
+/* Bodies of at least this size are compressed */
+static size_t
+response_compression_min_size(const struct mg_connection *conn)
+{
+	int min_size = atoi(conn->phys_ctx->dd.config[COMPRESSION_MIN_SIZE]);
+	return (min_size > 0) ? (size_t)min_size : 0;
+}
+#endif
+
+
+/* Send http response headers and a complete body held in memory
+ * Parameters:
+ *   conn: Current connection handle.
+ *   data: Response body.
+ *   len:  Length of the response body.
+ * Return:
+ *   0:    ok
+ *  -1:    parameter error
+ *  -2:    invalid connection type
+ *  -3:    invalid connection status
+ *  -4:    network send failed
+ *  -5:    out of memory
+ */
+int
+mg_response_send_body(struct mg_connection *conn, const void *data, size_t len)
+{
+	char content_length[32];
+	int is_head;
+	int ret;
+
+	if ((conn == NULL) || ((data == NULL) && (len > 0))) {
+		/* Parameter error */
+		return -1;
+	}
+	is_head = !strcmp(conn->request_info.request_method, "HEAD");
+
+#if defined(USE_ZLIB)
+	if (len >= response_compression_min_size(conn)) {
+		/* The content depends on Accept-Encoding: tell caches */
+		ret = mg_response_header_add(conn, "Vary", "Accept-Encoding", -1);
+		if (ret < 0) {
+			return ret;
 		}
-		if (!mg_strcasecmp("Connection",
-		                   conn->response_info.http_headers[i].name)) {
-			has_connection = 1;
+
+		/* Compressed bodies are streamed, so their length is not known
+		 * in advance: HTTP/1.1 needs chunked encoding, HTTP/1.0 clients
+		 * get the uncompressed body. */
+		if (conn->accept_gzip
+		    && ((conn->protocol_type == PROTOCOL_TYPE_HTTP2)
+		        || !strcmp(conn->request_info.http_version, "1.1"))
+		    && (response_deflate_prepare(conn) == 0)) {
+			char *head = NULL;
+			size_t head_len = 0;
+
+			mg_response_header_add(conn, "Content-Encoding", "gzip", -1);
+			if (conn->protocol_type != PROTOCOL_TYPE_HTTP2) {
+				mg_response_header_add(conn,
+				                       "Transfer-Encoding",
+				                       "chunked",
+				                       -1);
+			}
+#if !defined(NO_RESPONSE_BUFFERING)
+			if ((conn->protocol_type != PROTOCOL_TYPE_HTTP2) && !is_head) {
+				/* The header block goes out with the first chunk */
+				conn->request_state = 2;
+				head = format_http1_response_header(conn, 0, &head_len);
+				free_buffered_response_header_list(conn);
+				conn->request_state = 3;
+				if (head == NULL) {
+					return -5;
+				}
+			} else
+#endif
+			{
+				ret = mg_response_header_send(conn);
+				if ((ret != 0) || is_head) {
+					return ret;
+				}
+			}
+			ret = 0;
+			if (send_compressed_body(conn, data, len, head, head_len) < 0) {
+				/* The client can not find the end of this response */
+				conn->must_close = 1;
+				ret = -4;
+			}
+			mg_free(head);
+			return ret;
 		}
 	}
+#endif
 
-	if (!has_date) {
-		time_t curtime = time(NULL);
-		char date[64];
-		gmt_time_string(date, sizeof(date), &curtime);
-		mg_printf(conn, "Date: %s\r\n", date);
+	mg_snprintf(conn,
+	            NULL, /* No truncation check for content_length */
+	            content_length,
+	            sizeof(content_length),
+	            "%" UINT64_FMT,
+	            (uint64_t)len);
+	ret = mg_response_header_add(conn, "Content-Length", content_length, -1);
+	if (ret < 0) {
+		return ret;
 	}
-	if (!has_connection) {
-		mg_printf(conn, "Connection: %s\r\n", suggest_connection_header(conn));
+	if (is_head) {
+		len = 0;
+	}
+
+#if !defined(NO_RESPONSE_BUFFERING)
+	if (conn->protocol_type != PROTOCOL_TYPE_HTTP2) {
+		conn->request_state = 2;
+		return send_http1_response_header(conn, data, len);
 	}
 #endif
+	ret = mg_response_header_send(conn);
+	if ((ret == 0) && (len > 0)) {
+		if (mg_write(conn, data, len) != (int)len) {
+			ret = -4;
+		}
+	}
+	return ret;
+}
 
-	mg_write(conn, "\r\n", 2);
-	conn->request_state = 3;
 
-	/* ok */
-	free_buffered_response_header_list(conn);
+/* Send a complete response from a prebuilt header block
+ * Parameters:
+ *   conn: Current connection handle.
+ *   status: HTTP status code (e.g., 200 for "OK").
+ *   headers: Zero terminated header lines ("name: value\r\n").
+ *   headers_len: Length of headers.
+ *   body: Response body.
+ *   body_len: Length of the response body.
+ *   may_compress: Compress the body if the client accepts it.
+ * Return:
+ *   0:    ok
+ *  -1:    parameter error
+ *  -2:    invalid connection type
+ *  -3:    invalid connection status
+ *  -4:    network send failed
+ *  -5:    out of memory
+ */
+static int
+send_response_block(struct mg_connection *conn,
+                    int status,
+                    const char *headers,
+                    size_t headers_len,
+                    const void *body,
+                    size_t body_len,
+                    int may_compress)
+{
+	const char *http_version;
+	char *scratch;
+	size_t status_len, tail_len;
+	struct mg_iovec iov[4];
+	char content_length[48];
+	int compressible = 0;
+	int is_head;
+	int ret;
+	time_t now;
+
+	if ((conn == NULL) || (status < 100) || (status > 999)
+	    || ((headers == NULL) && (headers_len > 0))
+	    || ((body == NULL) && (body_len > 0))) {
+		/* Parameter error */
+		return -1;
+	}
+	if ((conn->connection_type != CONNECTION_TYPE_REQUEST)
+	    || (conn->protocol_type == PROTOCOL_TYPE_WEBSOCKET)) {
+		/* Only allowed in server context */
+		return -2;
+	}
+	if (conn->request_state != 0) {
+		/* only allowed if nothing was sent up to now */
+		return -3;
+	}
+
+#if defined(USE_ZLIB)
+	compressible =
+	    may_compress && (body_len >= response_compression_min_size(conn));
+#else
+	(void)may_compress;
+#endif
+	is_head = !strcmp(conn->request_info.request_method, "HEAD");
+
+	/* A 304 has no body, and its Content-Length would have to be the one
+	 * of the full response */
+	content_length[0] = '\0';
+	if ((status != 304) && (status != 204)) {
+		mg_snprintf(conn,
+		            NULL, /* big enough for any number */
+		            content_length,
+		            sizeof(content_length),
+		            "Content-Length: %" UINT64_FMT "\r\n",
+		            (uint64_t)body_len);
+	}
+
+	if ((conn->protocol_type == PROTOCOL_TYPE_HTTP2)
+	    || (compressible && conn->accept_gzip)) {
+		/* HTTP/2 headers are HPACK encoded and compressed bodies are
+		 * streamed: both need the buffered response header API */
+		ret = mg_response_header_start(conn, status);
+		if ((ret == 0) && (headers_len > 0)) {
+			ret = mg_response_header_add_lines(conn, headers);
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		if (compressible) {
+			return mg_response_send_body(conn, body, body_len);
+		}
+		/* Send the body as it is */
+		if (content_length[0]) {
+			ret = mg_response_header_add_lines(conn, content_length);
+		}
+		if (ret >= 0) {
+			ret = mg_response_header_send(conn);
+		}
+		if ((ret == 0) && !is_head && (body_len > 0)
+		    && (mg_write(conn, body, body_len) != (int)body_len)) {
+			ret = -4;
+		}
+		return ret;
+	}
+
+	http_version = conn->request_info.http_version;
+	if (!http_version) {
+		http_version = "1.0";
+	}
+	conn->status_code = status;
+
+	/* The Date header changes once per second */
+	now = time(NULL);
+	if ((now != conn->response_date_time) || !conn->response_date[0]) {
+		gmt_time_string(conn->response_date,
+		                sizeof(conn->response_date),
+		                &now);
+		conn->response_date_time = now;
+	}
+
+	/* Status line and generated headers are placed in the scratch space of
+	 * this worker thread, the header block and the body are sent from where
+	 * they are. */
+	scratch = conn->response_scratch;
+	mg_snprintf(conn,
+	            NULL, /* status texts are short */
+	            scratch,
+	            sizeof(conn->response_scratch),
+	            "HTTP/%s %i %s\r\n",
+	            http_version,
+	            status,
+	            mg_get_response_code_text(conn, status));
+	status_len = strlen(scratch);
+	mg_snprintf(conn,
+	            NULL, /* see size of response_scratch */
+	            scratch + status_len,
+	            sizeof(conn->response_scratch) - status_len,
+	            "%s"
+	            "%s"
+	            "Date: %s\r\n"
+	            "Connection: %s\r\n\r\n",
+	            content_length,
+	            compressible ? "Vary: Accept-Encoding\r\n" : "",
+	            conn->response_date,
+	            suggest_connection_header(conn));
+	tail_len = strlen(scratch + status_len);
+
+	iov[0].buf = scratch;
+	iov[0].len = status_len;
+	iov[1].buf = headers;
+	iov[1].len = headers_len;
+	iov[2].buf = scratch + status_len;
+	iov[2].len = tail_len;
+	iov[3].buf = body;
+	iov[3].len = is_head ? 0 : body_len;
+
+	ret = mg_writev(conn, iov, 4);
+	if ((ret < 0)
+	    || ((size_t)ret
+	        != (iov[0].len + iov[1].len + iov[2].len + iov[3].len))) {
+		return -4;
+	}
 	return 0;
 }
+
+
+int
+mg_send_response(struct mg_connection *conn,
+                 int status,
+                 const char *headers,
+                 size_t headers_len,
+                 const void *body,
+                 size_t body_len)
+{
+	return send_response_block(
+	    conn, status, headers, headers_len, body, body_len, 1);
+}
+
+
+int
+mg_send_response_as_is(struct mg_connection *conn,
+                       int status,
+                       const char *headers,
+                       size_t headers_len,
+                       const void *body,
+                       size_t body_len)
+{
+	return send_response_block(
+	    conn, status, headers, headers_len, body, body_len, 0);
+}
@@ -0,0 +1,592 @@
+/* route.inl
+ *
+ * Request handler dispatch.
+ *
+ * This file is part of the CivetWeb web server.
+ * See https://github.com/civetweb/civetweb/
+ *
+ * The handler list of a domain is compiled into lookup tables every time it
+ * is modified (mg_set_handler_type), so finding the handler for a request
+ * costs O(length of the URI) instead of up to three scans of the list.
+ *
+ * The result is the same as the one of the linear search used before:
+ *   step 0: exact match of the URI (case sensitive),
+ *   step 1: the handler URI followed by '/' is a prefix (case sensitive),
+ *   step 2: match_prefix() of the handler URI (case insensitive pattern),
+ * and within every step, the handler registered first wins.
+ *
+ * Exact matches use a hash table. All handler URIs are stored in a radix
+ * tree keyed by the lower case URI, which yields the candidates of step 1
+ * and 2 in a single walk along the request URI. Handler URIs containing
+ * pattern characters are additionally kept in a list and checked using
+ * match_prefix(), but only as long as they have been registered before the
+ * best candidate found in the tree.
+ */
+
+
+#define ROUTE_NONE ((size_t)-1)
+
+
+/* Node of the radix tree. */
+struct mg_route_node {
+	char *label; /* edge label from the parent node (lower case) */
+	size_t label_len;
+	struct mg_route_node **child; /* sorted by the first label character */
+	size_t num_child;
+	size_t *end; /* handlers ending in this node, in registration order */
+	size_t num_end;
+};
+
+
+/* Compiled handlers of one handler type. */
+struct mg_route_table {
+	struct mg_handler_info **entry; /* in registration order */
+	size_t num_entry;
+	char *is_pattern;    /* entry contains a pattern character */
+	size_t *exact;       /* open addressing: entry index + 1, 0 = free */
+	size_t exact_mask;   /* hash table size - 1 */
+	size_t *pattern;     /* entry index of all pattern URIs, ascending */
+	size_t num_pattern;
+	struct mg_route_node root;
+};
+
+
+/* Compiled handlers of a domain, one table for every handler type. */
+struct mg_routes {
+	struct mg_route_table type[3];
+};
+
+
+static size_t
+route_hash(const char *s, size_t len)
+{
+	/* FNV-1a */
+	size_t h = (size_t)2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= (size_t)16777619u;
+	}
+	return h;
+}
+
+
+static int
+route_is_pattern(const char *uri, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if ((uri[i] == '?') || (uri[i] == '*') || (uri[i] == '$')
+		    || (uri[i] == '|')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static struct mg_route_node *
+route_find_child(const struct mg_route_node *node, int c)
+{
+	size_t lo = 0, hi = node->num_child;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int k = (unsigned char)node->child[mid]->label[0];
+		if (k == c) {
+			return node->child[mid];
+		}
+		if (k < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+
+static void
+route_node_free(struct mg_route_node *node)
+{
+	size_t i;
+	for (i = 0; i < node->num_child; i++) {
+		route_node_free(node->child[i]);
+		mg_free(node->child[i]);
+	}
+	mg_free(node->child);
+	mg_free(node->end);
+	mg_free(node->label);
+}
+
+
+static struct mg_route_node *
+route_node_new(const char *label, size_t label_len, struct mg_context *ctx)
+{
+	struct mg_route_node *node;
+	(void)ctx; /* Only used with MEMORY_DEBUGGING */
+
+	node = (struct mg_route_node *)mg_calloc_ctx(1, sizeof(*node), ctx);
+	if (node == NULL) {
+		return NULL;
+	}
+	node->label = (char *)mg_malloc_ctx(label_len + 1, ctx);
+	if (node->label == NULL) {
+		mg_free(node);
+		return NULL;
+	}
+	memcpy(node->label, label, label_len);
+	node->label[label_len] = 0;
+	node->label_len = label_len;
+	return node;
+}
+
+
+/* Insert a new child node, keeping the children sorted. */
+static int
+route_add_child(struct mg_route_node *node,
+                struct mg_route_node *child,
+                struct mg_context *ctx)
+{
+	struct mg_route_node **c;
+	size_t i;
+	(void)ctx; /* Only used with MEMORY_DEBUGGING */
+
+	c = (struct mg_route_node **)mg_realloc_ctx(node->child,
+	                                            (node->num_child + 1)
+	                                                * sizeof(*c),
+	                                            ctx);
+	if (c == NULL) {
+		return 0;
+	}
+	node->child = c;
+	for (i = node->num_child; i > 0; i--) {
+		if ((unsigned char)c[i - 1]->label[0]
+		    < (unsigned char)child->label[0]) {
+			break;
+		}
+		c[i] = c[i - 1];
+	}
+	c[i] = child;
+	node->num_child++;
+	return 1;
+}
+
+
+static int
+route_add_end(struct mg_route_node *node, size_t idx, struct mg_context *ctx)
+{
+	size_t *e;
+	(void)ctx; /* Only used with MEMORY_DEBUGGING */
+
+	e = (size_t *)mg_realloc_ctx(node->end,
+	                             (node->num_end + 1) * sizeof(*e),
+	                             ctx);
+	if (e == NULL) {
+		return 0;
+	}
+	node->end = e;
+	node->end[node->num_end++] = idx;
+	return 1;
+}
+
+
+/* Add the lower case key to the radix tree, splitting edges as required. */
+static int
+route_insert(struct mg_route_node *root,
+             const char *key,
+             size_t len,
+             size_t idx,
+             struct mg_context *ctx)
+{
+	struct mg_route_node *node = root;
+
+	while (len > 0) {
+		struct mg_route_node *child =
+		    route_find_child(node, (unsigned char)key[0]);
+		size_t common = 0;
+
+		if (child == NULL) {
+			child = route_node_new(key, len, ctx);
+			if ((child == NULL) || !route_add_child(node, child, ctx)) {
+				if (child != NULL) {
+					route_node_free(child);
+					mg_free(child);
+				}
+				return 0;
+			}
+			return route_add_end(child, idx, ctx);
+		}
+
+		while ((common < child->label_len) && (common < len)
+		       && (child->label[common] == key[common])) {
+			common++;
+		}
+
+		if (common < child->label_len) {
+			/* Split the edge: node -> mid -> child */
+			struct mg_route_node *mid = route_node_new(key, common, ctx);
+			char *rest;
+			size_t i;
+
+			if (mid == NULL) {
+				return 0;
+			}
+			rest = mg_strdup_ctx(child->label + common, ctx);
+			if ((rest == NULL) || !route_add_child(mid, child, ctx)) {
+				mg_free(rest);
+				route_node_free(mid);
+				mg_free(mid);
+				return 0;
+			}
+			mg_free(child->label);
+			child->label = rest;
+			child->label_len -= common;
+			for (i = 0; i < node->num_child; i++) {
+				if (node->child[i] == child) {
+					node->child[i] = mid;
+					break;
+				}
+			}
+			child = mid;
+		}
+
+		node = child;
+		key += common;
+		len -= common;
+	}
+
+	return route_add_end(node, idx, ctx);
+}
+
+
+static void
+route_table_free(struct mg_route_table *t)
+{
+	route_node_free(&t->root);
+	mg_free(t->entry);
+	mg_free(t->is_pattern);
+	mg_free(t->exact);
+	mg_free(t->pattern);
+}
+
+
+static int
+route_table_build(struct mg_route_table *t,
+                  struct mg_handler_info *list,
+                  int handler_type,
+                  struct mg_context *ctx)
+{
+	struct mg_handler_info *rh;
+	size_t n = 0, size = 1, i, k;
+	char lc[256];
+	char *key;
+
+	for (rh = list; rh != NULL; rh = rh->next) {
+		if (rh->handler_type == handler_type) {
+			n++;
+		}
+	}
+	if (n == 0) {
+		return 1;
+	}
+	while (size < 2 * n) {
+		size *= 2;
+	}
+
+	t->entry = (struct mg_handler_info **)mg_malloc_ctx(n * sizeof(*t->entry),
+	                                                    ctx);
+	t->is_pattern = (char *)mg_calloc_ctx(n, 1, ctx);
+	t->pattern = (size_t *)mg_malloc_ctx(n * sizeof(*t->pattern), ctx);
+	t->exact = (size_t *)mg_calloc_ctx(size, sizeof(*t->exact), ctx);
+	if (!t->entry || !t->is_pattern || !t->pattern || !t->exact) {
+		return 0;
+	}
+	t->exact_mask = size - 1;
+
+	for (rh = list; rh != NULL; rh = rh->next) {
+		if (rh->handler_type != handler_type) {
+			continue;
+		}
+		i = t->num_entry++;
+		t->entry[i] = rh;
+
+		/* Exact match table. URIs are unique per handler type. */
+		k = route_hash(rh->uri, rh->uri_len) & t->exact_mask;
+		while (t->exact[k] != 0) {
+			k = (k + 1) & t->exact_mask;
+		}
+		t->exact[k] = i + 1;
+
+		if (route_is_pattern(rh->uri, rh->uri_len)) {
+			t->is_pattern[i] = 1;
+			t->pattern[t->num_pattern++] = i;
+		}
+
+		/* Prefix tree, lower case */
+		key = (rh->uri_len < sizeof(lc))
+		          ? lc
+		          : (char *)mg_malloc_ctx(rh->uri_len + 1, ctx);
+		if (key == NULL) {
+			return 0;
+		}
+		for (k = 0; k < rh->uri_len; k++) {
+			key[k] = (char)lowercase(rh->uri + k);
+		}
+		if (!route_insert(&t->root, key, rh->uri_len, i, ctx)) {
+			if (key != lc) {
+				mg_free(key);
+			}
+			return 0;
+		}
+		if (key != lc) {
+			mg_free(key);
+		}
+	}
+	return 1;
+}
+
+
+/* Compile a handler list. Returns NULL if out of memory. */
+static struct mg_routes *
+routes_compile(struct mg_handler_info *list, struct mg_context *ctx)
+{
+	struct mg_routes *routes =
+	    (struct mg_routes *)mg_calloc_ctx(1, sizeof(*routes), ctx);
+	int i;
+
+	if (routes == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < 3; i++) {
+		if (!route_table_build(&routes->type[i], list, i, ctx)) {
+			for (; i >= 0; i--) {
+				route_table_free(&routes->type[i]);
+			}
+			mg_free(routes);
+			return NULL;
+		}
+	}
+	return routes;
+}
+
+
+static void
+routes_free(struct mg_routes *routes)
+{
+	int i;
+	if (routes != NULL) {
+		for (i = 0; i < 3; i++) {
+			route_table_free(&routes->type[i]);
+		}
+		mg_free(routes);
+	}
+}
+
+
+/* Find the handler for a request URI. */
+static struct mg_handler_info *
+routes_lookup(const struct mg_routes *routes,
+              int handler_type,
+              const char *uri,
+              size_t urilen)
+{
+	const struct mg_route_table *t;
+	const struct mg_route_node *node;
+	size_t best_prefix = ROUTE_NONE, best_match = ROUTE_NONE;
+	size_t depth = 0, i, pos;
+
+	if ((routes == NULL) || (handler_type < 0) || (handler_type > 2)) {
+		return NULL;
+	}
+	t = &routes->type[handler_type];
+	if (t->num_entry == 0) {
+		return NULL;
+	}
+
+	/* Step 0: exact match */
+	pos = route_hash(uri, urilen) & t->exact_mask;
+	while (t->exact[pos] != 0) {
+		struct mg_handler_info *rh = t->entry[t->exact[pos] - 1];
+		if ((rh->uri_len == urilen) && !memcmp(rh->uri, uri, urilen)) {
+			return rh;
+		}
+		pos = (pos + 1) & t->exact_mask;
+	}
+
+	/* Step 1 and 2 for literal URIs: walk down the tree. Every handler
+	 * ending in a node on the way is a case insensitive prefix. */
+	node = &t->root;
+	for (;;) {
+		const struct mg_route_node *next;
+
+		for (i = 0; i < node->num_end; i++) {
+			size_t idx = node->end[i];
+			if ((depth < urilen) && (uri[depth] == '/')
+			    && (idx < best_prefix)
+			    && !memcmp(t->entry[idx]->uri, uri, depth)) {
+				best_prefix = idx;
+			}
+			if ((depth > 0) && !t->is_pattern[idx] && (idx < best_match)) {
+				best_match = idx;
+			}
+		}
+
+		if (depth >= urilen) {
+			break;
+		}
+		next = route_find_child(node, lowercase(uri + depth));
+		if ((next == NULL) || (next->label_len > urilen - depth)) {
+			break;
+		}
+		for (i = 1; i < next->label_len; i++) {
+			if (next->label[i] != (char)lowercase(uri + depth + i)) {
+				break;
+			}
+		}
+		if (i < next->label_len) {
+			break;
+		}
+		depth += next->label_len;
+		node = next;
+	}
+
+	if (best_prefix != ROUTE_NONE) {
+		return t->entry[best_prefix];
+	}
+
+	/* Step 2 for patterns registered before the best literal match */
+	for (i = 0; i < t->num_pattern; i++) {
+		struct mg_handler_info *rh = t->entry[t->pattern[i]];
+		if (t->pattern[i] > best_match) {
+			break;
+		}
+		if (match_prefix(rh->uri, rh->uri_len, uri) > 0) {
+			return rh;
+		}
+	}
+
+	return (best_match != ROUTE_NONE) ? t->entry[best_match] : NULL;
+}
+
+
+/* Lock-free lookup.
+ *
+ * Worker threads read the handler tables of a domain without any lock.
+ * Tables are immutable once published; a modification of the handlers
+ * compiles new tables, publishes them, and frees the old ones after all
+ * lookups which might still use them have finished (epoch based
+ * reclamation):
+ *
+ * A worker stores the current epoch in its connection (conn->route_epoch)
+ * while looking up a handler, and 0 when it is done. A writer increments the
+ * epoch after publishing new tables. Lookups that started with an older
+ * epoch might use the old tables, so the writer waits until the epoch of
+ * every worker is either 0 or new. Lookups take less than a microsecond,
+ * so this wait is short.
+ *
+ * A request handler may be used much longer, until release_handler_ref.
+ * It is recorded in conn->route_handler, and updating or removing a request
+ * handler waits until no worker uses it any more (as documented for
+ * mg_set_request_handler).
+ *
+ * Requests are only handled by worker threads, using the connection
+ * structures in ctx->worker_connections. mg_atomic_compare_and_swap is used
+ * as a full memory barrier.
+ */
+static const struct mg_routes *
+routes_enter(struct mg_connection *conn)
+{
+	ptrdiff_t epoch = conn->phys_ctx->route_epoch;
+
+	/* The epoch must be visible to writers before the tables are read */
+	mg_atomic_compare_and_swap(&conn->route_epoch, 0, epoch);
+	return conn->dom_ctx->routes;
+}
+
+
+static void
+routes_leave(struct mg_connection *conn)
+{
+	mg_atomic_compare_and_swap(&conn->route_epoch, conn->route_epoch, 0);
+}
+
+
+static void
+routes_release_handler(struct mg_connection *conn)
+{
+	/* Barrier: all use of the handler is complete before it is released */
+	mg_atomic_compare_and_swap(&conn->route_epoch, 0, 0);
+	conn->route_handler = NULL;
+}
+
+
+/* Wait until all lookups started before epoch have finished. */
+static void
+routes_synchronize(struct mg_context *phys_ctx, ptrdiff_t epoch)
+{
+	unsigned i;
+
+	if (phys_ctx->worker_connections == NULL) {
+		return;
+	}
+	for (i = 0; i < phys_ctx->cfg_max_worker_threads; i++) {
+		struct mg_connection *conn = phys_ctx->worker_connections + i;
+		ptrdiff_t e;
+		while (((e = conn->route_epoch) != 0) && (e < epoch)) {
+			mg_sleep(1);
+		}
+	}
+}
+
+
+/* Wait until no worker uses a request handler, which can not be found by a
+ * lookup any more. */
+static void
+routes_wait_unused(struct mg_context *phys_ctx,
+                   const struct mg_handler_info *rh)
+{
+	unsigned i;
+
+	if (phys_ctx->worker_connections == NULL) {
+		return;
+	}
+	for (i = 0; i < phys_ctx->cfg_max_worker_threads; i++) {
+		while (phys_ctx->worker_connections[i].route_handler == rh) {
+			mg_sleep(1);
+		}
+	}
+}
+
+
+/* Recompile the handlers of all domains and publish the new tables. Must be
+ * called with the context lock held, after the handler list has been
+ * modified. Domains share the handler list of the default domain. Returns
+ * after the old tables have been freed. */
+static void
+routes_update(struct mg_context *phys_ctx)
+{
+	struct mg_domain_context *dom;
+
+	for (dom = &(phys_ctx->dd); dom != NULL; dom = dom->next) {
+		struct mg_routes *routes = routes_compile(dom->handlers, phys_ctx);
+		struct mg_routes *old_routes = dom->routes;
+
+		if ((routes == NULL) && (dom->handlers != NULL)) {
+			mg_cry_ctx_internal(phys_ctx,
+			                    "%s",
+			                    "Cannot compile request handlers, OOM");
+		}
+
+		/* The first increment is a barrier: the new tables are complete
+		 * before they are published. Lookups starting after the second one
+		 * use the new tables. */
+		mg_atomic_inc(&phys_ctx->route_epoch);
+		dom->routes = routes;
+		routes_synchronize(phys_ctx, mg_atomic_inc(&phys_ctx->route_epoch));
+
+		routes_free(old_routes);
+	}
+}
+
+/* End of route.inl */
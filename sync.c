@@ -0,0 +1,188 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // clock_gettime, pthread_condattr_setclock
+#endif
+
+#include "sync.h"
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <time.h>
+#include <errno.h>
+#endif
+
+int sync_mutex_init(sync_mutex *m) {
+#ifdef _WIN32
+    InitializeCriticalSection(m);
+    return 0;
+#else
+    return pthread_mutex_init(m, NULL) == 0 ? 0 : -1;
+#endif
+}
+
+int sync_cond_init(sync_cond *c) {
+#ifdef _WIN32
+    InitializeConditionVariable(c);
+    return 0;
+#else
+    // Timeouts are measured on the monotonic clock
+    pthread_condattr_t attr;
+    int rc = pthread_condattr_init(&attr);
+    if (rc == 0) {
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        rc = pthread_cond_init(c, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+    return rc == 0 ? 0 : -1;
+#endif
+}
+
+void sync_mutex_destroy(sync_mutex *m) {
+#ifdef _WIN32
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+void sync_cond_destroy(sync_cond *c) {
+#ifdef _WIN32
+    (void)c; // nothing to free
+#else
+    pthread_cond_destroy(c);
+#endif
+}
+
+void sync_mutex_lock(sync_mutex *m) {
+#ifdef _WIN32
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+
+void sync_mutex_unlock(sync_mutex *m) {
+#ifdef _WIN32
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+
+void sync_cond_wait(sync_cond *c, sync_mutex *m, int ms) {
+#ifdef _WIN32
+    SleepConditionVariableCS(c, m, ms < 0 ? INFINITE : (DWORD)ms);
+#else
+    if (ms < 0) {
+        pthread_cond_wait(c, m);
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(c, m, &ts);
+#endif
+}
+
+void sync_cond_signal(sync_cond *c) {
+#ifdef _WIN32
+    WakeConditionVariable(c);
+#else
+    pthread_cond_signal(c);
+#endif
+}
+
+void sync_cond_broadcast(sync_cond *c) {
+#ifdef _WIN32
+    WakeAllConditionVariable(c);
+#else
+    pthread_cond_broadcast(c);
+#endif
+}
+
+typedef struct {
+    void (*fn)(void *);
+    void *arg;
+} thread_start;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID p) {
+#else
+static void *thread_main(void *p) {
+#endif
+    thread_start start = *(thread_start *)p;
+    free(p);
+    start.fn(start.arg);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+int sync_thread_start(sync_thread *t, void (*fn)(void *), void *arg) {
+    thread_start *start = malloc(sizeof(*start));
+    if (!start) return -1;
+    start->fn = fn;
+    start->arg = arg;
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+    if (*t == NULL) {
+        free(start);
+        return -1;
+    }
+#else
+    if (pthread_create(t, NULL, thread_main, start) != 0) {
+        free(start);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void sync_thread_join(sync_thread t) {
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+long long sync_now_ms(void) {
+#ifdef _WIN32
+    return (long long)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+long long sync_now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (long long)(count.QuadPart / freq.QuadPart * 1000000
+                       + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void sync_sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+#endif
+}
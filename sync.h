@@ -0,0 +1,44 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+// Threads, locks and condition variables for the application modules, on
+// pthreads or the Win32 API. Timeouts use a monotonic clock.
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION sync_mutex;
+typedef CONDITION_VARIABLE sync_cond;
+typedef HANDLE sync_thread;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t sync_mutex;
+typedef pthread_cond_t sync_cond;
+typedef pthread_t sync_thread;
+#endif
+
+// Return 0 on success, -1 on failure
+int sync_mutex_init(sync_mutex *m);
+int sync_cond_init(sync_cond *c);
+void sync_mutex_destroy(sync_mutex *m);
+void sync_cond_destroy(sync_cond *c);
+
+void sync_mutex_lock(sync_mutex *m);
+void sync_mutex_unlock(sync_mutex *m);
+
+// Wait with the mutex held for at most ms milliseconds, or for ever if ms
+// is negative. May return early; callers recheck their condition.
+void sync_cond_wait(sync_cond *c, sync_mutex *m, int ms);
+void sync_cond_signal(sync_cond *c);
+void sync_cond_broadcast(sync_cond *c);
+
+// Run fn(arg) on a new thread. Returns 0 on success, -1 on failure.
+int sync_thread_start(sync_thread *t, void (*fn)(void *), void *arg);
+void sync_thread_join(sync_thread t);
+
+// Milliseconds on a monotonic clock
+long long sync_now_ms(void);
+// Microseconds on a monotonic clock, for finer timing
+long long sync_now_us(void);
+void sync_sleep_ms(int ms);
+
+#endif // SYNC_H
@@ -0,0 +1,361 @@
+/* trace.inl
+ *
+ * Stage timing of sampled and slow requests.
+ *
+ * This file is part of the CivetWeb project.
+ *
+ * With "trace_sample" = N every worker traces one in N requests, and with
+ * "trace_slow_ms" every request that took at least that long. A trace is
+ * the time line of one request, split into stages:
+ *   queue    accepted until a worker took the connection,
+ *   headers  until the request headers had been read (TLS handshake and
+ *            client included),
+ * both only for the first request of a connection, then the stages the
+ * handler marks with mg_trace_stage ("auth", "sql", "send", ...), and
+ *   handler  the rest of handle_request after the last mark.
+ *
+ * Handlers of long-lived responses, such as event streams, call
+ * mg_trace_skip before they start, so they neither fill the slow ring nor
+ * count as samples.
+ *
+ * Every worker records the marks of every request into a trace of its own,
+ * which costs a read of the monotonic clock per mark. Only when a request is kept, its trace
+ * is copied into one of two rings of the context under a mutex: slow
+ * requests into one, sampled ones into the other, so a high sample rate
+ * does not push the slow traces out. mg_get_traces writes either ring as
+ * JSON, newest first.
+ */
+
+
+/* Traces kept in each ring */
+#define TRACE_RING_SIZE (128)
+
+/* Stages of one trace, further marks are ignored */
+#define TRACE_STAGES (16)
+
+/* Part of the URI kept */
+#define TRACE_URI_SIZE (96)
+
+
+struct mg_trace_stage {
+	const char *name; /* A string constant */
+	uint32_t end_us;  /* Since the start of the trace */
+};
+
+
+struct mg_trace {
+	uint64_t start_ns; /* Monotonic clock */
+	uint64_t start_ms; /* Wall clock, for reporting */
+	uint32_t total_us;
+	int status;
+	int num_stages;
+	char method[12];
+	char uri[TRACE_URI_SIZE];
+	struct mg_trace_stage stage[TRACE_STAGES];
+};
+
+
+/* Trace of the request a worker is processing */
+struct mg_worker_trace {
+	struct mg_trace t;
+	uint64_t accepted_ns; /* Of a new connection, 0 after its first request */
+	uint64_t dequeued_ns;
+	unsigned int requests; /* For sampling */
+	int skip;              /* mg_trace_skip was called for this request */
+};
+
+
+struct mg_trace_ring {
+	struct mg_trace trace[TRACE_RING_SIZE];
+	unsigned int next;
+	unsigned int count;
+};
+
+
+struct mg_tracer {
+	unsigned int sample;
+	uint32_t slow_us;
+	pthread_mutex_t lock;
+	struct mg_trace_ring slow;
+	struct mg_trace_ring sampled;
+};
+
+
+/* Called by mg_start. Tracing stays off if it is not configured, or out of
+ * memory. */
+static void
+trace_init(struct mg_context *ctx)
+{
+	int sample = atoi(ctx->dd.config[TRACE_SAMPLE]);
+	int slow_ms = atoi(ctx->dd.config[TRACE_SLOW]);
+	struct mg_tracer *tr;
+
+	if ((sample <= 0) && (slow_ms <= 0)) {
+		return;
+	}
+	tr = (struct mg_tracer *)mg_calloc_ctx(1, sizeof(*tr), ctx);
+	if (tr == NULL) {
+		mg_cry_ctx_internal(ctx, "%s", "Out of memory: tracing is off");
+		return;
+	}
+	tr->sample = (sample > 0) ? (unsigned)sample : 0;
+	tr->slow_us = (slow_ms > 0) ? (uint32_t)slow_ms * 1000 : 0;
+	pthread_mutex_init(&tr->lock, &pthread_mutex_attr);
+	ctx->tracer = tr;
+}
+
+
+static void
+trace_free(struct mg_context *ctx)
+{
+	if (ctx->tracer != NULL) {
+		pthread_mutex_destroy(&ctx->tracer->lock);
+		mg_free(ctx->tracer);
+		ctx->tracer = NULL;
+	}
+}
+
+
+/* Called by a worker thread when it starts */
+static struct mg_worker_trace *
+trace_attach(struct mg_context *ctx)
+{
+	if (ctx->tracer == NULL) {
+		return NULL;
+	}
+	return (struct mg_worker_trace *)mg_calloc_ctx(
+	    1, sizeof(struct mg_worker_trace), ctx);
+}
+
+
+/* Called by a worker that took a new connection from the queue */
+static void
+trace_connection(struct mg_connection *conn)
+{
+	struct mg_worker_trace *wt = conn->trace;
+
+	if (wt != NULL) {
+		wt->dequeued_ns = mg_get_monotonic_time_ns();
+		wt->accepted_ns = conn->client.accept_time;
+		if ((wt->accepted_ns == 0) || (wt->accepted_ns > wt->dequeued_ns)) {
+			wt->accepted_ns = wt->dequeued_ns;
+		}
+	}
+}
+
+
+static void
+trace_add(struct mg_trace *t, const char *name, uint64_t now_ns)
+{
+	if (t->num_stages < TRACE_STAGES) {
+		t->stage[t->num_stages].name = name;
+		t->stage[t->num_stages].end_us =
+		    (now_ns > t->start_ns) ? (uint32_t)((now_ns - t->start_ns) / 1000)
+		                           : 0;
+		t->num_stages++;
+	}
+}
+
+
+/* Called by handle_request_stat_log when the request has been read */
+static void
+trace_begin(struct mg_connection *conn)
+{
+	struct mg_worker_trace *wt = conn->trace;
+	uint64_t now;
+
+	if (wt == NULL) {
+		return;
+	}
+	now = mg_get_monotonic_time_ns();
+	wt->t.num_stages = 0;
+	wt->skip = 0;
+	if (wt->accepted_ns != 0) {
+		wt->t.start_ns = wt->accepted_ns;
+		trace_add(&wt->t, "queue", wt->dequeued_ns);
+		trace_add(&wt->t, "headers", now);
+		wt->accepted_ns = 0;
+	} else {
+		wt->t.start_ns = now;
+	}
+	wt->t.start_ms =
+	    (mg_get_current_time_ns() - (now - wt->t.start_ns)) / 1000000;
+}
+
+
+/* Called by handle_request_stat_log after the request. Keeps the trace if
+ * the request was slow or is sampled. */
+static void
+trace_end(struct mg_connection *conn)
+{
+	struct mg_worker_trace *wt = conn->trace;
+	struct mg_tracer *tr = conn->phys_ctx->tracer;
+	struct mg_trace_ring *ring;
+	uint64_t now;
+
+	if ((wt == NULL) || wt->skip) {
+		return;
+	}
+	now = mg_get_monotonic_time_ns();
+	trace_add(&wt->t, "handler", now);
+	wt->t.total_us =
+	    (now > wt->t.start_ns) ? (uint32_t)((now - wt->t.start_ns) / 1000) : 0;
+
+	if ((tr->slow_us > 0) && (wt->t.total_us >= tr->slow_us)) {
+		ring = &tr->slow;
+	} else if ((tr->sample > 0) && ((++wt->requests % tr->sample) == 0)) {
+		ring = &tr->sampled;
+	} else {
+		return;
+	}
+
+	wt->t.status = conn->status_code;
+	mg_strlcpy(wt->t.method,
+	           conn->request_info.request_method
+	               ? conn->request_info.request_method
+	               : "",
+	           sizeof(wt->t.method));
+	mg_strlcpy(wt->t.uri,
+	           conn->request_info.local_uri ? conn->request_info.local_uri
+	                                        : "",
+	           sizeof(wt->t.uri));
+
+	(void)pthread_mutex_lock(&tr->lock);
+	ring->trace[ring->next] = wt->t;
+	ring->next = (ring->next + 1) % TRACE_RING_SIZE;
+	if (ring->count < TRACE_RING_SIZE) {
+		ring->count++;
+	}
+	(void)pthread_mutex_unlock(&tr->lock);
+}
+
+
+CIVETWEB_API void
+mg_trace_stage(const struct mg_connection *conn, const char *stage)
+{
+	if ((conn != NULL) && (conn->trace != NULL) && (stage != NULL)) {
+		trace_add(&conn->trace->t, stage, mg_get_monotonic_time_ns());
+	}
+}
+
+
+CIVETWEB_API void
+mg_trace_skip(const struct mg_connection *conn)
+{
+	if ((conn != NULL) && (conn->trace != NULL)) {
+		conn->trace->skip = 1;
+	}
+}
+
+
+/* Append s as a JSON string */
+static size_t
+trace_append_json_string(char **buf, char *end, const char *s)
+{
+	char esc[8];
+	size_t len = mg_str_append(buf, end, "\"");
+
+	for (; *s != 0; s++) {
+		if ((*s == '"') || (*s == '\\')) {
+			esc[0] = '\\';
+			esc[1] = *s;
+			esc[2] = 0;
+		} else if ((unsigned char)*s < 0x20) {
+			mg_snprintf(
+			    NULL, NULL, esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+		} else {
+			esc[0] = *s;
+			esc[1] = 0;
+		}
+		len += mg_str_append(buf, end, esc);
+	}
+	return len + mg_str_append(buf, end, "\"");
+}
+
+
+CIVETWEB_API int
+mg_get_traces(const struct mg_context *ctx, int slow, char *buffer, int buflen)
+{
+	struct mg_tracer *tr;
+	struct mg_trace_ring *ring;
+	struct mg_trace *copy;
+	char block[128], *end;
+	size_t len = 0;
+	unsigned int i, count;
+	int j;
+
+	if ((ctx == NULL) || (ctx->tracer == NULL)) {
+		return -1;
+	}
+	tr = ctx->tracer;
+	ring = slow ? &tr->slow : &tr->sampled;
+
+	/* Format a copy, not to hold up workers that keep a trace */
+	copy = (struct mg_trace *)mg_malloc(sizeof(ring->trace));
+	if (copy == NULL) {
+		return -1;
+	}
+	(void)pthread_mutex_lock(&tr->lock);
+	count = ring->count;
+	for (i = 0; i < count; i++) {
+		copy[i] = ring->trace[(ring->next + TRACE_RING_SIZE - 1 - i)
+		                      % TRACE_RING_SIZE];
+	}
+	(void)pthread_mutex_unlock(&tr->lock);
+
+	if ((buffer == NULL) || (buflen < 1)) {
+		end = buffer;
+	} else {
+		*buffer = 0;
+		end = buffer + buflen;
+	}
+
+	len += mg_str_append(&buffer, end, "{\"traces\":[");
+	for (i = 0; i < count; i++) {
+		const struct mg_trace *t = &copy[i];
+		uint32_t prev = 0;
+
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            "%s{\"start_ms\":%" UINT64_FMT ",\"method\":",
+		            (i > 0) ? "," : "",
+		            t->start_ms);
+		len += mg_str_append(&buffer, end, block);
+		len += trace_append_json_string(&buffer, end, t->method);
+		len += mg_str_append(&buffer, end, ",\"uri\":");
+		len += trace_append_json_string(&buffer, end, t->uri);
+		mg_snprintf(NULL,
+		            NULL,
+		            block,
+		            sizeof(block),
+		            ",\"status\":%d,\"total_us\":%u,\"stages\":[",
+		            t->status,
+		            (unsigned)t->total_us);
+		len += mg_str_append(&buffer, end, block);
+		for (j = 0; j < t->num_stages; j++) {
+			/* Never negative */
+			uint32_t stage_end =
+			    (t->stage[j].end_us > prev) ? t->stage[j].end_us : prev;
+
+			len += mg_str_append(&buffer, end, (j > 0) ? ",{" : "{");
+			len += mg_str_append(&buffer, end, "\"stage\":");
+			len += trace_append_json_string(&buffer, end, t->stage[j].name);
+			mg_snprintf(NULL,
+			            NULL,
+			            block,
+			            sizeof(block),
+			            ",\"start_us\":%u,\"us\":%u}",
+			            (unsigned)prev,
+			            (unsigned)(stage_end - prev));
+			len += mg_str_append(&buffer, end, block);
+			prev = stage_end;
+		}
+		len += mg_str_append(&buffer, end, "]}");
+	}
+	len += mg_str_append(&buffer, end, "]}");
+
+	mg_free(copy);
+	return (int)len;
+}